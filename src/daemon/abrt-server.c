@@ -15,7 +15,9 @@
   with this program; if not, write to the Free Software Foundation, Inc.,
   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
+#include <arpa/inet.h>
 #include "libabrt.h"
+#include "post-create.h"
 
 /* Maximal length of backtrace. */
 #define MAX_BACKTRACE_SIZE (1024*1024)
@@ -68,12 +70,33 @@ MANDATORY ITEMS:
    \0
 
 You can send more messages using the same KEY=value format.
+
+The items are written to the problem directory as they come, a value longer
+than MaxItemSize (abrt.conf) aborts the transaction. Items passed as file
+descriptors (see below) are limited by MaxCrashReportsSize instead.
+
+** Binary protocol
+
+Used by problem_submission_send(), the stream starts with "ABRT" instead of
+an HTTP request line (see struct abrt_socket_stream_header in libabrt.h):
+-> "ABRT" version(16) reserved(16)
+-> type(16) key_len(16) value_len(32) key value
+   ...
+-> END record
+
+The numbers are in network byte order. The values are not terminated, so
+they may contain any bytes. FD_ITEM records have no value, their content is
+read from the next descriptor passed by SCM_RIGHTS. The same items are
+mandatory and the response is the same HTTP status line.
 */
 
 static unsigned total_bytes_read = 0;
 
 static uid_t client_uid = (uid_t)-1L;
 
+/* abrtd's queue of problem directories waiting for post-create */
+static int post_create_fd = -1;
+
 
 static bool dir_is_in_dump_location(const char *dump_dir_name)
 {
@@ -110,41 +133,46 @@ static int delete_path(const char *dump_dir_name)
         return 403; /* Forbidden */
     }
 
+    dup_index_forget_dump_dir(g_settings_dump_location, dump_dir_name);
     delete_dump_dir(dump_dir_name);
+    size_ledger_forget(g_settings_dump_location, dump_dir_name);
 
     return 0; /* success */
 }
 
-static pid_t spawn_event_handler_child(const char *dump_dir_name, const char *event_name, int *fdp)
+/* Output of the event commands goes to our log. Otherwise, errors on
+ * post-create result in "Deleting problem directory" without adequate
+ * explanation why.
+ */
+static char *log_event_output(char *log_line, void *param)
+{
+    log("%s", log_line);
+    return log_line;
+}
+
+/* Runs the event in our process, only its commands are forked */
+static int run_problem_event(const char *dirname, const char *event_name, char **dup_of_dir)
 {
-    char *args[7];
-    args[0] = (char *) LIBEXEC_DIR"/abrt-handle-event";
-    /* Do not forward ASK_* messages to parent*/
-    args[1] = (char *) "-i";
-    args[2] = (char *) "-e";
-    args[3] = (char *) event_name;
-    args[4] = (char *) "--";
-    args[5] = (char *) dump_dir_name;
-    args[6] = NULL;
+    struct run_event_state *run_state = new_run_event_state();
+    run_state->logging_callback = log_event_output;
 
-    int pipeout[2];
-    int flags = EXECFLG_INPUT_NUL | EXECFLG_OUTPUT | EXECFLG_QUIET | EXECFLG_ERR2OUT;
-    VERB1 flags &= ~EXECFLG_QUIET;
+    int r;
+    if (dup_of_dir)
+        r = run_post_create_event(run_state, dirname, dup_of_dir);
+    else
+        r = run_event_on_dir_name(run_state, dirname, event_name);
 
-    char *env_vec[2];
-    /* Intercept ASK_* messages in Client API -> don't wait for user response */
-    env_vec[0] = xstrdup("REPORT_CLIENT_NONINTERACTIVE=1");
-    env_vec[1] = NULL;
+    if (r == 0 && run_state->children_count == 0)
+    {
+        log("No actions are found for event '%s'", event_name);
+        r = 1;
+    }
 
-    pid_t child = fork_execv_on_steroids(flags, args, pipeout,
-                                         env_vec, /*dir:*/ NULL,
-                                         /*uid(unused):*/ 0);
-    if (fdp)
-        *fdp = pipeout[0];
-    return child;
+    free_run_event_state(run_state);
+    return r;
 }
 
-static int run_post_create(const char *dirname)
+static int check_post_create_dir(const char *dirname)
 {
     /* If doesn't start with "g_settings_dump_location/"... */
     if (!dir_is_in_dump_location(dirname))
@@ -164,83 +192,36 @@ static int run_post_create(const char *dirname)
         return 403; /* Forbidden */
     }
 
-    int child_stdout_fd;
-    int child_pid = spawn_event_handler_child(dirname, "post-create", &child_stdout_fd);
-
-    char *dup_of_dir = NULL;
-    struct strbuf *cmd_output = strbuf_new();
-
-    bool child_is_post_create = 1; /* else it is a notify child */
-
- read_child_output:
-    //log("Reading from event fd %d", child_stdout_fd);
-
-    /* Read streamed data and split lines */
-    for (;;)
-    {
-        char buf[250]; /* usually we get one line, no need to have big buf */
-        errno = 0;
-        int r = safe_read(child_stdout_fd, buf, sizeof(buf) - 1);
-        if (r <= 0)
-            break;
-        buf[r] = '\0';
-
-        /* split lines in the current buffer */
-        char *raw = buf;
-        char *newline;
-        while ((newline = strchr(raw, '\n')) != NULL)
-        {
-            *newline = '\0';
-            strbuf_append_str(cmd_output, raw);
-            char *msg = cmd_output->buf;
-
-            if (child_is_post_create
-             && prefixcmp(msg, "DUP_OF_DIR: ") == 0
-            ) {
-                free(dup_of_dir);
-                dup_of_dir = xstrdup(msg + strlen("DUP_OF_DIR: "));
-            }
-            else
-                log("%s", msg);
-
-            strbuf_clear(cmd_output);
-            /* jump to next line */
-            raw = newline + 1;
-        }
+    return 0;
+}
 
-        /* beginning of next line. the line continues by next read */
-        strbuf_append_str(cmd_output, raw);
-    }
+/* Occurrences abrt-dump-oops counted before post-create */
+static unsigned long load_pending_occurrences(struct dump_dir *dd)
+{
+    char *pending_str = dd_load_text_ext(dd, FILENAME_PENDING_OCCURRENCES,
+                DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE | DD_FAIL_QUIETLY_ENOENT);
+    const unsigned long pending = pending_str ? strtoul(pending_str, NULL, 10) : 0;
+    free(pending_str);
+    return pending;
+}
 
-    /* EOF/error */
+static int run_post_create(const char *dirname)
+{
+    int r = check_post_create_dir(dirname);
+    if (r != 0)
+        return r;
 
-    /* Wait for child to actually exit, collect status */
-    int status = 0;
-    if (safe_waitpid(child_pid, &status, 0) <= 0)
-    /* should not happen */
-        perror_msg("waitpid(%d)", child_pid);
+    /* The request is complete, post-create may take a long time */
+    alarm(0);
 
-    /* If it was a "notify[-dup]" event, then we're done */
-    if (!child_is_post_create)
-        goto ret;
+    char *dup_of_dir = NULL;
+    int status = run_problem_event(dirname, "post-create", &dup_of_dir);
 
-    /* exit 0 means "this is a good, non-dup dir" */
-    /* exit with 1 + "DUP_OF_DIR: dir" string => dup */
-    if (status != 0)
+    /* 0 means "this is a good, non-dup dir" */
+    if (status != 0 && !dup_of_dir)
     {
-        if (WIFSIGNALED(status))
-        {
-            log("'post-create' on '%s' killed by signal %d",
-                            dirname, WTERMSIG(status));
-            goto delete_bad_dir;
-        }
-        /* else: it is WIFEXITED(status) */
-        if (!dup_of_dir)
-        {
-            log("'post-create' on '%s' exited with %d",
-                            dirname, WEXITSTATUS(status));
-            goto delete_bad_dir;
-        }
+        log("'post-create' on '%s' exited with %d", dirname, status);
+        goto delete_bad_dir;
     }
 
     const char *work_dir = (dup_of_dir ? dup_of_dir : dirname);
@@ -258,15 +239,16 @@ static int run_post_create(const char *dirname)
     /* Don't increase crash count if we are working with newly uploaded
      * directory (remote crash) which already has its crash count set.
      */
-    if ((status != 0 && dup_of_dir) || count == 0)
+    if (dup_of_dir || count == 0)
     {
-        count++;
-        char new_count_str[sizeof(long)*3 + 2];
-        sprintf(new_count_str, "%lu", count);
-        dd_save_text(dd, FILENAME_COUNT, new_count_str);
+        /* A new problem may stand for more occurrences: abrt-dump-oops
+         * records repeated oopses of one batch as pending occurrences
+         * of the first one */
+        unsigned long new_count = 1;
+        char *last_ocr = NULL;
 
         /* This condition can be simplified to either
-         * (status * != 0 && * dup_of_dir) or (count == 1). But the
+         * dup_of_dir or (count == 1). But the
          * chosen form is much more reliable and safe. We must not call
          * dd_opendir() to locked dd otherwise we go into a deadlock.
          */
@@ -274,13 +256,17 @@ static int run_post_create(const char *dirname)
         {
             /* Update the last occurrence file by the time file of the new problem */
             struct dump_dir *new_dd = dd_opendir(dirname, DD_OPEN_READONLY);
-            char *last_ocr = NULL;
             if (new_dd)
             {
+                new_count += load_pending_occurrences(new_dd);
+
+                last_ocr = dd_load_text_ext(new_dd, FILENAME_LAST_OCCURRENCE,
+                            DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE | DD_FAIL_QUIETLY_ENOENT);
                 /* TIME must exists in a valid dump directory but we don't want to die
                  * due to broken duplicated dump directory */
-                last_ocr = dd_load_text_ext(new_dd, FILENAME_TIME,
-                            DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE | DD_FAIL_QUIETLY_ENOENT);
+                if (!last_ocr)
+                    last_ocr = dd_load_text_ext(new_dd, FILENAME_TIME,
+                                DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE | DD_FAIL_QUIETLY_ENOENT);
                 dd_close(new_dd);
             }
             else
@@ -294,9 +280,25 @@ static int run_post_create(const char *dirname)
                 time_t t = time(NULL);
                 last_ocr = xasprintf("%lu", (long)t);
             }
+        }
+        else
+        {
+            const unsigned long pending = load_pending_occurrences(dd);
+            if (pending != 0)
+            {
+                new_count += pending;
+                dd_delete_item(dd, FILENAME_PENDING_OCCURRENCES);
+            }
+        }
 
-            dd_save_text(dd, FILENAME_LAST_OCCURRENCE, last_ocr);
+        count += new_count;
+        char new_count_str[sizeof(long)*3 + 2];
+        sprintf(new_count_str, "%lu", count);
+        dd_save_text(dd, FILENAME_COUNT, new_count_str);
 
+        if (last_ocr)
+        {
+            dd_save_text(dd, FILENAME_LAST_OCCURRENCE, last_ocr);
             free(last_ocr);
         }
     }
@@ -306,6 +308,9 @@ static int run_post_create(const char *dirname)
 
     dd_close(dd);
 
+    /* post-create is done, the directory counts for trimming from now on */
+    size_ledger_update(g_settings_dump_location, work_dir);
+
     if (!dup_of_dir)
         log_notice("New problem directory %s, processing", work_dir);
     else
@@ -314,39 +319,127 @@ static int run_post_create(const char *dirname)
                     strrchr(dirname, '/') + 1,
                     strrchr(dup_of_dir, '/') + 1);
         delete_dump_dir(dirname);
+        size_ledger_forget(g_settings_dump_location, dirname);
     }
 
     /* Run "notify[-dup]" event */
-    int fd;
-    child_pid = spawn_event_handler_child(
-                work_dir,
-                (dup_of_dir ? "notify-dup" : "notify"),
-                &fd
-    );
-    //log("Started notify, fd %d -> %d", fd, child_stdout_fd);
-    xmove_fd(fd, child_stdout_fd);
-    child_is_post_create = 0;
-    strbuf_clear(cmd_output);
-    free(dup_of_dir);
-    dup_of_dir = NULL;
-    goto read_child_output;
+    run_problem_event(work_dir, (dup_of_dir ? "notify-dup" : "notify"), NULL);
+    /* Autoreporting may have added files */
+    size_ledger_update(g_settings_dump_location, work_dir);
+    goto ret;
 
  delete_bad_dir:
     log_warning("Deleting problem directory '%s'", dirname);
     delete_dump_dir(dirname);
+    size_ledger_forget(g_settings_dump_location, dirname);
 
  ret:
-    strbuf_free(cmd_output);
     free(dup_of_dir);
-    close(child_stdout_fd);
     return 0;
 }
 
-/* Create a new problem directory from client session.
- * Caller must ensure that all fields in struct client
- * are properly filled.
+/* Hands the directory over to abrtd's post-create workers.
+ * Falls back to running post-create ourself if there is no abrtd queue.
+ */
+static int queue_post_create(const char *dirname)
+{
+    int r = check_post_create_dir(dirname);
+    if (r != 0)
+        return r;
+
+    if (post_create_fd >= 0)
+    {
+        char *job = xasprintf("%s\n", dirname);
+        /* Writes of up to PIPE_BUF bytes are atomic, thus jobs written
+         * by concurrent abrt-servers don't interleave.
+         */
+        if (strlen(job) <= PIPE_BUF && full_write_str(post_create_fd, job) >= 0)
+        {
+            log_info("Queued post-create of '%s'", dirname);
+            free(job);
+            return 0;
+        }
+        perror_msg("Can't queue post-create of '%s'", dirname);
+        free(job);
+    }
+
+    return run_post_create(dirname);
+}
+
+/* Post-create worker loop. abrtd writes problem directory names
+ * terminated by '\n' to our stdin, we write '\n' to stdout after each
+ * of them is processed.
+ */
+static int run_post_create_worker(void)
+{
+    log_info("Waiting for post-create jobs");
+
+    char *dirname;
+    while ((dirname = xmalloc_fgetline(stdin)) != NULL)
+    {
+        run_post_create(dirname);
+        free(dirname);
+
+        if (full_write(STDOUT_FILENO, "\n", 1) < 0)
+            perror_msg_and_die("Can't notify abrtd");
+    }
+
+    return 0;
+}
+
+/* The problem directory being received, deleted if the transaction fails */
+static struct dump_dir *received_dd;
+
+static void delete_received_dir(void)
+{
+    if (received_dd)
+    {
+        dd_delete(received_dd);
+        received_dd = NULL;
+    }
+}
+
+/* Items which are needed to name and check the problem directory, they are
+ * kept in memory. The others are only written to the directory.
+ */
+static bool is_kept_item(const char *key)
+{
+    return strcmp(key, FILENAME_PID) == 0
+        || strcmp(key, "basename") == 0
+        || strcmp(key, FILENAME_TYPE) == 0
+        || strcmp(key, FILENAME_EXECUTABLE) == 0;
+}
+
+/* State of the item being received, items are written to the problem
+ * directory as they come, without waiting for the whole message.
  */
-static int create_problem_dir(GHashTable *problem_info, unsigned pid)
+struct item_receiver
+{
+    struct dump_dir *dd;
+    /* All received keys, values of the kept items, "" for the others */
+    GHashTable *problem_info;
+    unsigned long long max_item_size;
+    /* Items passed as descriptors, core dumps for example */
+    unsigned long long max_fd_item_size;
+
+    char key[NAME_MAX + 1];
+    unsigned key_len;
+    bool in_value;
+    /* Invalid item, its value is thrown away */
+    bool skip;
+    unsigned long long value_len;
+    /* max_item_size or max_fd_item_size, 0 means unlimited */
+    unsigned long long max_value_len;
+    /* The file of the value or -1 for kept items */
+    int fd;
+    struct strbuf *value;
+};
+
+/* Starts the problem directory with the data which don't come from client.
+ * Its name is not known until the client sends all items, it is renamed
+ * by finish_problem_dir().
+ */
+static void start_problem_dir(struct item_receiver *r)
 {
     /* Exit if free space is less than 1/4 of MaxCrashReportsSize */
     if (g_settings_nMaxCrashReportsSize > 0)
@@ -355,23 +448,8 @@ static int create_problem_dir(GHashTable *problem_info, unsigned pid)
             exit(1);
     }
 
-    /* Create temp directory with the problem data.
-     * This directory is renamed to final directory name after
-     * all files have been stored into it.
-     */
-
-    gchar *dir_basename = g_hash_table_lookup(problem_info, "basename");
-    if (!dir_basename)
-        dir_basename = g_hash_table_lookup(problem_info, FILENAME_TYPE);
-
-    char *path = xasprintf("%s/%s-%s-%u.new",
-                           g_settings_dump_location,
-                           dir_basename,
-                           iso_date_string(NULL),
-                           pid);
-
-    /* This item is useless, don't save it */
-    g_hash_table_remove(problem_info, "basename");
+    /* Ends with ".new", so that abrtd ignores it */
+    char *path = xasprintf("%s/abrt-server-%u.new", g_settings_dump_location, (unsigned)getpid());
 
     /* No need to check the path length, as all variables used are limited,
      * and dd_create() fails if the path is too long.
@@ -381,12 +459,39 @@ static int create_problem_dir(GHashTable *problem_info, unsigned pid)
     {
         error_msg_and_die("Error creating problem directory '%s'", path);
     }
+    free(path);
+
+    received_dd = dd;
+    atexit(delete_received_dir);
 
     dd_create_basic_files(dd, client_uid, NULL);
     dd_save_text(dd, FILENAME_ABRT_VERSION, VERSION);
 
-    gpointer gpkey = g_hash_table_lookup(problem_info, FILENAME_CMDLINE);
-    if (!gpkey)
+    /* Store id of the user whose application crashed. */
+    char uid_str[sizeof(long) * 3 + 2];
+    sprintf(uid_str, "%lu", (long)client_uid);
+    dd_save_text(dd, FILENAME_UID, uid_str);
+
+    r->dd = dd;
+    /* use free instead of g_free so that we can use xstr* functions from
+     * libreport/lib/xfuncs.c
+     */
+    r->problem_info = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+    r->max_item_size = g_settings_max_item_size * 1024ULL;
+    r->max_fd_item_size = g_settings_nMaxCrashReportsSize * 1024ULL * 1024ULL;
+    r->fd = -1;
+    r->value = strbuf_new();
+}
+
+/* Finishes the received problem directory and gives it its final name.
+ * Does not return.
+ */
+static void finish_problem_dir(struct item_receiver *r, unsigned pid)
+{
+    struct dump_dir *dd = r->dd;
+    GHashTable *problem_info = r->problem_info;
+
+    if (!g_hash_table_lookup(problem_info, FILENAME_CMDLINE))
     {
         /* Obtain and save the command line. */
         char *cmdline = get_cmdline(pid);
@@ -397,31 +502,35 @@ static int create_problem_dir(GHashTable *problem_info, unsigned pid)
         }
     }
 
-    /* Store id of the user whose application crashed. */
-    char uid_str[sizeof(long) * 3 + 2];
-    sprintf(uid_str, "%lu", (long)client_uid);
-    dd_save_text(dd, FILENAME_UID, uid_str);
+    gchar *dir_basename = g_hash_table_lookup(problem_info, "basename");
+    if (!dir_basename)
+        dir_basename = g_hash_table_lookup(problem_info, FILENAME_TYPE);
 
-    GHashTableIter iter;
-    gpointer gpvalue;
-    g_hash_table_iter_init(&iter, problem_info);
-    while (g_hash_table_iter_next(&iter, &gpkey, &gpvalue))
-    {
-        dd_save_text(dd, (gchar *) gpkey, (gchar *) gpvalue);
-    }
+    char *path = xasprintf("%s/%s-%s-%u",
+                           g_settings_dump_location,
+                           dir_basename,
+                           iso_date_string(NULL),
+                           pid);
 
+    char *received_path = xstrdup(dd->dd_dirname);
     dd_close(dd);
+    received_dd = NULL;
 
     /* Not needing it anymore */
     g_hash_table_destroy(problem_info);
+    strbuf_free(r->value);
 
     /* Move the completely created problem directory
      * to final directory.
      */
-    char *newpath = xstrndup(path, strlen(path) - strlen(".new"));
-    if (rename(path, newpath) == 0)
-        strcpy(path, newpath);
-    free(newpath);
+    if (rename(received_path, path) != 0)
+    {
+        perror_msg("Can't rename '%s' to '%s'", received_path, path);
+        free(path);
+        path = received_path;
+    }
+    else
+        free(received_path);
 
     log_notice("Saved problem directory of pid %u to '%s'", pid, path);
 
@@ -433,13 +542,8 @@ static int create_problem_dir(GHashTable *problem_info, unsigned pid)
     close(STDOUT_FILENO);
     xdup2(STDERR_FILENO, STDOUT_FILENO); /* paranoia: don't leave stdout fd closed */
 
-    /* Trim old problem directories if necessary */
-    if (g_settings_nMaxCrashReportsSize > 0)
-    {
-        trim_problem_dirs(g_settings_dump_location, g_settings_nMaxCrashReportsSize * (double)(1024*1024), path);
-    }
-
-    run_post_create(path);
+    /* abrtd trims old problem directories when needed */
+    queue_post_create(path);
 
     /* free(path); */
     exit(0);
@@ -461,18 +565,24 @@ static gboolean is_correct_filename(const char *value)
     return printable_str(value) && !strchr(value, '/') && !strchr(value, '.');
 }
 
-static gboolean key_value_ok(gchar *key, gchar *value)
+static gboolean key_ok(const char *key)
 {
-    char *i;
-
     /* check key, it has to be valid filename and will end up in the
      * bugzilla */
-    for (i = key; *i != 0; i++)
+    if (*key == '\0')
+        return FALSE;
+
+    for (const char *i = key; *i != 0; i++)
     {
         if (!isalpha(*i) && (*i != '-') && (*i != '_') && (*i != ' '))
             return FALSE;
     }
 
+    return TRUE;
+}
+
+static gboolean value_ok(const char *key, const char *value)
+{
     /* check value of 'basename', it has to be valid non-hidden directory
      * name */
     if (strcmp(key, "basename") == 0
@@ -490,46 +600,158 @@ static gboolean key_value_ok(gchar *key, gchar *value)
     return TRUE;
 }
 
-/* Handles a message received from client over socket. */
-static void process_message(GHashTable *problem_info, char *message)
+/* Opens the file of the item the way dd_save_text() does */
+static int open_item_file(struct dump_dir *dd, const char *name)
+{
+    char *path = concat_path_file(dd->dd_dirname, name);
+    unlink(path);
+    int fd = open(path, O_WRONLY | O_TRUNC | O_CREAT | O_NOFOLLOW, dd->mode);
+    if (fd < 0)
+        perror_msg("Can't open file '%s'", path);
+    else if (dd->dd_uid != (uid_t)-1L && fchown(fd, dd->dd_uid, dd->dd_gid) == -1)
+        perror_msg("Can't change '%s' ownership to %lu:%lu", path, (long)dd->dd_uid, (long)dd->dd_gid);
+    free(path);
+    return fd;
+}
+
+/* The key has been received */
+static void begin_item_value(struct item_receiver *r)
 {
-    gchar *key, *value;
+    r->key[r->key_len] = '\0';
+    r->in_value = true;
+    r->skip = true;
+    r->value_len = 0;
+    r->max_value_len = r->max_item_size;
+
+    if (!key_ok(r->key))
+    {
+        /* should use error_msg_and_die() here? */
+        error_msg("Invalid key format: '%s'", r->key);
+        return;
+    }
+
+    for (char *c = r->key; *c; ++c)
+        *c = g_ascii_tolower(*c);
+
+    if (strcmp(r->key, FILENAME_UID) == 0)
+    {
+        error_msg("Ignoring value of %s, will be determined later",
+                  FILENAME_UID);
+        return;
+    }
 
-    value = strchr(message, '=');
-    if (value)
+    if (is_kept_item(r->key))
+        strbuf_clear(r->value);
+    else
     {
-        key = g_ascii_strdown(message, value - message); /* result is malloced */
-//TODO: is it ok? it uses g_malloc, not malloc!
+        r->fd = open_item_file(r->dd, r->key);
+        if (r->fd < 0)
+            return;
+    }
+
+    r->skip = false;
+}
+
+static void append_item_value(struct item_receiver *r, const char *data, size_t len)
+{
+    r->value_len += len;
+    if (r->max_value_len != 0 && r->value_len > r->max_value_len)
+        error_msg_and_die("Item '%s' is too long, aborting", r->key);
+
+    if (r->skip || len == 0)
+        return;
+
+    if (r->fd >= 0)
+    {
+        if (full_write(r->fd, data, len) != len)
+            perror_msg_and_die("Can't save '%s'", r->key);
+    }
+    else
+        strbuf_append_strf(r->value, "%.*s", (int)len, data);
+}
+
+/* The terminating NUL of the item has been received */
+static void end_item(struct item_receiver *r)
+{
+    if (r->skip)
+        goto reset;
+
+    if (r->fd >= 0)
+    {
+        close(r->fd);
+        r->fd = -1;
+        g_hash_table_replace(r->problem_info, xstrdup(r->key), xstrdup(""));
+        goto reset;
+    }
+
+    const char *value = r->value->buf;
+    if (!value_ok(r->key, value))
+    {
+        /* should use error_msg_and_die() here? */
+        error_msg("Invalid key or value format: %s=%s", r->key, value);
+        goto reset;
+    }
+
+    g_hash_table_replace(r->problem_info, xstrdup(r->key), xstrdup(value));
+
+    /* This item is useless, don't save it */
+    if (strcmp(r->key, "basename") != 0)
+        dd_save_text(r->dd, r->key, value);
+
+    /* Compat, delete when FILENAME_ANALYZER is replaced by FILENAME_TYPE: */
+    if (strcmp(r->key, FILENAME_TYPE) == 0)
+    {
+        g_hash_table_replace(r->problem_info, xstrdup(FILENAME_ANALYZER), xstrdup(value));
+        dd_save_text(r->dd, FILENAME_ANALYZER, value);
+    }
+
+ reset:
+    r->key_len = 0;
+    r->in_value = false;
+}
 
-        value++;
-        if (key_value_ok(key, value))
+/* Handles the data received from client over socket, "KEY=value" items
+ * terminated by NUL can be split across the calls arbitrarily. */
+static void receive_items(struct item_receiver *r, const char *data, size_t len)
+{
+    const char *const end = data + len;
+    while (data < end)
+    {
+        if (!r->in_value)
         {
-            if (strcmp(key, FILENAME_UID) == 0)
+            const char c = *data++;
+            if (c == '=')
+                begin_item_value(r);
+            else if (c == '\0')
             {
-                error_msg("Ignoring value of %s, will be determined later",
-                          FILENAME_UID);
+                /* should use error_msg_and_die() here? */
+                error_msg("Invalid message format: '%.*s'", (int)r->key_len, r->key);
+                r->key_len = 0;
             }
+            else if (r->key_len < sizeof(r->key) - 1)
+                r->key[r->key_len++] = c;
             else
             {
-                g_hash_table_insert(problem_info, key, xstrdup(value));
-                /* Compat, delete when FILENAME_ANALYZER is replaced by FILENAME_TYPE: */
-                if (strcmp(key, FILENAME_TYPE) == 0)
-                    g_hash_table_insert(problem_info, xstrdup(FILENAME_ANALYZER), xstrdup(value));
-                /* Prevent freeing key later: */
-                key = NULL;
+                error_msg("Invalid key format: '%.*s...'", (int)r->key_len, r->key);
+                r->key_len = 0;
+                r->in_value = true;
+                r->skip = true;
+                r->value_len = 0;
+                r->max_value_len = r->max_item_size;
             }
+            continue;
         }
-        else
+
+        /* The value is processed in place */
+        const char *nul = memchr(data, '\0', end - data);
+        const char *value_end = nul ? nul : end;
+        append_item_value(r, data, value_end - data);
+        data = value_end;
+        if (nul)
         {
-            /* should use error_msg_and_die() here? */
-            error_msg("Invalid key or value format: %s", message);
+            end_item(r);
+            data++;
         }
-        free(key);
-    }
-    else
-    {
-        /* should use error_msg_and_die() here? */
-        error_msg("Invalid message format: '%s'", message);
     }
 }
 
@@ -580,37 +802,349 @@ unsigned convert_pid(GHashTable *problem_info)
     return (unsigned) ret;
 }
 
-static int perform_http_xact(void)
+/* Descriptors passed by client along with the binary protocol data,
+ * in the order of arrival */
+static int received_fds[ABRT_SOCKET_MAX_FDS];
+static unsigned received_fds_count;
+static unsigned received_fds_next;
+
+static void store_received_fds(struct msghdr *msg)
 {
-    /* use free instead of g_free so that we can use xstr* functions from
-     * libreport/lib/xfuncs.c
-     */
-    GHashTable *problem_info = g_hash_table_new_full(g_str_hash, g_str_equal,
-                                     free, free);
-    /* Read header */
-    char *body_start = NULL;
-    char *messagebuf_data = NULL;
-    unsigned messagebuf_len = 0;
-    /* Loop until EOF/error/timeout/end_of_header */
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        const int *fds = (const int *)CMSG_DATA(cmsg);
+        const unsigned count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            if (received_fds_count < ABRT_SOCKET_MAX_FDS)
+                received_fds[received_fds_count++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+
+    if (msg->msg_flags & MSG_CTRUNC)
+        error_msg_and_die("Too many descriptors, aborting");
+}
+
+/* Counts the data received from client, dies if there is too much of it */
+static int read_from_client(char *buf, unsigned size)
+{
+    /* stdin is not a socket when abrt-server is run by hand */
+    static bool not_socket;
+
+    int rd;
+    if (not_socket)
+        rd = read(STDIN_FILENO, buf, size);
+    else
+    {
+        struct iovec iov = { .iov_base = buf, .iov_len = size };
+        union {
+            struct cmsghdr cmsg;
+            char buf[CMSG_SPACE(sizeof(int) * ABRT_SOCKET_MAX_FDS)];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        rd = recvmsg(STDIN_FILENO, &msg, MSG_CMSG_CLOEXEC);
+        if (rd < 0 && errno == ENOTSOCK)
+        {
+            not_socket = true;
+            return read_from_client(buf, size);
+        }
+        if (rd >= 0)
+            store_received_fds(&msg);
+    }
+
+    if (rd < 0)
+    {
+        if (errno == EINTR) /* SIGALRM? */
+            error_msg_and_die("Timed out");
+        perror_msg_and_die("read");
+    }
+
+    if (rd > 0)
+    {
+        log_debug("Received %u bytes of data", rd);
+        total_bytes_read += rd;
+        if (total_bytes_read > MAX_MESSAGE_SIZE)
+            error_msg_and_die("Message is too long, aborting");
+    }
+
+    return rd;
+}
+
+/* Copies the content of the next passed descriptor to the current item */
+static void receive_fd_item(struct item_receiver *r)
+{
+    if (received_fds_next == received_fds_count)
+        error_msg_and_die("Descriptor of '%s' is missing, aborting", r->key);
+
+    const int fd = received_fds[received_fds_next++];
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        perror_msg_and_die("fstat('%s')", r->key);
+    /* Don't let client make us read a device or wait on a socket */
+    if (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode))
+        error_msg_and_die("Descriptor of '%s' is not a file or a pipe, aborting", r->key);
+
+    /* Not MaxItemSize, the descriptors are for the big items */
+    r->max_value_len = r->max_fd_item_size;
+
+    char buf[INPUT_BUFFER_SIZE];
     while (1)
     {
-        messagebuf_data = xrealloc(messagebuf_data, messagebuf_len + INPUT_BUFFER_SIZE);
-        char *p = messagebuf_data + messagebuf_len;
-        int rd = read(STDIN_FILENO, p, INPUT_BUFFER_SIZE);
+        /* Not safe_read(), SIGALRM must interrupt a stuck writer */
+        const ssize_t rd = read(fd, buf, sizeof(buf));
         if (rd < 0)
         {
             if (errno == EINTR) /* SIGALRM? */
                 error_msg_and_die("Timed out");
-            perror_msg_and_die("read");
+            perror_msg_and_die("Can't read '%s'", r->key);
         }
         if (rd == 0)
             break;
 
-        log_debug("Received %u bytes of data", rd);
+        append_item_value(r, buf, rd);
+    }
+
+    close(fd);
+}
+
+enum binary_state
+{
+    BINARY_STREAM_HEADER,
+    BINARY_RECORD_HEADER,
+    BINARY_KEY,
+    BINARY_VALUE,
+    BINARY_END,
+};
+
+struct binary_receiver
+{
+    struct item_receiver *items;
+    enum binary_state state;
+    union {
+        struct abrt_socket_stream_header stream;
+        struct abrt_socket_record_header record;
+        char bytes[8];
+    } header;
+    unsigned header_len;
+    unsigned type;
+    unsigned key_len;
+    unsigned long value_left;
+};
+
+static void begin_binary_record(struct binary_receiver *b)
+{
+    b->type = ntohs(b->header.record.type);
+    b->key_len = ntohs(b->header.record.key_len);
+    b->value_left = ntohl(b->header.record.value_len);
+
+    if (b->type == ABRT_SOCKET_END)
+    {
+        b->state = BINARY_END;
+        return;
+    }
+
+    if (b->type != ABRT_SOCKET_ITEM && b->type != ABRT_SOCKET_FD_ITEM)
+        error_msg_and_die("Invalid record type %u, aborting", b->type);
+    if (b->type == ABRT_SOCKET_FD_ITEM && b->value_left != 0)
+        error_msg_and_die("Descriptor record with data, aborting");
+    if (b->key_len == 0 || b->key_len > NAME_MAX)
+        error_msg_and_die("Invalid key length %u, aborting", b->key_len);
+
+    b->items->key_len = 0;
+    b->state = BINARY_KEY;
+}
+
+static void begin_binary_value(struct binary_receiver *b)
+{
+    struct item_receiver *r = b->items;
+    r->key[r->key_len] = '\0';
+    if (strlen(r->key) == r->key_len)
+        begin_item_value(r);
+    else
+    {
+        error_msg("Invalid key format: '%s'", r->key);
+        r->in_value = true;
+        r->skip = true;
+        r->value_len = 0;
+        r->max_value_len = r->max_item_size;
+    }
+
+    if (b->type == ABRT_SOCKET_FD_ITEM)
+    {
+        receive_fd_item(r);
+        end_item(r);
+        b->state = BINARY_RECORD_HEADER;
+    }
+    else if (b->value_left == 0)
+    {
+        end_item(r);
+        b->state = BINARY_RECORD_HEADER;
+    }
+    else
+        b->state = BINARY_VALUE;
+}
+
+/* Handles the data of the binary protocol, the records can be split across
+ * the calls arbitrarily. Returns the number of consumed bytes, the data past
+ * the end record are not consumed. */
+static size_t receive_binary(struct binary_receiver *b, const char *data, size_t len)
+{
+    const char *const start = data;
+    const char *const end = data + len;
+    while (data < end && b->state != BINARY_END)
+    {
+        switch (b->state)
+        {
+            case BINARY_STREAM_HEADER:
+            case BINARY_RECORD_HEADER:
+            {
+                const size_t header_size = b->state == BINARY_STREAM_HEADER
+                        ? sizeof(b->header.stream) : sizeof(b->header.record);
+                const size_t n = MIN(header_size - b->header_len, (size_t)(end - data));
+                memcpy(b->header.bytes + b->header_len, data, n);
+                b->header_len += n;
+                data += n;
+                if (b->header_len < header_size)
+                    break;
+
+                b->header_len = 0;
+                if (b->state == BINARY_RECORD_HEADER)
+                {
+                    begin_binary_record(b);
+                    break;
+                }
+
+                if (memcmp(b->header.stream.magic, ABRT_SOCKET_MAGIC, sizeof(b->header.stream.magic)) != 0)
+                    error_msg_and_die("Invalid stream header, aborting");
+                if (ntohs(b->header.stream.version) != ABRT_SOCKET_VERSION)
+                    error_msg_and_die("Unsupported protocol version %u, aborting",
+                                      ntohs(b->header.stream.version));
+                b->state = BINARY_RECORD_HEADER;
+                break;
+            }
+            case BINARY_KEY:
+            {
+                struct item_receiver *r = b->items;
+                const size_t n = MIN(b->key_len - r->key_len, (size_t)(end - data));
+                memcpy(r->key + r->key_len, data, n);
+                r->key_len += n;
+                data += n;
+                if (r->key_len == b->key_len)
+                    begin_binary_value(b);
+                break;
+            }
+            case BINARY_VALUE:
+            {
+                /* The value is processed in place */
+                const size_t n = MIN(b->value_left, (unsigned long)(end - data));
+                append_item_value(b->items, data, n);
+                b->value_left -= n;
+                data += n;
+                if (b->value_left == 0)
+                {
+                    end_item(b->items);
+                    b->state = BINARY_RECORD_HEADER;
+                }
+                break;
+            }
+            case BINARY_END:
+                break;
+        }
+    }
+
+    return data - start;
+}
+
+/* Everything has been received, saves the problem directory if the problem
+ * is complete and not rate limited */
+static int save_received_problem(struct item_receiver *receiver)
+{
+    int ret = 0;
+    GHashTable *problem_info = receiver->problem_info;
+    unsigned pid = convert_pid(problem_info);
+    die_if_data_is_missing(problem_info);
+
+    char *executable = g_hash_table_lookup(problem_info, FILENAME_EXECUTABLE);
+    if (executable && crash_rate_limit_check(executable, client_uid))
+        goto out; /* Only pretend that we saved it, ret is 0: "success" */
+
+    finish_problem_dir(receiver, pid);
+    /* does not return */
+
+ out:
+    delete_received_dir();
+    strbuf_free(receiver->value);
+    g_hash_table_destroy(problem_info);
+    return ret; /* Used as HTTP response code */
+}
+
+/* buf holds the first len bytes of the stream, it is reused for the rest */
+static int perform_binary_xact(char *buf, unsigned len)
+{
+    struct item_receiver receiver;
+    memset(&receiver, 0, sizeof(receiver));
+    start_problem_dir(&receiver);
+
+    struct binary_receiver binary;
+    memset(&binary, 0, sizeof(binary));
+    binary.items = &receiver;
+    binary.state = BINARY_STREAM_HEADER;
+
+    /* Loop until the end record/EOF/error/timeout */
+    while (1)
+    {
+        if (receive_binary(&binary, buf, len) != len)
+            error_msg_and_die("Data after the end record, aborting");
+        if (binary.state == BINARY_END)
+            break;
+
+        len = read_from_client(buf, INPUT_BUFFER_SIZE);
+        if (len == 0)
+        {
+            log_warning("Premature EOF detected, exiting");
+            return 400; /* Bad Request */
+        }
+    }
+
+    /* The end record received. Don't let alarm to interrupt after this. */
+    alarm(0);
+
+    return save_received_problem(&receiver);
+}
+
+static int perform_http_xact(void)
+{
+    /* Read header */
+    char *body_start = NULL;
+    /* The whole header must fit in, the body is processed in place
+     * block by block */
+    char messagebuf_data[INPUT_BUFFER_SIZE + 1];
+    unsigned messagebuf_len = 0;
+    /* Loop until EOF/error/timeout/end_of_header */
+    while (messagebuf_len < INPUT_BUFFER_SIZE)
+    {
+        char *p = messagebuf_data + messagebuf_len;
+        int rd = read_from_client(p, INPUT_BUFFER_SIZE - messagebuf_len);
+        if (rd == 0)
+            break;
+
         messagebuf_len += rd;
-        total_bytes_read += rd;
-        if (total_bytes_read > MAX_MESSAGE_SIZE)
-            error_msg_and_die("Message is too long, aborting");
+
+        /* Binary protocol of problem_submission_send() */
+        if (messagebuf_len >= strlen(ABRT_SOCKET_MAGIC)
+         && memcmp(messagebuf_data, ABRT_SOCKET_MAGIC, strlen(ABRT_SOCKET_MAGIC)) == 0)
+            return perform_binary_xact(messagebuf_data, messagebuf_len);
 
         /* Check whether we see end of header */
         /* Note: we support both [\r]\n\r\n and \n\n */
@@ -634,6 +1168,7 @@ static int perform_http_xact(void)
             }
         }
     } /* while (read) */
+    messagebuf_data[messagebuf_len] = '\0';
  found_end_of_header: ;
     log_debug("Request: %s", messagebuf_data);
 
@@ -648,14 +1183,14 @@ static int perform_http_xact(void)
      */
     if (prefixcmp(messagebuf_data, "DELETE ") == 0)
     {
-        messagebuf_data += strlen("DELETE ");
-        char *space = strchr(messagebuf_data, ' ');
+        char *path = messagebuf_data + strlen("DELETE ");
+        char *space = strchr(path, ' ');
         if (!space || prefixcmp(space+1, "HTTP/") != 0)
             return 400; /* Bad Request */
         *space = '\0';
-        //decode_url(messagebuf_data); %20 => ' '
+        //decode_url(path); %20 => ' '
         alarm(0);
-        return delete_path(messagebuf_data);
+        return delete_path(path);
     }
 
     /* We erroneously used "PUT /" to create new problems.
@@ -689,43 +1224,35 @@ static int perform_http_xact(void)
         return 400; /* Bad Request */
     }
 
-    messagebuf_len -= (body_start - messagebuf_data);
-    memmove(messagebuf_data, body_start, messagebuf_len);
-    log_debug("Body so far: %u bytes, '%s'", messagebuf_len, messagebuf_data);
+    /* The rest of the last read block is the beginning of the body */
+    unsigned body_len = messagebuf_data + messagebuf_len - body_start;
+    log_debug("Body so far: %u bytes", body_len);
+
+    struct item_receiver receiver;
+    memset(&receiver, 0, sizeof(receiver));
+    struct strbuf *notification = NULL;
+    if (url_type == CREATION_REQUEST)
+    {
+        start_problem_dir(&receiver);
+        receive_items(&receiver, body_start, body_len);
+    }
+    else
+    {
+        notification = strbuf_new();
+        strbuf_append_strf(notification, "%.*s", (int)body_len, body_start);
+    }
 
     /* Loop until EOF/error/timeout */
     while (1)
     {
-        if (url_type == CREATION_REQUEST)
-        {
-            while (1)
-            {
-                unsigned len = strnlen(messagebuf_data, messagebuf_len);
-                if (len >= messagebuf_len)
-                    break;
-                /* messagebuf has at least one NUL - process the line */
-                process_message(problem_info, messagebuf_data);
-                messagebuf_len -= (len + 1);
-                memmove(messagebuf_data, messagebuf_data + len + 1, messagebuf_len);
-            }
-        }
-
-        messagebuf_data = xrealloc(messagebuf_data, messagebuf_len + INPUT_BUFFER_SIZE + 1);
-        int rd = read(STDIN_FILENO, messagebuf_data + messagebuf_len, INPUT_BUFFER_SIZE);
-        if (rd < 0)
-        {
-            if (errno == EINTR) /* SIGALRM? */
-                error_msg_and_die("Timed out");
-            perror_msg_and_die("read");
-        }
+        int rd = read_from_client(messagebuf_data, INPUT_BUFFER_SIZE);
         if (rd == 0)
             break;
 
-        log_debug("Received %u bytes of data", rd);
-        messagebuf_len += rd;
-        total_bytes_read += rd;
-        if (total_bytes_read > MAX_MESSAGE_SIZE)
-            error_msg_and_die("Message is too long, aborting");
+        if (url_type == CREATION_REQUEST)
+            receive_items(&receiver, messagebuf_data, rd);
+        else
+            strbuf_append_strf(notification, "%.*s", rd, messagebuf_data);
     }
 
     /* Body received, EOF was seen. Don't let alarm to interrupt after this. */
@@ -733,38 +1260,22 @@ static int perform_http_xact(void)
 
     if (url_type == CREATION_NOTIFICATION)
     {
-        messagebuf_data[messagebuf_len] = '\0';
-        return run_post_create(messagebuf_data);
+        int r = queue_post_create(notification->buf);
+        strbuf_free(notification);
+        return r;
     }
 
-    /* Save problem dir */
-    int ret = 0;
-    unsigned pid = convert_pid(problem_info);
-    die_if_data_is_missing(problem_info);
-
-    char *executable = g_hash_table_lookup(problem_info, FILENAME_EXECUTABLE);
-    if (executable)
+    if (receiver.in_value)
     {
-        char *last_file = concat_path_file(g_settings_dump_location, "last-via-server");
-        int repeating_crash = check_recent_crash_file(last_file, executable);
-        free(last_file);
-        if (repeating_crash) /* Only pretend that we saved it */
-            goto out; /* ret is 0: "success" */
+        error_msg("Item '%s' is not terminated, ignoring it", receiver.key);
+        if (receiver.fd >= 0)
+        {
+            close(receiver.fd);
+            dd_delete_item(receiver.dd, receiver.key);
+        }
     }
 
-#if 0
-//TODO:
-    /* At least it should generate local problem identifier UUID */
-    problem_data_add_basics(problem_info);
-//...the problem being that problem_info here is not a problem_data_t!
-#endif
-
-    create_problem_dir(problem_info, pid);
-    /* does not return */
-
- out:
-    g_hash_table_destroy(problem_info);
-    return ret; /* Used as HTTP response code */
+    return save_received_problem(&receiver);
 }
 
 static void dummy_handler(int sig_unused) {}
@@ -789,6 +1300,8 @@ int main(int argc, char **argv)
         OPT_u = 1 << 1,
         OPT_s = 1 << 2,
         OPT_p = 1 << 3,
+        OPT_w = 1 << 4,
+        OPT_j = 1 << 5,
     };
     /* Keep enum above and order of options below in sync! */
     struct options program_options[] = {
@@ -796,18 +1309,35 @@ int main(int argc, char **argv)
         OPT_INTEGER('u', NULL, &client_uid, _("Use NUM as client uid")),
         OPT_BOOL(   's', NULL, NULL       , _("Log to syslog")),
         OPT_BOOL(   'p', NULL, NULL       , _("Add program names to log")),
+        OPT_BOOL(   'w', NULL, NULL       , _("Run post-create on directories read from stdin")),
+        OPT_INTEGER('j', NULL, &post_create_fd, _("Queue post-create jobs to FD")),
         OPT_END()
     };
     unsigned opts = parse_opts(argc, argv, program_options, program_usage_string);
 
     export_abrt_envvars(opts & OPT_p);
 
+    /* Intercept ASK_* messages in Client API of the event commands
+     * -> don't wait for user response
+     */
+    putenv((char*)"REPORT_CLIENT_NONINTERACTIVE=1");
+
     msg_prefix = xasprintf("%s[%u]", g_progname, getpid());
     if (opts & OPT_s)
     {
         logmode = LOGMODE_JOURNAL;
     }
 
+    if (opts & OPT_w)
+    {
+        /* Worker is started by abrtd, there is no client */
+        client_uid = 0;
+        load_abrt_conf();
+        int r = run_post_create_worker();
+        free_abrt_conf_data();
+        return r;
+    }
+
     /* Set up timeout handling */
     /* Part 1 - need this to make SIGALRM interrupt syscalls
      * (as opposed to restarting them): I want read syscall to be interrupted
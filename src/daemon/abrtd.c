@@ -20,6 +20,9 @@
 # include <locale.h>
 #endif
 #include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "abrt_glib.h"
 #include "abrt-inotify.h"
@@ -35,19 +38,36 @@
 
 
 #define VAR_RUN_PIDFILE   VAR_RUN"/abrt/abrtd.pid"
+/* Counters describing the load, see save_stats() */
+#define VAR_RUN_STATS     VAR_RUN"/abrt/abrtd.stats"
 
 #define SOCKET_FILE       VAR_RUN"/abrt/abrt.socket"
 #define SOCKET_PERMISSION 0666
-/* Maximum number of simultaneously opened client connections. */
+/* Maximum number of simultaneously running abrt-server processes. */
 #define MAX_CLIENT_COUNT  10
-
-#define IN_DUMP_LOCATION_FLAGS (IN_DELETE_SELF | IN_MOVE_SELF)
+/* Maximum number of requests being received or waiting for abrt-server,
+ * more connections are refused. */
+#define MAX_CONNECTION_COUNT 128
+/* A client must send the whole request in this many seconds */
+#define CONNECTION_TIMEOUT 10
+/* Same as in abrt-server, longer requests are refused */
+#define MAX_REQUEST_SIZE  (4*1024*1024)
+/* Maximum number of bytes of all requests being received or waiting,
+ * more connections are refused */
+#define MAX_BUFFERED_SIZE (32*1024*1024)
+
+#define IN_DUMP_LOCATION_FLAGS (IN_DELETE_SELF | IN_MOVE_SELF | IN_DELETE | IN_MOVED_FROM)
 
 /* Daemon initializes, then sits in glib main loop, waiting for events.
  * Events can be:
  * - inotify: something new appeared under /var/tmp/abrt or /var/spool/abrt-upload
  * - signal: we got SIGTERM, SIGINT, SIGALRM or SIGCHLD
- * - new socket connection
+ * - new socket connection, data from a connected client
+ * - new post-create job from abrt-server
+ * - post-create worker finished its job
+ *
+ * Once a second we check whether the dump location is over
+ * MaxCrashReportsSize and if it is, start a background trimmer.
  */
 static volatile sig_atomic_t s_sig_caught;
 static int s_signal_pipe[2];
@@ -59,6 +79,100 @@ static GIOChannel *channel_socket = NULL;
 static guint channel_id_socket = 0;
 static int child_count = 0;
 
+/* Connections to abrt.socket.
+ *
+ * Clients send the whole request and then shut down the writing side of
+ * the socket. We receive requests of all clients in the main loop, so slow
+ * clients don't hold abrt-server processes. A complete request is passed
+ * to an abrt-server process which parses it, saves the problem and answers
+ * the client.
+ */
+enum connection_state
+{
+    CONNECTION_READING,     /* receiving the request from client */
+    CONNECTION_WAITING,     /* complete, waiting for abrt-server */
+    CONNECTION_FEEDING,     /* writing the request to abrt-server */
+};
+
+struct client_connection
+{
+    enum connection_state state;
+    uid_t uid;
+    time_t deadline;
+    /* client's socket, abrt-server's stdin when feeding */
+    GIOChannel *channel;
+    guint channel_id;
+    char *data;
+    size_t len;
+    size_t size;
+    size_t sent;
+    /* descriptors passed by the client, they are passed on to abrt-server */
+    int fds[ABRT_SOCKET_MAX_FDS];
+    unsigned fds_count;
+};
+
+static GQueue s_connections = G_QUEUE_INIT;
+static GQueue s_waiting_connections = G_QUEUE_INIT;
+static guint s_connection_timer_id;
+/* Sum of sizes of all connections' buffers */
+static size_t s_buffered_size;
+
+static unsigned count_connections(enum connection_state state)
+{
+    unsigned count = 0;
+    for (GList *l = s_connections.head; l; l = l->next)
+        if (((struct client_connection *)l->data)->state == state)
+            ++count;
+    return count;
+}
+
+/* Post-create workers.
+ *
+ * abrt-server processes don't run post-create themselves. They write names
+ * of new problem directories to the job pipe and exit. We keep the names
+ * in a queue and hand them over to a pool of long-lived "abrt-server -w"
+ * processes, one job per worker at a time.
+ */
+struct post_create_worker
+{
+    pid_t pid;              /* 0 if not running */
+    int job_fd;             /* worker's stdin */
+    GIOChannel *channel;    /* worker's stdout, '\n' means "job done" */
+    guint channel_id;
+    char *dirname;          /* job in progress or NULL */
+};
+
+static struct post_create_worker *s_workers;
+static unsigned s_worker_count;
+static GQueue s_post_create_queue = G_QUEUE_INIT;
+static int s_job_pipe[2] = { -1, -1 };
+static GIOChannel *channel_jobs = NULL;
+static guint channel_id_jobs = 0;
+static struct strbuf *s_job_buf;
+
+static struct
+{
+    unsigned long jobs_queued;
+    unsigned long jobs_done;
+    unsigned long jobs_lost;
+    unsigned long max_queue_length;
+    unsigned long worker_restarts;
+    unsigned long accepting_paused;
+    unsigned long connections_refused;
+    unsigned long connections_timed_out;
+    unsigned long trims;
+} s_stats;
+static bool s_stats_dirty;
+
+/* Size of problem directories according to the size ledger, -1: unknown */
+static double s_dump_location_size = -1;
+static bool s_dump_location_size_dirty = true;
+static pid_t s_trimmer_pid;
+
+/* Snapshot of settings for abrt-hook-ccpp, locked while we run */
+static struct hook_settings s_hook_settings;
+static int s_hook_settings_lock_fd = -1;
+
 /* Helpers */
 static guint add_watch_or_die(GIOChannel *channel, unsigned condition, GIOFunc func)
 {
@@ -69,69 +183,782 @@ static guint add_watch_or_die(GIOChannel *channel, unsigned condition, GIOFunc f
     return r;
 }
 
-static void increment_child_count(void)
+static gboolean server_socket_cb(GIOChannel *source, GIOCondition condition, gpointer ptr_unused);
+
+static bool post_create_queue_is_full(void)
 {
-    if (++child_count >= MAX_CLIENT_COUNT)
+    return g_settings_post_create_queue_size != 0
+        && g_queue_get_length(&s_post_create_queue) >= g_settings_post_create_queue_size;
+}
+
+static void start_waiting_servers(void);
+
+/* Backpressure: stop accepting connections if the post-create workers can't
+ * keep up.
+ */
+static void update_socket_watch(void)
+{
+    if (!channel_socket)
+        return;
+
+    if (!post_create_queue_is_full())
+    {
+        if (!channel_id_socket)
+        {
+            log_info("Accepting connections on '%s'", SOCKET_FILE);
+            channel_id_socket = add_watch_or_die(channel_socket, G_IO_IN | G_IO_PRI | G_IO_HUP, server_socket_cb);
+        }
+        return;
+    }
+
+    if (channel_id_socket)
     {
-        error_msg("Too many clients, refusing connections to '%s'", SOCKET_FILE);
+        error_msg("Too many problems waiting for post-create, refusing connections to '%s'", SOCKET_FILE);
         /* To avoid infinite loop caused by the descriptor in "ready" state,
          * the callback must be disabled.
          */
         g_source_remove(channel_id_socket);
         channel_id_socket = 0;
+        s_stats.accepting_paused++;
+        s_stats_dirty = true;
     }
 }
 
-static gboolean server_socket_cb(GIOChannel *source, GIOCondition condition, gpointer ptr_unused);
+static void increment_child_count(void)
+{
+    ++child_count;
+    update_socket_watch();
+}
 
 static void decrement_child_count(void)
 {
     if (child_count)
         child_count--;
-    if (child_count < MAX_CLIENT_COUNT && !channel_id_socket)
+    start_waiting_servers();
+    update_socket_watch();
+}
+
+static void save_stats(void)
+{
+    unsigned busy = 0;
+    for (unsigned i = 0; i < s_worker_count; ++i)
+        if (s_workers[i].dirname)
+            ++busy;
+
+    struct strbuf *buf = strbuf_new();
+    strbuf_append_strf(buf, "clients=%d\n", child_count);
+    strbuf_append_strf(buf, "connections_receiving=%u\n", count_connections(CONNECTION_READING));
+    strbuf_append_strf(buf, "connections_waiting=%u\n", g_queue_get_length(&s_waiting_connections));
+    strbuf_append_strf(buf, "connections_buffered_bytes=%zu\n", s_buffered_size);
+    strbuf_append_strf(buf, "connections_refused=%lu\n", s_stats.connections_refused);
+    strbuf_append_strf(buf, "connections_timed_out=%lu\n", s_stats.connections_timed_out);
+    strbuf_append_strf(buf, "accepting_connections=%d\n", channel_id_socket != 0);
+    strbuf_append_strf(buf, "accepting_paused=%lu\n", s_stats.accepting_paused);
+    strbuf_append_strf(buf, "post_create_workers=%u\n", s_worker_count);
+    strbuf_append_strf(buf, "post_create_busy_workers=%u\n", busy);
+    strbuf_append_strf(buf, "post_create_worker_restarts=%lu\n", s_stats.worker_restarts);
+    strbuf_append_strf(buf, "post_create_queue_length=%u\n", g_queue_get_length(&s_post_create_queue));
+    strbuf_append_strf(buf, "post_create_queue_max_length=%lu\n", s_stats.max_queue_length);
+    strbuf_append_strf(buf, "post_create_jobs_queued=%lu\n", s_stats.jobs_queued);
+    strbuf_append_strf(buf, "post_create_jobs_done=%lu\n", s_stats.jobs_done);
+    strbuf_append_strf(buf, "post_create_jobs_lost=%lu\n", s_stats.jobs_lost);
+    if (s_dump_location_size >= 0)
+        strbuf_append_strf(buf, "dump_location_size=%.0f\n", s_dump_location_size);
+    strbuf_append_strf(buf, "trims=%lu\n", s_stats.trims);
+
+    /* Readers must never see a half written file */
+    int fd = open(VAR_RUN_STATS".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        perror_msg("Can't open '%s'", VAR_RUN_STATS".tmp");
+    else
     {
-        log_info("Accepting connections on '%s'", SOCKET_FILE);
-        channel_id_socket = add_watch_or_die(channel_socket, G_IO_IN | G_IO_PRI | G_IO_HUP, server_socket_cb);
+        int r = full_write(fd, buf->buf, buf->len);
+        close(fd);
+        if (r < 0 || rename(VAR_RUN_STATS".tmp", VAR_RUN_STATS) != 0)
+            perror_msg("Can't save '%s'", VAR_RUN_STATS);
     }
+
+    strbuf_free(buf);
+    s_stats_dirty = false;
 }
 
-/* Callback called by glib main loop when a client connects to ABRT's socket. */
-static gboolean server_socket_cb(GIOChannel *source, GIOCondition condition, gpointer ptr_unused)
+static void dispatch_post_create_jobs(void)
 {
-    int socket = accept(g_io_channel_unix_get_fd(source), NULL, NULL);
-    if (socket == -1)
+    for (unsigned i = 0; i < s_worker_count && !g_queue_is_empty(&s_post_create_queue); ++i)
     {
-        perror_msg("accept");
+        struct post_create_worker *worker = &s_workers[i];
+        if (worker->pid == 0 || worker->dirname)
+            continue;
+
+        char *dirname = g_queue_pop_head(&s_post_create_queue);
+        char *job = xasprintf("%s\n", dirname);
+        int r = full_write_str(worker->job_fd, job);
+        free(job);
+        if (r < 0)
+        {
+            /* Worker is dying, SIGCHLD handler will restart it */
+            perror_msg("Can't pass '%s' to post-create worker %d", dirname, (int)worker->pid);
+            g_queue_push_head(&s_post_create_queue, dirname);
+            continue;
+        }
+
+        log_debug("Worker %d runs post-create on '%s'", (int)worker->pid, dirname);
+        worker->dirname = dirname;
+    }
+
+    update_socket_watch();
+    s_stats_dirty = true;
+}
+
+static void queue_post_create_job(const char *dirname)
+{
+    g_queue_push_tail(&s_post_create_queue, xstrdup(dirname));
+    s_stats.jobs_queued++;
+    if (g_queue_get_length(&s_post_create_queue) > s_stats.max_queue_length)
+        s_stats.max_queue_length = g_queue_get_length(&s_post_create_queue);
+
+    dispatch_post_create_jobs();
+}
+
+/* Callback called by glib main loop when a worker reports finished job */
+static gboolean worker_done_cb(GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+    struct post_create_worker *worker = user_data;
+
+    char buf[64];
+    int r = safe_read(g_io_channel_unix_get_fd(source), buf, sizeof(buf));
+    if (r < 0 && errno == EAGAIN)
         return TRUE;
+    if (r <= 0)
+    {
+        /* Worker exited, SIGCHLD handler takes care of the rest */
+        worker->channel_id = 0;
+        return FALSE; /* "please remove this event" */
     }
 
-    log_notice("New client connected");
+    if (memchr(buf, '\n', r) && worker->dirname)
+    {
+        log_debug("Worker %d finished post-create on '%s'", (int)worker->pid, worker->dirname);
+        free(worker->dirname);
+        worker->dirname = NULL;
+        s_stats.jobs_done++;
+        s_dump_location_size_dirty = true;
+        dispatch_post_create_jobs();
+    }
+
+    return TRUE;
+}
+
+static void start_post_create_worker(struct post_create_worker *worker)
+{
+    int job_pipe[2];
+    int done_pipe[2];
+    xpipe(job_pipe);
+    xpipe(done_pipe);
+
     fflush(NULL); /* paranoia */
     pid_t pid = fork();
     if (pid < 0)
     {
         perror_msg("fork");
-        close(socket);
+        close(job_pipe[0]);
+        close(job_pipe[1]);
+        close(done_pipe[0]);
+        close(done_pipe[1]);
+        return;
+    }
+    if (pid == 0) /* child */
+    {
+        close(job_pipe[1]);
+        close(done_pipe[0]);
+        xmove_fd(job_pipe[0], STDIN_FILENO);
+        xmove_fd(done_pipe[1], STDOUT_FILENO);
+
+        char *argv[4];  /* abrt-server [-s] -w NULL */
+        char **pp = argv;
+        *pp++ = (char*)"abrt-server";
+        if (logmode & LOGMODE_JOURNAL)
+            *pp++ = (char*)"-s";
+        *pp++ = (char*)"-w";
+        *pp = NULL;
+
+        execvp(argv[0], argv);
+        perror_msg_and_die("Can't execute '%s'", argv[0]);
+    }
+    /* parent */
+    close(job_pipe[0]);
+    close(done_pipe[1]);
+    close_on_exec_on(job_pipe[1]);
+    close_on_exec_on(done_pipe[0]);
+    ndelay_on(done_pipe[0]);
+
+    log_info("Started post-create worker %d", (int)pid);
+    worker->pid = pid;
+    worker->job_fd = job_pipe[1];
+    worker->channel = abrt_gio_channel_unix_new(done_pipe[0]);
+    errno = 0;
+    worker->channel_id = g_io_add_watch(worker->channel, G_IO_IN | G_IO_PRI | G_IO_HUP, worker_done_cb, worker);
+    if (!worker->channel_id)
+        perror_msg_and_die("g_io_add_watch failed");
+}
+
+static void stop_post_create_worker(struct post_create_worker *worker)
+{
+    if (worker->channel_id)
+        g_source_remove(worker->channel_id);
+    worker->channel_id = 0;
+    if (worker->channel)
+        g_io_channel_unref(worker->channel);
+    worker->channel = NULL;
+    if (worker->job_fd >= 0)
+        close(worker->job_fd);
+    worker->job_fd = -1;
+    worker->pid = 0;
+}
+
+static gboolean restart_post_create_workers_cb(gpointer unused)
+{
+    if (s_exiting)
+        return FALSE;
+
+    for (unsigned i = 0; i < s_worker_count; ++i)
+        if (s_workers[i].pid == 0)
+            start_post_create_worker(&s_workers[i]);
+
+    dispatch_post_create_jobs();
+    return FALSE; /* one shot */
+}
+
+/* Returns true if pid was one of the workers */
+static bool post_create_worker_exited(pid_t pid)
+{
+    for (unsigned i = 0; i < s_worker_count; ++i)
+    {
+        struct post_create_worker *worker = &s_workers[i];
+        if (worker->pid != pid)
+            continue;
+
+        if (worker->dirname)
+        {
+            error_msg("Post-create worker %d died while processing '%s'", (int)pid, worker->dirname);
+            free(worker->dirname);
+            worker->dirname = NULL;
+            s_stats.jobs_lost++;
+        }
+        else
+            error_msg("Post-create worker %d died", (int)pid);
+
+        stop_post_create_worker(worker);
+        s_stats.worker_restarts++;
+        s_stats_dirty = true;
+
+        /* Delayed, not to spin if the worker can't start at all */
+        g_timeout_add_seconds(1, restart_post_create_workers_cb, NULL);
+        return true;
+    }
+
+    return false;
+}
+
+/* Callback called by glib main loop when abrt-server queues a job */
+static gboolean handle_job_cb(GIOChannel *source, GIOCondition condition, gpointer ptr_unused)
+{
+    char buf[PIPE_BUF];
+    int r = safe_read(g_io_channel_unix_get_fd(source), buf, sizeof(buf) - 1);
+    if (r <= 0)
+        return TRUE; /* we hold the write end, EOF can't happen */
+    buf[r] = '\0';
+
+    /* split lines in the current buffer */
+    char *raw = buf;
+    char *newline;
+    while ((newline = strchr(raw, '\n')) != NULL)
+    {
+        *newline = '\0';
+        strbuf_append_str(s_job_buf, raw);
+        if (s_job_buf->len != 0)
+            queue_post_create_job(s_job_buf->buf);
+        strbuf_clear(s_job_buf);
+        /* jump to next line */
+        raw = newline + 1;
+    }
+
+    /* beginning of next line. the line continues by next read */
+    strbuf_append_str(s_job_buf, raw);
+
+    return TRUE;
+}
+
+static void post_create_workers_init(void)
+{
+    xpipe(s_job_pipe);
+    close_on_exec_on(s_job_pipe[0]);
+    close_on_exec_on(s_job_pipe[1]);
+    ndelay_on(s_job_pipe[0]);
+    s_job_buf = strbuf_new();
+
+    channel_jobs = abrt_gio_channel_unix_new(s_job_pipe[0]);
+    channel_id_jobs = add_watch_or_die(channel_jobs, G_IO_IN | G_IO_PRI, handle_job_cb);
+
+    s_worker_count = g_settings_post_create_workers ? g_settings_post_create_workers : 1;
+    s_workers = xzalloc(s_worker_count * sizeof(s_workers[0]));
+    for (unsigned i = 0; i < s_worker_count; ++i)
+    {
+        s_workers[i].job_fd = -1;
+        start_post_create_worker(&s_workers[i]);
+    }
+
+    save_stats();
+}
+
+static void post_create_workers_shutdown(void)
+{
+    /* Workers finish their jobs and exit when they see EOF */
+    for (unsigned i = 0; i < s_worker_count; ++i)
+    {
+        free(s_workers[i].dirname);
+        stop_post_create_worker(&s_workers[i]);
+    }
+    free(s_workers);
+    s_workers = NULL;
+    s_worker_count = 0;
+
+    unsigned lost = g_queue_get_length(&s_post_create_queue);
+    if (lost)
+        error_msg("%u problem(s) left without post-create", lost);
+    g_queue_foreach(&s_post_create_queue, (GFunc)free, NULL);
+    g_queue_clear(&s_post_create_queue);
+
+    if (channel_jobs)
+    {
+        g_source_remove(channel_id_jobs);
+        g_io_channel_unref(channel_jobs);
+        channel_jobs = NULL;
+    }
+    if (s_job_pipe[1] >= 0)
+        close(s_job_pipe[1]);
+    s_job_pipe[1] = -1;
+    strbuf_free(s_job_buf);
+    s_job_buf = NULL;
+
+    unlink(VAR_RUN_STATS);
+}
+
+/* Trimming runs in a child with the lowest CPU and I/O priority,
+ * so that it doesn't slow down saving of new problems.
+ */
+static void start_trimmer(void)
+{
+    char *dirs = xasprintf("%um:%s", g_settings_nMaxCrashReportsSize, g_settings_dump_location);
+
+    fflush(NULL); /* paranoia */
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror_msg("fork");
+        free(dirs);
+        return;
+    }
+    if (pid == 0) /* child */
+    {
+        if (setpriority(PRIO_PROCESS, 0, 19) != 0)
+            perror_msg("setpriority");
+        /* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE; glibc has no wrapper */
+        if (syscall(SYS_ioprio_set, 1, 0, 3 << 13) != 0)
+            perror_msg("ioprio_set");
+
+        char *argv[4];
+        argv[0] = (char*)"abrt-action-trim-files";
+        argv[1] = (char*)"-d";
+        argv[2] = dirs;
+        argv[3] = NULL;
+        execvp(argv[0], argv);
+        perror_msg_and_die("Can't execute '%s'", argv[0]);
+    }
+    free(dirs);
+
+    log_info("Started trimmer %d", (int)pid);
+    s_trimmer_pid = pid;
+    s_stats.trims++;
+    s_stats_dirty = true;
+}
+
+static void check_dump_location_size(void)
+{
+    if (!s_dump_location_size_dirty || s_trimmer_pid)
+        return;
+    s_dump_location_size_dirty = false;
+
+    /* The ledger keeps the total, we never walk the dump location here */
+    double size = size_ledger_total(g_settings_dump_location);
+    if (size != s_dump_location_size)
+    {
+        s_dump_location_size = size;
+        s_stats_dirty = true;
+    }
+
+    if (g_settings_nMaxCrashReportsSize > 0
+     && size > g_settings_nMaxCrashReportsSize * (double)(1024*1024)
+    ) {
+        start_trimmer();
+    }
+}
+
+static void free_connection(struct client_connection *conn)
+{
+    g_queue_remove(&s_connections, conn);
+    if (conn->state == CONNECTION_WAITING)
+        g_queue_remove(&s_waiting_connections, conn);
+
+    if (conn->channel_id)
+        g_source_remove(conn->channel_id);
+    /* Closes the socket */
+    g_io_channel_unref(conn->channel);
+    for (unsigned i = 0; i < conn->fds_count; ++i)
+        close(conn->fds[i]);
+    s_buffered_size -= conn->size;
+    free(conn->data);
+    free(conn);
+    s_stats_dirty = true;
+}
+
+static void refuse_client(int fd)
+{
+    full_write_str(fd, "HTTP/1.1 503 \r\n\r\n");
+    s_stats.connections_refused++;
+    s_stats_dirty = true;
+}
+
+/* Grows the buffer to what the client has sent so far, rounded up to
+ * PIPE_BUF, but not much over MAX_REQUEST_SIZE. Returns false if all
+ * requests together would take too much memory. */
+static bool grow_connection_buffer(struct client_connection *conn, int fd)
+{
+    /* At least one byte, to tell EOF from an empty buffer */
+    int pending = 0;
+    if (ioctl(fd, FIONREAD, &pending) != 0 || pending <= 0)
+        pending = 1;
+
+    size_t needed = conn->len + pending;
+    if (needed <= conn->size)
+        return true;
+    if (needed > MAX_REQUEST_SIZE)
+    {
+        /* One byte over the limit is enough to see the request is too long */
+        needed = MAX_REQUEST_SIZE + 1;
+        if (needed <= conn->size)
+            return true;
+    }
+
+    size_t new_size = (needed + PIPE_BUF - 1) / PIPE_BUF * PIPE_BUF;
+    if (s_buffered_size - conn->size + new_size > MAX_BUFFERED_SIZE)
+    {
+        error_msg("Too much data received, refusing request of client with uid %lu",
+                  (unsigned long)conn->uid);
+        return false;
+    }
+
+    conn->data = xrealloc(conn->data, new_size);
+    s_buffered_size += new_size - conn->size;
+    conn->size = new_size;
+    return true;
+}
+
+/* Closes the connections of clients which don't send their requests
+ * in time. Runs while some requests are being received.
+ */
+static gboolean connection_timer_cb(gpointer unused)
+{
+    const time_t now = time(NULL);
+    GList *next;
+    for (GList *l = s_connections.head; l; l = next)
+    {
+        next = l->next;
+        struct client_connection *conn = l->data;
+        if (conn->state != CONNECTION_READING || now < conn->deadline)
+            continue;
+
+        error_msg("Client with uid %lu timed out", (unsigned long)conn->uid);
+        s_stats.connections_timed_out++;
+        free_connection(conn);
+    }
+
+    if (count_connections(CONNECTION_READING) != 0)
         return TRUE;
+
+    s_connection_timer_id = 0;
+    return FALSE; /* "please remove this event" */
+}
+
+static void store_received_fds(struct client_connection *conn, struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        const int *fds = (const int *)CMSG_DATA(cmsg);
+        const unsigned count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            /* abrt-server refuses the request if a descriptor is missing */
+            if (conn->fds_count < ABRT_SOCKET_MAX_FDS)
+                conn->fds[conn->fds_count++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+}
+
+/* Callback called by glib main loop when abrt-server can take more data */
+static gboolean feed_server_cb(GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+    struct client_connection *conn = user_data;
+    const int fd = g_io_channel_unix_get_fd(conn->channel);
+
+    while (conn->sent < conn->len)
+    {
+        struct iovec iov = {
+            .iov_base = conn->data + conn->sent,
+            .iov_len = conn->len - conn->sent,
+        };
+        union {
+            struct cmsghdr cmsg;
+            char buf[CMSG_SPACE(sizeof(int) * ABRT_SOCKET_MAX_FDS)];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (conn->fds_count != 0)
+        {
+            /* The descriptors go with the first byte, as they came */
+            msg.msg_control = control.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * conn->fds_count);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * conn->fds_count);
+            memcpy(CMSG_DATA(cmsg), conn->fds, sizeof(int) * conn->fds_count);
+        }
+
+        ssize_t r = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return TRUE;
+            /* abrt-server died, the client gets no answer */
+            perror_msg("Can't pass request to abrt-server");
+            conn->channel_id = 0;
+            free_connection(conn);
+            return FALSE; /* "please remove this event" */
+        }
+
+        for (unsigned i = 0; i < conn->fds_count; ++i)
+            close(conn->fds[i]);
+        conn->fds_count = 0;
+        conn->sent += r;
+    }
+
+    /* abrt-server sees EOF */
+    conn->channel_id = 0;
+    free_connection(conn);
+    return FALSE; /* "please remove this event" */
+}
+
+/* Starts abrt-server which answers the client and reads the request
+ * from a socket we feed.
+ */
+static void start_server(struct client_connection *conn)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+    {
+        perror_msg("socketpair");
+        free_connection(conn);
+        return;
+    }
+
+    fflush(NULL); /* paranoia */
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror_msg("fork");
+        close(sv[0]);
+        close(sv[1]);
+        free_connection(conn);
+        return;
     }
     if (pid == 0) /* child */
     {
-        xmove_fd(socket, 0);
-        xdup2(0, 1);
+        const int client_fd = g_io_channel_unix_get_fd(conn->channel);
+        /* The response is written by blocking stdio */
+        ndelay_off(client_fd);
+        xmove_fd(sv[1], STDIN_FILENO);
+        xdup2(client_fd, STDOUT_FILENO);
 
-        char *argv[3];  /* abrt-server [-s] NULL */
+        char *argv[7];  /* abrt-server [-s] -u UID -j FD NULL */
         char **pp = argv;
         *pp++ = (char*)"abrt-server";
         if (logmode & LOGMODE_JOURNAL)
             *pp++ = (char*)"-s";
+        /* Credentials of stdin are ours, not client's */
+        *pp++ = (char*)"-u";
+        *pp++ = xasprintf("%lu", (unsigned long)conn->uid);
+        if (s_job_pipe[1] >= 0)
+        {
+            /* Let abrt-server inherit the write end of the job pipe */
+            fcntl(s_job_pipe[1], F_SETFD, 0);
+            *pp++ = (char*)"-j";
+            *pp++ = xasprintf("%d", s_job_pipe[1]);
+        }
         *pp = NULL;
 
         execvp(argv[0], argv);
         perror_msg_and_die("Can't execute '%s'", argv[0]);
     }
     /* parent */
+    close(sv[1]);
     increment_child_count();
-    close(socket);
+
+    /* Client's socket is used only by abrt-server now */
+    g_io_channel_unref(conn->channel);
+    ndelay_on(sv[0]);
+    conn->channel = abrt_gio_channel_unix_new(sv[0]);
+    conn->state = CONNECTION_FEEDING;
+    errno = 0;
+    conn->channel_id = g_io_add_watch(conn->channel, G_IO_OUT | G_IO_ERR | G_IO_HUP, feed_server_cb, conn);
+    if (!conn->channel_id)
+        perror_msg_and_die("g_io_add_watch failed");
+}
+
+static void start_waiting_servers(void)
+{
+    while (child_count < MAX_CLIENT_COUNT && !g_queue_is_empty(&s_waiting_connections))
+    {
+        struct client_connection *conn = g_queue_pop_head(&s_waiting_connections);
+        start_server(conn);
+        s_stats_dirty = true;
+    }
+}
+
+/* Callback called by glib main loop when a client sends data */
+static gboolean client_readable_cb(GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+    struct client_connection *conn = user_data;
+    const int fd = g_io_channel_unix_get_fd(conn->channel);
+
+    while (1)
+    {
+        if (!grow_connection_buffer(conn, fd))
+        {
+            refuse_client(fd);
+            break;
+        }
+
+        struct iovec iov = {
+            .iov_base = conn->data + conn->len,
+            .iov_len = conn->size - conn->len,
+        };
+        union {
+            struct cmsghdr cmsg;
+            char buf[CMSG_SPACE(sizeof(int) * ABRT_SOCKET_MAX_FDS)];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t r = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return TRUE;
+            perror_msg("Can't read from client");
+            break;
+        }
+
+        store_received_fds(conn, &msg);
+        if (r == 0)
+        {
+            /* The request is complete */
+            log_debug("Received request of %lu bytes", (long)conn->len);
+            conn->channel_id = 0;
+            conn->state = CONNECTION_WAITING;
+            g_queue_push_tail(&s_waiting_connections, conn);
+            start_waiting_servers();
+            s_stats_dirty = true;
+            return FALSE; /* "please remove this event" */
+        }
+
+        conn->len += r;
+        if (conn->len > MAX_REQUEST_SIZE)
+        {
+            error_msg("Request of client with uid %lu is too long", (unsigned long)conn->uid);
+            break;
+        }
+    }
+
+    conn->channel_id = 0;
+    free_connection(conn);
+    return FALSE; /* "please remove this event" */
+}
+
+/* Callback called by glib main loop when a client connects to ABRT's socket. */
+static gboolean server_socket_cb(GIOChannel *source, GIOCondition condition, gpointer ptr_unused)
+{
+    int socket = accept4(g_io_channel_unix_get_fd(source), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (socket == -1)
+    {
+        perror_msg("accept");
+        return TRUE;
+    }
+
+    /* Don't log every refused connection of a burst */
+    static bool refusing;
+    if (count_connections(CONNECTION_READING) + g_queue_get_length(&s_waiting_connections) >= MAX_CONNECTION_COUNT
+     || s_buffered_size >= MAX_BUFFERED_SIZE
+    ) {
+        if (!refusing)
+            error_msg("Too many clients or too much data received, refusing connections to '%s'", SOCKET_FILE);
+        refusing = true;
+        refuse_client(socket);
+        close(socket);
+        return TRUE;
+    }
+    refusing = false;
+
+    struct ucred cr;
+    socklen_t crlen = sizeof(cr);
+    if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cr, &crlen) != 0 || crlen != sizeof(cr))
+    {
+        perror_msg("getsockopt(SO_PEERCRED)");
+        close(socket);
+        return TRUE;
+    }
+
+    log_notice("New client connected");
+    struct client_connection *conn = xzalloc(sizeof(*conn));
+    conn->state = CONNECTION_READING;
+    conn->uid = cr.uid;
+    conn->deadline = time(NULL) + CONNECTION_TIMEOUT;
+    conn->channel = abrt_gio_channel_unix_new(socket);
+    errno = 0;
+    conn->channel_id = g_io_add_watch(conn->channel, G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP, client_readable_cb, conn);
+    if (!conn->channel_id)
+        perror_msg_and_die("g_io_add_watch failed");
+    g_queue_push_tail(&s_connections, conn);
+
+    if (!s_connection_timer_id)
+        s_connection_timer_id = g_timeout_add_seconds(1, connection_timer_cb, NULL);
+
+    s_stats_dirty = true;
     return TRUE;
 }
 
@@ -149,9 +976,16 @@ static gboolean handle_signal_cb(GIOChannel *gio, GIOCondition condition, gpoint
             s_exiting = 1;
         else
         {
-            while (safe_waitpid(-1, NULL, WNOHANG) > 0)
+            pid_t pid;
+            while ((pid = safe_waitpid(-1, NULL, WNOHANG)) > 0)
             {
-                decrement_child_count();
+                if (pid == s_trimmer_pid)
+                {
+                    s_trimmer_pid = 0;
+                    s_dump_location_size_dirty = true;
+                }
+                else if (!post_create_worker_exited(pid))
+                    decrement_child_count();
             }
         }
     }
@@ -177,6 +1011,19 @@ static void ensure_writable_dir(const char *dir, mode_t mode, const char *user)
         perror_msg_and_die("Can't set mode %o on '%s'", mode, dir);
 }
 
+static void save_hook_settings(void)
+{
+    /* Reparses abrt.conf too, which is harmless */
+    if (hook_settings_load(&s_hook_settings) == 0)
+        s_hook_settings_lock_fd = hook_settings_save(&s_hook_settings, s_hook_settings_lock_fd);
+    else
+    {
+        /* Let the hook parse the config itself */
+        hook_settings_remove(s_hook_settings_lock_fd);
+        s_hook_settings_lock_fd = -1;
+    }
+}
+
 static void sanitize_dump_dir_rights(void)
 {
     /* We can't allow everyone to create dumps: otherwise users can flood
@@ -207,6 +1054,22 @@ static void handle_inotify_cb(struct abrt_inotify_watch *watch, struct inotify_e
 
             sanitize_dump_dir_rights();
             abrt_inotify_watch_reset(watch, g_settings_dump_location, IN_DUMP_LOCATION_FLAGS);
+            size_ledger_check(g_settings_dump_location);
+        }
+
+        /* Keep the size ledger right when someone removes a problem directory
+         * behind our back. Our own tools have already done this, it's harmless
+         * to do it twice.
+         */
+        if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) && (event->mask & IN_ISDIR)
+         && event->len && event->name[0] != '.'
+        ) {
+            const char *ext = strrchr(event->name, '.');
+            if (!ext || strcmp(ext, ".new") != 0)
+            {
+                size_ledger_forget(g_settings_dump_location, event->name);
+                s_dump_location_size_dirty = true;
+            }
         }
 /* We no longer watch for subdirectory creations */
 #if 0
@@ -271,6 +1134,13 @@ static void run_main_loop(GMainLoop* loop)
             cur_time = new_time;
             load_abrt_conf();
 //TODO: react to changes in g_settings_sWatchCrashdumpArchiveDir
+            /* PostCreateQueueSize could have changed */
+            update_socket_watch();
+            check_dump_location_size();
+            if (s_stats_dirty)
+                save_stats();
+            if (!hook_settings_is_current(&s_hook_settings))
+                save_hook_settings();
         }
 
         some_ready = g_main_context_check(context, max_priority, fds, nfds);
@@ -297,7 +1167,7 @@ static void dumpsocket_init(void)
     local.sun_family = AF_UNIX;
     strcpy(local.sun_path, SOCKET_FILE);
     xbind(socketfd, (struct sockaddr*)&local, sizeof(local));
-    xlisten(socketfd, MAX_CLIENT_COUNT);
+    xlisten(socketfd, MAX_CONNECTION_COUNT);
 
     if (chmod(SOCKET_FILE, SOCKET_PERMISSION) != 0)
         perror_msg_and_die("chmod '%s'", SOCKET_FILE);
@@ -314,11 +1184,19 @@ static void dumpsocket_shutdown(void)
     if (channel_socket)
     {
         /* Undo add_watch_or_die */
-        g_source_remove(channel_id_socket);
+        if (channel_id_socket)
+            g_source_remove(channel_id_socket);
+        channel_id_socket = 0;
         /* Undo g_io_channel_unix_new */
         g_io_channel_unref(channel_socket);
         channel_socket = NULL;
     }
+
+    if (s_connection_timer_id)
+        g_source_remove(s_connection_timer_id);
+    s_connection_timer_id = 0;
+    while (!g_queue_is_empty(&s_connections))
+        free_connection(g_queue_peek_head(&s_connections));
 }
 
 static int create_pidfile(void)
@@ -551,6 +1429,11 @@ int main(int argc, char** argv)
      */
     sanitize_dump_dir_rights();
     mark_unprocessed_dump_dirs_not_reportable(g_settings_dump_location);
+    /* Problem directories could have been added or removed while we were
+     * not running, the first post-create will rebuild the index.
+     */
+    dup_index_invalidate(g_settings_dump_location);
+    size_ledger_check(g_settings_dump_location);
 
     /* Daemonize unless -d */
     if (!(opts & OPT_d))
@@ -612,6 +1495,12 @@ int main(int argc, char** argv)
         goto init_error;
     pidfile_created = true;
 
+    /* Let abrt-hook-ccpp know we are alive and what our settings are */
+    save_hook_settings();
+
+    /* Start post-create workers before anyone can send us a job */
+    post_create_workers_init();
+
     /* Open socket to receive new problem data (from python etc). */
     dumpsocket_init();
 
@@ -646,8 +1535,12 @@ int main(int argc, char** argv)
      * Take care to not undo things we did not do.
      */
     dumpsocket_shutdown();
+    post_create_workers_shutdown();
     if (pidfile_created)
+    {
+        hook_settings_remove(s_hook_settings_lock_fd);
         unlink(VAR_RUN_PIDFILE);
+    }
 
     if (channel_id_signal_event > 0)
         g_source_remove(channel_id_signal_event);
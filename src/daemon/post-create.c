@@ -0,0 +1,599 @@
+/*
+    Copyright (C) 2011  ABRT Team
+    Copyright (C) 2011  RedHat inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * The post-create event with duplicate detection, shared by abrt-handle-event
+ * and the post-create workers of abrt-server.
+ */
+#include <satyr/thread.h>
+#include <satyr/stacktrace.h>
+#include <satyr/distance.h>
+#include <satyr/abrt.h>
+
+#include <sys/file.h>
+
+#include "libabrt.h"
+#include "post-create.h"
+
+/* 70 % similarity */
+#define BACKTRACE_DUP_THRESHOLD 0.3
+
+/* How long to wait for post-create of a possible duplicate */
+#define POST_CREATE_LOCK_TIMEOUT 100
+
+/* State of the post-create being run */
+static char *uid = NULL;
+static char *uuid = NULL;
+static struct sr_stacktrace *corebt = NULL;
+static char *analyzer = NULL;
+static char *executable = NULL;
+static char *crash_dump_dup_name = NULL;
+static char *fingerprint = NULL;
+
+static void dup_corebt_fini(void);
+
+static char* load_backtrace(const struct dump_dir *dd, const char *analyzer)
+{
+    const char *filename = FILENAME_BACKTRACE;
+    if (strcmp(analyzer, "CCpp") == 0)
+    {
+        filename = FILENAME_CORE_BACKTRACE;
+    }
+
+    return dd_load_text_ext(dd, filename,
+        DD_FAIL_QUIETLY_ENOENT|DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+}
+
+static int core_backtrace_is_duplicate(struct sr_stacktrace *bt1,
+                                       const char *bt2_text)
+{
+    struct sr_thread *thread1 = sr_stacktrace_find_crash_thread(bt1);
+
+    if (thread1 == NULL)
+    {
+        log_notice("New stacktrace has no crash thread, disabling core stacktrace deduplicate");
+        dup_corebt_fini();
+        return 0;
+    }
+
+    int result;
+    char *error_message;
+    struct sr_stacktrace *bt2 = sr_stacktrace_parse(sr_abrt_type_from_analyzer(analyzer),
+                                                    bt2_text, &error_message);
+    if (bt2 == NULL)
+    {
+        log_notice("Failed to parse backtrace, considering it not duplicate: %s", error_message);
+        free(error_message);
+        return 0;
+    }
+
+    struct sr_thread *thread2 = sr_stacktrace_find_crash_thread(bt2);
+
+    if (thread2 == NULL)
+    {
+        log_notice("Failed to get crash thread, considering it not duplicate");
+        result = 0;
+        goto end;
+    }
+
+    int length2 = sr_thread_frame_count(thread2);
+
+    if (length2 <= 0)
+    {
+        log_notice("Core backtrace has zero frames, considering it not duplicate");
+        result = 0;
+        goto end;
+    }
+
+    /* This is an ugly workaround for https://github.com/abrt/btparser/issues/6 */
+    /*
+    int length1 = sr_core_thread_get_frame_count(thread1);
+
+    if (length1 <= 2 || length2 <= 2)
+    {
+        log_notice("Backtraces too short, falling back on full comparison");
+        result = (sr_core_thread_cmp(thread1, thread2) == 0);
+        goto end;
+    }
+    */
+
+    float distance = sr_distance(SR_DISTANCE_DAMERAU_LEVENSHTEIN, thread1, thread2);
+    log_info("Distance between backtraces: %f", distance);
+    result = (distance <= BACKTRACE_DUP_THRESHOLD);
+
+end:
+    sr_stacktrace_free(bt2);
+
+    return result;
+}
+
+/* Hash of all frames of the crash thread. Equal fingerprints mean zero
+ * distance between backtraces, so the duplicate index can decide without
+ * parsing the other backtrace.
+ */
+static char *crash_thread_fingerprint(struct sr_stacktrace *bt)
+{
+    struct sr_thread *thread = sr_stacktrace_find_crash_thread(bt);
+    if (thread == NULL)
+        return NULL;
+
+    int frame_count = sr_thread_frame_count(thread);
+    if (frame_count <= 0)
+        return NULL;
+
+    return sr_thread_get_duphash(thread, frame_count, NULL, SR_DUPHASH_NORMAL);
+}
+
+static void dup_uuid_init(const struct dump_dir *dd)
+{
+    if (uuid)
+        return; /* we already loaded it, don't do it again */
+
+    uuid = dd_load_text_ext(dd, FILENAME_UUID,
+                            DD_FAIL_QUIETLY_ENOENT + DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE
+    );
+}
+
+static int dup_uuid_compare(const struct dump_dir *dd)
+{
+    char *dd_uuid;
+    int different;
+
+    if (!uuid)
+        return 0;
+
+    /* don't do uuid-based check on crashes that have backtrace available (and
+     * nonempty)
+     * XXX: this relies on the fact that backtrace is created in the same event
+     * as UUID
+     */
+    if (corebt)
+        return 0;
+
+    dd_uuid = dd_load_text_ext(dd, FILENAME_UUID, DD_FAIL_QUIETLY_ENOENT);
+    different = strcmp(uuid, dd_uuid);
+    free(dd_uuid);
+
+    if (!different)
+        log_notice("Duplicate: UUID");
+
+    return !different;
+}
+
+static void dup_uuid_fini(void)
+{
+    free(uuid);
+    uuid = NULL;
+}
+
+static void dup_corebt_init(const struct dump_dir *dd)
+{
+    if (corebt)
+        return; /* already loaded */
+
+    char *corebt_text = load_backtrace(dd, analyzer);
+    if (!corebt_text)
+        return; /* no backtrace */
+
+    enum sr_report_type report_type = sr_abrt_type_from_analyzer(analyzer);
+    if (report_type == SR_REPORT_INVALID)
+    {
+        log_notice("Can't load stacktrace because of unsupported analyzer: %s",
+                  analyzer);
+        return;
+    }
+
+    /* sr_stacktrace_parse moves the pointer */
+    char *error_message;
+    corebt = sr_stacktrace_parse(report_type, corebt_text, &error_message);
+    if (!corebt)
+    {
+        log_notice("Failed to load core stacktrace: %s", error_message);
+        free(error_message);
+    }
+    else
+        fingerprint = crash_thread_fingerprint(corebt);
+
+    free(corebt_text);
+}
+
+static int dup_corebt_compare(const struct dump_dir *dd)
+{
+    if (!corebt)
+        return 0;
+
+    int isdup;
+
+    char *dd_corebt = load_backtrace(dd, analyzer);
+    if (!dd_corebt)
+        return 0;
+
+    isdup = core_backtrace_is_duplicate(corebt, dd_corebt);
+    free(dd_corebt);
+
+    if (isdup)
+        log_notice("Duplicate: core backtrace");
+
+    return isdup;
+}
+
+static void dup_corebt_fini(void)
+{
+    sr_stacktrace_free(corebt);
+    corebt = NULL;
+    free(fingerprint);
+    fingerprint = NULL;
+}
+
+/* Loads the data the duplicate index keeps about a problem directory */
+static struct dup_index_entry *load_dup_index_entry(struct dump_dir *dd, const char *dd_analyzer)
+{
+    struct dup_index_entry *entry = xzalloc(sizeof(*entry));
+    entry->dirname = xstrdup(dd->dd_dirname);
+    entry->uuid = dd_load_text_ext(dd, FILENAME_UUID,
+                            DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+
+    enum sr_report_type report_type = sr_abrt_type_from_analyzer(dd_analyzer);
+    if (report_type == SR_REPORT_INVALID)
+        return entry;
+
+    char *bt_text = load_backtrace(dd, dd_analyzer);
+    if (!bt_text)
+        return entry;
+
+    char *error_message;
+    struct sr_stacktrace *bt = sr_stacktrace_parse(report_type, bt_text, &error_message);
+    if (bt)
+    {
+        entry->fingerprint = crash_thread_fingerprint(bt);
+        sr_stacktrace_free(bt);
+    }
+    else
+    {
+        log_info("Failed to parse backtrace of '%s': %s", dd->dd_dirname, error_message);
+        free(error_message);
+    }
+    free(bt_text);
+
+    return entry;
+}
+
+/* Walks all problem directories and (re)creates the duplicate index.
+ * This is the slow path. It is taken only when the index is missing
+ * or when abrtd invalidated it.
+ */
+static void rebuild_dup_index(const char *dump_dir_name)
+{
+    log_notice("Rebuilding duplicate index of '%s'", g_settings_dump_location);
+
+    if (dup_index_reset(g_settings_dump_location) != 0)
+        return;
+
+    DIR *dir = opendir(g_settings_dump_location);
+    if (dir == NULL)
+    {
+        perror_msg("Can't open directory '%s'", g_settings_dump_location);
+        return;
+    }
+
+    struct dirent *dent;
+    while ((dent = readdir(dir)) != NULL)
+    {
+        if (dent->d_name[0] == '.')
+            continue; /* skip "." and "..", and the index itself */
+        const char *ext = strrchr(dent->d_name, '.');
+        if (ext && strcmp(ext, ".new") == 0)
+            continue; /* skip anything named "<dirname>.new" */
+
+        char *tmp_concat_path = concat_path_file(g_settings_dump_location, dent->d_name);
+        char *dump_dir_name2 = realpath(tmp_concat_path, NULL);
+        free(tmp_concat_path);
+
+        /* Our own directory is added once post-create is done */
+        if (!dump_dir_name2 || strcmp(dump_dir_name, dump_dir_name2) == 0)
+        {
+            free(dump_dir_name2);
+            continue;
+        }
+
+        int sv_logmode = logmode;
+        /* Silently ignore any error in the silent log level. */
+        logmode = g_verbose == 0 ? 0 : sv_logmode;
+        struct dump_dir *dd = dd_opendir(dump_dir_name2, /*flags:*/ DD_FAIL_QUIETLY_ENOENT | DD_OPEN_READONLY);
+        logmode = sv_logmode;
+        free(dump_dir_name2);
+        if (!dd)
+            continue;
+
+        char *dd_uid = dd_load_text_ext(dd, FILENAME_UID, DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+        char *dd_analyzer = dd_load_text_ext(dd, FILENAME_ANALYZER, DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+        char *dd_executable = dd_load_text_ext(dd, FILENAME_EXECUTABLE, DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+
+        if (dd_uid && dd_analyzer)
+        {
+            struct dup_index_entry *entry = load_dup_index_entry(dd, dd_analyzer);
+            dup_index_add(g_settings_dump_location, dd_uid, dd_analyzer, dd_executable, entry);
+            dup_index_entry_free(entry);
+        }
+
+        dd_close(dd);
+        free(dd_uid);
+        free(dd_analyzer);
+        free(dd_executable);
+    }
+    closedir(dir);
+
+    dup_index_mark_valid(g_settings_dump_location);
+}
+
+/* Adds the directory which passed post-create to the duplicate index,
+ * into the bucket which is locked, even if the event changed analyzer
+ * or executable */
+static void add_to_dup_index(const char *dump_dir_name,
+        const char *dd_uid, const char *dd_analyzer, const char *dd_executable)
+{
+    /* The rebuild will pick the directory up */
+    if (!dup_index_is_valid(g_settings_dump_location))
+        return;
+
+    if (!dd_uid || !dd_analyzer)
+        return;
+
+    struct dump_dir *dd = dd_opendir(dump_dir_name, DD_OPEN_READONLY);
+    if (!dd)
+        return;
+
+    struct dup_index_entry *entry = load_dup_index_entry(dd, dd_analyzer);
+    dup_index_add(g_settings_dump_location, dd_uid, dd_analyzer, dd_executable, entry);
+    dup_index_entry_free(entry);
+    dd_close(dd);
+}
+
+/* This function is run after each post-create event is finished (there may be
+ * multiple such events).
+ *
+ * It first checks if there is CORE_BACKTRACE or UUID item in the dump dir
+ * we are processing.
+ *
+ * Then it looks up the bucket of the duplicate index holding the dump
+ * directories of the same user, analyzer and executable; other directories
+ * can't be duplicates. The key is the one run_post_create_event() loaded
+ * and locked before the event ran, the event may have changed the files
+ * since. If the index is missing or stale, it is rebuilt first.
+ *
+ * If there is a CORE_BACKTRACE, it iterates over the candidate dump
+ * directories and computes similarity to their core backtraces (if any).
+ * Candidates with the same crash thread fingerprint are duplicates without
+ * further ado, otherwise their backtraces are loaded and compared.
+ * If one of them is similar enough to be considered duplicate, the function
+ * saves the path to the dump directory in question and returns 1 to indicate
+ * that we have indeed found a duplicate of currently processed dump directory.
+ * No more events are processed and run_post_create_event() passes the path
+ * to the other directory to its caller.
+ *
+ * If there is an UUID item (and no core backtrace), the function again
+ * iterates over the candidate dump directories and compares this UUID to their
+ * UUID. If there is a match, the path to the duplicate is saved and 1 is returned.
+ *
+ * If duplicate is not found as described above, the function returns 0 and we
+ * either process remaining events if there are any, or successfully terminate
+ * processing of the current dump directory.
+ */
+static int is_crash_a_dup(const char *dump_dir_name, void *param)
+{
+    int retval = 0; /* defaults to no dup found, "run_event, please continue iterating" */
+
+    struct dump_dir *dd = dd_opendir(dump_dir_name, DD_OPEN_READONLY);
+    if (!dd)
+        return 0; /* wtf? (error, but will be handled elsewhere later) */
+    dup_uuid_init(dd);
+    dup_corebt_init(dd);
+    dd_close(dd);
+
+    /* dump_dir_name can be relative */
+    dump_dir_name = realpath(dump_dir_name, NULL);
+    if (!dump_dir_name)
+        return 0;
+
+    /* No need to look at other directories if we have nothing to compare */
+    if (!uuid && !corebt)
+        goto end;
+
+    /* Scan candidate crash dumps looking for a dup */
+    GList *candidates = dup_index_get_bucket(g_settings_dump_location, uid, analyzer, executable);
+    for (GList *li = candidates; li != NULL && crash_dump_dup_name == NULL; li = g_list_next(li))
+    {
+        struct dup_index_entry *entry = (struct dup_index_entry *)li->data;
+
+        dd = NULL;
+
+        char *tmp_concat_path = concat_path_file(g_settings_dump_location, entry->dirname);
+
+        char *dump_dir_name2 = realpath(tmp_concat_path, NULL);
+        if (!dump_dir_name2)
+        {
+            if (g_verbose > 1)
+                perror_msg("realpath(%s)", tmp_concat_path);
+
+            /* The directory was deleted behind our back */
+            if (errno == ENOENT)
+                dup_index_remove(g_settings_dump_location, uid, analyzer, executable, entry->dirname);
+        }
+
+        free(tmp_concat_path);
+
+        if (!dump_dir_name2)
+            continue;
+
+        if (strcmp(dump_dir_name, dump_dir_name2) == 0)
+            goto next; /* we are never a dup of ourself */
+
+        int sv_logmode = logmode;
+        /* Silently ignore any error in the silent log level. */
+        logmode = g_verbose == 0 ? 0 : sv_logmode;
+        dd = dd_opendir(dump_dir_name2, /*flags:*/ DD_FAIL_QUIETLY_ENOENT | DD_OPEN_READONLY);
+        logmode = sv_logmode;
+        if (!dd)
+            goto next;
+
+        /* The bucket already guarantees same uid, analyzer and executable */
+        int isdup;
+        if (corebt && fingerprint && entry->fingerprint)
+        {
+            isdup = (strcmp(fingerprint, entry->fingerprint) == 0);
+            if (isdup)
+                log_notice("Duplicate: core backtrace fingerprint");
+            else
+                isdup = dup_corebt_compare(dd);
+        }
+        else if (!corebt && uuid && entry->uuid)
+        {
+            /* See dup_uuid_compare() */
+            isdup = (strcmp(uuid, entry->uuid) == 0);
+            if (isdup)
+                log_notice("Duplicate: UUID");
+        }
+        else
+            isdup = dup_uuid_compare(dd) || dup_corebt_compare(dd);
+
+        if (isdup)
+        {
+            crash_dump_dup_name = dump_dir_name2;
+            dump_dir_name2 = NULL;
+            retval = 1; /* "run_event, please stop iterating" */
+            /* sonce crash_dump_dup_name != NULL now, we exit the loop */
+        }
+
+next:
+        free(dump_dir_name2);
+        dd_close(dd);
+    }
+    g_list_free_full(candidates, (GDestroyNotify)dup_index_entry_free);
+
+end:
+    free((char*)dump_dir_name);
+    return retval;
+}
+
+/* fds of flock()ed files held while post-create runs */
+static int global_lock_fd = -1;
+static int bucket_lock_fd = -1;
+
+static void create_lockfile(const char *dump_dir_name, const char *dd_analyzer, const char *dd_executable)
+{
+    /* Only problems with the same uid, analyzer and executable can be
+     * duplicates of each other, so post-create of other problems can run
+     * in parallel.
+     *
+     * Someone else's post-create may take a long-ish time to finish.
+     * For example, I had a failing email sending there, it took
+     * a minute to time out.
+     * That's why timeout is large (100 seconds). After that we assume
+     * the other post-create is stuck and go on without the lock.
+     */
+    global_lock_fd = dup_index_lock_global(g_settings_dump_location, LOCK_SH, POST_CREATE_LOCK_TIMEOUT);
+    if (global_lock_fd < 0)
+        error_msg("Can't lock the duplicate index, proceeding without the lock");
+    else if (!dup_index_is_valid(g_settings_dump_location))
+    {
+        /* Nobody may use the index while it is being rebuilt.
+         * Note: flock() releases the shared lock before it starts waiting.
+         */
+        if (flock_with_timeout(global_lock_fd, LOCK_EX, POST_CREATE_LOCK_TIMEOUT) == 0)
+        {
+            /* Someone could have rebuilt it while we were waiting */
+            if (!dup_index_is_valid(g_settings_dump_location))
+            {
+                char *real_dump_dir_name = realpath(dump_dir_name, NULL);
+                if (real_dump_dir_name)
+                    rebuild_dup_index(real_dump_dir_name);
+                free(real_dump_dir_name);
+            }
+        }
+        else
+            error_msg("Can't rebuild the duplicate index, other post-create is stuck");
+
+        flock(global_lock_fd, LOCK_SH);
+    }
+
+    bucket_lock_fd = dup_index_lock_bucket(g_settings_dump_location,
+                            uid, dd_analyzer, dd_executable, POST_CREATE_LOCK_TIMEOUT);
+    if (bucket_lock_fd < 0 && errno == ETIMEDOUT)
+        error_msg("Someone else's post-create is stuck, not waiting for it anymore");
+}
+
+static void delete_lockfile(void)
+{
+    dup_index_unlock(bucket_lock_fd);
+    bucket_lock_fd = -1;
+    dup_index_unlock(global_lock_fd);
+    global_lock_fd = -1;
+}
+
+int run_post_create_event(struct run_event_state *run_state, const char *dump_dir_name, char **dup_of_dir)
+{
+    *dup_of_dir = NULL;
+
+    struct dump_dir *dd = dd_opendir(dump_dir_name, /*flags:*/ DD_OPEN_READONLY);
+    if (!dd)
+        return 1;
+
+    /* The key of the bucket lock, the dup index lookup and the insert
+     * use it too. Loaded once: the event may rewrite these files. */
+    uid = dd_load_text_ext(dd, FILENAME_UID, DD_FAIL_QUIETLY_ENOENT);
+    analyzer = dd_load_text_ext(dd, FILENAME_ANALYZER, DD_FAIL_QUIETLY_ENOENT);
+    executable = dd_load_text_ext(dd, FILENAME_EXECUTABLE, DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+    dd_close(dd);
+
+    run_state->post_run_callback = is_crash_a_dup;
+    /*
+     * The post-create event cannot be run concurrently for problem
+     * directories which can be duplicates. The problem is in searching
+     * for duplicates process in case when two concurrently processed
+     * directories are duplicates of each other. Both of the directories
+     * are marked as duplicates of each other and are deleted.
+     */
+    create_lockfile(dump_dir_name, analyzer, executable);
+
+    int r = run_event_on_dir_name(run_state, dump_dir_name, "post-create");
+
+    /* The directory is not a dup, later crashes can be its dups.
+     * Must be done under the lock, otherwise the next post-create
+     * could miss us.
+     */
+    if (r == 0 && run_state->children_count != 0 && !crash_dump_dup_name)
+        add_to_dup_index(dump_dir_name, uid, analyzer, executable);
+    delete_lockfile();
+
+    /* Needed only if is_crash_a_dup() was called, but harmless
+     * even if it wasn't:
+     */
+    dup_uuid_fini();
+    dup_corebt_fini();
+    free(analyzer);
+    analyzer = NULL;
+    free(executable);
+    executable = NULL;
+    free(uid);
+    uid = NULL;
+
+    *dup_of_dir = crash_dump_dup_name;
+    crash_dump_dup_name = NULL;
+    return r;
+}
@@ -0,0 +1,33 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef _ABRT_POST_CREATE_H_
+#define _ABRT_POST_CREATE_H_
+
+#include <libreport/run_event.h>
+
+/* Runs the 'post-create' event on the problem directory under the duplicate
+ * index locks and looks for a duplicate after every step of the event.
+ *
+ * Returns the result of run_event_on_dir_name(). If the problem is
+ * a duplicate, *dup_of_dir is set to the malloced name of the first
+ * occurrence, otherwise to NULL. The callers set up logging of run_state.
+ */
+int run_post_create_event(struct run_event_state *run_state, const char *dump_dir_name, char **dup_of_dir);
+
+#endif /*_ABRT_POST_CREATE_H_*/
@@ -14,6 +14,10 @@ static guint g_timeout_source;
 /* default, settable with -t: */
 static unsigned g_timeout_value = 120;
 
+/* Problems in g_settings_dump_location, list and filter queries don't
+ * touch the disk */
+static struct problem_index *s_problem_index;
+
 /* ---------------------------------------------------------------------------------------------------- */
 
 static GDBusNodeInfo *introspection_data = NULL;
@@ -63,6 +67,16 @@ static const gchar introspection_xml[] =
   "      <arg type='b' name='all_users' direction='in'/>"
   "      <arg type='as' name='response' direction='out'/>"
   "    </method>"
+  "    <method name='GetProblemsFiltered'>"
+  "      <arg type='a{ss}' name='filter' direction='in'/>"
+  "      <arg type='s' name='sort_by' direction='in'/>"
+  "      <arg type='b' name='descending' direction='in'/>"
+  "      <arg type='u' name='offset' direction='in'/>"
+  "      <arg type='u' name='limit' direction='in'/>"
+  "      <arg type='as' name='element_names' direction='in'/>"
+  "      <arg type='b' name='all_users' direction='in'/>"
+  "      <arg type='a{sa{ss}}' name='response' direction='out'/>"
+  "    </method>"
   "    <method name='Quit' />"
   "  </interface>"
   "</node>";
@@ -273,23 +287,64 @@ struct field_and_time_range {
     unsigned long timestamp_to;
 };
 
-static int add_dirname_to_GList_if_matches(struct dump_dir *dd, void *arg)
+/* Reads elements of one problem. Elements which are not indexed are read
+ * from disk, the directory is opened once for all of them. */
+struct element_loader {
+    struct problem_index_entry *entry;
+    struct dump_dir *dd;
+    bool dd_tried;
+};
+
+/* Returns NULL if the element doesn't exist */
+static char *load_element(struct element_loader *loader, const char *element)
+{
+    if (problem_index_element_is_indexed(element))
+    {
+        const char *value = problem_index_entry_get(loader->entry, element);
+        return value ? xstrdup(value) : NULL;
+    }
+
+    if (!loader->dd_tried)
+    {
+        loader->dd = dd_opendir(problem_index_entry_dirname(loader->entry),
+                                DD_OPEN_READONLY | DD_FAIL_QUIETLY_EACCES | DD_DONT_WAIT_FOR_LOCK);
+        loader->dd_tried = true;
+    }
+    if (!loader->dd)
+        return NULL;
+
+    return dd_load_text_ext(loader->dd, element, 0
+                                | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE
+                                | DD_FAIL_QUIETLY_ENOENT
+                                | DD_FAIL_QUIETLY_EACCES);
+}
+
+static void element_loader_close(struct element_loader *loader)
+{
+    if (loader->dd)
+        dd_close(loader->dd);
+    loader->dd = NULL;
+}
+
+static int add_dirname_to_GList_if_matches(struct problem_index_entry *entry, void *arg)
 {
     struct field_and_time_range *me = arg;
 
-    char *field_data = dd_load_text(dd, me->element);
-    int brk = (strcmp(field_data, me->value) != 0);
-    free(field_data);
-    if (brk)
+    /* Check the time first, it is in memory */
+    const char *last_occurrence = problem_index_entry_get(entry, FILENAME_LAST_OCCURRENCE);
+    long val = last_occurrence ? atol(last_occurrence) : 0;
+    if (val < me->timestamp_from || val > me->timestamp_to)
         return 0;
 
-    field_data = dd_load_text(dd, FILENAME_LAST_OCCURRENCE);
-    long val = atol(field_data);
+    struct element_loader loader = { .entry = entry };
+    char *field_data = load_element(&loader, me->element);
+    element_loader_close(&loader);
+    int brk = (!field_data || strcmp(field_data, me->value) != 0);
     free(field_data);
-    if (val < me->timestamp_from || val > me->timestamp_to)
+    if (brk)
         return 0;
 
-    me->list = g_list_prepend(me->list, xstrdup(dd->dd_dirname));
+    me->list = g_list_prepend(me->list, xstrdup(problem_index_entry_dirname(entry)));
     return 0;
 }
 
@@ -310,11 +365,183 @@ static GList *get_problem_dirs_for_element_in_time(uid_t uid,
         .timestamp_to = timestamp_to,
     };
 
-    for_each_problem_in_dir(g_settings_dump_location, uid, add_dirname_to_GList_if_matches, &me);
+    problem_index_for_each(s_problem_index, uid, add_dirname_to_GList_if_matches, &me);
 
     return g_list_reverse(me.list);
 }
 
+/*
+ * Lists problems matching a filter together with requested elements,
+ * sorted and paged, so clients don't need GetInfo for every problem
+ */
+
+struct problem_filter {
+    GList *matches;             /* struct filtered_problem */
+    GVariant *filter;           /* a{ss}, keywords and required element values */
+    long since;
+    long until;
+    int reported;               /* -1 = don't care, 0 = not reported, 1 = reported */
+    const char *sort_by;
+};
+
+struct filtered_problem {
+    struct problem_index_entry *entry;
+    char *sort_value;
+};
+
+static void free_filtered_problem(gpointer data)
+{
+    struct filtered_problem *fp = data;
+    free(fp->sort_value);
+    free(fp);
+}
+
+static bool is_filter_keyword(const char *key)
+{
+    return strcmp(key, "since") == 0
+        || strcmp(key, "until") == 0
+        || strcmp(key, "reported") == 0;
+}
+
+/* Returns the invalid key of the filter or NULL */
+static const char *parse_problem_filter(GVariant *filter, struct problem_filter *pf)
+{
+    pf->filter = filter;
+    pf->since = 0;
+    pf->until = G_MAXLONG;
+    pf->reported = -1;
+
+    GVariantIter iter;
+    const char *key;
+    const char *value;
+    g_variant_iter_init(&iter, filter);
+    while (g_variant_iter_next(&iter, "{&s&s}", &key, &value))
+    {
+        if (strcmp(key, "reported") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+                pf->reported = 1;
+            else if (strcmp(value, "no") == 0)
+                pf->reported = 0;
+            else
+                return key;
+            continue;
+        }
+
+        if (!is_filter_keyword(key))
+        {
+            if (!str_is_correct_filename(key))
+                return key;
+            continue;
+        }
+
+        char *end;
+        errno = 0;
+        long val = strtol(value, &end, 10);
+        if (errno || end == value || *end != '\0')
+            return key;
+
+        if (strcmp(key, "since") == 0)
+            pf->since = val;
+        else
+            pf->until = val;
+    }
+
+    return NULL;
+}
+
+static int add_filtered_problem_if_matches(struct problem_index_entry *entry, void *arg)
+{
+    struct problem_filter *pf = arg;
+
+    /* Check the indexed elements first, they are in memory */
+    const char *last_occurrence = problem_index_entry_get(entry, FILENAME_LAST_OCCURRENCE);
+    long val = last_occurrence ? atol(last_occurrence) : 0;
+    if (val < pf->since || val > pf->until)
+        return 0;
+
+    if (pf->reported >= 0)
+    {
+        const char *reported_to = problem_index_entry_get(entry, FILENAME_REPORTED_TO);
+        if ((reported_to && reported_to[0] != '\0') != pf->reported)
+            return 0;
+    }
+
+    struct element_loader loader = { .entry = entry };
+    GVariantIter iter;
+    const char *key;
+    const char *value;
+    g_variant_iter_init(&iter, pf->filter);
+    while (g_variant_iter_next(&iter, "{&s&s}", &key, &value))
+    {
+        if (is_filter_keyword(key))
+            continue;
+
+        char *field_data = load_element(&loader, key);
+        int brk = (!field_data || strcmp(field_data, value) != 0);
+        free(field_data);
+        if (brk)
+        {
+            element_loader_close(&loader);
+            return 0;
+        }
+    }
+
+    struct filtered_problem *fp = xmalloc(sizeof(*fp));
+    fp->entry = entry;
+    fp->sort_value = load_element(&loader, pf->sort_by);
+    pf->matches = g_list_prepend(pf->matches, fp);
+    element_loader_close(&loader);
+    return 0;
+}
+
+/* Numbers (time, count) are compared by value, anything else as text */
+static gint compare_filtered_problems(gconstpointer a, gconstpointer b, gpointer descending)
+{
+    const struct filtered_problem *fa = a;
+    const struct filtered_problem *fb = b;
+    const char *va = fa->sort_value ? fa->sort_value : "";
+    const char *vb = fb->sort_value ? fb->sort_value : "";
+
+    char *end_a;
+    char *end_b;
+    unsigned long long na = strtoull(va, &end_a, 10);
+    unsigned long long nb = strtoull(vb, &end_b, 10);
+
+    int r;
+    if (end_a != va && *end_a == '\0' && end_b != vb && *end_b == '\0')
+        r = (na > nb) - (na < nb);
+    else
+        r = strcmp(va, vb);
+
+    /* Same order in every call, pages don't overlap */
+    if (r == 0)
+        r = strcmp(problem_index_entry_dirname(fa->entry), problem_index_entry_dirname(fb->entry));
+
+    return GPOINTER_TO_INT(descending) ? -r : r;
+}
+
+static GVariant *variant_from_problem_elements(struct problem_index_entry *entry, GList *elements)
+{
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{ss}"));
+
+    struct element_loader loader = { .entry = entry };
+    for (GList *l = elements; l; l = l->next)
+    {
+        const char *element_name = (const char*)l->data;
+        char *value = load_element(&loader, element_name);
+        if (value)
+        {
+            g_variant_builder_add(&builder, "{ss}", element_name, value);
+            free(value);
+        }
+    }
+    element_loader_close(&loader);
+
+    return g_variant_builder_end(&builder);
+}
+
 
 static void handle_method_call(GDBusConnection *connection,
                         const gchar *caller,
@@ -359,7 +586,7 @@ static void handle_method_call(GDBusConnection *connection,
 
     if (g_strcmp0(method_name, "GetProblems") == 0)
     {
-        GList *dirs = get_problem_dirs_for_uid(caller_uid, g_settings_dump_location);
+        GList *dirs = problem_index_get_dirs_for_uid(s_problem_index, caller_uid);
         response = variant_from_string_list(dirs);
         list_free_with_free(dirs);
 
@@ -382,7 +609,7 @@ static void handle_method_call(GDBusConnection *connection,
                 caller_uid = 0;
         }
 
-        GList * dirs = get_problem_dirs_for_uid(caller_uid, g_settings_dump_location);
+        GList * dirs = problem_index_get_dirs_for_uid(s_problem_index, caller_uid);
         response = variant_from_string_list(dirs);
 
         list_free_with_free(dirs);
@@ -393,7 +620,7 @@ static void handle_method_call(GDBusConnection *connection,
 
     if (g_strcmp0(method_name, "GetForeignProblems") == 0)
     {
-        GList * dirs = get_problem_dirs_not_accessible_by_uid(caller_uid, g_settings_dump_location);
+        GList * dirs = problem_index_get_dirs_not_accessible_by_uid(s_problem_index, caller_uid);
         response = variant_from_string_list(dirs);
         list_free_with_free(dirs);
 
@@ -481,9 +708,13 @@ static void handle_method_call(GDBusConnection *connection,
             return;
         }
 
-        if (!dump_dir_accessible_by_uid(problem_dir, caller_uid))
+        /* Problems in the dump location are known to the index */
+        struct problem_index_entry *entry = problem_index_find(s_problem_index, problem_dir);
+        const bool accessible = entry ? problem_index_entry_accessible_by_uid(entry, caller_uid)
+                                      : dump_dir_accessible_by_uid(problem_dir, caller_uid);
+        if (!accessible)
         {
-            if (errno == ENOTDIR)
+            if (!entry && errno == ENOTDIR)
             {
                 log_notice("Requested directory does not exist '%s'", problem_dir);
                 return_InvalidProblemDir_error(invocation, problem_dir);
@@ -500,23 +731,40 @@ static void handle_method_call(GDBusConnection *connection,
             }
         }
 
-        struct dump_dir *dd = dd_opendir(problem_dir, DD_OPEN_READONLY | DD_FAIL_QUIETLY_EACCES);
-        if (!dd)
-        {
-            return_InvalidProblemDir_error(invocation, problem_dir);
-            return;
-        }
-
 	/* Get 2nd param - vector of element names */
         GVariant *array = g_variant_get_child_value(parameters, 1);
         GList *elements = string_list_from_variant(array);
         g_variant_unref(array);
 
+        /* Don't open the directory if the index has all the elements */
+        bool indexed = (entry != NULL);
+        for (GList *l = elements; l && indexed; l = l->next)
+            indexed = problem_index_element_is_indexed((const char*)l->data);
+
+        struct dump_dir *dd = NULL;
+        if (!indexed)
+        {
+            dd = dd_opendir(problem_dir, DD_OPEN_READONLY | DD_FAIL_QUIETLY_EACCES);
+            if (!dd)
+            {
+                list_free_with_free(elements);
+                return_InvalidProblemDir_error(invocation, problem_dir);
+                return;
+            }
+        }
+
         GVariantBuilder *builder = NULL;
         for (GList *l = elements; l; l = l->next)
         {
             const char *element_name = (const char*)l->data;
-            char *value = dd_load_text_ext(dd, element_name, 0
+            char *value;
+            if (indexed)
+            {
+                const char *indexed_value = problem_index_entry_get(entry, element_name);
+                value = indexed_value ? xstrdup(indexed_value) : NULL;
+            }
+            else
+                value = dd_load_text_ext(dd, element_name, 0
                                                 | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE
                                                 | DD_FAIL_QUIETLY_ENOENT
                                                 | DD_FAIL_QUIETLY_EACCES);
@@ -532,7 +780,8 @@ static void handle_method_call(GDBusConnection *connection,
             }
         }
         list_free_with_free(elements);
-        dd_close(dd);
+        if (dd)
+            dd_close(dd);
         /* It is OK to call g_variant_new("(a{ss})", NULL) because */
         /* G_VARIANT_TYPE_TUPLE allows NULL value */
         GVariant *response = g_variant_new("(a{ss})", builder);
@@ -586,8 +835,15 @@ static void handle_method_call(GDBusConnection *connection,
 
         const double requested_size = (double)strlen(value) - item_size;
         /* Don't want to check the size limit in case of reducing of size */
+        double dump_location_size = 0;
+        if (requested_size > 0)
+        {
+            dump_location_size = get_dump_location_usage(g_settings_dump_location);
+            if (dump_location_size < 0)
+                dump_location_size = get_dirsize(g_settings_dump_location);
+        }
         if (requested_size > 0
-            && requested_size > (max_dir_size - get_dirsize(g_settings_dump_location)))
+            && requested_size > (max_dir_size - dump_location_size))
         {
             log_notice("No problem space left in '%s' (requested Bytes %f)", problem_id, requested_size);
             g_dbus_method_invocation_return_dbus_error(invocation,
@@ -674,6 +930,7 @@ static void handle_method_call(GDBusConnection *connection,
                     continue;
                 }
             }
+            dup_index_forget_dump_dir(g_settings_dump_location, dir_name);
             delete_dump_dir(dir_name);
         }
 
@@ -709,6 +966,78 @@ static void handle_method_call(GDBusConnection *connection,
         return;
     }
 
+    if (g_strcmp0(method_name, "GetProblemsFiltered") == 0)
+    {
+        const gchar *sort_by;
+        gboolean descending;
+        guint32 offset;
+        guint32 limit;
+        gboolean all;
+
+        GVariant *filter = g_variant_get_child_value(parameters, 0);
+        g_variant_get_child(parameters, 1, "&s", &sort_by);
+        g_variant_get_child(parameters, 2, "b", &descending);
+        g_variant_get_child(parameters, 3, "u", &offset);
+        g_variant_get_child(parameters, 4, "u", &limit);
+        GVariant *array = g_variant_get_child_value(parameters, 5);
+        GList *elements = string_list_from_variant(array);
+        g_variant_unref(array);
+        g_variant_get_child(parameters, 6, "b", &all);
+
+        if (sort_by[0] == '\0')
+            sort_by = FILENAME_LAST_OCCURRENCE;
+
+        struct problem_filter pf = {
+            .matches = NULL,
+            .sort_by = sort_by,
+        };
+        const char *invalid = parse_problem_filter(filter, &pf);
+        if (!invalid && !str_is_correct_filename(sort_by))
+            invalid = sort_by;
+        for (GList *l = elements; l && !invalid; l = l->next)
+            if (!str_is_correct_filename((const char*)l->data))
+                invalid = (const char*)l->data;
+
+        if (invalid)
+        {
+            log_notice("'%s' is not a valid filter, sort key or element name", invalid);
+            char *error = xasprintf(_("'%s' is not a valid filter, sort key or element name"), invalid);
+            g_dbus_method_invocation_return_dbus_error(invocation,
+                                              "org.freedesktop.problems.InvalidFilter",
+                                              error);
+            free(error);
+            list_free_with_free(elements);
+            g_variant_unref(filter);
+            return;
+        }
+
+        if (all && polkit_check_authorization_dname(caller, "org.freedesktop.problems.getall") == PolkitYes)
+            caller_uid = 0;
+
+        problem_index_for_each(s_problem_index, caller_uid, add_filtered_problem_if_matches, &pf);
+        pf.matches = g_list_sort_with_data(pf.matches, compare_filtered_problems, GINT_TO_POINTER(descending));
+
+        GVariantBuilder *builder = g_variant_builder_new(G_VARIANT_TYPE("a{sa{ss}}"));
+        GList *l = g_list_nth(pf.matches, offset);
+        for (guint32 count = 0; l && (limit == 0 || count < limit); l = l->next, ++count)
+        {
+            struct filtered_problem *fp = l->data;
+            g_variant_builder_add(builder, "{s@a{ss}}",
+                                  problem_index_entry_dirname(fp->entry),
+                                  variant_from_problem_elements(fp->entry, elements));
+        }
+        response = g_variant_new("(a{sa{ss}})", builder);
+        g_variant_builder_unref(builder);
+
+        log_info("GetProblemsFiltered: %u matching problems", g_list_length(pf.matches));
+        g_list_free_full(pf.matches, free_filtered_problem);
+        list_free_with_free(elements);
+        g_variant_unref(filter);
+
+        g_dbus_method_invocation_return_value(invocation, response);
+        return;
+    }
+
     if (g_strcmp0(method_name, "Quit") == 0)
     {
         g_dbus_method_invocation_return_value(invocation, NULL);
@@ -723,6 +1052,13 @@ static gboolean on_timeout_cb(gpointer user_data)
     return TRUE;
 }
 
+/* Keeps the index current while nobody asks, inotify queue doesn't overflow */
+static gboolean handle_index_events_cb(GIOChannel *gio, GIOCondition condition, gpointer user_data)
+{
+    problem_index_process_events(s_problem_index);
+    return TRUE; /* "please don't remove this event" */
+}
+
 static const GDBusInterfaceVTable interface_vtable =
 {
     .method_call = handle_method_call,
@@ -828,11 +1164,30 @@ int main(int argc, char *argv[])
     /* initialize the g_settings_dump_location */
     load_abrt_conf();
 
+    s_problem_index = problem_index_new(g_settings_dump_location);
+    GIOChannel *index_channel = NULL;
+    guint index_channel_id = 0;
+    if (problem_index_get_fd(s_problem_index) >= 0)
+    {
+        index_channel = abrt_gio_channel_unix_new(problem_index_get_fd(s_problem_index));
+        index_channel_id = g_io_add_watch(index_channel, G_IO_IN | G_IO_PRI, handle_index_events_cb, NULL);
+    }
+
     loop = g_main_loop_new(NULL, FALSE);
     g_main_loop_run(loop);
 
     log_notice("Cleaning up");
 
+    if (index_channel_id)
+        g_source_remove(index_channel_id);
+    if (index_channel)
+    {
+        /* The descriptor belongs to the index */
+        g_io_channel_set_close_on_unref(index_channel, FALSE);
+        g_io_channel_unref(index_channel);
+    }
+    problem_index_free(s_problem_index);
+
     g_bus_unown_name(owner_id);
 
     g_dbus_node_info_unref(introspection_data);
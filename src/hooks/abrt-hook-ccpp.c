@@ -19,6 +19,8 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 #include <sys/utsname.h>
+#include <sys/mman.h>
+#include <lzma.h>
 #include "libabrt.h"
 
 #ifdef ENABLE_DUMP_TIME_UNWIND
@@ -50,18 +52,183 @@ static char* malloc_readlink(const char *linkname)
     return NULL;
 }
 
+/* Cores of big processes are hundreds of megabytes or more and the crashed
+ * process is kept around until we read all of it, so the copy loop needs
+ * to be fast: we read in large page-aligned chunks and look for holes
+ * word-at-a-time in SPARSE_BLOCK sized blocks, merging neighbouring
+ * data blocks into one write and neighbouring zero blocks into one seek.
+ *
+ * We don't splice() from the kernel's pipe: data moved that way never
+ * reaches user space and we would lose the ability to skip zero pages,
+ * which usually make up most of a core file. write_sparse() is in hooklib.c.
+ */
+#define CONFIG_FEATURE_COPYBUF_KB 1024
+
+/* Fills the whole buffer if it can: pipe gives us
+ * at most 64k per read, too little to be efficient.
+ * Returns 0 on eof, -1 on error.
+ */
+static ssize_t read_chunk(int src_fd, char *buffer, int buffer_size)
+{
+	ssize_t rd = 0;
+	while (rd < buffer_size) {
+		ssize_t r = safe_read(src_fd, buffer + rd, buffer_size - rd);
+		if (r < 0) {
+			perror_msg("Read error");
+			return -1;
+		}
+		if (r == 0)
+			break;
+		rd += r;
+	}
+	return rd;
+}
+
+/* abrt's copy of the core: sparse file or xz stream.
+ *
+ * When compressing, every XZ_BLOCK_SIZE bytes of input start a new xz
+ * block; block sizes are recorded in the index at the end of the stream,
+ * so readers can seek to an offset without decompressing everything
+ * before it.
+ */
+#define XZ_BLOCK_SIZE (8 * 1024 * 1024)
+struct core_writer {
+	int fd;
+	int last_was_seek;
+	bool compress;
+	lzma_stream xz;
+	off_t xz_block_left;
+	uint8_t xz_outbuf[64 * 1024];
+};
+
+/* compress_level < 0: don't compress */
+static int core_writer_init(struct core_writer *w, int fd, int compress_level)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	if (compress_level < 0)
+		return 0;
+
+	w->compress = true;
+	w->xz = (lzma_stream)LZMA_STREAM_INIT;
+	lzma_ret ret = lzma_easy_encoder(&w->xz, compress_level, LZMA_CHECK_CRC32);
+	if (ret != LZMA_OK) {
+		error_msg("Can't initialize xz compression (error %d)", (int)ret);
+		return -1;
+	}
+	w->xz.next_out = w->xz_outbuf;
+	w->xz.avail_out = sizeof(w->xz_outbuf);
+	w->xz_block_left = XZ_BLOCK_SIZE;
+	return 0;
+}
+
+/* Writes whatever the encoder has in its output buffer */
+static int xz_flush_output(struct core_writer *w)
+{
+	size_t len = sizeof(w->xz_outbuf) - w->xz.avail_out;
+	if (len != 0) {
+		errno = 0;
+		if (full_write(w->fd, w->xz_outbuf, len) != (ssize_t)len) {
+			perror_msg("Write error");
+			return -1;
+		}
+	}
+	w->xz.next_out = w->xz_outbuf;
+	w->xz.avail_out = sizeof(w->xz_outbuf);
+	return 0;
+}
+
+/* Runs the encoder until it consumes all input (or finishes the stream,
+ * or the block) */
+static int xz_encode(struct core_writer *w, lzma_action action)
+{
+	while (1) {
+		lzma_ret ret = lzma_code(&w->xz, action);
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+			error_msg("xz compression failed (error %d)", (int)ret);
+			return -1;
+		}
+		if (w->xz.avail_out == 0 || ret == LZMA_STREAM_END)
+			if (xz_flush_output(w) != 0)
+				return -1;
+		if (ret == LZMA_STREAM_END)
+			return 0;
+		if (action == LZMA_RUN && w->xz.avail_in == 0)
+			return 0;
+	}
+}
+
+static int xz_write(struct core_writer *w, const uint8_t *buf, size_t size)
+{
+	while (size != 0) {
+		size_t len = size;
+		if ((off_t)len > w->xz_block_left)
+			len = w->xz_block_left;
+		w->xz.next_in = buf;
+		w->xz.avail_in = len;
+		if (xz_encode(w, LZMA_RUN) != 0)
+			return -1;
+		buf += len;
+		size -= len;
+		w->xz_block_left -= len;
+		if (w->xz_block_left == 0) {
+			if (xz_encode(w, LZMA_FULL_FLUSH) != 0)
+				return -1;
+			w->xz_block_left = XZ_BLOCK_SIZE;
+		}
+	}
+	return 0;
+}
+
+/* core_filter_write_fn: buf == NULL means size zero bytes */
+static int core_writer_write(void *param, const void *buf, size_t size)
+{
+	struct core_writer *w = param;
+
+	if (!w->compress) {
+		if (buf)
+			return write_sparse(w->fd, buf, size, &w->last_was_seek);
+		if (size != 0) {
+			xlseek(w->fd, size, SEEK_CUR);
+			w->last_was_seek = 1;
+		}
+		return 0;
+	}
+
+	if (buf)
+		return xz_write(w, buf, size);
+
+	static const uint8_t zeros[SPARSE_BLOCK];
+	while (size != 0) {
+		size_t len = (size < sizeof(zeros) ? size : sizeof(zeros));
+		if (xz_write(w, zeros, len) != 0)
+			return -1;
+		size -= len;
+	}
+	return 0;
+}
+
+static int core_writer_finish(struct core_writer *w)
+{
+	if (!w->compress)
+		return finish_sparse(w->fd, w->last_was_seek);
+
+	int r = xz_encode(w, LZMA_FINISH);
+	lzma_end(&w->xz);
+	return r;
+}
+
 /* Custom version of copyfd_xyz,
- * one which is able to write into two descriptors at once.
+ * one which is able to write into two descriptors at once:
+ * abrt's copy of the core, possibly filtered and compressed,
+ * and user's core, which gets everything up to user_core_size.
  */
-#define CONFIG_FEATURE_COPYBUF_KB 4
-static off_t copyfd_sparse(int src_fd, int dst_fd1, int dst_fd2, off_t size2)
+static off_t copy_core(int src_fd, struct core_writer *abrt_core,
+		struct core_filter *filter, struct core_filter_stats *filter_stats,
+		int user_core_fd, off_t user_core_size)
 {
 	off_t total = 0;
-	int last_was_seek = 0;
-#if CONFIG_FEATURE_COPYBUF_KB <= 4
-	char buffer[CONFIG_FEATURE_COPYBUF_KB * 1024];
-	enum { buffer_size = sizeof(buffer) };
-#else
+	int user_last_was_seek = 0;
 	char *buffer;
 	int buffer_size;
 
@@ -73,73 +240,59 @@ static off_t copyfd_sparse(int src_fd, int dst_fd1, int dst_fd2, off_t size2)
 			/* ignored: */ -1, 0);
 	buffer_size = CONFIG_FEATURE_COPYBUF_KB * 1024;
 	if (buffer == MAP_FAILED) {
-		buffer = alloca(4 * 1024);
-		buffer_size = 4 * 1024;
+		buffer = alloca(SPARSE_BLOCK);
+		buffer_size = SPARSE_BLOCK;
 	}
-#endif
 
 	while (1) {
-		ssize_t rd = safe_read(src_fd, buffer, buffer_size);
+		ssize_t rd = read_chunk(src_fd, buffer, buffer_size);
+		if (rd < 0) {
+			total = -1;
+			goto out;
+		}
 		if (!rd) { /* eof */
-			if (last_was_seek) {
-				if (lseek(dst_fd1, -1, SEEK_CUR) < 0
-				 || safe_write(dst_fd1, "", 1) != 1
-				 || (dst_fd2 >= 0
-				     && (lseek(dst_fd2, -1, SEEK_CUR) < 0
-					 || safe_write(dst_fd2, "", 1) != 1
-				        )
-				    )
-				) {
-					perror_msg("Write error");
-					total = -1;
-					goto out;
-				}
+			if ((user_core_fd >= 0 && finish_sparse(user_core_fd, user_last_was_seek) != 0)
+			 || (filter && core_filter_finish(filter, filter_stats) != 0)
+			 || core_writer_finish(abrt_core) != 0
+			) {
+				total = -1;
 			}
 			/* all done */
 			goto out;
 		}
-		if (rd < 0) {
-			perror_msg("Read error");
+
+		if (user_core_fd >= 0) {
+			/* The buffer is big, don't let it overshoot ulimit -c */
+			size_t user_rd = (rd < user_core_size ? rd : user_core_size);
+			if (write_sparse(user_core_fd, buffer, user_rd, &user_last_was_seek) != 0) {
+				total = -1;
+				goto out;
+			}
+		}
+
+		int r = filter ? core_filter_feed(filter, buffer, rd)
+		               : core_writer_write(abrt_core, buffer, rd);
+		if (r != 0) {
 			total = -1;
 			goto out;
 		}
 
-		/* checking sparseness */
-		ssize_t cnt = rd;
-		while (--cnt >= 0) {
-			if (buffer[cnt] != 0) {
-				/* not sparse */
-				errno = 0;
-				ssize_t wr1 = full_write(dst_fd1, buffer, rd);
-				ssize_t wr2 = (dst_fd2 >= 0 ? full_write(dst_fd2, buffer, rd) : rd);
-				if (wr1 < rd || wr2 < rd) {
-					perror_msg("Write error");
-					total = -1;
-					goto out;
-				}
-				last_was_seek = 0;
-				goto adv;
+		total += rd;
+		user_core_size -= rd;
+		if (user_core_fd >= 0 && user_core_size <= 0) {
+			if (finish_sparse(user_core_fd, user_last_was_seek) != 0) {
+				total = -1;
+				goto out;
 			}
+			user_core_fd = -1;
 		}
-		/* sparse */
-		xlseek(dst_fd1, rd, SEEK_CUR);
-		if (dst_fd2 >= 0)
-			xlseek(dst_fd2, rd, SEEK_CUR);
-		last_was_seek = 1;
- adv:
-		total += rd;
-		size2 -= rd;
-		if (size2 < 0)
-			dst_fd2 = -1;
-//TODO: truncate to 0 or even delete the second file
+//TODO: truncate to 0 or even delete the user's file
 //(currently we delete the file later)
 	}
  out:
 
-#if CONFIG_FEATURE_COPYBUF_KB > 4
-	if (buffer_size != 4 * 1024)
+	if (buffer_size != SPARSE_BLOCK)
 		munmap(buffer, buffer_size);
-#endif
 	return total;
 }
 
@@ -528,30 +681,34 @@ int main(int argc, char** argv)
 
     logmode = LOGMODE_JOURNAL;
 
-    /* Parse abrt.conf */
-    load_abrt_conf();
-    /* ... and plugins/CCpp.conf */
-    bool setting_MakeCompatCore;
-    bool setting_SaveBinaryImage;
-    bool setting_SaveFullCore;
-    bool setting_CreateCoreBacktrace;
+    /* Use the parsed abrt.conf and plugins/CCpp.conf kept by abrtd,
+     * parse them ourself only if the snapshot is missing or stale */
+    struct hook_settings hs;
+    bool abrtd_running;
+    bool have_snapshot = (hook_settings_read(&hs, &abrtd_running) == 0);
+    if (!have_snapshot)
+        hook_settings_load(&hs);
+    else
     {
-        map_string_t *settings = new_map_string();
-        load_abrt_plugin_conf_file("CCpp.conf", settings);
-        const char *value;
-        value = get_map_string_item_or_NULL(settings, "MakeCompatCore");
-        setting_MakeCompatCore = value && string_to_bool(value);
-        value = get_map_string_item_or_NULL(settings, "SaveBinaryImage");
-        setting_SaveBinaryImage = value && string_to_bool(value);
-        value = get_map_string_item_or_NULL(settings, "SaveFullCore");
-        setting_SaveFullCore = value ? string_to_bool(value) : true;
-        value = get_map_string_item_or_NULL(settings, "CreateCoreBacktrace");
-        setting_CreateCoreBacktrace = value ? string_to_bool(value) : true;
-        value = get_map_string_item_or_NULL(settings, "VerboseLog");
-        if (value)
-            g_verbose = xatoi_positive(value);
-        free_map_string(settings);
+        g_settings_nMaxCrashReportsSize = hs.max_crash_reports_size;
+        g_settings_crash_rate_burst = hs.crash_rate_burst;
+        g_settings_crash_rate_interval = hs.crash_rate_interval;
+        g_settings_crash_rate_uid_burst = hs.crash_rate_uid_burst;
+        g_settings_crash_rate_uid_interval = hs.crash_rate_uid_interval;
+        free(g_settings_dump_location);
+        g_settings_dump_location = xstrdup(hs.dump_location);
     }
+    if (hs.verbose_log >= 0)
+        g_verbose = hs.verbose_log;
+
+    bool setting_MakeCompatCore = hs.make_compat_core;
+    bool setting_SaveBinaryImage = hs.save_binary_image;
+    bool setting_SaveFullCore = hs.save_full_core;
+    bool setting_CreateCoreBacktrace = hs.create_core_backtrace;
+    bool setting_CoreCompression = hs.core_compression;
+    unsigned setting_CoreCompressionLevel = hs.core_compression_level;
+    bool setting_CoreFilter = hs.core_filter;
+    struct core_filter_settings core_filter_settings = { .heap_limit = hs.core_filter_heap_limit, .drop_files = NULL };
 
     if (argc == 2 && strcmp(argv[1], "--config-test"))
         return test_configuration(setting_SaveFullCore, setting_CreateCoreBacktrace);
@@ -671,7 +828,8 @@ int main(int argc, char** argv)
         default: return create_user_core(user_core_fd, pid, ulimit_c); // not a signal we care about
     }
 
-    if (!daemon_is_ok())
+    /* The snapshot lock tells us abrtd is alive without reading its pidfile */
+    if (!(have_snapshot && abrtd_running) && !daemon_is_ok())
     {
         /* not an error, exit with exit code 0 */
         log("abrtd is not running. If it crashed, "
@@ -686,13 +844,22 @@ int main(int argc, char** argv)
         /* If free space is less than 1/4 of MaxCrashReportsSize... */
         if (low_free_space(g_settings_nMaxCrashReportsSize, g_settings_dump_location))
             return create_user_core(user_core_fd, pid, ulimit_c);
+
+        /* rhbz#539551: "abrt going crazy when crashing process is respawned"
+         * abrtd trims the dump location in background. If it can't keep up
+         * (x1.25 and round up to 64m), don't make things worse.
+         */
+        unsigned maxsize = g_settings_nMaxCrashReportsSize + g_settings_nMaxCrashReportsSize / 4;
+        maxsize |= 63;
+        if (get_dump_location_usage(g_settings_dump_location) > maxsize * (double)(1024*1024))
+        {
+            error_msg("%s is over %uMiB, not saving the crash", g_settings_dump_location, maxsize);
+            return create_user_core(user_core_fd, pid, ulimit_c);
+        }
     }
 
-    /* Check /var/tmp/abrt/last-ccpp marker, do not dump repeated crashes
-     * if they happen too often. Else, write new marker value.
-     */
-    snprintf(path, sizeof(path), "%s/last-ccpp", g_settings_dump_location);
-    if (check_recent_crash_file(path, executable))
+    /* Do not dump repeated crashes if they happen too often */
+    if (crash_rate_limit_check(executable, uid))
     {
         /* It is a repeating crash */
         return create_user_core(user_core_fd, pid, ulimit_c);
@@ -708,11 +875,13 @@ int main(int argc, char** argv)
          */
         snprintf(path, sizeof(path), "%s/%s-coredump", g_settings_dump_location, last_slash);
         int abrt_core_fd = xopen3(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-        off_t core_size = copyfd_eof(STDIN_FILENO, abrt_core_fd, COPYFD_SPARSE);
+        struct core_writer abrt_core;
+        core_writer_init(&abrt_core, abrt_core_fd, /*no compression:*/ -1);
+        off_t core_size = copy_core(STDIN_FILENO, &abrt_core, NULL, NULL, -1, 0);
         if (core_size < 0 || fsync(abrt_core_fd) != 0)
         {
             unlink(path);
-            /* copyfd_eof logs the error including errno string,
+            /* copy_core logs the error including errno string,
              * but it does not log file name */
             error_msg_and_die("Error saving '%s'", path);
         }
@@ -722,7 +891,7 @@ int main(int argc, char** argv)
 
     unsigned path_len = snprintf(path, sizeof(path), "%s/ccpp-%s-%lu.new",
             g_settings_dump_location, iso_date_string(NULL), (long)pid);
-    if (path_len >= (sizeof(path) - sizeof("/"FILENAME_COREDUMP)))
+    if (path_len >= (sizeof(path) - sizeof("/"FILENAME_COREDUMP_XZ)))
     {
         return create_user_core(user_core_fd, pid, ulimit_c);
     }
@@ -820,7 +989,7 @@ int main(int argc, char** argv)
         off_t core_size = 0;
         if (setting_SaveFullCore)
         {
-            strcpy(path + path_len, "/"FILENAME_COREDUMP);
+            strcpy(path + path_len, setting_CoreCompression ? "/"FILENAME_COREDUMP_XZ : "/"FILENAME_COREDUMP);
             int abrt_core_fd = create_or_die(path, user_core_fd);
 
             /* We write both coredumps at once.
@@ -833,7 +1002,71 @@ int main(int argc, char** argv)
              * 21631 Segmentation fault (core dumped) ./test
              * ls: cannot access core*: No such file or directory <=== BAD
              */
-            core_size = copyfd_sparse(STDIN_FILENO, abrt_core_fd, user_core_fd, ulimit_c);
+            struct core_writer abrt_core;
+            /* Only abrt's copy is filtered, user gets what kernel gave us */
+            struct core_filter *filter = NULL;
+            struct core_filter_stats filter_stats;
+            memset(&filter_stats, 0, sizeof(filter_stats));
+            char *maps = NULL;
+            if (setting_CoreFilter)
+            {
+                /* Split only here: the filter keeps pointing to the patterns */
+                if (hs.core_filter_drop_files[0])
+                    core_filter_settings.drop_files = g_strsplit_set(hs.core_filter_drop_files, " \t", -1);
+                maps = dd_load_text_ext(dd, FILENAME_MAPS, DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+                filter = core_filter_new(&core_filter_settings, maps, core_writer_write, &abrt_core);
+            }
+
+            struct timespec copy_start, copy_end;
+            clock_gettime(CLOCK_MONOTONIC, &copy_start);
+            core_size = -1;
+            if (core_writer_init(&abrt_core, abrt_core_fd,
+                        setting_CoreCompression ? (int)setting_CoreCompressionLevel : -1) == 0)
+            {
+                core_size = copy_core(STDIN_FILENO, &abrt_core, filter, &filter_stats, user_core_fd, ulimit_c);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &copy_end);
+
+            if (core_size >= 0)
+            {
+                /* Saved for every core, so that filtered and unfiltered
+                 * problems can be told apart and compared */
+                if (!filter)
+                {
+                    filter_stats.in_size = filter_stats.out_size = core_size;
+                    filter_stats.passthrough = true;
+                }
+                unsigned long ms = (copy_end.tv_sec - copy_start.tv_sec) * 1000
+                                 + (copy_end.tv_nsec - copy_start.tv_nsec) / 1000000;
+                char *stats = xasprintf(
+                        "in_size=%llu\n"
+                        "out_size=%llu\n"
+                        "segments=%u\n"
+                        "dropped_segments=%u\n"
+                        "truncated_segments=%u\n"
+                        "filtered=%s\n"
+                        "time_ms=%lu\n",
+                        (long long)filter_stats.in_size,
+                        (long long)filter_stats.out_size,
+                        filter_stats.segments,
+                        filter_stats.dropped_segments,
+                        filter_stats.truncated_segments,
+                        filter_stats.passthrough ? "no" : "yes",
+                        ms);
+                dd_save_text(dd, FILENAME_CORE_FILTER_STATS, stats);
+                free(stats);
+                if (filter)
+                    log_notice("Filtered core dump of pid %lu: kept %llu of %llu bytes, "
+                               "dropped %u and truncated %u of %u segments in %lu ms",
+                               (long)pid,
+                               (long long)filter_stats.out_size, (long long)filter_stats.in_size,
+                               filter_stats.dropped_segments, filter_stats.truncated_segments,
+                               filter_stats.segments, ms);
+            }
+            core_filter_free(filter);
+            g_strfreev(core_filter_settings.drop_files);
+            free(maps);
+
             if (fsync(abrt_core_fd) != 0 || close(abrt_core_fd) != 0 || core_size < 0)
             {
                 unlink(path);
@@ -843,7 +1076,7 @@ int main(int argc, char** argv)
                     xchdir(user_pwd);
                     unlink(core_basename);
                 }
-                /* copyfd_sparse logs the error including errno string,
+                /* copy_core logs the error including errno string,
                  * but it does not log file name */
                 error_msg_and_die("Error writing '%s'", path);
             }
@@ -919,19 +1152,9 @@ int main(int argc, char** argv)
             log_notice("Saved core dump of pid %lu (%s) to %s (%llu bytes)",
                        (long)pid, executable, path, (long long)core_size);
 
+        /* abrtd trims old problem directories when needed */
         notify_new_path(path);
 
-        /* rhbz#539551: "abrt going crazy when crashing process is respawned" */
-        if (g_settings_nMaxCrashReportsSize > 0)
-        {
-            /* x1.25 and round up to 64m: go a bit up, so that usual in-daemon trimming
-             * kicks in first, and we don't "fight" with it:
-             */
-            unsigned maxsize = g_settings_nMaxCrashReportsSize + g_settings_nMaxCrashReportsSize / 4;
-            maxsize |= 63;
-            trim_problem_dirs(g_settings_dump_location, maxsize * (double)(1024*1024), path);
-        }
-
         free(rootdir);
         return 0;
     }
@@ -17,56 +17,73 @@
 */
 #include "libabrt.h"
 
-struct oops_text {
-    unsigned panic_no;
+/* Only the header of a record is kept in memory, the text is copied from
+ * the file when the records are merged.
+ */
+struct pstore_record {
+    unsigned dump_no;
     unsigned part_no;
     const char *filename;
-    char *text;
+    long text_offset;
 };
 
+/* The header looks like "Panic#2 Part1" or "Oops#5 Part3" */
 static
-struct oops_text *parse_file(const char *filename)
+bool read_record_header(const char *filename, struct pstore_record *rec)
 {
     FILE *fp = fopen(filename, "r");
     if (!fp)
-        return NULL;
-
-    char buffer[16 * 1024];
-
-    struct oops_text *ot = NULL;
-
-    if (!fgets(buffer, sizeof(buffer), fp))
-        goto ret;
-    unsigned n1, n2;
-    int n = sscanf(buffer, "Panic#%u Part%u\n", &n1, &n2);
-    if (n != 2)
-        goto ret;
+    {
+        log_notice("Can't open '%s'", filename);
+        return false;
+    }
 
-    ot = xzalloc(sizeof(*ot));
-    ot->filename = filename;
-    ot->panic_no = n1;
-    ot->part_no = n2;
+    bool valid = false;
+    char header[64];
+    if (fgets(header, sizeof(header), fp) && strchr(header, '\n'))
+    {
+        char reason[16];
+        valid = (sscanf(header, "%15[A-Za-z]#%u Part%u\n", reason, &rec->dump_no, &rec->part_no) == 3);
+        rec->filename = filename;
+        rec->text_offset = ftell(fp);
+    }
+    fclose(fp);
 
-    size_t sz = fread(buffer, 1, sizeof(buffer), fp);
-    ot->text = strndup(buffer, sz);
+    if (!valid)
+        log_notice("'%s' is not a pstore oops record", filename);
+    return valid;
+}
 
- ret:
-    fclose(fp);
-    return ot;
+static
+int compare_records(const void *a, const void *b)
+{
+    const struct pstore_record *aa = a;
+    const struct pstore_record *bb = b;
+    if (aa->dump_no != bb->dump_no)
+        return aa->dump_no < bb->dump_no ? -1 : 1;
+    if (aa->part_no != bb->part_no)
+        return aa->part_no < bb->part_no ? -1 : 1;
+    return 0;
 }
 
 static
-int compare_oops_texts(const void *a, const void *b)
+void print_record_text(const struct pstore_record *rec)
 {
-    struct oops_text *aa = *(struct oops_text **)a;
-    struct oops_text *bb = *(struct oops_text **)b;
-    if (aa->panic_no < bb->panic_no)
-        return -1;
-    if (aa->panic_no > bb->panic_no)
-        return 1;
-    if (aa->part_no < bb->part_no)
-        return -1;
-    return (aa->part_no > bb->part_no);
+    FILE *fp = fopen(rec->filename, "r");
+    if (!fp || fseek(fp, rec->text_offset, SEEK_SET) != 0)
+    {
+        perror_msg("Can't read '%s'", rec->filename);
+        if (fp)
+            fclose(fp);
+        return;
+    }
+
+    char buffer[16 * 1024];
+    size_t sz;
+    while ((sz = fread(buffer, 1, sizeof(buffer), fp)) != 0)
+        fwrite(buffer, 1, sz, stdout);
+
+    fclose(fp);
 }
 
 int main(int argc, char **argv)
@@ -102,47 +119,53 @@ int main(int argc, char **argv)
 
     export_abrt_envvars(0);
 
-    struct oops_text **v = xzalloc(sizeof(v[0]));
-    int i = 0;
+    argv += optind;
 
-    while (*argv)
+    struct pstore_record *records = NULL;
+    unsigned count = 0;
+    unsigned allocated = 0;
+    for (; *argv; ++argv)
     {
-        v[i] = parse_file(*argv);
-        if (v[i])
+        if (count == allocated)
         {
-            v = xrealloc(v, (++i + 1) * sizeof(v[0]));
-            v[i] = NULL;
+            allocated = allocated ? allocated * 2 : 64;
+            records = xrealloc(records, allocated * sizeof(records[0]));
         }
-        argv++;
+        if (read_record_header(*argv, &records[count]))
+            count++;
     }
 
-    if (i == 0) /* nothing was found */
+    if (count == 0) /* nothing was found */
+    {
+        free(records);
         return 0;
+    }
 
-    qsort(v, i, sizeof(v[0]), compare_oops_texts);
+    /* Parts of one dump must be merged in order */
+    qsort(records, count, sizeof(records[0]), compare_records);
 
     if (opts & OPT_o)
     {
-        struct oops_text **vv = v;
-        while (*vv)
+        for (unsigned i = 0; i < count; ++i)
         {
-            struct oops_text *cur_oops = *vv;
-            fputs(cur_oops->text, stdout);
-            vv++;
+            const struct pstore_record *rec = &records[i];
+            if (i != 0 && rec->dump_no == rec[-1].dump_no && rec->part_no > rec[-1].part_no + 1)
+                log_notice("Dump %u: parts %u to %u are missing", rec->dump_no, rec[-1].part_no + 1, rec->part_no - 1);
+            print_record_text(rec);
         }
+        fflush(stdout);
     }
 
     if (opts & OPT_d)
     {
-        struct oops_text **vv = v;
-        while (*vv)
+        for (unsigned i = 0; i < count; ++i)
         {
-            struct oops_text *cur_oops = *vv;
-            if (unlink(cur_oops->filename) != 0)
-                perror_msg("Can't unlink '%s'", cur_oops->filename);
-            vv++;
+            if (unlink(records[i].filename) != 0)
+                perror_msg("Can't unlink '%s'", records[i].filename);
         }
     }
 
+    free(records);
+
     return 0;
 }
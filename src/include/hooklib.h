@@ -29,3 +29,14 @@
  stored data, but it's not guaranteed)
  */
 char *problem_data_save(problem_data_t *pd);
+
+/* Sparse files: zero blocks of SPARSE_BLOCK bytes are seeked over.
+ * Runs of blocks of the same kind go to one write() or lseek().
+ * finish_sparse() writes the last byte if the file ends with a hole,
+ * so that the file gets its size.
+ * Both return 0 on success, -1 on error (the error is logged). */
+#define SPARSE_BLOCK 4096
+#define write_sparse abrt_write_sparse
+int write_sparse(int dst_fd, const char *buffer, size_t size, int *last_was_seek);
+#define finish_sparse abrt_finish_sparse
+int finish_sparse(int dst_fd, int last_was_seek);
@@ -42,6 +42,31 @@ int low_free_space(unsigned setting_MaxCrashReportsSize, const char *dump_locati
 
 #define trim_problem_dirs abrt_trim_problem_dirs
 void trim_problem_dirs(const char *dirname, double cap_size, const char *exclude_path);
+/* Core saved by abrt-hook-ccpp with CoreCompression = xz */
+#define FILENAME_COREDUMP_XZ FILENAME_COREDUMP".xz"
+/* Sizes and timing of core filtering (CoreFilter = yes) */
+#define FILENAME_CORE_FILTER_STATS "core_filter_stats"
+/* Duphash of the backtrace computed by the oops extractor */
+#define FILENAME_KOOPS_DUPHASH "koops_duphash"
+/* Hardware errors counted per CPU and bank: "CPU 2 Bank 5: 3" lines */
+#define FILENAME_HW_ERRORS "hw_errors"
+/* Occurrences counted before post-create, which adds them to count */
+#define FILENAME_PENDING_OCCURRENCES "pending_occurrences"
+
+#define get_coredump_path abrt_get_coredump_path
+/**
+  @brief Returns path to the uncompressed core of the problem
+
+  If the problem directory holds only the compressed core, it is unpacked
+  to a temporary file in LARGE_DATA_TMP_DIR and is_temporary is set to true;
+  the caller must unlink the file when done with it. The whole core is
+  unpacked on every call, nothing is cached.
+
+  @param dump_dir_name Problem directory
+  @param is_temporary Set to true if the returned file is a temporary copy
+  @return Malloc'ed path or NULL if the compressed core can't be unpacked
+*/
+char *get_coredump_path(const char *dump_dir_name, bool *is_temporary);
 #define run_unstrip_n abrt_run_unstrip_n
 char *run_unstrip_n(const char *dump_dir_name, unsigned timeout_sec);
 #define get_backtrace abrt_get_backtrace
@@ -62,6 +87,20 @@ extern bool          g_settings_autoreporting;
 extern char *        g_settings_autoreporting_event;
 #define g_settings_shortenedreporting abrt_g_settings_shortenedreporting
 extern bool          g_settings_shortenedreporting;
+#define g_settings_post_create_workers abrt_g_settings_post_create_workers
+extern unsigned int  g_settings_post_create_workers;
+#define g_settings_post_create_queue_size abrt_g_settings_post_create_queue_size
+extern unsigned int  g_settings_post_create_queue_size;
+#define g_settings_crash_rate_burst abrt_g_settings_crash_rate_burst
+extern unsigned int  g_settings_crash_rate_burst;
+#define g_settings_crash_rate_interval abrt_g_settings_crash_rate_interval
+extern unsigned int  g_settings_crash_rate_interval;
+#define g_settings_crash_rate_uid_burst abrt_g_settings_crash_rate_uid_burst
+extern unsigned int  g_settings_crash_rate_uid_burst;
+#define g_settings_crash_rate_uid_interval abrt_g_settings_crash_rate_uid_interval
+extern unsigned int  g_settings_crash_rate_uid_interval;
+#define g_settings_max_item_size abrt_g_settings_max_item_size
+extern unsigned int  g_settings_max_item_size;
 
 
 #define load_abrt_conf abrt_load_abrt_conf
@@ -84,6 +123,16 @@ int save_abrt_plugin_conf_file(const char *file, map_string_t *settings);
 
 void migrate_to_xdg_dirs(void);
 
+/* Returns 1 if the crash should not be saved because crashes of the same
+ * executable (or other key) or of the same uid happen too often.
+ * See crash_rate_limit.c */
+#define crash_rate_limit_check abrt_crash_rate_limit_check
+int crash_rate_limit_check(const char *key, uid_t uid);
+/* The same, but checks only the bucket of key, for crashes which don't
+ * belong to any uid (kernel oopses, Xorg) */
+#define crash_rate_limit_check_key abrt_crash_rate_limit_check_key
+int crash_rate_limit_check_key(const char *key);
+/* Obsolete, calls crash_rate_limit_check_key(executable) */
 int check_recent_crash_file(const char *filename, const char *executable);
 
 /* Returns 1 if abrtd daemon is running, 0 otherwise. */
@@ -98,6 +147,243 @@ int daemon_is_ok(void);
 #define notify_new_path abrt_notify_new_path
 void notify_new_path(const char *path);
 
+/**
+  @brief An entry of the on-disk index of problem directories used for
+  detection of duplicates
+
+  The index is divided into buckets by (uid, analyzer, executable), so the
+  duplicate search needs to look only at directories which can be duplicates.
+*/
+struct dup_index_entry {
+    char *dirname;      /**< Base name of the problem directory */
+    char *uuid;         /**< Content of FILENAME_UUID or NULL */
+    char *fingerprint;  /**< Hash of the crash thread frames or NULL */
+};
+
+#define dup_index_entry_free abrt_dup_index_entry_free
+void dup_index_entry_free(struct dup_index_entry *entry);
+/* Returns malloced path to the bucket file for the given key */
+#define dup_index_bucket_path abrt_dup_index_bucket_path
+char *dup_index_bucket_path(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable);
+/* Returns true if the index was completely built and is up to date */
+#define dup_index_is_valid abrt_dup_index_is_valid
+bool dup_index_is_valid(const char *dump_location);
+/* Forces the next user of the index to rebuild it */
+#define dup_index_invalidate abrt_dup_index_invalidate
+void dup_index_invalidate(const char *dump_location);
+/* Drops all buckets, the caller is expected to re-populate the index and
+ * call dup_index_mark_valid() */
+#define dup_index_reset abrt_dup_index_reset
+int dup_index_reset(const char *dump_location);
+#define dup_index_mark_valid abrt_dup_index_mark_valid
+void dup_index_mark_valid(const char *dump_location);
+/* Returns list of struct dup_index_entry */
+#define dup_index_get_bucket abrt_dup_index_get_bucket
+GList *dup_index_get_bucket(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable);
+#define dup_index_add abrt_dup_index_add
+void dup_index_add(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable,
+        const struct dup_index_entry *entry);
+#define dup_index_remove abrt_dup_index_remove
+void dup_index_remove(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable,
+        const char *dump_dir_name);
+/* Locks serializing post-create of problems from the same bucket. The global
+ * lock is to be held shared while holding a bucket lock, and exclusively
+ * while rebuilding the index. Return fd to pass to dup_index_unlock() or -1
+ * (errno is ETIMEDOUT on timeout). timeout_sec == 0 means wait forever.
+ */
+#define dup_index_lock_global abrt_dup_index_lock_global
+int dup_index_lock_global(const char *dump_location, int operation, unsigned timeout_sec);
+#define dup_index_lock_bucket abrt_dup_index_lock_bucket
+int dup_index_lock_bucket(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable,
+        unsigned timeout_sec);
+#define dup_index_unlock abrt_dup_index_unlock
+void dup_index_unlock(int fd);
+/* flock() which gives up after timeout_sec seconds with errno ETIMEDOUT */
+#define flock_with_timeout abrt_flock_with_timeout
+int flock_with_timeout(int fd, int operation, unsigned timeout_sec);
+/* Loads the key from the problem directory and removes it from the index.
+ * Must be called before the directory is deleted. */
+#define dup_index_forget_dump_dir abrt_dup_index_forget_dump_dir
+void dup_index_forget_dump_dir(const char *dump_location, const char *dump_dir_name);
+
+/* Sizes of problem directories in the dump location, see size_ledger.c */
+#define size_ledger_update abrt_size_ledger_update
+void size_ledger_update(const char *dump_location, const char *dump_dir_name);
+#define size_ledger_forget abrt_size_ledger_forget
+void size_ledger_forget(const char *dump_location, const char *dump_dir_name);
+/* Creates the ledger or brings it in sync with the directory */
+#define size_ledger_check abrt_size_ledger_check
+int size_ledger_check(const char *dump_location);
+/* Returns -1 if there is no ledger */
+#define size_ledger_total abrt_size_ledger_total
+double size_ledger_total(const char *dump_location);
+/* Size of the dump location as known to abrtd, without walking it.
+ * Returns -1 if it is not known. */
+#define get_dump_location_usage abrt_get_dump_location_usage
+double get_dump_location_usage(const char *dump_location);
+/* Deletes the "worst" directories until the total size is under cap_size.
+ * Returns -1 if there is no ledger. */
+#define size_ledger_trim abrt_size_ledger_trim
+int size_ledger_trim(const char *dump_location, double cap_size, const char *excluded_basename);
+
+/* Streaming filter of ELF core files, see core_filter.c */
+struct core_filter_settings {
+    off_t heap_limit;       /* bytes of [heap] and anonymous memory to keep, -1: all */
+    char **drop_files;      /* NULL terminated fnmatch patterns of files not to dump */
+};
+
+struct core_filter_stats {
+    off_t in_size;
+    off_t out_size;
+    unsigned segments;
+    unsigned dropped_segments;
+    unsigned truncated_segments;
+    bool passthrough;       /* input wasn't a core we can filter */
+};
+
+/* buf == NULL means size zero bytes */
+typedef int (*core_filter_write_fn)(void *param, const void *buf, size_t size);
+
+struct core_filter;
+/* maps is content of /proc/PID/maps of the crashed process */
+#define core_filter_new abrt_core_filter_new
+struct core_filter *core_filter_new(const struct core_filter_settings *settings,
+        const char *maps, core_filter_write_fn write, void *write_param);
+/* Returns -1 if write failed */
+#define core_filter_feed abrt_core_filter_feed
+int core_filter_feed(struct core_filter *filter, const void *buf, size_t size);
+#define core_filter_finish abrt_core_filter_finish
+int core_filter_finish(struct core_filter *filter, struct core_filter_stats *stats);
+#define core_filter_free abrt_core_filter_free
+void core_filter_free(struct core_filter *filter);
+
+/* Parsed settings abrt-hook-ccpp needs, see hook_settings.c */
+#define HOOK_SETTINGS_SOURCES 4
+struct hook_settings_source {
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long size;
+    unsigned long long ino;
+    int exists;
+};
+
+struct hook_settings {
+    unsigned magic;
+    unsigned version;
+    unsigned size;
+    struct hook_settings_source sources[HOOK_SETTINGS_SOURCES];
+    /* abrt.conf */
+    unsigned max_crash_reports_size;
+    unsigned crash_rate_burst;
+    unsigned crash_rate_interval;
+    unsigned crash_rate_uid_burst;
+    unsigned crash_rate_uid_interval;
+    char dump_location[PATH_MAX];
+    /* CCpp.conf */
+    bool make_compat_core;
+    bool save_binary_image;
+    bool save_full_core;
+    bool create_core_backtrace;
+    bool core_compression;
+    bool core_filter;
+    unsigned core_compression_level;
+    int verbose_log;                /* -1: not set */
+    long long core_filter_heap_limit;
+    char core_filter_drop_files[4096];
+};
+
+/* Parses the config files and sets g_settings_*. Returns -1 if some value
+ * doesn't fit into the struct, such snapshot must not be saved. */
+#define hook_settings_load abrt_hook_settings_load
+int hook_settings_load(struct hook_settings *s);
+/* Returns false if any of the config files changed since s was loaded */
+#define hook_settings_is_current abrt_hook_settings_is_current
+bool hook_settings_is_current(const struct hook_settings *s);
+/* Used by abrtd. Returns the fd which keeps the snapshot locked
+ * (or old_lock_fd on failure). */
+#define hook_settings_save abrt_hook_settings_save
+int hook_settings_save(const struct hook_settings *s, int old_lock_fd);
+#define hook_settings_remove abrt_hook_settings_remove
+void hook_settings_remove(int lock_fd);
+/* Used by the hook. Returns -1 if there is no valid and current snapshot;
+ * abrtd_running is set to true if abrtd holds the snapshot lock. */
+#define hook_settings_read abrt_hook_settings_read
+int hook_settings_read(struct hook_settings *s, bool *abrtd_running);
+
+/* Searches for many substrings at once, see str_matcher.c */
+struct str_matcher;
+/* patterns is NULL terminated, it is not needed after the call */
+#define str_matcher_new abrt_str_matcher_new
+struct str_matcher *str_matcher_new(const char *const *patterns);
+#define str_matcher_free abrt_str_matcher_free
+void str_matcher_free(struct str_matcher *m);
+/* Returns index of a pattern found in buf or -1 */
+#define str_matcher_find abrt_str_matcher_find
+int str_matcher_find(const struct str_matcher *m, const char *buf, size_t len);
+#define str_matcher_find_str abrt_str_matcher_find_str
+int str_matcher_find_str(const struct str_matcher *m, const char *str);
+
+/* Binary protocol of abrt.socket, see problem_submission.c
+ *
+ * The stream starts with a header: the 4 bytes of the magic, the version and
+ * a reserved field, both u16. The numbers are in network byte order. Records
+ * follow, a record is a header and key_len bytes of the key followed by
+ * value_len bytes of the value.
+ */
+#define ABRT_SOCKET_MAGIC "ABRT"
+#define ABRT_SOCKET_VERSION 1
+/* At most this many descriptors can be passed with one problem */
+#define ABRT_SOCKET_MAX_FDS 16
+enum {
+    /* The value is the item's data */
+    ABRT_SOCKET_ITEM    = 1,
+    /* The data are read from the next passed descriptor, value_len is 0 */
+    ABRT_SOCKET_FD_ITEM = 2,
+    /* The problem is complete, the server responds by a HTTP status line */
+    ABRT_SOCKET_END     = 3,
+};
+struct abrt_socket_stream_header
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+};
+struct abrt_socket_record_header
+{
+    uint16_t type;
+    uint16_t key_len;
+    uint32_t value_len;
+};
+
+/* A problem to be sent to abrtd in the binary format */
+struct problem_submission;
+#define problem_submission_new abrt_problem_submission_new
+struct problem_submission *problem_submission_new(void);
+#define problem_submission_free abrt_problem_submission_free
+void problem_submission_free(struct problem_submission *ps);
+/* Neither key nor data are copied, they must be valid until the problem
+ * is sent */
+#define problem_submission_add abrt_problem_submission_add
+void problem_submission_add(struct problem_submission *ps, const char *key, const void *data, size_t len);
+#define problem_submission_add_str abrt_problem_submission_add_str
+void problem_submission_add_str(struct problem_submission *ps, const char *key, const char *str);
+/* The item's data are read by abrtd from fd, the caller closes it after
+ * the problem is sent */
+#define problem_submission_add_fd abrt_problem_submission_add_fd
+void problem_submission_add_fd(struct problem_submission *ps, const char *key, int fd);
+/* Writes the problem to a connected socket, returns 0 or -errno */
+#define problem_submission_write abrt_problem_submission_write
+int problem_submission_write(struct problem_submission *ps, int sockfd);
+/* Sends the problem to abrtd, returns HTTP status of the response
+ * (201 if the problem was saved) or -errno */
+#define problem_submission_send abrt_problem_submission_send
+int problem_submission_send(struct problem_submission *ps);
+
 /* Note: should be public since unit tests need to call it */
 #define koops_extract_version abrt_koops_extract_version
 char *koops_extract_version(const char *line);
@@ -128,6 +414,37 @@ struct abrt_koops_line_info {
 void koops_extract_oopses_from_lines(GList **oops_list, const struct abrt_koops_line_info *lines_info, int lines_info_size);
 #define koops_extract_oopses abrt_koops_extract_oopses
 void koops_extract_oopses(GList **oops_list, char *buffer, size_t buflen);
+
+/*
+ * Incremental oops extraction for logs of any size. The parser keeps only
+ * the lines which can still become a part of an oops.
+ *
+ * The callback gets each found oops as a malloced string and takes
+ * its ownership. NULL instead of an oops means that the log contains
+ * a marker of abrt saying the oopses found so far were already reported.
+ */
+typedef void (*koops_parser_fn)(char *oops, void *param);
+struct koops_parser;
+#define koops_parser_new abrt_koops_parser_new
+struct koops_parser *koops_parser_new(koops_parser_fn callback, void *param);
+#define koops_parser_free abrt_koops_parser_free
+void koops_parser_free(struct koops_parser *parser);
+/* Raw dmesg or syslog data, lines may be split between calls */
+#define koops_parser_feed abrt_koops_parser_feed
+void koops_parser_feed(struct koops_parser *parser, const char *buffer, size_t buflen);
+/* One kernel message without the log level and time stamp */
+#define koops_parser_feed_line abrt_koops_parser_feed_line
+void koops_parser_feed_line(struct koops_parser *parser, const char *line, int level);
+/* The same for a line which is not NUL terminated. Lines which can't be
+ * a part of an oops are not copied. */
+#define koops_parser_feed_line_len abrt_koops_parser_feed_line_len
+void koops_parser_feed_line_len(struct koops_parser *parser, const char *line, size_t len, int level);
+/* End of input, reports the last oops. The parser can be fed again. */
+#define koops_parser_finish abrt_koops_parser_finish
+void koops_parser_finish(struct koops_parser *parser);
+/* Callback collecting the oopses in GList **param */
+#define koops_list_append_oops abrt_koops_list_append_oops
+void koops_list_append_oops(char *oops, void *param);
 #define koops_suspicious_strings_list abrt_koops_suspicious_strings_list
 GList *koops_suspicious_strings_list(void);
 #define koops_print_suspicious_strings abrt_koops_print_suspicious_strings
@@ -69,3 +69,65 @@ GList *get_problem_dirs_not_accessible_by_uid(uid_t uid, const char *dump_locati
  * @returns Non zero if problem data are complete, otherwise false
  */
 int problem_dump_dir_is_complete(struct dump_dir *dd);
+
+
+/*
+ * In-memory index of problem directories kept up to date via inotify,
+ * see problem_index.c
+ */
+struct problem_index;
+struct problem_index_entry;
+
+/*
+ * Indexes problem directories in @dump_location and starts watching them
+ */
+struct problem_index *problem_index_new(const char *dump_location);
+void problem_index_free(struct problem_index *index);
+
+/*
+ * Returns inotify descriptor of the index or -1. The events are processed
+ * before every query, call @problem_index_process_events when the descriptor
+ * is readable to keep the kernel queue short.
+ */
+int problem_index_get_fd(struct problem_index *index);
+void problem_index_process_events(struct problem_index *index);
+
+/*
+ * Checks whether the element's value is kept in memory
+ */
+bool problem_index_element_is_indexed(const char *name);
+
+const char *problem_index_entry_dirname(const struct problem_index_entry *entry);
+
+/*
+ * Gets value of an indexed element
+ *
+ * @returns NULL if the element doesn't exist or is not indexed
+ */
+const char *problem_index_entry_get(const struct problem_index_entry *entry, const char *name);
+
+/*
+ * Same as dump_dir_accessible_by_uid(), the result is cached until
+ * attributes of the directory change
+ */
+bool problem_index_entry_accessible_by_uid(struct problem_index_entry *entry, uid_t uid);
+
+/*
+ * Finds problem directory by its full path
+ *
+ * @returns NULL if the directory is not a known problem directory
+ */
+struct problem_index_entry *problem_index_find(struct problem_index *index, const char *dirname);
+
+typedef int (* problem_index_callback)(struct problem_index_entry *entry, void *arg);
+
+/*
+ * The same as @for_each_problem_in_dir but without touching the disk
+ */
+int problem_index_for_each(struct problem_index *index,
+                        uid_t caller_uid,
+                        problem_index_callback callback,
+                        void *arg);
+
+GList *problem_index_get_dirs_for_uid(struct problem_index *index, uid_t uid);
+GList *problem_index_get_dirs_not_accessible_by_uid(struct problem_index *index, uid_t uid);
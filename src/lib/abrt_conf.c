@@ -27,6 +27,13 @@ bool          g_settings_delete_uploaded = 0;
 bool          g_settings_autoreporting = 0;
 char *        g_settings_autoreporting_event = NULL;
 bool          g_settings_shortenedreporting = 0;
+unsigned int  g_settings_post_create_workers = 4;
+unsigned int  g_settings_post_create_queue_size = 100;
+unsigned int  g_settings_crash_rate_burst = 1;
+unsigned int  g_settings_crash_rate_interval = 20;
+unsigned int  g_settings_crash_rate_uid_burst = 10;
+unsigned int  g_settings_crash_rate_uid_interval = 6;
+unsigned int  g_settings_max_item_size = 0;
 
 void free_abrt_conf_data()
 {
@@ -37,6 +44,22 @@ void free_abrt_conf_data()
     g_settings_dump_location = NULL;
 }
 
+static void parse_unsigned_setting(map_string_t *settings, const char *name, unsigned int *result)
+{
+    const char *value = get_map_string_item_or_NULL(settings, name);
+    if (!value)
+        return;
+
+    char *end;
+    errno = 0;
+    unsigned long ul = strtoul(value, &end, 10);
+    if (errno || end == value || *end != '\0' || ul > INT_MAX)
+        error_msg("Error parsing %s setting: '%s'", name, value);
+    else
+        *result = ul;
+    remove_map_string_item(settings, name);
+}
+
 static void ParseCommon(map_string_t *settings, const char *conf_filename)
 {
     const char *value;
@@ -48,18 +71,7 @@ static void ParseCommon(map_string_t *settings, const char *conf_filename)
         remove_map_string_item(settings, "WatchCrashdumpArchiveDir");
     }
 
-    value = get_map_string_item_or_NULL(settings, "MaxCrashReportsSize");
-    if (value)
-    {
-        char *end;
-        errno = 0;
-        unsigned long ul = strtoul(value, &end, 10);
-        if (errno || end == value || *end != '\0' || ul > INT_MAX)
-            error_msg("Error parsing %s setting: '%s'", "MaxCrashReportsSize", value);
-        else
-            g_settings_nMaxCrashReportsSize = ul;
-        remove_map_string_item(settings, "MaxCrashReportsSize");
-    }
+    parse_unsigned_setting(settings, "MaxCrashReportsSize", &g_settings_nMaxCrashReportsSize);
 
     value = get_map_string_item_or_NULL(settings, "DumpLocation");
     if (value)
@@ -106,6 +118,14 @@ static void ParseCommon(map_string_t *settings, const char *conf_filename)
         g_settings_shortenedreporting = (desktop_env && strcasestr(desktop_env, "gnome") != NULL);
     }
 
+    parse_unsigned_setting(settings, "PostCreateWorkers", &g_settings_post_create_workers);
+    parse_unsigned_setting(settings, "PostCreateQueueSize", &g_settings_post_create_queue_size);
+    parse_unsigned_setting(settings, "CrashRateBurst", &g_settings_crash_rate_burst);
+    parse_unsigned_setting(settings, "CrashRateInterval", &g_settings_crash_rate_interval);
+    parse_unsigned_setting(settings, "CrashRateUidBurst", &g_settings_crash_rate_uid_burst);
+    parse_unsigned_setting(settings, "CrashRateUidInterval", &g_settings_crash_rate_uid_interval);
+    parse_unsigned_setting(settings, "MaxItemSize", &g_settings_max_item_size);
+
     GHashTableIter iter;
     const char *name;
     /*char *value; - already declared */
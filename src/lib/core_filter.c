@@ -0,0 +1,526 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include <elf.h>
+#include <link.h>
+#include <fnmatch.h>
+#include <sys/procfs.h>
+#include "libabrt.h"
+
+/* Streaming rewriter of ELF core files.
+ *
+ * The kernel writes a core as: ELF header, program headers, PT_NOTE data
+ * and then page-aligned PT_LOAD data in the order of program headers.
+ * We buffer everything up to the end of the notes, decide how much of each
+ * PT_LOAD segment to keep, emit the header with adjusted p_offset/p_filesz
+ * and then pass through only the kept parts of the segments. If the input
+ * doesn't look like that, it is passed through unmodified.
+ */
+
+/* Cores with notes bigger than this are not filtered */
+#define MAX_HEADER_SIZE (64 * 1024 * 1024)
+
+/* Index of the stack pointer in prstatus' pr_reg */
+#if defined(__x86_64__)
+# define SP_REG_INDEX 19 /* RSP */
+#elif defined(__i386__)
+# define SP_REG_INDEX 15 /* UESP */
+#elif defined(__aarch64__)
+# define SP_REG_INDEX 31
+#elif defined(__powerpc__)
+# define SP_REG_INDEX 1  /* r1 */
+#endif
+
+enum {
+    STATE_HEADER,       /* collecting ELF header, program headers and notes */
+    STATE_SEGMENTS,     /* passing through kept parts of PT_LOAD segments */
+    STATE_PASSTHROUGH,  /* not a core we understand, copying everything */
+};
+
+struct mapping {
+    unsigned long start;
+    unsigned long end;
+    char *name;
+};
+
+struct segment {
+    off_t in_offset;
+    off_t keep;
+    off_t out_offset;
+};
+
+struct core_filter {
+    const struct core_filter_settings *settings;
+    core_filter_write_fn write;
+    void *write_param;
+    int state;
+
+    struct mapping *maps;
+    unsigned map_count;
+
+    /* STATE_HEADER */
+    char *header;
+    size_t header_len;
+    size_t header_size;
+
+    /* STATE_SEGMENTS */
+    struct segment *segments;
+    unsigned segment_count;
+    unsigned cur_segment;
+    off_t in_pos;
+    off_t out_pos;
+
+    struct core_filter_stats stats;
+};
+
+static void parse_maps(struct core_filter *filter, const char *maps)
+{
+    unsigned allocated = 0;
+    while (maps && *maps)
+    {
+        const char *eol = strchrnul(maps, '\n');
+        unsigned long start, end;
+        int name_ofs = 0;
+        /* 00400000-0040b000 r-xp 00000000 fd:01 1234    /usr/bin/foo */
+        if (sscanf(maps, "%lx-%lx %*s %*s %*s %*s %n", &start, &end, &name_ofs) >= 2 && name_ofs > 0)
+        {
+            if (filter->map_count == allocated)
+            {
+                allocated = allocated * 2 + 64;
+                filter->maps = xrealloc(filter->maps, allocated * sizeof(filter->maps[0]));
+            }
+            struct mapping *m = &filter->maps[filter->map_count++];
+            m->start = start;
+            m->end = end;
+            m->name = (maps + name_ofs < eol) ? xstrndup(maps + name_ofs, eol - (maps + name_ofs)) : xstrdup("");
+        }
+        maps = (*eol ? eol + 1 : eol);
+    }
+}
+
+/* maps are sorted by address */
+static const struct mapping *find_mapping(const struct core_filter *filter, unsigned long addr)
+{
+    unsigned lo = 0, hi = filter->map_count;
+    while (lo < hi)
+    {
+        unsigned mid = lo + (hi - lo) / 2;
+        const struct mapping *m = &filter->maps[mid];
+        if (addr < m->start)
+            hi = mid;
+        else if (addr >= m->end)
+            lo = mid + 1;
+        else
+            return m;
+    }
+    return NULL;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Collects stack pointers of all threads from NT_PRSTATUS notes */
+static unsigned long *collect_stack_pointers(const char *notes, size_t size, unsigned *count)
+{
+    unsigned long *sps = NULL;
+    unsigned allocated = 0;
+    *count = 0;
+
+#ifdef SP_REG_INDEX
+    size_t pos = 0;
+    while (pos + sizeof(ElfW(Nhdr)) <= size)
+    {
+        ElfW(Nhdr) nhdr;
+        memcpy(&nhdr, notes + pos, sizeof(nhdr));
+        size_t desc_pos = pos + sizeof(nhdr) + ((nhdr.n_namesz + 3) & ~3);
+        size_t next = desc_pos + ((nhdr.n_descsz + 3) & ~3);
+        if (next > size || next <= pos)
+            break;
+
+        if (nhdr.n_type == NT_PRSTATUS && nhdr.n_descsz >= sizeof(struct elf_prstatus))
+        {
+            struct elf_prstatus prstatus;
+            memcpy(&prstatus, notes + desc_pos, sizeof(prstatus));
+            if (*count == allocated)
+            {
+                allocated = allocated * 2 + 16;
+                sps = xrealloc(sps, allocated * sizeof(sps[0]));
+            }
+            sps[(*count)++] = prstatus.pr_reg[SP_REG_INDEX];
+        }
+        pos = next;
+    }
+
+    if (*count)
+        qsort(sps, *count, sizeof(sps[0]), cmp_ulong);
+#endif
+
+    return sps;
+}
+
+static bool contains_stack_pointer(const unsigned long *sps, unsigned count,
+        unsigned long start, unsigned long end)
+{
+    unsigned lo = 0, hi = count;
+    while (lo < hi)
+    {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (sps[mid] < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < count && sps[lo] < end;
+}
+
+static bool is_dropped_file(const struct core_filter_settings *settings, const char *name)
+{
+    if (!settings->drop_files)
+        return false;
+
+    for (char **pattern = settings->drop_files; *pattern; ++pattern)
+        if (fnmatch(*pattern, name, 0) == 0)
+            return true;
+
+    return false;
+}
+
+/* Returns how many bytes of the segment to keep */
+static off_t segment_keep(struct core_filter *filter, const ElfW(Phdr) *phdr,
+        const unsigned long *sps, unsigned sp_count, off_t *heap_left)
+{
+    off_t size = phdr->p_filesz;
+    if (size == 0)
+        return 0;
+
+    unsigned long start = phdr->p_vaddr;
+    unsigned long end = phdr->p_vaddr + phdr->p_memsz;
+    if (contains_stack_pointer(sps, sp_count, start, end))
+        return size;
+
+    const struct mapping *m = find_mapping(filter, start);
+    if (!m)
+        return size;
+
+    if (m->name[0] == '/')
+    {
+        /* DSOs, executable and other files */
+        if (is_dropped_file(filter->settings, m->name))
+            return 0;
+        return size;
+    }
+
+    /* [stack], [vdso], [vvar], [vsyscall], ... */
+    if (m->name[0] == '[' && strcmp(m->name, "[heap]") != 0)
+        return size;
+
+    /* Heap and anonymous mappings */
+    if (*heap_left < 0)
+        return size;
+    off_t keep = (size < *heap_left) ? size : *heap_left;
+    keep &= ~(off_t)(getpagesize() - 1);
+    *heap_left -= keep;
+    return keep;
+}
+
+static int emit(struct core_filter *filter, const void *buf, size_t size)
+{
+    if (size == 0)
+        return 0;
+    filter->stats.out_size += size;
+    return filter->write(filter->write_param, buf, size);
+}
+
+static int start_passthrough(struct core_filter *filter)
+{
+    filter->state = STATE_PASSTHROUGH;
+    filter->stats.passthrough = true;
+    int r = emit(filter, filter->header, filter->header_len);
+    free(filter->header);
+    filter->header = NULL;
+    filter->header_len = 0;
+    return r;
+}
+
+static int feed_segments(struct core_filter *filter, const char *buf, size_t size);
+
+/* Called when the whole header is buffered */
+static int start_segments(struct core_filter *filter)
+{
+    ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)filter->header;
+    ElfW(Phdr) *phdrs = (ElfW(Phdr) *)(filter->header + ehdr->e_phoff);
+    size_t header_size = filter->header_size;
+    off_t page_size = getpagesize();
+
+    unsigned sp_count = 0;
+    unsigned long *sps = NULL;
+    for (unsigned i = 0; i < ehdr->e_phnum; ++i)
+    {
+        if (phdrs[i].p_type != PT_NOTE)
+            continue;
+        free(sps);
+        /* There is one PT_NOTE in kernel's cores */
+        sps = collect_stack_pointers(filter->header + phdrs[i].p_offset, phdrs[i].p_filesz, &sp_count);
+    }
+
+    filter->segments = xzalloc(ehdr->e_phnum * sizeof(filter->segments[0]));
+    off_t heap_left = filter->settings->heap_limit;
+    off_t out_offset = (header_size + page_size - 1) & ~(page_size - 1);
+    off_t prev_in_end = header_size;
+    for (unsigned i = 0; i < ehdr->e_phnum; ++i)
+    {
+        ElfW(Phdr) *phdr = &phdrs[i];
+        if (phdr->p_type != PT_LOAD)
+            continue;
+
+        if ((off_t)phdr->p_offset < prev_in_end)
+        {
+            /* Not in file order, we can't stream it */
+            free(sps);
+            free(filter->segments);
+            filter->segments = NULL;
+            filter->segment_count = 0;
+            return start_passthrough(filter);
+        }
+        prev_in_end = phdr->p_offset + phdr->p_filesz;
+
+        off_t keep = segment_keep(filter, phdr, sps, sp_count, &heap_left);
+        filter->stats.segments++;
+        if (keep == 0 && phdr->p_filesz != 0)
+            filter->stats.dropped_segments++;
+        else if (keep < (off_t)phdr->p_filesz)
+            filter->stats.truncated_segments++;
+
+        struct segment *seg = &filter->segments[filter->segment_count++];
+        seg->in_offset = phdr->p_offset;
+        seg->keep = keep;
+        seg->out_offset = out_offset;
+
+        /* p_memsz stays, the rest of the segment reads as zeros */
+        phdr->p_offset = out_offset;
+        phdr->p_filesz = keep;
+        out_offset = (out_offset + keep + page_size - 1) & ~(page_size - 1);
+    }
+    free(sps);
+
+    /* Header and notes are not modified, only program headers */
+    char *buffered = filter->header;
+    size_t buffered_len = filter->header_len;
+    filter->header = NULL;
+    filter->header_len = 0;
+    filter->state = STATE_SEGMENTS;
+    filter->in_pos = header_size;
+    filter->out_pos = header_size;
+
+    int r = emit(filter, buffered, header_size);
+    if (r == 0)
+        r = feed_segments(filter, buffered + header_size, buffered_len - header_size);
+    free(buffered);
+    return r;
+}
+
+/* Returns how many bytes of the header we need to look at next,
+ * or -1 if this is not a core we can filter. *complete is set when
+ * the returned size covers ELF header, program headers and notes.
+ */
+static ssize_t header_target(const struct core_filter *filter, bool *complete)
+{
+    *complete = false;
+
+    const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *)filter->header;
+    if (filter->header_len < sizeof(*ehdr))
+        return sizeof(*ehdr);
+
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+     || ehdr->e_ident[EI_CLASS] != (sizeof(long) == 8 ? ELFCLASS64 : ELFCLASS32)
+     || ehdr->e_type != ET_CORE
+     || ehdr->e_phentsize != sizeof(ElfW(Phdr))
+     || ehdr->e_phnum == PN_XNUM
+     || ehdr->e_phoff < sizeof(*ehdr)
+     || ehdr->e_phoff % sizeof(long) != 0
+    ) {
+        return -1;
+    }
+
+    size_t phdrs_end = ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof(ElfW(Phdr));
+    if (phdrs_end > MAX_HEADER_SIZE)
+        return -1;
+    if (filter->header_len < phdrs_end)
+        return phdrs_end;
+
+    /* Notes follow program headers */
+    size_t end = phdrs_end;
+    const ElfW(Phdr) *phdrs = (const ElfW(Phdr) *)(filter->header + ehdr->e_phoff);
+    for (unsigned i = 0; i < ehdr->e_phnum; ++i)
+    {
+        if (phdrs[i].p_type != PT_NOTE)
+            continue;
+        size_t note_end = phdrs[i].p_offset + phdrs[i].p_filesz;
+        if (note_end > MAX_HEADER_SIZE || phdrs[i].p_offset < phdrs_end)
+            return -1;
+        if (note_end > end)
+            end = note_end;
+    }
+    *complete = true;
+    return end;
+}
+
+static int feed_header(struct core_filter *filter, const char *buf, size_t size)
+{
+    while (1)
+    {
+        bool complete;
+        ssize_t target = header_target(filter, &complete);
+        if (target < 0)
+        {
+            if (start_passthrough(filter) != 0)
+                return -1;
+            return emit(filter, buf, size);
+        }
+
+        size_t len = 0;
+        if ((size_t)target > filter->header_len)
+            len = target - filter->header_len;
+        if (len > size)
+            len = size;
+        if (complete && len == target - filter->header_len)
+        {
+            /* The rest of buf belongs to segments, keep it too */
+            len = size;
+        }
+
+        filter->header = xrealloc(filter->header, filter->header_len + len);
+        memcpy(filter->header + filter->header_len, buf, len);
+        filter->header_len += len;
+        buf += len;
+        size -= len;
+
+        if (complete && filter->header_len >= (size_t)target)
+        {
+            filter->header_size = target;
+            return start_segments(filter);
+        }
+        if (size == 0)
+            return 0;
+    }
+}
+
+static int feed_segments(struct core_filter *filter, const char *buf, size_t size)
+{
+    while (size != 0)
+    {
+        while (filter->cur_segment < filter->segment_count)
+        {
+            const struct segment *seg = &filter->segments[filter->cur_segment];
+            if (filter->in_pos < seg->in_offset + seg->keep)
+                break;
+            filter->cur_segment++;
+        }
+        if (filter->cur_segment == filter->segment_count)
+            return 0; /* the rest is dropped */
+
+        const struct segment *seg = &filter->segments[filter->cur_segment];
+        if (filter->in_pos < seg->in_offset)
+        {
+            /* padding or dropped data */
+            off_t skip = seg->in_offset - filter->in_pos;
+            if ((size_t)skip > size)
+                skip = size;
+            filter->in_pos += skip;
+            buf += skip;
+            size -= skip;
+            continue;
+        }
+
+        off_t out_target = seg->out_offset + (filter->in_pos - seg->in_offset);
+        if (filter->out_pos < out_target)
+        {
+            /* alignment padding */
+            filter->stats.out_size += out_target - filter->out_pos;
+            if (filter->write(filter->write_param, NULL, out_target - filter->out_pos) != 0)
+                return -1;
+            filter->out_pos = out_target;
+        }
+
+        off_t len = seg->in_offset + seg->keep - filter->in_pos;
+        if ((size_t)len > size)
+            len = size;
+        if (emit(filter, buf, len) != 0)
+            return -1;
+        filter->in_pos += len;
+        filter->out_pos += len;
+        buf += len;
+        size -= len;
+    }
+    return 0;
+}
+
+struct core_filter *core_filter_new(const struct core_filter_settings *settings,
+        const char *maps, core_filter_write_fn write, void *write_param)
+{
+    struct core_filter *filter = xzalloc(sizeof(*filter));
+    filter->settings = settings;
+    filter->write = write;
+    filter->write_param = write_param;
+    filter->state = STATE_HEADER;
+    parse_maps(filter, maps);
+    return filter;
+}
+
+int core_filter_feed(struct core_filter *filter, const void *buf, size_t size)
+{
+    filter->stats.in_size += size;
+
+    switch (filter->state)
+    {
+        case STATE_HEADER:
+            return feed_header(filter, buf, size);
+        case STATE_SEGMENTS:
+            return feed_segments(filter, buf, size);
+        default:
+            return emit(filter, buf, size);
+    }
+}
+
+int core_filter_finish(struct core_filter *filter, struct core_filter_stats *stats)
+{
+    int r = 0;
+    /* Truncated core, too short to see all notes */
+    if (filter->state == STATE_HEADER)
+        r = start_passthrough(filter);
+
+    if (stats)
+        *stats = filter->stats;
+    return r;
+}
+
+void core_filter_free(struct core_filter *filter)
+{
+    if (!filter)
+        return;
+
+    for (unsigned i = 0; i < filter->map_count; ++i)
+        free(filter->maps[i].name);
+    free(filter->maps);
+    free(filter->segments);
+    free(filter->header);
+    free(filter);
+}
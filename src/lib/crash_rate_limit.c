@@ -0,0 +1,229 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Crash storm suppression
+ *
+ * Every crash must pass two token buckets: one of the crashed executable
+ * and one of the uid it ran under. A bucket holds up to "burst" tokens and
+ * regains one token every "interval" seconds. A crash takes one token from
+ * both buckets, if either of them is empty the crash is not saved.
+ *
+ * Kernel oopses and Xorg crashes are not crashes of a user's process,
+ * they are checked against the key bucket only.
+ *
+ * The buckets live in a small hash table in a mmap()ed file in /var/run, so
+ * that the check costs no disk writes. Each bucket is stored as the single
+ * timestamp at which it will be full again (the "theoretical arrival time"
+ * of the generic cell rate algorithm). The table is flock()ed for the short
+ * time it is updated. When a probe sequence is full, the bucket which is
+ * full again for the longest time is reused - forgetting such bucket loses
+ * no information.
+ */
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "libabrt.h"
+
+#define CRASH_RATE_FILE    VAR_RUN"/abrt/crash-rate"
+#define CRASH_RATE_MAGIC   0x63726174 /* "crat" */
+#define CRASH_RATE_VERSION 1
+#define CRASH_RATE_SLOTS   512
+#define CRASH_RATE_PROBES  16
+
+struct crash_rate_slot {
+    uint64_t key;       /* 0: unused */
+    int64_t full_at;    /* ms since the epoch */
+};
+
+struct crash_rate_table {
+    uint32_t magic;
+    uint32_t version;
+    struct crash_rate_slot slots[CRASH_RATE_SLOTS];
+};
+
+/* FNV-1a */
+static uint64_t crash_rate_key(const char *prefix, const char *str)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *s = prefix; *s; ++s)
+        h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+    for (const char *s = str; *s; ++s)
+        h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+    return h ? h : 1;
+}
+
+/* "taken" is a slot found earlier for the same crash, it must not be reused */
+static struct crash_rate_slot *find_slot(struct crash_rate_table *table, uint64_t key, int64_t now,
+        const struct crash_rate_slot *taken)
+{
+    struct crash_rate_slot *victim = NULL;
+    for (unsigned i = 0; i < CRASH_RATE_PROBES; ++i)
+    {
+        struct crash_rate_slot *slot = &table->slots[(key + i) % CRASH_RATE_SLOTS];
+        if (slot->key == key)
+            return slot;
+        if (slot == taken)
+            continue;
+        if (slot->key == 0)
+        {
+            if (!victim || victim->key != 0)
+                victim = slot;
+        }
+        else if (!victim || (victim->key != 0 && slot->full_at < victim->full_at))
+            victim = slot;
+    }
+
+    victim->key = key;
+    victim->full_at = now;
+    return victim;
+}
+
+/* Returns the new value of full_at or -1 if the bucket is empty */
+static int64_t take_token(const struct crash_rate_slot *slot, int64_t now, unsigned burst, unsigned interval)
+{
+    int64_t interval_ms = (int64_t)interval * 1000;
+    int64_t full_at = slot->full_at;
+    /* Also catches the clock going backwards */
+    if (full_at < now || full_at > now + burst * interval_ms)
+        full_at = now;
+    full_at += interval_ms;
+    if (full_at - now > burst * interval_ms)
+        return -1;
+    return full_at;
+}
+
+static struct crash_rate_table *open_table(int *fd_p)
+{
+    int fd = open(CRASH_RATE_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        /* Happens when run by an unprivileged user */
+        log_notice("Can't open '%s': %s", CRASH_RATE_FILE, strerror(errno));
+        return NULL;
+    }
+    if (flock_with_timeout(fd, LOCK_EX, 1) != 0)
+    {
+        perror_msg("Can't lock '%s'", CRASH_RATE_FILE);
+        goto err;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0
+     || (sb.st_size != sizeof(struct crash_rate_table)
+        && ftruncate(fd, sizeof(struct crash_rate_table)) != 0)
+    ) {
+        perror_msg("Can't resize '%s'", CRASH_RATE_FILE);
+        goto err;
+    }
+
+    struct crash_rate_table *table = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (table == MAP_FAILED)
+    {
+        perror_msg("Can't mmap '%s'", CRASH_RATE_FILE);
+        goto err;
+    }
+
+    if (table->magic != CRASH_RATE_MAGIC || table->version != CRASH_RATE_VERSION)
+    {
+        memset(table, 0, sizeof(*table));
+        table->magic = CRASH_RATE_MAGIC;
+        table->version = CRASH_RATE_VERSION;
+    }
+
+    *fd_p = fd;
+    return table;
+
+ err:
+    close(fd);
+    return NULL;
+}
+
+static int check_buckets(const char *key, uid_t uid, bool with_uid)
+{
+    bool check_key = (g_settings_crash_rate_burst != 0 && g_settings_crash_rate_interval != 0);
+    bool check_uid = with_uid
+            && (g_settings_crash_rate_uid_burst != 0 && g_settings_crash_rate_uid_interval != 0);
+    if (!check_key && !check_uid)
+        return 0;
+
+    int fd;
+    struct crash_rate_table *table = open_table(&fd);
+    if (!table) /* don't lose crashes because of us */
+        return 0;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    int64_t now = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+    int suppressed = 0;
+    struct crash_rate_slot *key_slot = NULL, *uid_slot = NULL;
+    int64_t key_full_at = 0, uid_full_at = 0;
+    if (check_key)
+    {
+        key_slot = find_slot(table, crash_rate_key("key:", key), now, NULL);
+        key_full_at = take_token(key_slot, now, g_settings_crash_rate_burst, g_settings_crash_rate_interval);
+        if (key_full_at < 0)
+        {
+            error_msg("Not saving repeating crash in '%s'", key);
+            suppressed = 1;
+        }
+    }
+    if (check_uid && !suppressed)
+    {
+        char uid_str[sizeof(long) * 3 + 2];
+        sprintf(uid_str, "%lu", (long)uid);
+        uid_slot = find_slot(table, crash_rate_key("uid:", uid_str), now, key_slot);
+        uid_full_at = take_token(uid_slot, now, g_settings_crash_rate_uid_burst, g_settings_crash_rate_uid_interval);
+        if (uid_full_at < 0)
+        {
+            error_msg("Not saving crash in '%s', too many crashes of uid %lu", key, (long)uid);
+            suppressed = 1;
+        }
+    }
+
+    /* Take the tokens only if the crash passed both buckets */
+    if (!suppressed)
+    {
+        if (key_slot)
+            key_slot->full_at = key_full_at;
+        if (uid_slot)
+            uid_slot->full_at = uid_full_at;
+    }
+
+    munmap(table, sizeof(*table));
+    close(fd);
+    return suppressed;
+}
+
+int crash_rate_limit_check(const char *key, uid_t uid)
+{
+    return check_buckets(key, uid, /*with_uid:*/ true);
+}
+
+int crash_rate_limit_check_key(const char *key)
+{
+    return check_buckets(key, /*uid:*/ 0, /*with_uid:*/ false);
+}
+
+/* Kept for the programs linked against older libabrt, filename is not used
+ * anymore, the crash counts against the executable's bucket */
+int check_recent_crash_file(const char *filename, const char *executable)
+{
+    return crash_rate_limit_check_key(executable);
+}
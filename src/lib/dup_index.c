@@ -0,0 +1,507 @@
+/*
+    Copyright (C) 2014  ABRT team
+    Copyright (C) 2014  RedHat Inc
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Duplicate index
+ *
+ * The index lives in DumpLocation/.dup-index/ and consists of one bucket file
+ * per (uid, analyzer, executable) triple. Bucket files are named after SHA1 of
+ * the triple and contain one line per problem directory:
+ *
+ *   <dir basename> TAB <uuid> TAB <crash thread fingerprint> LF
+ *
+ * Empty columns mean "not available". The index is only a hint: consumers
+ * must verify that a candidate directory still exists and still matches.
+ *
+ * The file "valid" is created after a complete rebuild. The index is
+ * considered stale when the file is missing (abrtd removes it on startup,
+ * because directories could have been created or deleted behind our back).
+ *
+ * Locking:
+ * - bucket files are flock()ed for the short time they are read or modified,
+ * - "<bucket>.lock" files serialize post-create of problems of the same
+ *   bucket, because only these can be duplicates of each other,
+ * - "lock" is held shared by everybody holding a bucket lock and exclusively
+ *   while the index is rebuilt.
+ * flock() locks are released by kernel when their owner dies, hence there are
+ * no stale locks to clean up.
+ */
+
+#include <sys/file.h>
+#include "internal_libabrt.h"
+
+#define DUP_INDEX_DIR ".dup-index"
+#define DUP_INDEX_VALID_FILE "valid"
+#define DUP_INDEX_LOCK_FILE "lock"
+#define DUP_INDEX_LOCK_SUFFIX ".lock"
+#define DUP_INDEX_COLUMN_DELIMITER '\t'
+
+/* Version of the bucket file format. Stored in the "valid" file. */
+#define DUP_INDEX_VERSION "1"
+
+#define DUP_INDEX_DD_OPEN_FLAGS (DD_OPEN_READONLY | DD_FAIL_QUIETLY_ENOENT | DD_FAIL_QUIETLY_EACCES)
+#define DUP_INDEX_DD_LOAD_TEXT_FLAGS (DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE | DD_FAIL_QUIETLY_ENOENT | DD_FAIL_QUIETLY_EACCES)
+
+static char *dup_index_dir_path(const char *dump_location)
+{
+    return concat_path_file(dump_location, DUP_INDEX_DIR);
+}
+
+char *dup_index_bucket_path(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable)
+{
+    sha1_ctx_t ctx;
+    sha1_begin(&ctx);
+    /* NUL bytes work as separators, they can't occur in any of the values */
+    sha1_hash(&ctx, uid ? uid : "", strlen(uid ? uid : "") + 1);
+    sha1_hash(&ctx, analyzer ? analyzer : "", strlen(analyzer ? analyzer : "") + 1);
+    /* Missing executable differs from the empty one */
+    if (executable)
+        sha1_hash(&ctx, executable, strlen(executable) + 1);
+
+    char hash_bytes[SHA1_RESULT_LEN];
+    sha1_end(&ctx, hash_bytes);
+
+    char hash_str[SHA1_RESULT_LEN*2 + 1];
+    *bin2hex(hash_str, hash_bytes, SHA1_RESULT_LEN) = '\0';
+
+    char *dir = dup_index_dir_path(dump_location);
+    char *path = concat_path_file(dir, hash_str);
+    free(dir);
+    return path;
+}
+
+static void dummy_handler(int sig_unused) {}
+
+int flock_with_timeout(int fd, int operation, unsigned timeout_sec)
+{
+    if (timeout_sec == 0)
+        return flock(fd, operation);
+
+    /* Don't restart flock() after SIGALRM */
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dummy_handler;
+    sigaction(SIGALRM, &sa, &old_sa);
+    const time_t started = time(NULL);
+    unsigned old_alarm = alarm(timeout_sec);
+
+    int r = flock(fd, operation);
+    int sv_errno = errno;
+
+    alarm(0);
+    sigaction(SIGALRM, &old_sa, NULL);
+    if (old_alarm)
+    {
+        /* The previous alarm kept running while we waited */
+        const time_t elapsed = time(NULL) - started;
+        if (elapsed >= (time_t)old_alarm)
+            raise(SIGALRM);
+        else
+            alarm(old_alarm - elapsed);
+    }
+
+    if (r != 0 && sv_errno == EINTR)
+        sv_errno = ETIMEDOUT;
+    errno = sv_errno;
+    return r;
+}
+
+static int dup_index_open_lock(const char *path, int operation, unsigned timeout_sec)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        perror_msg("Can't open '%s'", path);
+        return -1;
+    }
+
+    if (flock_with_timeout(fd, operation, timeout_sec) != 0)
+    {
+        if (errno == ETIMEDOUT)
+            error_msg("Timed out waiting for '%s'", path);
+        else
+            perror_msg("Can't lock '%s'", path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int dup_index_mkdir(const char *dump_location)
+{
+    char *dir = dup_index_dir_path(dump_location);
+    int r = 0;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+    {
+        perror_msg("Can't create '%s'", dir);
+        r = -1;
+    }
+    free(dir);
+    return r;
+}
+
+int dup_index_lock_global(const char *dump_location, int operation, unsigned timeout_sec)
+{
+    if (dup_index_mkdir(dump_location) != 0)
+        return -1;
+
+    char *dir = dup_index_dir_path(dump_location);
+    char *lock_file = concat_path_file(dir, DUP_INDEX_LOCK_FILE);
+    free(dir);
+
+    int fd = dup_index_open_lock(lock_file, operation, timeout_sec);
+    free(lock_file);
+    return fd;
+}
+
+int dup_index_lock_bucket(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable,
+        unsigned timeout_sec)
+{
+    if (dup_index_mkdir(dump_location) != 0)
+        return -1;
+
+    char *bucket = dup_index_bucket_path(dump_location, uid, analyzer, executable);
+    char *lock_file = xasprintf("%s"DUP_INDEX_LOCK_SUFFIX, bucket);
+    free(bucket);
+
+    int fd = dup_index_open_lock(lock_file, LOCK_EX, timeout_sec);
+    free(lock_file);
+    return fd;
+}
+
+void dup_index_unlock(int fd)
+{
+    /* Closing the last descriptor releases flock() */
+    if (fd >= 0)
+        close(fd);
+}
+
+static bool dup_index_value_ok(const char *value)
+{
+    return value && !strchr(value, DUP_INDEX_COLUMN_DELIMITER) && !strchr(value, '\n');
+}
+
+void dup_index_entry_free(struct dup_index_entry *entry)
+{
+    if (!entry)
+        return;
+    free(entry->dirname);
+    free(entry->uuid);
+    free(entry->fingerprint);
+    free(entry);
+}
+
+static struct dup_index_entry *dup_index_parse_line(const char *line)
+{
+    const char *dirname_end = strchr(line, DUP_INDEX_COLUMN_DELIMITER);
+    if (!dirname_end || dirname_end == line)
+        return NULL;
+    const char *uuid = dirname_end + 1;
+    const char *uuid_end = strchr(uuid, DUP_INDEX_COLUMN_DELIMITER);
+    if (!uuid_end)
+        return NULL;
+    const char *fingerprint = uuid_end + 1;
+
+    struct dup_index_entry *entry = xzalloc(sizeof(*entry));
+    entry->dirname = xstrndup(line, dirname_end - line);
+    if (uuid_end != uuid)
+        entry->uuid = xstrndup(uuid, uuid_end - uuid);
+    if (fingerprint[0] != '\0')
+        entry->fingerprint = xstrdup(fingerprint);
+
+    return entry;
+}
+
+bool dup_index_is_valid(const char *dump_location)
+{
+    char *dir = dup_index_dir_path(dump_location);
+    char *valid_file = concat_path_file(dir, DUP_INDEX_VALID_FILE);
+    free(dir);
+
+    char *version = xmalloc_open_read_close(valid_file, /*maxsize:*/ NULL);
+    free(valid_file);
+
+    bool valid = (version && strcmp(version, DUP_INDEX_VERSION) == 0);
+    free(version);
+
+    return valid;
+}
+
+void dup_index_invalidate(const char *dump_location)
+{
+    char *dir = dup_index_dir_path(dump_location);
+    char *valid_file = concat_path_file(dir, DUP_INDEX_VALID_FILE);
+    free(dir);
+
+    if (unlink(valid_file) != 0 && errno != ENOENT)
+        perror_msg("Can't remove '%s'", valid_file);
+
+    free(valid_file);
+}
+
+int dup_index_reset(const char *dump_location)
+{
+    dup_index_invalidate(dump_location);
+
+    if (dup_index_mkdir(dump_location) != 0)
+        return -1;
+
+    char *dir = dup_index_dir_path(dump_location);
+    DIR *dp = opendir(dir);
+    if (!dp)
+    {
+        perror_msg("Can't open directory '%s'", dir);
+        free(dir);
+        return -1;
+    }
+
+    struct dirent *dent;
+    while ((dent = readdir(dp)) != NULL)
+    {
+        if (dot_or_dotdot(dent->d_name))
+            continue;
+
+        /* Lock files may be held by others */
+        if (strcmp(dent->d_name, DUP_INDEX_LOCK_FILE) == 0)
+            continue;
+        const char *ext = strrchr(dent->d_name, '.');
+        if (ext && strcmp(ext, DUP_INDEX_LOCK_SUFFIX) == 0)
+            continue;
+
+        char *bucket = concat_path_file(dir, dent->d_name);
+        if (unlink(bucket) != 0 && errno != ENOENT)
+            perror_msg("Can't remove '%s'", bucket);
+        free(bucket);
+    }
+    closedir(dp);
+    free(dir);
+
+    return 0;
+}
+
+void dup_index_mark_valid(const char *dump_location)
+{
+    char *dir = dup_index_dir_path(dump_location);
+    char *valid_file = concat_path_file(dir, DUP_INDEX_VALID_FILE);
+    free(dir);
+
+    int fd = open(valid_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || full_write_str(fd, DUP_INDEX_VERSION) < 0)
+        perror_msg("Can't write '%s'", valid_file);
+    if (fd >= 0)
+        close(fd);
+
+    free(valid_file);
+}
+
+GList *dup_index_get_bucket(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable)
+{
+    char *bucket = dup_index_bucket_path(dump_location, uid, analyzer, executable);
+    int fd = open(bucket, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            perror_msg("Can't open duplicate index bucket '%s'", bucket);
+        free(bucket);
+        return NULL;
+    }
+    /* Don't read half written lines */
+    flock(fd, LOCK_SH);
+    FILE *fp = fdopen(fd, "r");
+    if (!fp)
+    {
+        perror_msg("Can't open duplicate index bucket '%s'", bucket);
+        close(fd);
+        free(bucket);
+        return NULL;
+    }
+
+    /* A directory can be listed more than once if it was indexed by a rebuild
+     * and then by its own post-create. The last line wins.
+     */
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    GList *entries = NULL;
+    unsigned line_num = 0;
+    char *line;
+    while ((line = xmalloc_fgetline(fp)) != NULL)
+    {
+        ++line_num;
+        struct dup_index_entry *entry = dup_index_parse_line(line);
+        free(line);
+        if (!entry)
+        {
+            log_notice("Malformed line %u in duplicate index bucket '%s'", line_num, bucket);
+            continue;
+        }
+
+        GList *old = g_hash_table_lookup(seen, entry->dirname);
+        if (old)
+        {
+            struct dup_index_entry *prev = old->data;
+            old->data = entry;
+            /* Must not keep the key of the freed entry */
+            g_hash_table_replace(seen, entry->dirname, old);
+            dup_index_entry_free(prev);
+        }
+        else
+        {
+            entries = g_list_prepend(entries, entry);
+            g_hash_table_insert(seen, entry->dirname, entries);
+        }
+    }
+    g_hash_table_destroy(seen);
+    fclose(fp);
+    free(bucket);
+
+    return g_list_reverse(entries);
+}
+
+void dup_index_add(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable,
+        const struct dup_index_entry *entry)
+{
+    const char *dirname = strrchr(entry->dirname, '/');
+    dirname = dirname ? dirname + 1 : entry->dirname;
+    if (!dup_index_value_ok(dirname))
+    {
+        log_notice("Won't add '%s' to the duplicate index: bad name", entry->dirname);
+        return;
+    }
+
+    if (dup_index_mkdir(dump_location) != 0)
+        return;
+
+    char *bucket = dup_index_bucket_path(dump_location, uid, analyzer, executable);
+    int fd = open(bucket, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        perror_msg("Can't open duplicate index bucket '%s'", bucket);
+        free(bucket);
+        return;
+    }
+
+    /* Values which would break the line format are not indexed; the lookup
+     * then falls back to loading the data from the problem directory.
+     */
+    char *line = xasprintf("%s%c%s%c%s\n", dirname,
+            DUP_INDEX_COLUMN_DELIMITER, dup_index_value_ok(entry->uuid) ? entry->uuid : "",
+            DUP_INDEX_COLUMN_DELIMITER, dup_index_value_ok(entry->fingerprint) ? entry->fingerprint : "");
+
+    flock(fd, LOCK_EX);
+    if (full_write_str(fd, line) < 0)
+        perror_msg("Can't write to duplicate index bucket '%s'", bucket);
+
+    free(line);
+    close(fd);
+    free(bucket);
+}
+
+void dup_index_remove(const char *dump_location,
+        const char *uid, const char *analyzer, const char *executable,
+        const char *dump_dir_name)
+{
+    const char *dirname = strrchr(dump_dir_name, '/');
+    dirname = dirname ? dirname + 1 : dump_dir_name;
+    const size_t dirname_len = strlen(dirname);
+
+    char *bucket = dup_index_bucket_path(dump_location, uid, analyzer, executable);
+    /* The bucket is rewritten in place, renaming a new file over it would
+     * break flock() of concurrent appenders.
+     */
+    int fd = open(bucket, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            perror_msg("Can't open duplicate index bucket '%s'", bucket);
+        free(bucket);
+        return;
+    }
+    flock(fd, LOCK_EX);
+
+    char *content = xmalloc_read(fd, /*maxsize:*/ NULL);
+    if (!content)
+    {
+        perror_msg("Can't read duplicate index bucket '%s'", bucket);
+        goto ret;
+    }
+
+    struct strbuf *new_content = strbuf_new();
+    bool found = false;
+    char *line = content;
+    while (*line != '\0')
+    {
+        char *line_end = strchrnul(line, '\n');
+        if (strncmp(line, dirname, dirname_len) == 0
+         && line[dirname_len] == DUP_INDEX_COLUMN_DELIMITER)
+        {
+            found = true;
+        }
+        else if (line_end != line)
+        {
+            strbuf_append_strf(new_content, "%.*s\n", (int)(line_end - line), line);
+        }
+        line = *line_end ? line_end + 1 : line_end;
+    }
+
+    if (found)
+    {
+        if (lseek(fd, 0, SEEK_SET) != 0
+         || ftruncate(fd, 0) != 0
+         || full_write(fd, new_content->buf, new_content->len) < 0
+        ) {
+            perror_msg("Can't write to duplicate index bucket '%s'", bucket);
+        }
+    }
+
+    strbuf_free(new_content);
+    free(content);
+ ret:
+    close(fd);
+    free(bucket);
+}
+
+void dup_index_forget_dump_dir(const char *dump_location, const char *dump_dir_name)
+{
+    /* Nothing to update if the index was never built */
+    char *dir = dup_index_dir_path(dump_location);
+    bool has_index = (access(dir, F_OK) == 0);
+    free(dir);
+    if (!has_index)
+        return;
+
+    struct dump_dir *dd = dd_opendir(dump_dir_name, DUP_INDEX_DD_OPEN_FLAGS);
+    if (!dd)
+        return;
+
+    char *uid = dd_load_text_ext(dd, FILENAME_UID, DUP_INDEX_DD_LOAD_TEXT_FLAGS);
+    char *analyzer = dd_load_text_ext(dd, FILENAME_ANALYZER, DUP_INDEX_DD_LOAD_TEXT_FLAGS);
+    char *executable = dd_load_text_ext(dd, FILENAME_EXECUTABLE, DUP_INDEX_DD_LOAD_TEXT_FLAGS);
+    dd_close(dd);
+
+    if (uid && analyzer)
+        dup_index_remove(dump_location, uid, analyzer, executable, dump_dir_name);
+
+    free(executable);
+    free(analyzer);
+    free(uid);
+}
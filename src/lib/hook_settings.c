@@ -0,0 +1,204 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include <sys/file.h>
+#include "libabrt.h"
+
+/* abrt-hook-ccpp runs while the crashed process is stuck in exit, so it must
+ * start fast. Instead of parsing abrt.conf and CCpp.conf on every crash it
+ * reads a binary snapshot of the parsed settings which abrtd keeps up to
+ * date. The snapshot records stat data of the config files it was made from
+ * and it is used only if none of them changed since.
+ *
+ * abrtd holds an exclusive flock on the snapshot while it runs, which
+ * the hook uses as a cheap check that abrtd is alive.
+ */
+
+#define HOOK_SETTINGS_MAGIC   0x61627274 /* "abrt" */
+#define HOOK_SETTINGS_VERSION 2
+#define HOOK_SETTINGS_FILE    VAR_RUN"/abrt/hook-settings"
+
+static const char *const config_files[HOOK_SETTINGS_SOURCES] = {
+    DEFAULT_CONF_DIR"/abrt.conf",
+    CONF_DIR"/abrt.conf",
+    DEFAULT_PLUGINS_CONF_DIR"/CCpp.conf",
+    PLUGINS_CONF_DIR"/CCpp.conf",
+};
+
+static void stat_sources(struct hook_settings_source sources[HOOK_SETTINGS_SOURCES])
+{
+    memset(sources, 0, HOOK_SETTINGS_SOURCES * sizeof(sources[0]));
+    for (unsigned i = 0; i < HOOK_SETTINGS_SOURCES; ++i)
+    {
+        struct stat sb;
+        if (stat(config_files[i], &sb) != 0)
+            continue;
+        sources[i].exists = 1;
+        sources[i].ino = sb.st_ino;
+        sources[i].size = sb.st_size;
+        sources[i].mtime_sec = sb.st_mtim.tv_sec;
+        sources[i].mtime_nsec = sb.st_mtim.tv_nsec;
+    }
+}
+
+static int parse_ccpp_settings(map_string_t *settings, struct hook_settings *s)
+{
+    int ret = 0;
+    const char *value;
+    value = get_map_string_item_or_NULL(settings, "MakeCompatCore");
+    s->make_compat_core = value && string_to_bool(value);
+    value = get_map_string_item_or_NULL(settings, "SaveBinaryImage");
+    s->save_binary_image = value && string_to_bool(value);
+    value = get_map_string_item_or_NULL(settings, "SaveFullCore");
+    s->save_full_core = value ? string_to_bool(value) : true;
+    value = get_map_string_item_or_NULL(settings, "CreateCoreBacktrace");
+    s->create_core_backtrace = value ? string_to_bool(value) : true;
+
+    value = get_map_string_item_or_NULL(settings, "CoreCompression");
+    if (value && strcmp(value, "xz") == 0)
+        s->core_compression = true;
+    else if (value && strcmp(value, "none") != 0)
+        error_msg("CoreCompression: unsupported method '%s', core won't be compressed", value);
+    value = get_map_string_item_or_NULL(settings, "CoreCompressionLevel");
+    s->core_compression_level = value ? xatoi_positive(value) : 1;
+    if (s->core_compression_level > 9)
+        s->core_compression_level = 9;
+
+    value = get_map_string_item_or_NULL(settings, "CoreFilter");
+    s->core_filter = value && string_to_bool(value);
+    value = get_map_string_item_or_NULL(settings, "CoreFilterHeapLimit");
+    s->core_filter_heap_limit = value ? (long long)xatoi_positive(value) * 1024 * 1024 : -1;
+    value = get_map_string_item_or_NULL(settings, "CoreFilterDropFiles");
+    if (value && strlen(value) >= sizeof(s->core_filter_drop_files))
+    {
+        error_msg("CoreFilterDropFiles is too long, ignoring it");
+        ret = -1;
+    }
+    else if (value)
+        strcpy(s->core_filter_drop_files, value);
+
+    value = get_map_string_item_or_NULL(settings, "VerboseLog");
+    s->verbose_log = value ? xatoi_positive(value) : -1;
+
+    return ret;
+}
+
+int hook_settings_load(struct hook_settings *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->magic = HOOK_SETTINGS_MAGIC;
+    s->version = HOOK_SETTINGS_VERSION;
+    s->size = sizeof(*s);
+
+    /* stat first: if a file changes while we parse it,
+     * the snapshot will be seen as stale */
+    stat_sources(s->sources);
+
+    /* g_settings_* stay loaded, the hook uses them directly */
+    load_abrt_conf();
+    int ret = 0;
+    s->max_crash_reports_size = g_settings_nMaxCrashReportsSize;
+    s->crash_rate_burst = g_settings_crash_rate_burst;
+    s->crash_rate_interval = g_settings_crash_rate_interval;
+    s->crash_rate_uid_burst = g_settings_crash_rate_uid_burst;
+    s->crash_rate_uid_interval = g_settings_crash_rate_uid_interval;
+    if (strlen(g_settings_dump_location) < sizeof(s->dump_location))
+        strcpy(s->dump_location, g_settings_dump_location);
+    else
+        ret = -1;
+
+    map_string_t *settings = new_map_string();
+    load_abrt_plugin_conf_file("CCpp.conf", settings);
+    if (parse_ccpp_settings(settings, s) != 0)
+        ret = -1;
+    free_map_string(settings);
+
+    return ret;
+}
+
+bool hook_settings_is_current(const struct hook_settings *s)
+{
+    struct hook_settings_source sources[HOOK_SETTINGS_SOURCES];
+    stat_sources(sources);
+    return memcmp(sources, s->sources, sizeof(sources)) == 0;
+}
+
+int hook_settings_save(const struct hook_settings *s, int old_lock_fd)
+{
+    int fd = open(HOOK_SETTINGS_FILE".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror_msg("Can't open '%s'", HOOK_SETTINGS_FILE".tmp");
+        return old_lock_fd;
+    }
+
+    /* Lock before the file becomes visible, so that the hook
+     * never sees a snapshot without the lock while we run */
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0
+     || full_write(fd, s, sizeof(*s)) != sizeof(*s)
+     || rename(HOOK_SETTINGS_FILE".tmp", HOOK_SETTINGS_FILE) != 0
+    ) {
+        perror_msg("Can't save '%s'", HOOK_SETTINGS_FILE);
+        unlink(HOOK_SETTINGS_FILE".tmp");
+        close(fd);
+        return old_lock_fd;
+    }
+
+    if (old_lock_fd >= 0)
+        close(old_lock_fd);
+    return fd;
+}
+
+void hook_settings_remove(int lock_fd)
+{
+    unlink(HOOK_SETTINGS_FILE);
+    if (lock_fd >= 0)
+        close(lock_fd);
+}
+
+int hook_settings_read(struct hook_settings *s, bool *abrtd_running)
+{
+    *abrtd_running = false;
+
+    int fd = open(HOOK_SETTINGS_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    /* If we can get shared lock, abrtd doesn't hold the exclusive one */
+    *abrtd_running = (flock(fd, LOCK_SH | LOCK_NB) != 0 && errno == EWOULDBLOCK);
+
+    ssize_t r = read(fd, s, sizeof(*s));
+    close(fd);
+
+    if (r != sizeof(*s)
+     || s->magic != HOOK_SETTINGS_MAGIC
+     || s->version != HOOK_SETTINGS_VERSION
+     || s->size != sizeof(*s)
+     || s->dump_location[sizeof(s->dump_location) - 1] != '\0'
+     || s->core_filter_drop_files[sizeof(s->core_filter_drop_files) - 1] != '\0'
+    ) {
+        return -1;
+    }
+
+    if (!hook_settings_is_current(s))
+    {
+        log_info("'%s' is out of date", HOOK_SETTINGS_FILE);
+        return -1;
+    }
+
+    return 0;
+}
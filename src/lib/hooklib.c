@@ -16,6 +16,7 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 #include <sys/statvfs.h>
+#include <lzma.h>
 #include "internal_libabrt.h"
 
 int low_free_space(unsigned setting_MaxCrashReportsSize, const char *dump_location)
@@ -63,6 +64,10 @@ void trim_problem_dirs(const char *dirname, double cap_size, const char *exclude
     }
     log_debug("excluded_basename:'%s'", excluded_basename);
 
+    if (size_ledger_trim(dirname, cap_size, excluded_basename) == 0)
+        return;
+
+    /* No ledger, walk the whole directory */
     int count = 20;
     while (--count >= 0)
     {
@@ -79,6 +84,7 @@ void trim_problem_dirs(const char *dirname, double cap_size, const char *exclude
                 dirname, cur_size, cap_size / (1024*1024), worst_basename);
         char *d = concat_path_file(dirname, worst_basename);
         free(worst_basename);
+        dup_index_forget_dump_dir(dirname, d);
         delete_dump_dir(d);
         free(d);
     }
@@ -172,14 +178,223 @@ static char* exec_vp(char **args, int redirect_stderr, int exec_timeout_sec, int
     return strbuf_free_nobuf(buf_out);
 }
 
+/* Returns 1 if the block contains only zero bytes */
+static int is_zero_block(const char *block, size_t size)
+{
+    /* Leading bytes up to word alignment */
+    while (size != 0 && ((uintptr_t)block % sizeof(long)) != 0)
+    {
+        if (*block++)
+            return 0;
+        size--;
+    }
+
+    const unsigned long *word = (const unsigned long *)block;
+    const unsigned long *end = word + size / sizeof(long);
+
+    /* Four words per iteration: lets the compiler keep the loop branch-light */
+    while (end - word >= 4)
+    {
+        if (word[0] | word[1] | word[2] | word[3])
+            return 0;
+        word += 4;
+    }
+    while (word < end)
+    {
+        if (*word++)
+            return 0;
+    }
+
+    /* Trailing bytes */
+    block = (const char *)end;
+    size %= sizeof(long);
+    while (size-- != 0)
+    {
+        if (*block++)
+            return 0;
+    }
+    return 1;
+}
+
+int write_sparse(int dst_fd, const char *buffer, size_t size, int *last_was_seek)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t run_start = pos;
+        size_t len = (size - pos >= SPARSE_BLOCK ? SPARSE_BLOCK : size - pos);
+        int sparse = is_zero_block(buffer + pos, len);
+
+        /* extend the run while blocks are of the same kind */
+        pos += len;
+        while (size - pos >= SPARSE_BLOCK
+            && is_zero_block(buffer + pos, SPARSE_BLOCK) == sparse
+        ) {
+            pos += SPARSE_BLOCK;
+        }
+
+        size_t run_len = pos - run_start;
+        if (!sparse)
+        {
+            errno = 0;
+            if (full_write(dst_fd, buffer + run_start, run_len) != (ssize_t)run_len)
+            {
+                perror_msg("Write error");
+                return -1;
+            }
+            *last_was_seek = 0;
+        }
+        else
+        {
+            if (lseek(dst_fd, run_len, SEEK_CUR) < 0)
+            {
+                perror_msg("Seek error");
+                return -1;
+            }
+            *last_was_seek = 1;
+        }
+    }
+    return 0;
+}
+
+int finish_sparse(int dst_fd, int last_was_seek)
+{
+    if (last_was_seek)
+    {
+        if (lseek(dst_fd, -1, SEEK_CUR) < 0
+         || safe_write(dst_fd, "", 1) != 1
+        ) {
+            perror_msg("Write error");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int decompress_xz_fd(int src_fd, int dst_fd)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+    if (ret != LZMA_OK)
+    {
+        error_msg("Can't initialize xz decompression (error %d)", (int)ret);
+        return -1;
+    }
+
+    enum { IN_SIZE = 64 * 1024, OUT_SIZE = 1024 * 1024 };
+    uint8_t *inbuf = xmalloc(IN_SIZE);
+    uint8_t *outbuf = xmalloc(OUT_SIZE);
+    int retval = -1;
+    int last_was_seek = 0;
+    lzma_action action = LZMA_RUN;
+
+    strm.next_out = outbuf;
+    strm.avail_out = OUT_SIZE;
+    while (1)
+    {
+        if (strm.avail_in == 0 && action == LZMA_RUN)
+        {
+            ssize_t rd = safe_read(src_fd, inbuf, IN_SIZE);
+            if (rd < 0)
+            {
+                perror_msg("Read error");
+                goto ret;
+            }
+            if (rd == 0)
+                action = LZMA_FINISH;
+            strm.next_in = inbuf;
+            strm.avail_in = rd;
+        }
+
+        ret = lzma_code(&strm, action);
+
+        if (strm.avail_out == 0 || ret == LZMA_STREAM_END)
+        {
+            if (write_sparse(dst_fd, (const char *)outbuf, OUT_SIZE - strm.avail_out, &last_was_seek) != 0)
+                goto ret;
+            strm.next_out = outbuf;
+            strm.avail_out = OUT_SIZE;
+        }
+
+        if (ret == LZMA_STREAM_END)
+            break;
+        if (ret != LZMA_OK)
+        {
+            error_msg("xz decompression failed (error %d)", (int)ret);
+            goto ret;
+        }
+    }
+
+    /* The data could have ended with a hole */
+    if (finish_sparse(dst_fd, last_was_seek) != 0)
+        goto ret;
+    retval = 0;
+
+ ret:
+    free(outbuf);
+    free(inbuf);
+    lzma_end(&strm);
+    return retval;
+}
+
+char *get_coredump_path(const char *dump_dir_name, bool *is_temporary)
+{
+    *is_temporary = false;
+
+    char *path = concat_path_file(dump_dir_name, FILENAME_COREDUMP);
+    if (access(path, F_OK) == 0)
+        return path;
+
+    char *xz_path = concat_path_file(dump_dir_name, FILENAME_COREDUMP_XZ);
+    int src_fd = open(xz_path, O_RDONLY);
+    if (src_fd < 0)
+    {
+        /* Neither exists, let the caller fail on the plain name */
+        free(xz_path);
+        return path;
+    }
+    free(path);
+
+    path = xstrdup(LARGE_DATA_TMP_DIR"/abrt-coredump-XXXXXX");
+    int dst_fd = mkstemp(path);
+    if (dst_fd < 0)
+    {
+        perror_msg("Can't create temporary file '%s'", path);
+        free(path);
+        path = NULL;
+        goto ret;
+    }
+
+    log_notice("Decompressing '%s' to '%s'", xz_path, path);
+    if (decompress_xz_fd(src_fd, dst_fd) != 0 || close(dst_fd) != 0)
+    {
+        error_msg("Can't decompress '%s'", xz_path);
+        unlink(path);
+        free(path);
+        path = NULL;
+        goto ret;
+    }
+    *is_temporary = true;
+
+ ret:
+    close(src_fd);
+    free(xz_path);
+    return path;
+}
+
 char *run_unstrip_n(const char *dump_dir_name, unsigned timeout_sec)
 {
     int flags = EXECFLG_INPUT_NUL | EXECFLG_OUTPUT | EXECFLG_SETSID | EXECFLG_QUIET;
     VERB1 flags &= ~EXECFLG_QUIET;
+    bool core_is_temporary;
+    char *core_path = get_coredump_path(dump_dir_name, &core_is_temporary);
+    if (!core_path)
+        return NULL;
+
     int pipeout[2];
     char* args[4];
     args[0] = (char*)"eu-unstrip";
-    args[1] = xasprintf("--core=%s/"FILENAME_COREDUMP, dump_dir_name);
+    args[1] = xasprintf("--core=%s", core_path);
     args[2] = (char*)"-n";
     args[3] = NULL;
     pid_t child = fork_execv_on_steroids(flags, args, pipeout, /*env_vec:*/ NULL, /*dir:*/ NULL, /*uid(unused):*/ 0);
@@ -229,6 +444,10 @@ char *run_unstrip_n(const char *dump_dir_name, unsigned timeout_sec)
     int status;
     safe_waitpid(child, &status, 0);
 
+    if (core_is_temporary)
+        unlink(core_path);
+    free(core_path);
+
     if (status != 0 || buf_out == NULL)
     {
         /* unstrip didnt exit with exit code 0, or we timed out */
@@ -249,6 +468,14 @@ char *get_backtrace(const char *dump_dir_name, unsigned timeout_sec, const char
     char *executable = dd_load_text(dd, FILENAME_EXECUTABLE);
     dd_close(dd);
 
+    bool core_is_temporary;
+    char *core_path = get_coredump_path(dump_dir_name, &core_is_temporary);
+    if (!core_path)
+    {
+        free(executable);
+        return NULL;
+    }
+
     /* Let user know what's going on */
     log(_("Generating backtrace"));
 
@@ -324,7 +551,7 @@ char *get_backtrace(const char *dump_dir_name, unsigned timeout_sec, const char
 
     args[i++] = (char*)"-ex";
     const unsigned core_cmd_index = i++;
-    args[core_cmd_index] = xasprintf("core-file %s/"FILENAME_COREDUMP, dump_dir_name);
+    args[core_cmd_index] = xasprintf("core-file %s", core_path);
 
     args[i++] = (char*)"-ex";
     const unsigned bt_cmd_index = i++;
@@ -403,6 +630,10 @@ char *get_backtrace(const char *dump_dir_name, unsigned timeout_sec, const char
     free(args[debug_dir_cmd_index]);
     free(args[file_cmd_index]);
     free(args[core_cmd_index]);
+
+    if (core_is_temporary)
+        unlink(core_path);
+    free(core_path);
     return bt;
 }
 
@@ -27,8 +27,39 @@
  */
 #define SANE_MIN_OOPS_LEN 30
 
-static void record_oops(GList **oops_list, const struct abrt_koops_line_info* lines_info, int oopsstart, int oopsend)
+struct koops_parser
 {
+    koops_parser_fn callback;
+    void *param;
+
+    /* Window of lines which still can become a part of an oops,
+     * indexes below are relative to its beginning */
+    struct abrt_koops_line_info *lines;
+    int lines_count;
+    int lines_size;
+
+    /* State of the line analyzer */
+    int cur;
+    int oopsstart;
+    int inbacktrace;
+    char prevlevel;
+
+    /* The line being assembled from the fed data, reused for all lines */
+    char *line;
+    size_t line_len;
+    size_t line_size;
+    int linecount;
+};
+
+/* An oops start is analyzed only when the following lines are known,
+ * its end marker is searched for in them */
+#define KOOPS_END_MARKER_LOOKAHEAD 50
+/* Don't shift the window for every single processed line */
+#define KOOPS_WINDOW_SLACK 64
+
+static void record_oops(struct koops_parser *parser, int oopsstart, int oopsend)
+{
+    const struct abrt_koops_line_info *lines_info = parser->lines;
     int q;
     int len;
     int rv = 1;
@@ -55,10 +86,7 @@ static void record_oops(GList **oops_list, const struct abrt_koops_line_info* li
         }
         if ((dst - oops) > SANE_MIN_OOPS_LEN)
         {
-            *oops_list = g_list_append(
-                        *oops_list,
-                        xasprintf("%s\n%s", (version ? version : ""), oops)
-            );
+            parser->callback(xasprintf("%s\n%s", (version ? version : ""), oops), parser->param);
         }
         else
         {
@@ -126,9 +154,14 @@ static const char *const s_koops_suspicious_strings[] = {
      * if we want more readable data, we must rely on other tools
      * (such as mcelog daemon consuming binary /dev/mcelog and writing
      * human-readable /var/log/mcelog).
+     *
+     * Newer kernels print every non-fatal MCE if nobody consumes them:
+     * arch/x86/kernel/cpu/mcheck/mce.c:	pr_emerg(HW_ERR "CPU %d: Machine Check%s: %Lx Bank %d: %016Lx\n",
+     * (%s is " Exception" for the fatal ones).
      */
     "Machine Check Exception:",
     "Machine check events logged",
+    "Machine Check: ",
 
     /* X86 TRAPs */
     "divide error:",
@@ -147,6 +180,20 @@ static const char *const s_koops_suspicious_strings[] = {
     NULL
 };
 
+/* Compiled s_koops_suspicious_strings, built on first use */
+static bool has_suspicious_string_len(const char *line, size_t len)
+{
+    static struct str_matcher *matcher;
+    if (!matcher)
+        matcher = str_matcher_new(s_koops_suspicious_strings);
+    return str_matcher_find(matcher, line, len) >= 0;
+}
+
+static bool has_suspicious_string(const char *line)
+{
+    return has_suspicious_string_len(line, strlen(line));
+}
+
 void koops_print_suspicious_strings(void)
 {
     koops_print_suspicious_strings_filtered(NULL);
@@ -234,276 +281,517 @@ int koops_line_skip_level(const char **c)
     return linelevel;
 }
 
-void koops_extract_oopses(GList **oops_list, char *buffer, size_t buflen)
+/* Analyzes the line parser->cur, which must have enough lines after it
+ * (see KOOPS_END_MARKER_LOOKAHEAD) unless the input has ended.
+ */
+static void koops_parser_analyze_line(struct koops_parser *parser)
 {
-    char *c;
-    int linecount = 0;
-    int lines_info_size = 0;
-    struct abrt_koops_line_info *lines_info = NULL;
+    const struct abrt_koops_line_info *lines_info = parser->lines;
+    const int lines_info_size = parser->lines_count;
+    int i = parser->cur;
+    char *curline = lines_info[i].ptr;
 
-    /* Split buffer into lines */
+    while (*curline == ' ')
+        curline++;
 
-    if (buflen != 0)
-            buffer[buflen - 1] = '\n';  /* the buffer usually ends with \n, but let's make sure */
-    c = buffer;
-    while (c < buffer + buflen)
+    if (parser->oopsstart < 0)
     {
-        char linelevel;
-        char *c9;
-        char *colon;
-
-        linecount++;
-        c9 = (char*)memchr(c, '\n', buffer + buflen - c); /* a \n will always be found */
-        assert(c9);
-        *c9 = '\0'; /* turn the \n into a string termination */
-        if (c9 == c)
-            goto next_line;
-
-        /* Is it a syslog file (/var/log/messages or similar)?
-         * Even though _usually_ it looks like "Nov 19 12:34:38 localhost kernel: xxx",
-         * some users run syslog in non-C locale:
-         * "2010-02-22T09:24:08.156534-08:00 gnu-4 gnome-session[2048]: blah blah"
-         *  ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^ !!!
-         * We detect it by checking for N:NN:NN pattern in first 15 chars
-         * (and this still is not good enough... false positive: "pci 0000:15:00.0: PME# disabled")
-         */
-        colon = strchr(c, ':');
-        if (colon && colon > c && colon < c + 15
-         && isdigit(colon[-1]) /* N:... */
-         && isdigit(colon[1]) /* ...N:NN:... */
-         && isdigit(colon[2])
-         && colon[3] == ':'
-         && isdigit(colon[4]) /* ...N:NN:NN... */
-         && isdigit(colon[5])
-        ) {
-            /* It's syslog file, not a bare dmesg */
+        /* Find start-of-oops markers */
+        if (has_suspicious_string(curline))
+            parser->oopsstart = i;
+
+        /* Non-fatal MCEs are single lines, the following lines are not
+         * theirs - those can be a fatal MCE, for example */
+        if (parser->oopsstart >= 0
+         && (strstr(curline, "Machine check events logged") || strstr(curline, "Machine Check: ")))
+        {
+            log_debug("Hardware error at line %d: '%s'", i, curline);
+            record_oops(parser, i, i);
+            parser->oopsstart = -1;
+        }
 
-            /* Skip non-kernel lines */
-            char *kernel_str = strstr(c, "kernel: ");
-            if (!kernel_str)
+        if (parser->oopsstart >= 0)
+        {
+            /* debug information */
+            log_debug("Found oops at line %d: '%s'", parser->oopsstart, lines_info[parser->oopsstart].ptr);
+            /* try to find the end marker */
+            int i2 = i + 1;
+            while (i2 < lines_info_size && i2 < (i + KOOPS_END_MARKER_LOOKAHEAD))
             {
-                /* if we see our own marker:
-                 * "hostname abrt: Kerneloops: Reported 1 kernel oopses to Abrt"
-                 * we know we submitted everything upto here already */
-                if (strstr(c, "kernel oopses to Abrt"))
+                if (strstr(lines_info[i2].ptr, "---[ end trace"))
                 {
-                    log_debug("Found our marker at line %d", linecount);
-                    free(lines_info);
-                    lines_info = NULL;
-                    lines_info_size = 0;
-                    list_free_with_free(*oops_list);
-                    *oops_list = NULL;
+                    parser->inbacktrace = 1;
+                    i = i2;
+                    break;
                 }
-                goto next_line;
+                i2++;
             }
-            c = kernel_str + sizeof("kernel: ")-1;
         }
+    }
+
+    /* Are we entering a call trace part? */
+    /* a call trace starts with "Call Trace:" or with the " [<.......>] function+0xFF/0xAA" pattern */
+    if (parser->oopsstart >= 0 && !parser->inbacktrace)
+    {
+        if (strcasestr(curline, "Call Trace:")) /* yes, it must be case-insensitive */
+            parser->inbacktrace = 1;
+        else
+        /* Fatal MCE's have a few lines of useful information between
+         * first "Machine check exception:" line and the final "Kernel panic"
+         * line. Such oops, of course, is only detectable in kdumps (tested)
+         * or possibly pstore-saved logs (I did not try this yet).
+         * In order to capture all these lines, we treat final line
+         * as "backtrace" (which is admittedly a hack):
+         */
+        if (strstr(curline, "Kernel panic - not syncing"))
+            parser->inbacktrace = 1;
+        else
+        if (strnlen(curline, 9) > 8
+         && (  (curline[0] == '(' && curline[1] == '[' && curline[2] == '<')
+            || (curline[0] == '[' && curline[1] == '<'))
+         && strstr(curline, ">]")
+         && strstr(curline, "+0x")
+         && strstr(curline, "/0x")
+        ) {
+            parser->inbacktrace = 1;
+        }
+    }
 
-        /* store and remove kernel log level */
-        linelevel = koops_line_skip_level((const char **)&c);
-        koops_line_skip_jiffies((const char **)&c);
+    /* Are we at the end of an oops? */
+    else if (parser->oopsstart >= 0 && parser->inbacktrace)
+    {
+        int oopsend = INT_MAX;
+
+        /* line needs to start with " [" or have "] [" if it is still a call trace */
+        /* example: "[<ffffffffa006c156>] radeon_get_ring_head+0x16/0x41 [radeon]" */
+        /* example s390: "([<ffffffffa006c156>] 0xdeadbeaf)" */
+        if ((curline[0] != '[' && (curline[0] != '(' || curline[1] != '['))
+         && !strstr(curline, "] [")
+         && !strstr(curline, "--- Exception")
+         && !strstr(curline, "LR =")
+         && !strstr(curline, "<#DF>")
+         && !strstr(curline, "<IRQ>")
+         && !strstr(curline, "<EOI>")
+         && !strstr(curline, "<NMI>")
+         && !strstr(curline, "<<EOE>>")
+         && strncmp(curline, "Code: ", 6) != 0
+         && strncmp(curline, "RIP ", 4) != 0
+         && strncmp(curline, "RSP ", 4) != 0
+         /* s390 Call Trace ends with 'Last Breaking-Event-Address:'
+          * which is followed by a single frame */
+         && strncmp(curline, "Last Breaking-Event-Address:", strlen("Last Breaking-Event-Address:")) != 0
+        ) {
+            oopsend = i-1; /* not a call trace line */
+        }
+        /* oops lines are always more than 8 chars long */
+        else if (strnlen(curline, 8) < 8)
+            oopsend = i-1;
+        /* single oopses are of the same loglevel */
+        else if (lines_info[i].level != parser->prevlevel)
+            oopsend = i-1;
+        else if (strstr(curline, "Instruction dump:"))
+            oopsend = i;
+        /* kernel end-of-oops marker (not including marker itself) */
+        else if (strstr(curline, "---[ end trace"))
+            oopsend = i-1;
+        else
+        {
+            /* if a new oops starts, this one has ended */
+            if (has_suspicious_string(curline))
+                oopsend = i-1;
+        }
 
-        if ((lines_info_size & 0xfff) == 0)
+        if (oopsend <= i)
         {
-            lines_info = xrealloc(lines_info, (lines_info_size + 0x1000) * sizeof(lines_info[0]));
+            log_debug("End of oops at line %d (%d): '%s'", oopsend, i, lines_info[oopsend].ptr);
+            record_oops(parser, parser->oopsstart, oopsend);
+            parser->oopsstart = -1;
+            parser->inbacktrace = 0;
         }
-        lines_info[lines_info_size].ptr = c;
-        lines_info[lines_info_size].level = linelevel;
-        lines_info_size++;
-next_line:
-        c = c9 + 1;
     }
 
-    koops_extract_oopses_from_lines(oops_list, lines_info, lines_info_size);
-    free(lines_info);
+    parser->prevlevel = lines_info[i].level;
+    i++;
+    parser->cur = i;
+
+    if (parser->oopsstart >= 0)
+    {
+        /* Do we have a suspiciously long oops? Cancel it.
+         * Bumped from 60 to 80 (see examples/oops_recursive_locking1.test)
+         */
+        if (i - parser->oopsstart > 80)
+        {
+            parser->inbacktrace = 0;
+            parser->oopsstart = -1;
+            log_debug("Dropped oops, too long");
+            return;
+        }
+        if (!parser->inbacktrace && i - parser->oopsstart > 40)
+        {
+            /* Used to drop oopses w/o backtraces, but some of them
+             * (MCEs, for example) don't have backtrace yet we still want to file them.
+             */
+            log_debug("One-line oops at line %d: '%s'", parser->oopsstart, lines_info[parser->oopsstart].ptr);
+            record_oops(parser, parser->oopsstart, parser->oopsstart);
+            /*inbacktrace = 0; - already is */
+            parser->oopsstart = -1;
+            return;
+        }
+    }
 }
 
-void koops_extract_oopses_from_lines(GList **oops_list, const struct abrt_koops_line_info *lines_info, int lines_info_size)
+/* Forgets the first 'count' lines of the window */
+static void koops_parser_drop_lines(struct koops_parser *parser, int count)
+{
+    for (int i = 0; i < count; ++i)
+        free(parser->lines[i].ptr);
+
+    parser->lines_count -= count;
+    memmove(parser->lines, parser->lines + count, parser->lines_count * sizeof(parser->lines[0]));
+    parser->cur -= count;
+    if (parser->oopsstart >= 0)
+        parser->oopsstart -= count;
+}
+
+static void koops_parser_run(struct koops_parser *parser, bool input_ended)
+{
+    while (parser->cur < parser->lines_count
+        && (input_ended || parser->lines_count - parser->cur >= KOOPS_END_MARKER_LOOKAHEAD))
+    {
+        koops_parser_analyze_line(parser);
+    }
+
+    /* Lines before the current oops (or the current line) are not needed
+     * anymore, this keeps the window shorter than ~80 + lookahead lines */
+    int unneeded = (parser->oopsstart >= 0 ? parser->oopsstart : parser->cur);
+    if (unneeded >= KOOPS_WINDOW_SLACK || (input_ended && unneeded > 0))
+        koops_parser_drop_lines(parser, unneeded);
+}
+
+static void koops_parser_reset(struct koops_parser *parser)
 {
-    /* Analyze lines */
+    koops_parser_drop_lines(parser, parser->lines_count);
+    parser->cur = 0;
+    parser->oopsstart = -1;
+    parser->inbacktrace = 0;
+    parser->prevlevel = 0;
+}
 
-    int i;
-    char prevlevel = 0;
-    int oopsstart = -1;
-    int inbacktrace = 0;
+struct koops_parser *koops_parser_new(koops_parser_fn callback, void *param)
+{
+    struct koops_parser *parser = xzalloc(sizeof(*parser));
+    parser->callback = callback;
+    parser->param = param;
+    parser->oopsstart = -1;
+    return parser;
+}
 
-    i = 0;
-    while (i < lines_info_size)
+void koops_parser_free(struct koops_parser *parser)
+{
+    if (!parser)
+        return;
+
+    koops_parser_drop_lines(parser, parser->lines_count);
+    free(parser->lines);
+    free(parser->line);
+    free(parser);
+}
+
+void koops_parser_feed_line_len(struct koops_parser *parser, const char *line, size_t len, int level)
+{
+    /* Most lines are not a part of any oops, don't copy them. Until an oops
+     * starts, only the level of the previous line is needed. The matcher
+     * may find a string which the analysis (skipping leading spaces) won't,
+     * such line is just analyzed the slow way.
+     */
+    if (parser->oopsstart < 0 && parser->cur == parser->lines_count
+     && !has_suspicious_string_len(line, len))
     {
-        char *curline = lines_info[i].ptr;
+        parser->prevlevel = level;
+        return;
+    }
 
-        if (curline == NULL)
-        {
-            i++;
-            continue;
-        }
-        while (*curline == ' ')
-            curline++;
+    if (parser->lines_count == parser->lines_size)
+    {
+        parser->lines_size = parser->lines_size * 2 + 16;
+        parser->lines = xrealloc(parser->lines, parser->lines_size * sizeof(parser->lines[0]));
+    }
+    parser->lines[parser->lines_count].ptr = xstrndup(line, len);
+    parser->lines[parser->lines_count].level = level;
+    parser->lines_count++;
 
-        if (oopsstart < 0)
-        {
-            /* Find start-of-oops markers */
-            for (const char *const *str = s_koops_suspicious_strings; *str; ++str)
-            {
-                if (strstr(curline, *str))
-                {
-                    oopsstart = i;
-                    break;
-                }
-            }
+    koops_parser_run(parser, /*input_ended:*/ false);
+}
+
+void koops_parser_feed_line(struct koops_parser *parser, const char *line, int level)
+{
+    koops_parser_feed_line_len(parser, line, strlen(line), level);
+}
 
-            if (oopsstart >= 0)
+/* Handles one line of a syslog file or dmesg output */
+static void koops_parser_feed_log_line(struct koops_parser *parser, const char *c)
+{
+    parser->linecount++;
+    if (c[0] == '\0')
+        return;
+
+    /* Is it a syslog file (/var/log/messages or similar)?
+     * Even though _usually_ it looks like "Nov 19 12:34:38 localhost kernel: xxx",
+     * some users run syslog in non-C locale:
+     * "2010-02-22T09:24:08.156534-08:00 gnu-4 gnome-session[2048]: blah blah"
+     *  ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^ !!!
+     * We detect it by checking for N:NN:NN pattern in first 15 chars
+     * (and this still is not good enough... false positive: "pci 0000:15:00.0: PME# disabled")
+     */
+    const char *colon = strchr(c, ':');
+    if (colon && colon > c && colon < c + 15
+     && isdigit(colon[-1]) /* N:... */
+     && isdigit(colon[1]) /* ...N:NN:... */
+     && isdigit(colon[2])
+     && colon[3] == ':'
+     && isdigit(colon[4]) /* ...N:NN:NN... */
+     && isdigit(colon[5])
+    ) {
+        /* It's syslog file, not a bare dmesg */
+
+        /* Skip non-kernel lines */
+        const char *kernel_str = strstr(c, "kernel: ");
+        if (!kernel_str)
+        {
+            /* if we see our own marker:
+             * "hostname abrt: Kerneloops: Reported 1 kernel oopses to Abrt"
+             * we know we submitted everything upto here already */
+            if (strstr(c, "kernel oopses to Abrt"))
             {
-                /* debug information */
-                log_debug("Found oops at line %d: '%s'", oopsstart, lines_info[oopsstart].ptr);
-                /* try to find the end marker */
-                int i2 = i + 1;
-                while (i2 < lines_info_size && i2 < (i+50))
-                {
-                    if (strstr(lines_info[i2].ptr, "---[ end trace"))
-                    {
-                        inbacktrace = 1;
-                        i = i2;
-                        break;
-                    }
-                    i2++;
-                }
+                log_debug("Found our marker at line %d", parser->linecount);
+                koops_parser_reset(parser);
+                parser->callback(NULL, parser->param);
             }
+            return;
         }
+        c = kernel_str + sizeof("kernel: ")-1;
+    }
+
+    /* store and remove kernel log level */
+    int linelevel = koops_line_skip_level(&c);
+    koops_line_skip_jiffies(&c);
 
-        /* Are we entering a call trace part? */
-        /* a call trace starts with "Call Trace:" or with the " [<.......>] function+0xFF/0xAA" pattern */
-        if (oopsstart >= 0 && !inbacktrace)
+    koops_parser_feed_line(parser, c, linelevel);
+}
+
+static void koops_parser_append(struct koops_parser *parser, const char *data, size_t len)
+{
+    if (parser->line_len + len >= parser->line_size)
+    {
+        parser->line_size = parser->line_len + len + 256;
+        parser->line = xrealloc(parser->line, parser->line_size);
+    }
+    memcpy(parser->line + parser->line_len, data, len);
+    parser->line_len += len;
+    parser->line[parser->line_len] = '\0';
+}
+
+void koops_parser_feed(struct koops_parser *parser, const char *buffer, size_t buflen)
+{
+    const char *c = buffer;
+    const char *end = buffer + buflen;
+    while (c < end)
+    {
+        const char *eol = memchr(c, '\n', end - c);
+        if (!eol)
         {
-            if (strcasestr(curline, "Call Trace:")) /* yes, it must be case-insensitive */
-                inbacktrace = 1;
-            else
-            /* Fatal MCE's have a few lines of useful information between
-             * first "Machine check exception:" line and the final "Kernel panic"
-             * line. Such oops, of course, is only detectable in kdumps (tested)
-             * or possibly pstore-saved logs (I did not try this yet).
-             * In order to capture all these lines, we treat final line
-             * as "backtrace" (which is admittedly a hack):
-             */
-            if (strstr(curline, "Kernel panic - not syncing"))
-                inbacktrace = 1;
-            else
-            if (strnlen(curline, 9) > 8
-             && (  (curline[0] == '(' && curline[1] == '[' && curline[2] == '<')
-                || (curline[0] == '[' && curline[1] == '<'))
-             && strstr(curline, ">]")
-             && strstr(curline, "+0x")
-             && strstr(curline, "/0x")
-            ) {
-                inbacktrace = 1;
-            }
+            /* Wait for the rest of the line */
+            koops_parser_append(parser, c, end - c);
+            break;
         }
 
-        /* Are we at the end of an oops? */
-        else if (oopsstart >= 0 && inbacktrace)
-        {
-            int oopsend = INT_MAX;
-
-            /* line needs to start with " [" or have "] [" if it is still a call trace */
-            /* example: "[<ffffffffa006c156>] radeon_get_ring_head+0x16/0x41 [radeon]" */
-            /* example s390: "([<ffffffffa006c156>] 0xdeadbeaf)" */
-            if ((curline[0] != '[' && (curline[0] != '(' || curline[1] != '['))
-             && !strstr(curline, "] [")
-             && !strstr(curline, "--- Exception")
-             && !strstr(curline, "LR =")
-             && !strstr(curline, "<#DF>")
-             && !strstr(curline, "<IRQ>")
-             && !strstr(curline, "<EOI>")
-             && !strstr(curline, "<NMI>")
-             && !strstr(curline, "<<EOE>>")
-             && strncmp(curline, "Code: ", 6) != 0
-             && strncmp(curline, "RIP ", 4) != 0
-             && strncmp(curline, "RSP ", 4) != 0
-             /* s390 Call Trace ends with 'Last Breaking-Event-Address:'
-              * which is followed by a single frame */
-             && strncmp(curline, "Last Breaking-Event-Address:", strlen("Last Breaking-Event-Address:")) != 0
-            ) {
-                oopsend = i-1; /* not a call trace line */
-            }
-            /* oops lines are always more than 8 chars long */
-            else if (strnlen(curline, 8) < 8)
-                oopsend = i-1;
-            /* single oopses are of the same loglevel */
-            else if (lines_info[i].level != prevlevel)
-                oopsend = i-1;
-            else if (strstr(curline, "Instruction dump:"))
-                oopsend = i;
-            /* kernel end-of-oops marker (not including marker itself) */
-            else if (strstr(curline, "---[ end trace"))
-                oopsend = i-1;
-            else
-            {
-                /* if a new oops starts, this one has ended */
-                for (const char *const *str = s_koops_suspicious_strings; *str; ++str)
-                {
-                    if (strstr(curline, *str))
-                    {
-                        oopsend = i-1;
-                        break;
-                    }
-                }
-            }
+        koops_parser_append(parser, c, eol - c);
+        koops_parser_feed_log_line(parser, parser->line);
+        parser->line_len = 0;
+        c = eol + 1;
+    }
+}
 
-            if (oopsend <= i)
-            {
-                log_debug("End of oops at line %d (%d): '%s'", oopsend, i, lines_info[oopsend].ptr);
-                record_oops(oops_list, lines_info, oopsstart, oopsend);
-                oopsstart = -1;
-                inbacktrace = 0;
-            }
+void koops_parser_finish(struct koops_parser *parser)
+{
+    if (parser->line_len != 0)
+    {
+        koops_parser_feed_log_line(parser, parser->line);
+        parser->line_len = 0;
+    }
+
+    koops_parser_run(parser, /*input_ended:*/ true);
+
+    /* process last oops if we have one */
+    if (parser->oopsstart >= 0)
+    {
+        if (parser->inbacktrace)
+        {
+            int oopsend = parser->lines_count - 1;
+            log_debug("End of oops at line %d (end of file): '%s'", oopsend, parser->lines[oopsend].ptr);
+            record_oops(parser, parser->oopsstart, oopsend);
+        }
+        else
+        {
+            log_debug("One-line oops at line %d: '%s'", parser->oopsstart, parser->lines[parser->oopsstart].ptr);
+            record_oops(parser, parser->oopsstart, parser->oopsstart);
         }
+    }
 
-        prevlevel = lines_info[i].level;
-        i++;
+    koops_parser_reset(parser);
+}
 
-        if (oopsstart >= 0)
+void koops_list_append_oops(char *oops, void *param)
+{
+    GList **oops_list = param;
+    if (oops == NULL)
+    {
+        list_free_with_free(*oops_list);
+        *oops_list = NULL;
+        return;
+    }
+    *oops_list = g_list_append(*oops_list, oops);
+}
+
+void koops_extract_oopses(GList **oops_list, char *buffer, size_t buflen)
+{
+    struct koops_parser *parser = koops_parser_new(koops_list_append_oops, oops_list);
+    koops_parser_feed(parser, buffer, buflen);
+    koops_parser_finish(parser);
+    koops_parser_free(parser);
+}
+
+void koops_extract_oopses_from_lines(GList **oops_list, const struct abrt_koops_line_info *lines_info, int lines_info_size)
+{
+    struct koops_parser *parser = koops_parser_new(koops_list_append_oops, oops_list);
+    for (int i = 0; i < lines_info_size; ++i)
+    {
+        if (lines_info[i].ptr != NULL)
+            koops_parser_feed_line(parser, lines_info[i].ptr, lines_info[i].level);
+    }
+    koops_parser_finish(parser);
+    koops_parser_free(parser);
+}
+
+/*
+ * Recently computed duphashes
+ *
+ * A looping WARN_ON produces the same oops over and over, parsing it by satyr
+ * every time is a waste. The oopses are keyed by their lines which can hold
+ * frames (the lines with "0x" or '<'), without the things which differ between
+ * occurrences of the same oops and which are not used for the duphash: return
+ * addresses of the frames with a symbol and numbers of the CPU and the PID.
+ */
+#define KOOPS_HASH_CACHE_SIZE 64
+
+struct koops_hash_entry
+{
+    char *key;
+    GList link;
+    int bad;
+    char hash[SHA1_RESULT_LEN*2 + 1];
+};
+
+static GHashTable *s_hash_cache;
+/* Most recently used first */
+static GQueue s_hash_lru = G_QUEUE_INIT;
+
+static void koops_hash_entry_free(void *p)
+{
+    struct koops_hash_entry *entry = p;
+    free(entry->key);
+    free(entry);
+}
+
+/* Appends [line, end) without "[<address>]" and the numbers after "CPU: " and "PID: " */
+static void koops_hash_append_line(struct strbuf *key, const char *line, const char *end, bool has_symbol)
+{
+    while (line < end)
+    {
+        if (has_symbol && line[0] == '[' && line + 1 < end && line[1] == '<')
         {
-            /* Do we have a suspiciously long oops? Cancel it.
-             * Bumped from 60 to 80 (see examples/oops_recursive_locking1.test)
-             */
-            if (i - oopsstart > 80)
+            const char *close = memchr(line, ']', end - line);
+            if (close)
             {
-                inbacktrace = 0;
-                oopsstart = -1;
-                log_debug("Dropped oops, too long");
-                continue;
-            }
-            if (!inbacktrace && i - oopsstart > 40)
-            {
-                /* Used to drop oopses w/o backtraces, but some of them
-                 * (MCEs, for example) don't have backtrace yet we still want to file them.
-                 */
-                log_debug("One-line oops at line %d: '%s'", oopsstart, lines_info[oopsstart].ptr);
-                record_oops(oops_list, lines_info, oopsstart, oopsstart);
-                /*inbacktrace = 0; - already is */
-                oopsstart = -1;
+                line = close + 1;
                 continue;
             }
         }
-    } /* while (i < lines_info_size) */
 
-    /* process last oops if we have one */
-    if (oopsstart >= 0)
-    {
-        if (inbacktrace)
-        {
-            int oopsend = i-1;
-            log_debug("End of oops at line %d (end of file): '%s'", oopsend, lines_info[oopsend].ptr);
-            record_oops(oops_list, lines_info, oopsstart, oopsend);
-        }
-        else
+        if ((end - line > 5) && (strncmp(line, "CPU: ", 5) == 0 || strncmp(line, "PID: ", 5) == 0))
         {
-            log_debug("One-line oops at line %d: '%s'", oopsstart, lines_info[oopsstart].ptr);
-            record_oops(oops_list, lines_info, oopsstart, oopsstart);
+            strbuf_append_strf(key, "%.5s", line);
+            line += 5;
+            while (line < end && isdigit((unsigned char)*line))
+                ++line;
+            continue;
         }
+
+        strbuf_append_char(key, *line++);
     }
+    strbuf_append_char(key, '\n');
 }
-int koops_hash_str_ext(char result[SHA1_RESULT_LEN*2 + 1], const char *oops_buf, int frame_count, int duphash_flags)
+
+static char *koops_hash_cache_key(const char *oops_buf, int frame_count, int duphash_flags)
+{
+    struct strbuf *key = strbuf_new();
+    strbuf_append_strf(key, "%d %d\n", frame_count, duphash_flags);
+
+    const char *line = oops_buf;
+    while (*line)
+    {
+        const char *end = strchrnul(line, '\n');
+        const size_t len = end - line;
+        if (memmem(line, len, "0x", 2) || memchr(line, '<', len))
+            koops_hash_append_line(key, line, end, memmem(line, len, "+0x", 3) != NULL);
+
+        if (*end == '\0')
+            break;
+        line = end + 1;
+    }
+
+    return strbuf_free_nobuf(key);
+}
+
+static struct koops_hash_entry *koops_hash_cache_find(const char *key)
+{
+    if (!s_hash_cache)
+        return NULL;
+
+    struct koops_hash_entry *entry = g_hash_table_lookup(s_hash_cache, key);
+    if (entry)
+    {
+        g_queue_unlink(&s_hash_lru, &entry->link);
+        g_queue_push_head_link(&s_hash_lru, &entry->link);
+    }
+    return entry;
+}
+
+/* Takes ownership of key */
+static void koops_hash_cache_add(char *key, int bad, const char *hash)
+{
+    if (!s_hash_cache)
+        s_hash_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, koops_hash_entry_free);
+
+    if (g_queue_get_length(&s_hash_lru) >= KOOPS_HASH_CACHE_SIZE)
+    {
+        GList *oldest = g_queue_pop_tail_link(&s_hash_lru);
+        struct koops_hash_entry *old_entry = oldest->data;
+        g_hash_table_remove(s_hash_cache, old_entry->key);
+    }
+
+    struct koops_hash_entry *entry = xzalloc(sizeof(*entry));
+    entry->key = key;
+    entry->link.data = entry;
+    entry->bad = bad;
+    if (!bad)
+        strcpy(entry->hash, hash);
+
+    g_hash_table_insert(s_hash_cache, entry->key, entry);
+    g_queue_push_head_link(&s_hash_lru, &entry->link);
+}
+
+static int koops_hash_str_uncached(char result[SHA1_RESULT_LEN*2 + 1], const char *oops_buf, int frame_count, int duphash_flags)
 {
     char *hash_str = NULL, *error = NULL;
     int bad = 0;
@@ -554,6 +842,24 @@ end:
     return bad;
 }
 
+int koops_hash_str_ext(char result[SHA1_RESULT_LEN*2 + 1], const char *oops_buf, int frame_count, int duphash_flags)
+{
+    char *key = koops_hash_cache_key(oops_buf, frame_count, duphash_flags);
+    const struct koops_hash_entry *entry = koops_hash_cache_find(key);
+    if (entry)
+    {
+        log_debug("Using cached duphash of the oops");
+        free(key);
+        if (!entry->bad)
+            strcpy(result, entry->hash);
+        return entry->bad;
+    }
+
+    const int bad = koops_hash_str_uncached(result, oops_buf, frame_count, duphash_flags);
+    koops_hash_cache_add(key, bad, result);
+    return bad;
+}
+
 int koops_hash_str(char result[SHA1_RESULT_LEN*2 + 1], const char *oops_buf)
 {
     const int frame_count = 6;
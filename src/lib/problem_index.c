@@ -0,0 +1,530 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * In-memory index of problem directories
+ *
+ * Listing problems through for_each_problem_in_dir() opens and lock-probes
+ * every directory and reads the requested elements from disk on every call.
+ * The index loads the small elements which are used for listing and
+ * filtering once and keeps them up to date via inotify: one watch on the
+ * dump location and one on every problem directory. Results of access
+ * checks are remembered per uid until attributes of the directory change.
+ *
+ * Pending inotify events are processed before every query, so a query
+ * always sees the changes done before it was issued.
+ *
+ * If a directory can't be watched (fs.inotify.max_user_watches is reached,
+ * for example), its elements are reread on every query, as they would be
+ * without the index. The same goes for the dump location: without its watch
+ * it is listed again on every query to find new and deleted problems.
+ */
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include "problem_api.h"
+
+#define DUMP_LOCATION_EVENTS (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM \
+                              | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define PROBLEM_DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM \
+                            | IN_ATTRIB | IN_ONLYDIR)
+
+/* Elements kept in memory, the others have to be read from disk */
+static const char *const indexed_elements[] = {
+    FILENAME_TIME,
+    FILENAME_UID,
+    FILENAME_TYPE,
+    FILENAME_LAST_OCCURRENCE,
+    FILENAME_COUNT,
+    FILENAME_UUID,
+    FILENAME_DUPHASH,
+    FILENAME_REPORTED_TO,
+    FILENAME_COMPONENT,
+    FILENAME_REASON,
+    /* Filters of GetProblemsFiltered */
+    FILENAME_EXECUTABLE,
+    FILENAME_PKG_NAME,
+};
+
+struct access_check
+{
+    uid_t uid;
+    bool accessible;
+};
+
+struct problem_index_entry
+{
+    char *dirname;
+    int wd;
+    /* NULL if the element doesn't exist */
+    char *values[ARRAY_SIZE(indexed_elements)];
+    struct access_check *access;
+    unsigned access_count;
+};
+
+struct problem_index
+{
+    char *dump_location;
+    int inotify_fd;
+    int dump_location_wd;
+    /* Events were lost or the dump location is gone */
+    bool stale;
+    /* Failures are logged once, not on every query */
+    bool watch_failure_logged;
+    /* full path -> struct problem_index_entry */
+    GHashTable *entries;
+    /* wd -> struct problem_index_entry */
+    GHashTable *watches;
+};
+
+static int element_index(const char *name)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(indexed_elements); ++i)
+        if (strcmp(indexed_elements[i], name) == 0)
+            return i;
+    return -1;
+}
+
+bool problem_index_element_is_indexed(const char *name)
+{
+    return element_index(name) >= 0;
+}
+
+/* The same transformation dd_load_text() does */
+static char *load_element(const char *dirname, const char *name)
+{
+    char *path = concat_path_file(dirname, name);
+    size_t size = INT_MAX - 4095;
+    char *value = xmalloc_open_read_close(path, &size);
+    free(path);
+    if (!value)
+        return NULL;
+
+    unsigned newlines = 0;
+    char *dst = value;
+    for (size_t i = 0; i < size; ++i)
+    {
+        unsigned char c = value[i];
+        if (c == '\n')
+            ++newlines;
+        if (c == '\0')
+            c = ' ';
+        if (isspace(c) || c >= ' ')
+            *dst++ = c;
+    }
+    /* One-line value with '\n' at the end */
+    if (newlines == 1 && dst != value && dst[-1] == '\n')
+        --dst;
+    *dst = '\0';
+
+    return value;
+}
+
+static void entry_free(struct problem_index_entry *entry)
+{
+    free(entry->dirname);
+    for (unsigned i = 0; i < ARRAY_SIZE(indexed_elements); ++i)
+        free(entry->values[i]);
+    free(entry->access);
+    free(entry);
+}
+
+/* Adds the watch of the directory and returns its descriptor or -1 */
+static int watch_dir(struct problem_index *index, const char *dirname, uint32_t mask)
+{
+    if (index->inotify_fd < 0)
+        return -1;
+
+    const int wd = inotify_add_watch(index->inotify_fd, dirname, mask);
+    if (wd < 0 && errno != ENOENT && !index->watch_failure_logged)
+    {
+        perror_msg("inotify_add_watch('%s'), unwatched problems will be reread on every query", dirname);
+        index->watch_failure_logged = true;
+    }
+    return wd;
+}
+
+static void entry_load(struct problem_index_entry *entry)
+{
+    for (unsigned i = 0; i < ARRAY_SIZE(indexed_elements); ++i)
+    {
+        free(entry->values[i]);
+        entry->values[i] = load_element(entry->dirname, indexed_elements[i]);
+    }
+    free(entry->access);
+    entry->access = NULL;
+    entry->access_count = 0;
+}
+
+/* Changes of an unwatched directory are not known, it is reread. The watch
+ * is tried again, other watches may have been removed in the meantime. */
+static void entry_refresh(struct problem_index *index, struct problem_index_entry *entry)
+{
+    if (entry->wd >= 0)
+        return;
+
+    entry->wd = watch_dir(index, entry->dirname, PROBLEM_DIR_EVENTS);
+    if (entry->wd >= 0)
+        g_hash_table_replace(index->watches, GINT_TO_POINTER(entry->wd), entry);
+    entry_load(entry);
+}
+
+static void index_remove_dir(struct problem_index *index, const char *name)
+{
+    char *dirname = concat_path_file(index->dump_location, name);
+    struct problem_index_entry *entry = g_hash_table_lookup(index->entries, dirname);
+    free(dirname);
+    if (!entry)
+        return;
+
+    if (entry->wd >= 0)
+    {
+        g_hash_table_remove(index->watches, GINT_TO_POINTER(entry->wd));
+        inotify_rm_watch(index->inotify_fd, entry->wd);
+    }
+    g_hash_table_remove(index->entries, entry->dirname);
+}
+
+static void index_add_dir(struct problem_index *index, const char *name)
+{
+    if (dot_or_dotdot(name))
+        return;
+
+    /* Forget the old directory of the same name, if there was any */
+    index_remove_dir(index, name);
+
+    char *dirname = concat_path_file(index->dump_location, name);
+    struct stat st;
+    if (lstat(dirname, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        free(dirname);
+        return;
+    }
+
+    /* Watch first, not to miss changes done while loading */
+    struct problem_index_entry *entry = xzalloc(sizeof(*entry));
+    entry->dirname = dirname;
+    entry->wd = watch_dir(index, dirname, PROBLEM_DIR_EVENTS);
+    entry_load(entry);
+
+    g_hash_table_replace(index->entries, entry->dirname, entry);
+    if (entry->wd >= 0)
+        g_hash_table_replace(index->watches, GINT_TO_POINTER(entry->wd), entry);
+}
+
+static void index_clear(struct problem_index *index)
+{
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, index->watches);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        inotify_rm_watch(index->inotify_fd, ((struct problem_index_entry *)value)->wd);
+    g_hash_table_remove_all(index->watches);
+    g_hash_table_remove_all(index->entries);
+
+    if (index->dump_location_wd >= 0)
+        inotify_rm_watch(index->inotify_fd, index->dump_location_wd);
+    index->dump_location_wd = -1;
+}
+
+static void index_rebuild(struct problem_index *index)
+{
+    log_info("Indexing problems in '%s'", index->dump_location);
+    index_clear(index);
+    index->stale = false;
+
+    index->dump_location_wd = watch_dir(index, index->dump_location, DUMP_LOCATION_EVENTS);
+
+    DIR *dp = opendir(index->dump_location);
+    if (!dp)
+        return;
+
+    struct dirent *dent;
+    while ((dent = readdir(dp)) != NULL)
+        index_add_dir(index, dent->d_name);
+    closedir(dp);
+}
+
+/* Without the watch of the dump location (it doesn't exist or it can't be
+ * watched), the index is compared with its content. Only new directories
+ * are loaded. */
+static void index_rescan(struct problem_index *index)
+{
+    /* Watch first, not to miss changes done while listing */
+    index->dump_location_wd = watch_dir(index, index->dump_location, DUMP_LOCATION_EVENTS);
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, index->entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        struct problem_index_entry *entry = value;
+        struct stat st;
+        if (lstat(entry->dirname, &st) == 0 && S_ISDIR(st.st_mode))
+            continue;
+
+        if (entry->wd >= 0)
+        {
+            g_hash_table_remove(index->watches, GINT_TO_POINTER(entry->wd));
+            inotify_rm_watch(index->inotify_fd, entry->wd);
+        }
+        g_hash_table_iter_remove(&iter);
+    }
+
+    DIR *dp = opendir(index->dump_location);
+    if (!dp)
+        return;
+
+    struct dirent *dent;
+    while ((dent = readdir(dp)) != NULL)
+    {
+        char *dirname = concat_path_file(index->dump_location, dent->d_name);
+        if (!g_hash_table_lookup(index->entries, dirname))
+            index_add_dir(index, dent->d_name);
+        free(dirname);
+    }
+    closedir(dp);
+}
+
+static void handle_event(struct problem_index *index, const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        log_notice("Inotify queue overflowed, reindexing problems");
+        index->stale = true;
+        return;
+    }
+
+    if (event->wd == index->dump_location_wd)
+    {
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+            index->stale = true;
+        else if (event->len != 0 && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+            index_add_dir(index, event->name);
+        else if (event->len != 0 && (event->mask & (IN_DELETE | IN_MOVED_FROM)))
+            index_remove_dir(index, event->name);
+        return;
+    }
+
+    struct problem_index_entry *entry = g_hash_table_lookup(index->watches, GINT_TO_POINTER(event->wd));
+    if (!entry)
+        return;
+
+    if (event->len == 0)
+    {
+        /* Owner or mode of the directory itself changed */
+        if (event->mask & IN_ATTRIB)
+        {
+            free(entry->access);
+            entry->access = NULL;
+            entry->access_count = 0;
+        }
+        return;
+    }
+
+    const int i = element_index(event->name);
+    if (i < 0 || (event->mask & IN_ATTRIB))
+        return;
+
+    free(entry->values[i]);
+    entry->values[i] = NULL;
+    if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        entry->values[i] = load_element(entry->dirname, event->name);
+}
+
+void problem_index_process_events(struct problem_index *index)
+{
+    if (index->inotify_fd >= 0)
+    {
+        int available = 0;
+        if (ioctl(index->inotify_fd, FIONREAD, &available) != 0 || available <= 0)
+            available = (sizeof(struct inotify_event) + FILENAME_MAX) * 128;
+
+        char *buf = xmalloc(available);
+        while (1)
+        {
+            ssize_t len = read(index->inotify_fd, buf, available);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0 && errno == EINVAL)
+            {
+                /* The buffer is too small for the next event */
+                available *= 2;
+                buf = xrealloc(buf, available);
+                continue;
+            }
+            if (len <= 0)
+                break;
+
+            for (char *p = buf; p < buf + len; )
+            {
+                const struct inotify_event *event = (const struct inotify_event *)p;
+                handle_event(index, event);
+                p += sizeof(*event) + event->len;
+            }
+        }
+        free(buf);
+    }
+
+    if (index->stale)
+        index_rebuild(index);
+    else if (index->dump_location_wd < 0)
+        index_rescan(index);
+}
+
+struct problem_index *problem_index_new(const char *dump_location)
+{
+    struct problem_index *index = xzalloc(sizeof(*index));
+    index->dump_location = xstrdup(dump_location);
+    index->dump_location_wd = -1;
+    index->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)entry_free);
+    index->watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (index->inotify_fd < 0)
+        perror_msg("inotify_init1, problems will be reread on every query");
+
+    index_rebuild(index);
+    return index;
+}
+
+void problem_index_free(struct problem_index *index)
+{
+    if (!index)
+        return;
+
+    g_hash_table_destroy(index->watches);
+    g_hash_table_destroy(index->entries);
+    if (index->inotify_fd >= 0)
+        close(index->inotify_fd);
+    free(index->dump_location);
+    free(index);
+}
+
+int problem_index_get_fd(struct problem_index *index)
+{
+    return index->inotify_fd;
+}
+
+const char *problem_index_entry_dirname(const struct problem_index_entry *entry)
+{
+    return entry->dirname;
+}
+
+const char *problem_index_entry_get(const struct problem_index_entry *entry, const char *name)
+{
+    const int i = element_index(name);
+    return i >= 0 ? entry->values[i] : NULL;
+}
+
+bool problem_index_entry_accessible_by_uid(struct problem_index_entry *entry, uid_t uid)
+{
+    for (unsigned i = 0; i < entry->access_count; ++i)
+        if (entry->access[i].uid == uid)
+            return entry->access[i].accessible;
+
+    /* libreport decides, we only remember the answer */
+    const bool accessible = dump_dir_accessible_by_uid(entry->dirname, uid);
+    entry->access = xrealloc(entry->access, (entry->access_count + 1) * sizeof(entry->access[0]));
+    entry->access[entry->access_count].uid = uid;
+    entry->access[entry->access_count].accessible = accessible;
+    entry->access_count++;
+
+    return accessible;
+}
+
+struct problem_index_entry *problem_index_find(struct problem_index *index, const char *dirname)
+{
+    problem_index_process_events(index);
+
+    struct problem_index_entry *entry = g_hash_table_lookup(index->entries, dirname);
+    if (entry)
+        entry_refresh(index, entry);
+    /* dd_opendir() doesn't accept directories without time either */
+    return entry && entry->values[0] ? entry : NULL;
+}
+
+int problem_index_for_each(struct problem_index *index,
+                        uid_t caller_uid,
+                        problem_index_callback callback,
+                        void *arg)
+{
+    problem_index_process_events(index);
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, index->entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        struct problem_index_entry *entry = value;
+        entry_refresh(index, entry);
+        if (entry->values[0] == NULL)
+            continue; /* not a problem directory (yet) */
+
+        if (caller_uid != (uid_t)-1 && !problem_index_entry_accessible_by_uid(entry, caller_uid))
+            continue;
+
+        int brk = callback(entry, arg);
+        if (brk)
+            return brk;
+    }
+
+    return 0;
+}
+
+/* problem_index_get_dirs_for_uid and its helpers */
+
+static int add_entry_dirname_to_GList(struct problem_index_entry *entry, void *arg)
+{
+    GList **list = arg;
+    *list = g_list_prepend(*list, xstrdup(entry->dirname));
+    return 0;
+}
+
+GList *problem_index_get_dirs_for_uid(struct problem_index *index, uid_t uid)
+{
+    GList *list = NULL;
+    problem_index_for_each(index, uid, add_entry_dirname_to_GList, &list);
+    return g_list_reverse(list);
+}
+
+/* problem_index_get_dirs_not_accessible_by_uid and its helpers */
+
+struct add_entry_dirname_if_not_accessible_args
+{
+    uid_t uid;
+    GList *list;
+};
+
+static int add_entry_dirname_to_GList_if_not_accessible(struct problem_index_entry *entry, void *arg)
+{
+    struct add_entry_dirname_if_not_accessible_args *param = arg;
+    if (!problem_index_entry_accessible_by_uid(entry, param->uid))
+        param->list = g_list_prepend(param->list, xstrdup(entry->dirname));
+    return 0;
+}
+
+GList *problem_index_get_dirs_not_accessible_by_uid(struct problem_index *index, uid_t uid)
+{
+    struct add_entry_dirname_if_not_accessible_args args = {
+        .uid = uid,
+        .list = NULL,
+    };
+
+    problem_index_for_each(index, /*disable default uid check*/-1, add_entry_dirname_to_GList_if_not_accessible, &args);
+    return g_list_reverse(args.list);
+}
@@ -0,0 +1,249 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Client of the binary protocol of abrt.socket
+ *
+ * The whole problem is described by an array of iovecs pointing to the
+ * caller's data, so it is usually written by a single sendmsg() together
+ * with the passed descriptors. abrt-server writes the values to the problem
+ * directory as they come, without looking for separators.
+ */
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "libabrt.h"
+
+struct problem_record
+{
+    struct abrt_socket_record_header header;
+    const char *key;
+    const void *data;
+    size_t len;
+};
+
+struct problem_submission
+{
+    struct problem_record *records;
+    unsigned records_count;
+    unsigned records_size;
+    int fds[ABRT_SOCKET_MAX_FDS];
+    unsigned fds_count;
+    /* An item which can't be sent was added */
+    int error;
+};
+
+struct problem_submission *problem_submission_new(void)
+{
+    return xzalloc(sizeof(struct problem_submission));
+}
+
+void problem_submission_free(struct problem_submission *ps)
+{
+    if (!ps)
+        return;
+
+    free(ps->records);
+    free(ps);
+}
+
+static void add_record(struct problem_submission *ps, int type, const char *key, const void *data, size_t len)
+{
+    const size_t key_len = strlen(key);
+    if (key_len > UINT16_MAX || len > UINT32_MAX)
+    {
+        error_msg("Item '%s' is too long", key);
+        ps->error = -EINVAL;
+        return;
+    }
+
+    if (ps->records_count == ps->records_size)
+    {
+        ps->records_size = ps->records_size * 2 + 8;
+        ps->records = xrealloc(ps->records, ps->records_size * sizeof(ps->records[0]));
+    }
+
+    struct problem_record *r = &ps->records[ps->records_count++];
+    r->header.type = htons(type);
+    r->header.key_len = htons(key_len);
+    r->header.value_len = htonl(len);
+    r->key = key;
+    r->data = data;
+    r->len = len;
+}
+
+void problem_submission_add(struct problem_submission *ps, const char *key, const void *data, size_t len)
+{
+    add_record(ps, ABRT_SOCKET_ITEM, key, data, len);
+}
+
+void problem_submission_add_str(struct problem_submission *ps, const char *key, const char *str)
+{
+    add_record(ps, ABRT_SOCKET_ITEM, key, str, strlen(str));
+}
+
+void problem_submission_add_fd(struct problem_submission *ps, const char *key, int fd)
+{
+    if (ps->fds_count == ABRT_SOCKET_MAX_FDS)
+    {
+        error_msg("Too many descriptors, can't pass '%s'", key);
+        ps->error = -EINVAL;
+        return;
+    }
+
+    ps->fds[ps->fds_count++] = fd;
+    add_record(ps, ABRT_SOCKET_FD_ITEM, key, NULL, 0);
+}
+
+int problem_submission_write(struct problem_submission *ps, int sockfd)
+{
+    if (ps->error)
+        return ps->error;
+
+    struct abrt_socket_record_header end_header;
+    memset(&end_header, 0, sizeof(end_header));
+    end_header.type = htons(ABRT_SOCKET_END);
+    struct abrt_socket_stream_header stream_header;
+    memcpy(stream_header.magic, ABRT_SOCKET_MAGIC, sizeof(stream_header.magic));
+    stream_header.version = htons(ABRT_SOCKET_VERSION);
+    stream_header.reserved = 0;
+
+    /* stream header, header + key + data per record, end */
+    const unsigned iov_count = 1 + 3 * ps->records_count + 1;
+    struct iovec *iov = xmalloc(iov_count * sizeof(iov[0]));
+    struct iovec *v = iov;
+    v->iov_base = &stream_header;
+    v->iov_len = sizeof(stream_header);
+    ++v;
+    for (unsigned i = 0; i < ps->records_count; ++i)
+    {
+        struct problem_record *r = &ps->records[i];
+        v->iov_base = &r->header;
+        v->iov_len = sizeof(r->header);
+        ++v;
+        v->iov_base = (void *)r->key;
+        v->iov_len = ntohs(r->header.key_len);
+        ++v;
+        v->iov_base = (void *)r->data;
+        v->iov_len = r->len;
+        ++v;
+    }
+    v->iov_base = &end_header;
+    v->iov_len = sizeof(end_header);
+
+    union {
+        struct cmsghdr cmsg;
+        char buf[CMSG_SPACE(sizeof(int) * ABRT_SOCKET_MAX_FDS)];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    if (ps->fds_count != 0)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * ps->fds_count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * ps->fds_count);
+        memcpy(CMSG_DATA(cmsg), ps->fds, sizeof(int) * ps->fds_count);
+    }
+
+    /* A big problem may need more calls */
+    int r = 0;
+    unsigned first = 0;
+    while (first < iov_count)
+    {
+        msg.msg_iov = iov + first;
+        msg.msg_iovlen = MIN(iov_count - first, (unsigned)IOV_MAX);
+        ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            r = -errno;
+            perror_msg("sendmsg");
+            break;
+        }
+
+        /* The descriptors went with the first byte */
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+
+        while (first < iov_count && (size_t)sent >= iov[first].iov_len)
+        {
+            sent -= iov[first].iov_len;
+            ++first;
+        }
+        if (sent != 0)
+        {
+            iov[first].iov_base = (char *)iov[first].iov_base + sent;
+            iov[first].iov_len -= sent;
+        }
+    }
+
+    free(iov);
+    return r;
+}
+
+int problem_submission_send(struct problem_submission *ps)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        int r = -errno;
+        perror_msg("socket(AF_UNIX)");
+        return r;
+    }
+
+    struct sockaddr_un sunx;
+    memset(&sunx, 0, sizeof(sunx));
+    sunx.sun_family = AF_UNIX;
+    strcpy(sunx.sun_path, VAR_RUN"/abrt/abrt.socket");
+
+    if (connect(fd, (struct sockaddr *)&sunx, sizeof(sunx)))
+    {
+        int r = -errno;
+        perror_msg("connect('%s')", sunx.sun_path);
+        close(fd);
+        return r;
+    }
+
+    int r = problem_submission_write(ps, fd);
+    if (r < 0)
+    {
+        close(fd);
+        return r;
+    }
+    shutdown(fd, SHUT_WR);
+
+    /* "HTTP/1.1 201 Created" */
+    char response[64];
+    const ssize_t len = full_read(fd, response, sizeof(response) - 1);
+    close(fd);
+    if (len < 0)
+        return -EIO;
+    response[len] = '\0';
+
+    unsigned status;
+    if (sscanf(response, "HTTP/%*u.%*u %u", &status) != 1)
+    {
+        error_msg("Invalid response of abrtd: '%s'", response);
+        return -EPROTO;
+    }
+
+    return status;
+}
@@ -0,0 +1,603 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Size ledger
+ *
+ * The ledger lives in DumpLocation/.size-ledger and remembers size and mtime
+ * of every problem directory, so that neither the total size nor trimming
+ * has to walk the dump location. The file is mmap()ed, it holds:
+ *
+ *   - a header with the total size of all directories,
+ *   - an open addressing hash table of the directories, keyed by name,
+ *   - a binary max-heap of the table slots ordered by trimming weight.
+ *
+ * Updating or forgetting a directory and picking a victim cost O(log N),
+ * reading the total costs O(1). The table is rebuilt twice as big when it
+ * gets half full (deleted slots count as full).
+ *
+ * The weight of a directory is size * 2^(age / 1 day): big and old
+ * directories go first. Unlike size * age, which get_dirsize_find_largest_dir()
+ * uses, this order doesn't change as the directories age, so it can be kept
+ * in the heap.
+ *
+ * The entries are updated by post-create and after the notify event.
+ * Reporting adds files to problem directories without telling us, so the
+ * victims of trimming are measured again if their mtime changed. abrtd checks
+ * the whole ledger against the dump location on startup, because directories
+ * could have been created, changed or deleted while it was not running.
+ * A missing ledger means "not available", all updates are then ignored and
+ * trimming falls back to walking the dump location.
+ *
+ * The file is flock()ed while it is mapped.
+ */
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "internal_libabrt.h"
+
+#define SIZE_LEDGER_FILE      ".size-ledger"
+#define SIZE_LEDGER_MAGIC     0x737a6c67 /* "szlg" */
+#define SIZE_LEDGER_VERSION   1
+#define SIZE_LEDGER_MIN_SLOTS 256
+#define SIZE_LEDGER_MAX_DELETED 20
+/* The weight of a directory doubles with every day of its age */
+#define SIZE_LEDGER_AGE_SCALE (24 * 60 * 60)
+
+enum {
+    SLOT_FREE = 0,
+    SLOT_USED,
+    SLOT_DELETED,
+};
+
+struct ledger_slot {
+    char name[NAME_MAX + 1];
+    uint32_t state;
+    uint32_t heap_pos;
+    uint64_t size;
+    int64_t mtime;
+    double key;         /* log2 of the weight, less now / SIZE_LEDGER_AGE_SCALE */
+};
+
+struct ledger_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;    /* power of two */
+    uint32_t used;          /* also the number of heap items */
+    uint32_t deleted;
+    uint32_t reserved;
+    uint64_t total;
+    /* struct ledger_slot slots[slot_count]; */
+    /* uint32_t heap[slot_count]; slot indexes */
+};
+
+struct ledger {
+    int fd;
+    size_t map_size;
+    struct ledger_header *hdr;
+    struct ledger_slot *slots;
+    uint32_t *heap;
+};
+
+static size_t ledger_file_size(uint32_t slot_count)
+{
+    return sizeof(struct ledger_header)
+            + (size_t)slot_count * (sizeof(struct ledger_slot) + sizeof(uint32_t));
+}
+
+static const char *basename_of(const char *dump_dir_name)
+{
+    const char *name = strrchr(dump_dir_name, '/');
+    return name ? name + 1 : dump_dir_name;
+}
+
+static int map_ledger(struct ledger *l, size_t size)
+{
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, l->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror_msg("Can't mmap '%s'", SIZE_LEDGER_FILE);
+        return -1;
+    }
+    l->map_size = size;
+    l->hdr = map;
+    l->slots = (struct ledger_slot *)(l->hdr + 1);
+    l->heap = (uint32_t *)(l->slots + l->hdr->slot_count);
+    return 0;
+}
+
+static void unmap_ledger(struct ledger *l)
+{
+    if (l->hdr)
+        munmap(l->hdr, l->map_size);
+    l->hdr = NULL;
+}
+
+/* Truncates the file to an empty ledger of slot_count slots */
+static int init_ledger(struct ledger *l, uint32_t slot_count)
+{
+    unmap_ledger(l);
+    const size_t size = ledger_file_size(slot_count);
+    if (ftruncate(l->fd, 0) != 0 || ftruncate(l->fd, size) != 0)
+    {
+        perror_msg("Can't resize '%s'", SIZE_LEDGER_FILE);
+        return -1;
+    }
+
+    struct ledger_header hdr = {
+        .magic = SIZE_LEDGER_MAGIC,
+        .version = SIZE_LEDGER_VERSION,
+        .slot_count = slot_count,
+    };
+    if (pwrite(l->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+    {
+        perror_msg("Can't write '%s'", SIZE_LEDGER_FILE);
+        return -1;
+    }
+    return map_ledger(l, size);
+}
+
+static bool ledger_is_valid(int fd, const struct stat *sb)
+{
+    struct ledger_header hdr;
+    if (sb->st_size < (off_t)sizeof(hdr) || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+        return false;
+    return hdr.magic == SIZE_LEDGER_MAGIC
+        && hdr.version == SIZE_LEDGER_VERSION
+        && hdr.slot_count >= SIZE_LEDGER_MIN_SLOTS
+        && (hdr.slot_count & (hdr.slot_count - 1)) == 0
+        && sb->st_size == (off_t)ledger_file_size(hdr.slot_count)
+        && hdr.used <= hdr.slot_count;
+}
+
+/* With O_CREAT in flags, an invalid ledger (the text format of older versions,
+ * for example) is replaced by an empty one. Returns -1 if there is no ledger. */
+static int open_ledger(struct ledger *l, const char *dump_location, int flags, int lock)
+{
+    memset(l, 0, sizeof(*l));
+    char *path = concat_path_file(dump_location, SIZE_LEDGER_FILE);
+    l->fd = open(path, flags | O_RDWR | O_CLOEXEC, 0600);
+    if (l->fd < 0)
+    {
+        if (errno != ENOENT)
+            perror_msg("Can't open '%s'", path);
+        free(path);
+        return -1;
+    }
+
+    struct stat sb;
+    if (flock(l->fd, lock) != 0)
+        perror_msg("Can't lock '%s'", path);
+    else if (fstat(l->fd, &sb) != 0)
+        perror_msg("Can't stat '%s'", path);
+    else if (ledger_is_valid(l->fd, &sb))
+    {
+        if (map_ledger(l, sb.st_size) == 0)
+            goto ret;
+    }
+    else if (flags & O_CREAT)
+    {
+        if (init_ledger(l, SIZE_LEDGER_MIN_SLOTS) == 0)
+            goto ret;
+    }
+    else
+        log_notice("'%s' is not valid, ignoring it", path);
+
+    close(l->fd);
+    l->fd = -1;
+
+ ret:
+    free(path);
+    return l->fd;
+}
+
+static void close_ledger(struct ledger *l)
+{
+    unmap_ledger(l);
+    close(l->fd);
+}
+
+/* log2(weight) - now / SIZE_LEDGER_AGE_SCALE, log2 of the size is
+ * interpolated linearly between powers of two */
+static double weight_key(uint64_t size, int64_t mtime)
+{
+    uint64_t v = size + 1;
+    unsigned exp = 0;
+    while ((v >> exp) > 1)
+        exp++;
+    const double log2_size = exp + (double)(v - (1ULL << exp)) / (1ULL << exp);
+    return log2_size - (double)mtime / SIZE_LEDGER_AGE_SCALE;
+}
+
+/* Binary max-heap of slot indexes ordered by key */
+static void heap_set(struct ledger *l, uint32_t pos, uint32_t idx)
+{
+    l->heap[pos] = idx;
+    l->slots[idx].heap_pos = pos;
+}
+
+static double heap_key(const struct ledger *l, uint32_t pos)
+{
+    return l->slots[l->heap[pos]].key;
+}
+
+static void heap_fix(struct ledger *l, uint32_t pos)
+{
+    const uint32_t idx = l->heap[pos];
+    const double key = l->slots[idx].key;
+
+    while (pos > 0 && heap_key(l, (pos - 1) / 2) < key)
+    {
+        heap_set(l, pos, l->heap[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+
+    const uint32_t count = l->hdr->used;
+    for (;;)
+    {
+        uint32_t largest = 2 * pos + 1;
+        if (largest >= count)
+            break;
+        if (largest + 1 < count && heap_key(l, largest + 1) > heap_key(l, largest))
+            largest++;
+        if (heap_key(l, largest) <= key)
+            break;
+        heap_set(l, pos, l->heap[largest]);
+        pos = largest;
+    }
+    heap_set(l, pos, idx);
+}
+
+static uint32_t name_hash(const char *name)
+{
+    /* FNV-1a */
+    uint32_t h = 0x811c9dc5;
+    for (const char *s = name; *s; ++s)
+        h = (h ^ (unsigned char)*s) * 0x01000193;
+    return h;
+}
+
+/* Returns the slot of name or NULL. *free_slot is set to the slot
+ * where name would be inserted. */
+static struct ledger_slot *find_slot(const struct ledger *l, const char *name, struct ledger_slot **free_slot)
+{
+    const uint32_t mask = l->hdr->slot_count - 1;
+    uint32_t i = name_hash(name) & mask;
+    for (uint32_t n = 0; n <= mask; ++n, i = (i + 1) & mask)
+    {
+        struct ledger_slot *slot = &l->slots[i];
+        if (slot->state == SLOT_USED)
+        {
+            if (strcmp(slot->name, name) == 0)
+                return slot;
+            continue;
+        }
+        if (free_slot && !*free_slot)
+            *free_slot = slot;
+        if (slot->state == SLOT_FREE)
+            break;
+    }
+    return NULL;
+}
+
+static void remove_slot(struct ledger *l, struct ledger_slot *slot)
+{
+    const uint32_t pos = slot->heap_pos;
+    const uint32_t last = --l->hdr->used;
+    if (pos != last)
+    {
+        heap_set(l, pos, l->heap[last]);
+        heap_fix(l, pos);
+    }
+
+    l->hdr->total -= slot->size;
+    l->hdr->deleted++;
+    slot->state = SLOT_DELETED;
+}
+
+static void set_slot(struct ledger *l, struct ledger_slot *slot, uint64_t size, int64_t mtime)
+{
+    l->hdr->total = l->hdr->total - slot->size + size;
+    slot->size = size;
+    slot->mtime = mtime;
+    slot->key = weight_key(size, mtime);
+    heap_fix(l, slot->heap_pos);
+}
+
+static int insert_slot(struct ledger *l, const char *name, uint64_t size, int64_t mtime);
+
+/* Moves the entries to a new table with room for at least one more */
+static int rehash_ledger(struct ledger *l)
+{
+    const uint32_t used = l->hdr->used;
+    uint32_t slot_count = SIZE_LEDGER_MIN_SLOTS;
+    while ((used + 1) * 4 > slot_count)
+        slot_count *= 2;
+
+    struct ledger_slot *old = xmalloc(sizeof(old[0]) * (used + 1));
+    for (uint32_t i = 0; i < used; ++i)
+        old[i] = l->slots[l->heap[i]];
+
+    int r = init_ledger(l, slot_count);
+    for (uint32_t i = 0; r == 0 && i < used; ++i)
+        r = insert_slot(l, old[i].name, old[i].size, old[i].mtime);
+    free(old);
+
+    if (r != 0)
+    {
+        /* Not valid anymore, abrtd rebuilds it on its next start */
+        unmap_ledger(l);
+        if (ftruncate(l->fd, 0) != 0)
+            perror_msg("Can't truncate '%s'", SIZE_LEDGER_FILE);
+    }
+    return r;
+}
+
+static int insert_slot(struct ledger *l, const char *name, uint64_t size, int64_t mtime)
+{
+    if (strlen(name) > NAME_MAX)
+        return -1;
+
+    if ((l->hdr->used + l->hdr->deleted + 1) * 2 > l->hdr->slot_count)
+    {
+        if (rehash_ledger(l) != 0)
+            return -1;
+    }
+
+    struct ledger_slot *slot = NULL;
+    find_slot(l, name, &slot);
+    if (slot->state == SLOT_DELETED)
+        l->hdr->deleted--;
+    strcpy(slot->name, name);
+    slot->state = SLOT_USED;
+    slot->size = 0;
+    heap_set(l, l->hdr->used++, slot - l->slots);
+    set_slot(l, slot, size, mtime);
+    return 0;
+}
+
+/* Returns -1 if the ledger is not usable anymore */
+static int update_entry(struct ledger *l, const char *name, uint64_t size, int64_t mtime)
+{
+    struct ledger_slot *slot = find_slot(l, name, NULL);
+    if (slot)
+    {
+        set_slot(l, slot, size, mtime);
+        return 0;
+    }
+    return insert_slot(l, name, size, mtime);
+}
+
+void size_ledger_update(const char *dump_location, const char *dump_dir_name)
+{
+    struct stat sb;
+    if (stat(dump_dir_name, &sb) != 0 || !S_ISDIR(sb.st_mode))
+    {
+        size_ledger_forget(dump_location, dump_dir_name);
+        return;
+    }
+
+    /* Measure before taking the lock, it takes time */
+    const double size = get_dirsize(dump_dir_name);
+
+    struct ledger l;
+    if (open_ledger(&l, dump_location, 0, LOCK_EX) < 0)
+        return;
+    update_entry(&l, basename_of(dump_dir_name), size, sb.st_mtime);
+    close_ledger(&l);
+}
+
+void size_ledger_forget(const char *dump_location, const char *dump_dir_name)
+{
+    struct ledger l;
+    if (open_ledger(&l, dump_location, 0, LOCK_EX) < 0)
+        return;
+    struct ledger_slot *slot = find_slot(&l, basename_of(dump_dir_name), NULL);
+    if (slot)
+        remove_slot(&l, slot);
+    close_ledger(&l);
+}
+
+int size_ledger_check(const char *dump_location)
+{
+    struct ledger l;
+    if (open_ledger(&l, dump_location, O_CREAT, LOCK_EX) < 0)
+        return -1;
+
+    DIR *dp = opendir(dump_location);
+    if (!dp)
+    {
+        perror_msg("Can't open directory '%s'", dump_location);
+        close_ledger(&l);
+        return -1;
+    }
+
+    /* Size is recomputed only for directories which are new or changed */
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    unsigned changed = 0;
+    int r = 0;
+    struct dirent *dent;
+    while ((dent = readdir(dp)) != NULL)
+    {
+        /* Skip our own files and directories which are being created */
+        const char *ext = strrchr(dent->d_name, '.');
+        if (dent->d_name[0] == '.' || (ext && strcmp(ext, ".new") == 0))
+            continue;
+
+        char *path = concat_path_file(dump_location, dent->d_name);
+        struct stat sb;
+        if (lstat(path, &sb) == 0 && S_ISDIR(sb.st_mode))
+        {
+            g_hash_table_insert(seen, xstrdup(dent->d_name), (gpointer)1);
+            struct ledger_slot *slot = find_slot(&l, dent->d_name, NULL);
+            if (!slot || slot->mtime != sb.st_mtime)
+            {
+                r = update_entry(&l, dent->d_name, get_dirsize(path), sb.st_mtime);
+                ++changed;
+            }
+        }
+        free(path);
+        if (r != 0)
+            break;
+    }
+    closedir(dp);
+
+    /* Whatever was not seen belongs to deleted directories */
+    for (uint32_t i = 0; r == 0 && i < l.hdr->slot_count; ++i)
+    {
+        struct ledger_slot *slot = &l.slots[i];
+        if (slot->state == SLOT_USED && !g_hash_table_lookup(seen, slot->name))
+        {
+            remove_slot(&l, slot);
+            ++changed;
+        }
+    }
+
+    if (changed)
+        log_notice("Size ledger of '%s' had %u stale entries", dump_location, changed);
+
+    g_hash_table_destroy(seen);
+    close_ledger(&l);
+    return r;
+}
+
+double size_ledger_total(const char *dump_location)
+{
+    struct ledger l;
+    if (open_ledger(&l, dump_location, 0, LOCK_SH) < 0)
+        return -1;
+    const double total = l.hdr->total;
+    close_ledger(&l);
+    return total;
+}
+
+double get_dump_location_usage(const char *dump_location)
+{
+    /* abrtd publishes the size in its stats file, reading it is the cheapest */
+    char *stats = xmalloc_open_read_close(VAR_RUN"/abrt/abrtd.stats", /*maxsize:*/ NULL);
+    if (stats)
+    {
+        const char *key = "dump_location_size=";
+        const char *p = stats;
+        while (p && strncmp(p, key, strlen(key)) != 0)
+        {
+            p = strchr(p, '\n');
+            if (p)
+                p++;
+        }
+        double size = p ? strtod(p + strlen(key), NULL) : -1;
+        free(stats);
+        if (size >= 0)
+            return size;
+    }
+
+    return size_ledger_total(dump_location);
+}
+
+/* The heaviest directory but excluded. The heap is not changed, so if its top
+ * is excluded, the next one is one of the top's children. */
+static struct ledger_slot *pick_victim(struct ledger *l, const struct ledger_slot *excluded)
+{
+    const uint32_t count = l->hdr->used;
+    if (count == 0)
+        return NULL;
+
+    struct ledger_slot *top = &l->slots[l->heap[0]];
+    if (top != excluded)
+        return top;
+
+    if (count == 1)
+        return NULL;
+    uint32_t pos = 1;
+    if (count > 2 && heap_key(l, 2) > heap_key(l, 1))
+        pos = 2;
+    return &l->slots[l->heap[pos]];
+}
+
+int size_ledger_trim(const char *dump_location, double cap_size, const char *excluded_basename)
+{
+    /* Victims are picked and removed from the ledger under the lock,
+     * but deleted only after it is released: deleting takes time */
+    struct ledger l;
+    if (open_ledger(&l, dump_location, 0, LOCK_EX) < 0)
+        return -1;
+
+    double cur_size = l.hdr->total;
+    const struct ledger_slot *excluded = NULL;
+    if (excluded_basename)
+    {
+        excluded = find_slot(&l, excluded_basename, NULL);
+        /* Newly created directory isn't in the ledger until its post-create is done */
+        if (!excluded)
+        {
+            char *path = concat_path_file(dump_location, excluded_basename);
+            cur_size += get_dirsize(path);
+            free(path);
+        }
+    }
+
+    GList *victims = NULL;
+    unsigned deleted = 0;
+    unsigned measured = 0;
+    while (cur_size > cap_size && deleted < SIZE_LEDGER_MAX_DELETED)
+    {
+        struct ledger_slot *victim = pick_victim(&l, excluded);
+        if (!victim)
+            break;
+
+        char *path = concat_path_file(dump_location, victim->name);
+        struct stat sb;
+        if (lstat(path, &sb) != 0 || !S_ISDIR(sb.st_mode))
+        {
+            /* Deleted behind our back */
+            cur_size -= victim->size;
+            remove_slot(&l, victim);
+            free(path);
+            continue;
+        }
+        /* Changed since it was measured, it may not be the heaviest one */
+        if (sb.st_mtime != victim->mtime && measured++ < SIZE_LEDGER_MAX_DELETED)
+        {
+            cur_size -= victim->size;
+            set_slot(&l, victim, get_dirsize(path), sb.st_mtime);
+            cur_size += victim->size;
+            free(path);
+            continue;
+        }
+
+        log("%s is %.0f bytes (more than %.0fMiB), deleting '%s'",
+                dump_location, cur_size, cap_size / (1024*1024), victim->name);
+        victims = g_list_prepend(victims, path);
+
+        cur_size -= victim->size;
+        remove_slot(&l, victim);
+        deleted++;
+    }
+    log_info("cur_size:%.0f cap_size:%.0f, no (more) trimming", cur_size, cap_size);
+
+    close_ledger(&l);
+
+    for (GList *li = victims; li; li = li->next)
+    {
+        dup_index_forget_dump_dir(dump_location, li->data);
+        delete_dump_dir(li->data);
+    }
+    g_list_free_full(victims, free);
+
+    return 0;
+}
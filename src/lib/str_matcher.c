@@ -0,0 +1,158 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Multi-pattern substring search
+ *
+ * Aho-Corasick automaton compiled into a full transition table, so that
+ * the search reads every input byte exactly once regardless of the number
+ * of patterns. To keep the table small, input bytes are first mapped to
+ * classes: every byte which occurs in some pattern has its own class, all
+ * other bytes share class 0.
+ */
+
+#include "libabrt.h"
+
+struct str_matcher {
+    unsigned nclasses;
+    unsigned nstates;
+    unsigned char byte_class[256];
+    /* Bytes which don't move the automaton away from the root state */
+    bool root_loop[256];
+    /* Index of a pattern which ends in the state, -1: none */
+    int *out;
+    /* nstates rows of nclasses next states */
+    unsigned *delta;
+};
+
+struct str_matcher *str_matcher_new(const char *const *patterns)
+{
+    struct str_matcher *m = xzalloc(sizeof(*m));
+
+    unsigned max_states = 1;
+    m->nclasses = 1;
+    for (const char *const *pat = patterns; *pat; ++pat)
+    {
+        for (const unsigned char *c = (const unsigned char *)*pat; *c; ++c)
+        {
+            if (!m->byte_class[*c])
+                m->byte_class[*c] = m->nclasses++;
+            max_states++;
+        }
+    }
+
+    /* Build the trie, 0 in delta means "no edge" for now */
+    m->delta = xzalloc(sizeof(m->delta[0]) * max_states * m->nclasses);
+    m->out = xmalloc(sizeof(m->out[0]) * max_states);
+    m->out[0] = -1;
+    m->nstates = 1;
+    for (const char *const *pat = patterns; *pat; ++pat)
+    {
+        unsigned state = 0;
+        for (const unsigned char *c = (const unsigned char *)*pat; *c; ++c)
+        {
+            unsigned *next = &m->delta[state * m->nclasses + m->byte_class[*c]];
+            if (!*next)
+            {
+                *next = m->nstates;
+                m->out[m->nstates++] = -1;
+            }
+            state = *next;
+        }
+        if (m->out[state] < 0)
+            m->out[state] = pat - patterns;
+    }
+
+    /* Breadth-first, fill missing edges with edges of the failure state.
+     * Failure states are shallower, hence already complete.
+     */
+    unsigned *fail = xzalloc(sizeof(fail[0]) * m->nstates);
+    unsigned *queue = xmalloc(sizeof(queue[0]) * m->nstates);
+    unsigned head = 0, tail = 0;
+    for (unsigned c = 0; c < m->nclasses; ++c)
+        if (m->delta[c])
+            queue[tail++] = m->delta[c];
+
+    while (head < tail)
+    {
+        unsigned state = queue[head++];
+        if (m->out[state] < 0)
+            m->out[state] = m->out[fail[state]];
+
+        unsigned *row = &m->delta[state * m->nclasses];
+        const unsigned *fail_row = &m->delta[fail[state] * m->nclasses];
+        for (unsigned c = 0; c < m->nclasses; ++c)
+        {
+            if (row[c])
+            {
+                fail[row[c]] = fail_row[c];
+                queue[tail++] = row[c];
+            }
+            else
+                row[c] = fail_row[c];
+        }
+    }
+    free(queue);
+    free(fail);
+
+    for (unsigned b = 0; b < 256; ++b)
+        m->root_loop[b] = (m->delta[m->byte_class[b]] == 0);
+
+    return m;
+}
+
+void str_matcher_free(struct str_matcher *m)
+{
+    if (!m)
+        return;
+    free(m->delta);
+    free(m->out);
+    free(m);
+}
+
+int str_matcher_find(const struct str_matcher *m, const char *buf, size_t len)
+{
+    /* An empty pattern matches anything */
+    if (m->out[0] >= 0)
+        return m->out[0];
+
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    unsigned state = 0;
+    while (p < end)
+    {
+        if (state == 0)
+        {
+            /* Most of the input is skipped here */
+            while (p < end && m->root_loop[*p])
+                p++;
+            if (p == end)
+                break;
+        }
+        state = m->delta[state * m->nclasses + m->byte_class[*p++]];
+        if (m->out[state] >= 0)
+            return m->out[state];
+    }
+
+    return -1;
+}
+
+int str_matcher_find_str(const struct str_matcher *m, const char *str)
+{
+    return str_matcher_find(m, str, strlen(str));
+}
@@ -59,9 +59,27 @@ int main(int argc, char **argv)
     map_string_t *settings = new_map_string();
     load_abrt_plugin_conf_file("oops.conf", settings);
 
-    char *oops = dd_load_text(dd, FILENAME_BACKTRACE);
     char hash_str[SHA1_RESULT_LEN*2 + 1];
-    int bad = koops_hash_str(hash_str, oops);
+    int bad = 1;
+
+    /* The extractor saves the duphash if it has computed it */
+    char *saved_hash = dd_load_text_ext(dd, FILENAME_KOOPS_DUPHASH,
+            DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+    if (saved_hash && strlen(saved_hash) == SHA1_RESULT_LEN*2)
+    {
+        log_info("Using the duphash computed by the oops extractor");
+        strcpy(hash_str, saved_hash);
+        bad = 0;
+    }
+    free(saved_hash);
+
+    char *oops = NULL;
+    if (bad)
+    {
+        oops = dd_load_text(dd, FILENAME_BACKTRACE);
+        bad = koops_hash_str(hash_str, oops);
+    }
+
     if (bad)
     {
         error_msg("Can't find a meaningful backtrace for hashing in '%s'", dump_dir_name);
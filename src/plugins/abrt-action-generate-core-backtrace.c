@@ -18,9 +18,75 @@
 */
 #include <satyr/abrt.h>
 #include <satyr/utils.h>
+#include <satyr/core/fingerprint.h>
+#include <satyr/core/stacktrace.h>
+#include <satyr/core/unwind.h>
 
 #include "libabrt.h"
 
+/* sr_abrt_create_core_stacktrace*() read DIR/coredump. If the core is
+ * stored compressed, it is unpacked to a temporary file and the stacktrace
+ * is created the same way from that file.
+ */
+static bool create_core_stacktrace(const char *dump_dir_name, const char *gdb_output,
+                                   bool hash_fingerprints, char **error_message)
+{
+    bool core_is_temporary = false;
+    char *core_path = get_coredump_path(dump_dir_name, &core_is_temporary);
+    if (!core_path)
+    {
+        *error_message = xstrdup(_("Can't unpack the core dump"));
+        return false;
+    }
+
+    if (!core_is_temporary)
+    {
+        free(core_path);
+        if (gdb_output)
+            return sr_abrt_create_core_stacktrace_from_gdb(dump_dir_name, gdb_output,
+                                                           hash_fingerprints, error_message);
+        return sr_abrt_create_core_stacktrace(dump_dir_name, hash_fingerprints, error_message);
+    }
+
+    bool success = false;
+    struct sr_core_stacktrace *core_stacktrace = NULL;
+    struct dump_dir *dd = dd_opendir(dump_dir_name, /*flags:*/ 0);
+    if (!dd)
+    {
+        *error_message = xasprintf(_("Can't open problem directory '%s'"), dump_dir_name);
+        goto ret;
+    }
+
+    char *executable = dd_load_text(dd, FILENAME_EXECUTABLE);
+    if (gdb_output)
+        core_stacktrace = sr_core_stacktrace_from_gdb(gdb_output, core_path, executable,
+                                                      error_message);
+    else
+        core_stacktrace = sr_parse_coredump(core_path, executable, error_message);
+    free(executable);
+    if (!core_stacktrace)
+        goto ret;
+
+    if (!sr_core_fingerprint_generate(core_stacktrace, error_message))
+        goto ret;
+    if (hash_fingerprints)
+        sr_core_fingerprint_hash(core_stacktrace);
+
+    char *json = sr_core_stacktrace_to_json(core_stacktrace);
+    char *text = xasprintf("%s\n", json);
+    dd_save_text(dd, FILENAME_CORE_BACKTRACE, text);
+    free(text);
+    free(json);
+    success = true;
+
+ ret:
+    sr_core_stacktrace_free(core_stacktrace);
+    dd_close(dd);
+    unlink(core_path);
+    free(core_path);
+    return success;
+}
+
 int main(int argc, char **argv)
 {
     /* I18n */
@@ -68,8 +134,8 @@ int main(int argc, char **argv)
 
 #ifdef ENABLE_NATIVE_UNWINDER
 
-    success = sr_abrt_create_core_stacktrace(dump_dir_name, !raw_fingerprints,
-                                             &error_message);
+    success = create_core_stacktrace(dump_dir_name, /*gdb_output:*/ NULL,
+                                     !raw_fingerprints, &error_message);
 #else /* ENABLE_NATIVE_UNWINDER */
 
     /* The value 240 was taken from abrt-action-generate-backtrace.c. */
@@ -82,10 +148,8 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    success = sr_abrt_create_core_stacktrace_from_gdb(dump_dir_name,
-                                                      gdb_output,
-                                                      !raw_fingerprints,
-                                                      &error_message);
+    success = create_core_stacktrace(dump_dir_name, gdb_output,
+                                     !raw_fingerprints, &error_message);
     free(gdb_output);
 
 #endif /* ENABLE_NATIVE_UNWINDER */
@@ -17,61 +17,59 @@
 #include "oops-utils.h"
 
 #define ABRT_JOURNAL_WATCH_STATE_FILE VAR_STATE"/abrt-dump-journal-oops.state"
-#define ABRT_JOURNAL_WATCH_STATE_FILE_MODE 0600
-#define ABRT_JOURNAL_WATCH_STATE_FILE_MAX_SZ (4 * 1024)
-
-/* Limit number of buffered lines */
-#define ABRT_JOURNAL_MAX_READ_LINES (1024 * 1024)
-
-/* Forward declarations */
-static void save_abrt_journal_watch_position(abrt_journal_t *journal, const char *file_name);
 
 /*
  * Koops extractor
  */
 
-static GList* abrt_journal_extract_kernel_oops(abrt_journal_t *journal)
+static GPtrArray *abrt_journal_extract_kernel_oops(abrt_journal_t *journal)
 {
-    size_t lines_info_count = 0;
-    size_t lines_info_size = 32;
-    struct abrt_koops_line_info *lines_info = xmalloc(lines_info_size * sizeof(lines_info[0]));
+    GPtrArray *oopses = g_ptr_array_new_with_free_func(free);
+    struct koops_parser *parser = koops_parser_new(abrt_oops_array_append, oopses);
+
+    /* Only for messages with a level or time stamp prefix */
+    char *buf = NULL;
+    size_t buf_size = 0;
 
     do
     {
-        char *line = abrt_journal_get_log_line(journal);
-        if (line == NULL)
+        const char *msg;
+        size_t len;
+        if (abrt_journal_get_message(journal, &msg, &len) < 0)
             error_msg_and_die(_("Cannot read journal data."));
 
-        if (lines_info_count == lines_info_size)
+        /* journald stores kernel messages without these prefixes, the rare
+         * message which has them is copied because the parsing functions
+         * need a NULL terminated string */
+        int level = 0;
+        if (len != 0 && (msg[0] == '<' || msg[0] == '['))
         {
-            lines_info_size *= 2;
-            lines_info = xrealloc(lines_info, lines_info_size * sizeof(lines_info[0]));
-        }
-
-        char *orig_line = line;
-        lines_info[lines_info_count].level = koops_line_skip_level((const char **)&line);
-        koops_line_skip_jiffies((const char **)&line);
-
-        memmove(orig_line, line, strlen(line) + 1);
+            if (len >= buf_size)
+            {
+                buf_size = len + 1;
+                buf = xrealloc(buf, buf_size);
+            }
+            memcpy(buf, msg, len);
+            buf[len] = '\0';
 
-        lines_info[lines_info_count].ptr = orig_line;
+            msg = buf;
+            level = koops_line_skip_level(&msg);
+            koops_line_skip_jiffies(&msg);
+            len = strlen(msg);
+        }
 
-        ++lines_info_count;
+        /* Copied only if it can be a part of an oops */
+        koops_parser_feed_line_len(parser, msg, len, level);
     }
-    while (lines_info_count < ABRT_JOURNAL_MAX_READ_LINES
-            && abrt_journal_next(journal) > 0);
-
-    GList *oops_list = NULL;
-    koops_extract_oopses_from_lines(&oops_list, lines_info, lines_info_count);
+    while (abrt_journal_next(journal) > 0);
 
-    log_debug("Extracted: %d oopses", g_list_length(oops_list));
+    koops_parser_finish(parser);
+    koops_parser_free(parser);
+    free(buf);
 
-    for (size_t i = 0; i < lines_info_count; ++i)
-        free(lines_info[i].ptr);
+    log_debug("Extracted: %u oopses", oopses->len);
 
-    free(lines_info);
-
-    return oops_list;
+    return oopses;
 }
 
 /*
@@ -89,16 +87,17 @@ static void abrt_journal_watch_extract_kernel_oops(abrt_journal_watch_t *watch,
 
     abrt_journal_t *journal = abrt_journal_watch_get_journal(watch);
 
-    /* Give systemd-journal one second to suck in all kernel's strings */
-    if (abrt_oops_signaled_sleep(1) > 0)
+    /* Give systemd-journal time to suck in all kernel's strings: wait until
+     * the kernel stops logging for a moment, but at most one second */
+    if (abrt_journal_wait_quiet(journal, 200, 1000) > 0)
     {
         abrt_journal_watch_stop(watch);
         return;
     }
 
-    GList *oopses = abrt_journal_extract_kernel_oops(journal);
+    GPtrArray *oopses = abrt_journal_extract_kernel_oops(journal);
     abrt_oops_process_list(oopses, conf->dump_location, conf->oops_utils_flags);
-    g_list_free_full(oopses, (GDestroyNotify)free);
+    g_ptr_array_free(oopses, TRUE);
 
     /* Skip stuff which appeared while processing oops as it is not necessary */
     /* to catch all consecutive oopses (anyway such oopses are almost */
@@ -107,7 +106,7 @@ static void abrt_journal_watch_extract_kernel_oops(abrt_journal_watch_t *watch,
 
     /* In case of disaster, lets make sure we won't read the journal messages */
     /* again. */
-    save_abrt_journal_watch_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
+    abrt_journal_save_current_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
 
     if (g_abrt_oops_sleep_woke_up_on_signal > 0)
         abrt_journal_watch_stop(watch);
@@ -117,94 +116,6 @@ static void abrt_journal_watch_extract_kernel_oops(abrt_journal_watch_t *watch,
  * Koops extractor end
  */
 
-static void try_restore_abrt_journal_watch_position(abrt_journal_t *journal, const char *file_name)
-{
-    struct stat buf;
-    if (lstat(file_name, &buf) < 0)
-    {
-        if (errno == ENOENT)
-        {
-            /* Only notice because this is expected */
-            log_notice(_("Not restoring journal watch's position: file '%s' does not exist"), file_name);
-            return;
-        }
-
-        perror_msg(_("Cannot restore journal watch's position form file '%s'"), file_name);
-        return;
-    }
-
-    if (!(buf.st_mode & S_IFREG))
-    {
-        error_msg(_("Cannot restore journal watch's position: path '%s' is not regular file"), file_name);
-        return;
-    }
-
-    if (buf.st_size > ABRT_JOURNAL_WATCH_STATE_FILE_MAX_SZ)
-    {
-        error_msg(_("Cannot restore journal watch's position: file '%s' exceeds %dB size limit"),
-                file_name, ABRT_JOURNAL_WATCH_STATE_FILE_MAX_SZ);
-        return;
-    }
-
-    int state_fd = open(file_name, O_RDONLY | O_NOFOLLOW);
-    if (state_fd < 0)
-    {
-        perror_msg(_("Cannot restore journal watch's position: open('%s')"), file_name);
-        return;
-    }
-
-    char *crsr = xmalloc(buf.st_size + 1);
-
-    const int sz = full_read(state_fd, crsr, buf.st_size);
-    if (sz != buf.st_size)
-    {
-        error_msg(_("Cannot restore journal watch's position: cannot read entire file '%s'"), file_name);
-        close(state_fd);
-        return;
-    }
-
-    crsr[sz] = '\0';
-    close(state_fd);
-
-    const int r = abrt_journal_set_cursor(journal, crsr);
-    if (r < 0)
-    {
-        /* abrt_journal_set_cursor() prints error message in verbose mode */
-        error_msg(_("Failed to move the journal to a cursor from file '%s'"), file_name);
-        return;
-    }
-
-    free(crsr);
-}
-
-static void save_abrt_journal_watch_position(abrt_journal_t *journal, const char *file_name)
-{
-    char *crsr = NULL;
-    const int r = abrt_journal_get_cursor(journal, &crsr);
-
-    if (r < 0)
-    {
-        /* abrt_journal_set_cursor() prints error message in verbose mode */
-        error_msg(_("Cannot save journal watch's position"));
-        return;
-    }
-
-    int state_fd = open(file_name,
-            O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
-            ABRT_JOURNAL_WATCH_STATE_FILE_MODE);
-
-    if (state_fd < 0)
-    {
-        perror_msg(_("Cannot save journal watch's position: open('%s')"), file_name);
-        return;
-    }
-
-    full_write_str(state_fd, crsr);
-    close(state_fd);
-
-    free(crsr);
-}
-
 static void watch_journald(abrt_journal_t *journal, const char *dump_location, int flags)
 {
     GList *koops_strings = koops_suspicious_strings_list();
@@ -256,6 +167,7 @@ static void watch_journald(abrt_journal_t *journal, const char *dump_location, i
     abrt_journal_watch_run_sync(watch);
     abrt_journal_watch_free(watch);
 
+    str_matcher_free(notify_strings_conf.matcher);
     g_list_free(koops_strings);
 }
 
@@ -367,13 +279,13 @@ int main(int argc, char *argv[])
     if ((opts & OPT_f))
     {
         if (!cursor)
-            try_restore_abrt_journal_watch_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
+            abrt_journal_restore_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
         else if(abrt_journal_set_cursor(journal, cursor))
             error_msg_and_die(_("Failed to start watch from cursor '%s'"), cursor);
 
         watch_journald(journal, dump_location, oops_utils_flags);
 
-        save_abrt_journal_watch_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
+        abrt_journal_save_current_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
     }
     else
     {
@@ -384,9 +296,9 @@ int main(int argc, char *argv[])
          * to a next message.*/
         abrt_journal_next(journal);
 
-        GList *oopses = abrt_journal_extract_kernel_oops(journal);
+        GPtrArray *oopses = abrt_journal_extract_kernel_oops(journal);
         const int errors = abrt_oops_process_list(oopses, dump_location, oops_utils_flags);
-        g_list_free_full(oopses, (GDestroyNotify)free);
+        g_ptr_array_free(oopses, TRUE);
 
         return errors;
     }
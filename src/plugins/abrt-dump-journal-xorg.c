@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2015  ABRT team
+ * Copyright (C) 2015  RedHat Inc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "libabrt.h"
+#include "abrt-journal.h"
+#include "xorg-utils.h"
+
+#define ABRT_JOURNAL_WATCH_STATE_FILE VAR_STATE"/abrt-dump-journal-xorg.state"
+
+/*
+ * Xorg extractor
+ */
+
+/* Feeds the messages from the current one to the end of the journal */
+static unsigned abrt_journal_extract_xorg_crashes(abrt_journal_t *journal, struct abrt_xorg_parser *parser)
+{
+    do
+    {
+        const char *msg;
+        size_t len;
+        if (abrt_journal_get_message(journal, &msg, &len) < 0)
+            error_msg_and_die(_("Cannot read journal data."));
+
+        /* The parser copies only the unfinished line */
+        abrt_xorg_parser_feed(parser, msg, len);
+        abrt_xorg_parser_feed(parser, "\n", 1);
+    }
+    while (abrt_journal_next(journal) > 0);
+
+    const unsigned crashes = abrt_xorg_parser_finish(parser);
+    log_debug("Extracted: %u Xorg crashes", crashes);
+
+    return crashes;
+}
+
+static void abrt_journal_watch_extract_xorg_crashes(abrt_journal_watch_t *watch, void *data)
+{
+    struct abrt_xorg_parser *parser = (struct abrt_xorg_parser *)data;
+
+    abrt_journal_t *journal = abrt_journal_watch_get_journal(watch);
+
+    /* The backtrace is logged line by line, wait until Xorg stops logging
+     * for a moment, but at most one second */
+    if (abrt_journal_wait_quiet(journal, 200, 1000) > 0)
+    {
+        abrt_journal_watch_stop(watch);
+        return;
+    }
+
+    abrt_journal_extract_xorg_crashes(journal, parser);
+
+    /* The messages have been read up to the end, the next call starts from
+     * a new message */
+    abrt_journal_save_current_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
+}
+
+/*
+ * Xorg extractor end
+ */
+
+static void watch_journald(abrt_journal_t *journal, struct abrt_xorg_parser *parser)
+{
+    GList *xorg_strings = g_list_prepend(NULL, (gpointer)ABRT_XORG_SEARCH_STRING);
+
+    struct abrt_journal_watch_notify_strings notify_strings_conf = {
+        .decorated_cb = abrt_journal_watch_extract_xorg_crashes,
+        .decorated_cb_data = parser,
+        .strings = xorg_strings,
+    };
+
+    abrt_journal_watch_t *watch = NULL;
+    if (abrt_journal_watch_new(&watch, journal, abrt_journal_watch_notify_strings, &notify_strings_conf) < 0)
+        error_msg_and_die(_("Failed to initialize systemd-journal watch"));
+
+    abrt_journal_watch_run_sync(watch);
+    abrt_journal_watch_free(watch);
+
+    str_matcher_free(notify_strings_conf.matcher);
+    g_list_free(xorg_strings);
+}
+
+int main(int argc, char *argv[])
+{
+    /* I18n */
+    setlocale(LC_ALL, "");
+#if ENABLE_NLS
+    bindtextdomain(PACKAGE, LOCALEDIR);
+    textdomain(PACKAGE);
+#endif
+
+    abrt_init(argv);
+
+    /* Can't keep these strings/structs static: _() doesn't support that */
+    const char *program_usage_string = _(
+        "& [-vsoxf] [-e]/[-c CURSOR] [-d DIR]/[-D]\n"
+        "\n"
+        "Extract Xorg crashes from systemd-journal\n"
+        "\n"
+        "-c and -e options conflicts because both specifies the first read message.\n"
+        "\n"
+        "-e is useful only for -f because the following of journal starts by reading \n"
+        "the entire journal if the last seen possition is not available.\n"
+        "\n"
+        "The last seen position is saved in "ABRT_JOURNAL_WATCH_STATE_FILE"\n"
+    );
+    enum {
+        OPT_v = 1 << 0,
+        OPT_s = 1 << 1,
+        OPT_o = 1 << 2,
+        OPT_d = 1 << 3,
+        OPT_D = 1 << 4,
+        OPT_x = 1 << 5,
+        OPT_c = 1 << 6,
+        OPT_e = 1 << 7,
+        OPT_f = 1 << 8,
+    };
+
+    char *cursor = NULL;
+    char *dump_location = NULL;
+
+    /* Keep enum above and order of options below in sync! */
+    struct options program_options[] = {
+        OPT__VERBOSE(&g_verbose),
+        OPT_BOOL(  's', NULL, NULL, _("Log to syslog")),
+        OPT_BOOL(  'o', NULL, NULL, _("Print found crash data on standard output")),
+        OPT_STRING('d', NULL, &dump_location, "DIR", _("Create problem directory in DIR for every crash found")),
+        OPT_BOOL(  'D', NULL, NULL, _("Same as -d DumpLocation, DumpLocation is specified in abrt.conf")),
+        OPT_BOOL(  'x', NULL, NULL, _("Make the problem directory world readable")),
+        OPT_STRING('c', NULL, &cursor, "CURSOR", _("Start reading systemd-journal from the CURSOR position")),
+        OPT_BOOL(  'e', NULL, NULL, _("Start reading systemd-journal from the end")),
+        OPT_BOOL(  'f', NULL, NULL, _("Follow systemd-journal from the last seen position (if available)")),
+        OPT_END()
+    };
+    unsigned opts = parse_opts(argc, argv, program_options, program_usage_string);
+
+    export_abrt_envvars(0);
+
+    msg_prefix = g_progname;
+    if ((opts & OPT_s) || getenv("ABRT_SYSLOG"))
+    {
+        logmode = LOGMODE_JOURNAL;
+    }
+
+    if ((opts & OPT_c) && (opts & OPT_e))
+        error_msg_and_die(_("You need to specify either -c CURSOR or -e"));
+
+    if (opts & OPT_D)
+    {
+        if (opts & OPT_d)
+            show_usage_and_die(program_usage_string, program_options);
+        load_abrt_conf();
+        dump_location = g_settings_dump_location;
+        g_settings_dump_location = NULL;
+        free_abrt_conf_data();
+    }
+
+    int xorg_utils_flags = 0;
+    if ((opts & OPT_x))
+        xorg_utils_flags |= ABRT_XORG_WORLD_READABLE;
+
+    if ((opts & OPT_o))
+        xorg_utils_flags |= ABRT_XORG_PRINT_STDOUT;
+
+    /* The server's name differs between releases, the matches of
+     * the same field are ORed together */
+    const char *const env_journal_filter = getenv("ABRT_DUMP_JOURNAL_XORG_DEBUG_FILTER");
+    static const char *xorg_journal_filter[4] = { 0 };
+    if (env_journal_filter)
+        xorg_journal_filter[0] = env_journal_filter;
+    else
+    {
+        xorg_journal_filter[0] = "_COMM=Xorg";
+        xorg_journal_filter[1] = "_COMM=Xorg.bin";
+        xorg_journal_filter[2] = "_COMM=gdm-x-session";
+    }
+    log_debug("Using journal match: '%s'", xorg_journal_filter[0]);
+
+    abrt_journal_t *journal = NULL;
+    if (abrt_journal_new(&journal))
+        error_msg_and_die(_("Cannot open systemd-journal"));
+
+    if (abrt_journal_set_journal_filter(journal, xorg_journal_filter) < 0)
+        error_msg_and_die(_("Cannot filter systemd-journal to Xorg data only"));
+
+    if ((opts & OPT_e) && abrt_journal_seek_tail(journal) < 0)
+        error_msg_and_die(_("Cannot seek to the end of journal"));
+
+    /* One parser for the whole run, the names of the problem directories
+     * are unique within it */
+    struct abrt_xorg_parser *parser = abrt_xorg_parser_new(dump_location, xorg_utils_flags);
+
+    if ((opts & OPT_f))
+    {
+        if (!cursor)
+            abrt_journal_restore_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
+        else if(abrt_journal_set_cursor(journal, cursor))
+            error_msg_and_die(_("Failed to start watch from cursor '%s'"), cursor);
+
+        watch_journald(journal, parser);
+
+        abrt_journal_save_current_position(journal, ABRT_JOURNAL_WATCH_STATE_FILE);
+    }
+    else
+    {
+        if (cursor && abrt_journal_set_cursor(journal, cursor))
+            error_msg_and_die(_("Failed to set systemd-journal cursor '%s'"), cursor);
+
+        /* Compatibility hack, a watch's callback gets the journal already moved
+         * to a next message.*/
+        abrt_journal_next(journal);
+
+        abrt_journal_extract_xorg_crashes(journal, parser);
+    }
+
+    abrt_xorg_parser_free(parser);
+    abrt_journal_free(journal);
+
+    return EXIT_SUCCESS;
+}
@@ -20,43 +20,26 @@
 #include "libabrt.h"
 #include "oops-utils.h"
 
-#define MAX_SCAN_BLOCK  (4*1024*1024)
-#define READ_AHEAD          (10*1024)
+/* The log is parsed as it is read, the size of the buffer doesn't limit
+ * the size of the log */
+#define SCAN_BLOCK (64*1024)
 
-static void scan_syslog_file(GList **oops_list, int fd)
+static void scan_syslog_file(GPtrArray *oopses, int fd)
 {
-    struct stat st;
-    struct stat *statbuf = &st;
-
-    /* Try to not allocate an absurd amount of memory */
-    int sz = MAX_SCAN_BLOCK - READ_AHEAD;
-    /* If it's a real file, estimate size after cur pos */
-    off_t cur_pos = lseek(fd, 0, SEEK_CUR);
-    if (cur_pos >= 0 && fstat(fd, statbuf) == 0 && S_ISREG(statbuf->st_mode))
-    {
-        off_t size_to_read = statbuf->st_size - cur_pos;
-        if (size_to_read >= 0 && sz > size_to_read)
-            sz = size_to_read;
-    }
-
-    /*
-     * In theory we have a race here, since someone can spew
-     * to /var/log/messages before we read it in...
-     * We try to deal with it by reading READ_AHEAD extra.
-     */
-    sz += READ_AHEAD;
-    char *buffer = xzalloc(sz);
+    char *buffer = xmalloc(SCAN_BLOCK);
+    struct koops_parser *parser = koops_parser_new(abrt_oops_array_append, oopses);
 
     for (;;)
     {
-        int r = full_read(fd, buffer, sz-1);
+        ssize_t r = safe_read(fd, buffer, SCAN_BLOCK);
         if (r <= 0)
             break;
-        log_debug("Read %u bytes", r);
-        koops_extract_oopses(oops_list, buffer, r);
-//TODO: rewind to last newline?
+        log_debug("Read %u bytes", (unsigned)r);
+        koops_parser_feed(parser, buffer, r);
     }
 
+    koops_parser_finish(parser);
+    koops_parser_free(parser);
     free(buffer);
 }
 
@@ -162,21 +145,21 @@ int main(int argc, char **argv)
     if (argv[0])
         xmove_fd(xopen(argv[0], O_RDONLY), STDIN_FILENO);
 
-    GList *oops_list = NULL;
-    scan_syslog_file(&oops_list, STDIN_FILENO);
+    GPtrArray *oopses = g_ptr_array_new_with_free_func(free);
+    scan_syslog_file(oopses, STDIN_FILENO);
 
     unsigned errors = 0;
     if (opts & OPT_u)
     {
         log("Updating problem directory");
-        switch (g_list_length(oops_list))
+        switch (oopses->len)
         {
             case 1:
                 {
                     struct dump_dir *dd = dd_opendir(problem_dir, /*open for writing*/0);
                     if (dd)
                     {
-                        abrt_oops_save_data_in_dump_dir(dd, (char *)oops_list->data, /*no proc modules*/NULL);
+                        abrt_oops_save_data_in_dump_dir(dd, (char *)g_ptr_array_index(oopses, 0), /*no proc modules*/NULL);
                         dd_close(dd);
                     }
                 }
@@ -188,10 +171,9 @@ int main(int argc, char **argv)
         }
     }
     else
-        errors = abrt_oops_process_list(oops_list, dump_location, oops_utils_flags);
+        errors = abrt_oops_process_list(oopses, dump_location, oops_utils_flags);
 
-    list_free_with_free(oops_list);
-    //oops_list = NULL;
+    g_ptr_array_free(oopses, TRUE);
 
     return errors;
 }
@@ -23,12 +23,6 @@
 
 #include <systemd/sd-journal.h>
 
-/*
- * http://www.freedesktop.org/software/systemd/man/sd_journal_get_data.html
- * sd_journal_set_data_threshold() : This threshold defaults to 64K by default.
- */
-#define JOURNALD_MAX_FIELD_SIZE (64*1024)
-
 
 struct abrt_journal
 {
@@ -124,6 +118,25 @@ char *abrt_journal_get_log_line(abrt_journal_t *journal)
     return abrt_journal_get_string_field(journal, "MESSAGE", NULL);
 }
 
+int abrt_journal_get_message(abrt_journal_t *journal, const char **message, size_t *len)
+{
+    size_t data_len;
+    const char *data;
+    const int r = abrt_journal_get_field(journal, "MESSAGE", (const void **)&data, &data_len);
+    if (r < 0)
+        return r;
+
+    if (data_len < strlen("MESSAGE="))
+    {
+        error_msg("Invalid data format from journal: field data are not prefixed with field name");
+        return -EINVAL;
+    }
+
+    *message = data + strlen("MESSAGE=");
+    *len = data_len - strlen("MESSAGE=");
+    return 0;
+}
+
 int abrt_journal_get_cursor(abrt_journal_t *journal, char **cursor)
 {
     const int r = sd_journal_get_cursor(journal->j, cursor);
@@ -172,10 +185,134 @@ int abrt_journal_next(abrt_journal_t *journal)
 }
 
 /*
- * ABRT systemd-journal wrapper end
+ * Watch position persistence
  */
+#define ABRT_JOURNAL_POSITION_FILE_MODE 0600
+#define ABRT_JOURNAL_POSITION_FILE_MAX_SZ (4 * 1024)
+
+int abrt_journal_restore_position(abrt_journal_t *journal, const char *file_name)
+{
+    struct stat buf;
+    if (lstat(file_name, &buf) < 0)
+    {
+        if (errno == ENOENT)
+        {
+            /* Only notice because this is expected */
+            log_notice(_("Not restoring journal watch's position: file '%s' does not exist"), file_name);
+            return -ENOENT;
+        }
+
+        perror_msg(_("Cannot restore journal watch's position form file '%s'"), file_name);
+        return -1;
+    }
+
+    if (!(buf.st_mode & S_IFREG))
+    {
+        error_msg(_("Cannot restore journal watch's position: path '%s' is not regular file"), file_name);
+        return -1;
+    }
+
+    if (buf.st_size > ABRT_JOURNAL_POSITION_FILE_MAX_SZ)
+    {
+        error_msg(_("Cannot restore journal watch's position: file '%s' exceeds %dB size limit"),
+                file_name, ABRT_JOURNAL_POSITION_FILE_MAX_SZ);
+        return -1;
+    }
+
+    int state_fd = open(file_name, O_RDONLY | O_NOFOLLOW);
+    if (state_fd < 0)
+    {
+        perror_msg(_("Cannot restore journal watch's position: open('%s')"), file_name);
+        return -1;
+    }
+
+    char *crsr = xmalloc(buf.st_size + 1);
+
+    const int sz = full_read(state_fd, crsr, buf.st_size);
+    if (sz != buf.st_size)
+    {
+        error_msg(_("Cannot restore journal watch's position: cannot read entire file '%s'"), file_name);
+        close(state_fd);
+        free(crsr);
+        return -1;
+    }
+
+    crsr[sz] = '\0';
+    close(state_fd);
+
+    const int r = abrt_journal_set_cursor(journal, crsr);
+    free(crsr);
+    if (r < 0)
+    {
+        /* abrt_journal_set_cursor() prints error message in verbose mode */
+        error_msg(_("Failed to move the journal to a cursor from file '%s'"), file_name);
+        return r;
+    }
+
+    return 0;
+}
+
+int abrt_journal_save_current_position(abrt_journal_t *journal, const char *file_name)
+{
+    char *crsr = NULL;
+    const int r = abrt_journal_get_cursor(journal, &crsr);
+
+    if (r < 0)
+    {
+        /* abrt_journal_set_cursor() prints error message in verbose mode */
+        error_msg(_("Cannot save journal watch's position"));
+        return r;
+    }
+
+    int state_fd = open(file_name,
+            O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+            ABRT_JOURNAL_POSITION_FILE_MODE);
+
+    if (state_fd < 0)
+    {
+        perror_msg(_("Cannot save journal watch's position: open('%s')"), file_name);
+        free(crsr);
+        return -1;
+    }
+
+    full_write_str(state_fd, crsr);
+    close(state_fd);
+
+    free(crsr);
+    return 0;
+}
 
 static volatile int s_loop_terminated;
+
+int abrt_journal_wait_quiet(abrt_journal_t *journal, int quiet_ms, int max_ms)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!s_loop_terminated)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const long waited_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (waited_ms >= max_ms)
+            break;
+
+        const long timeout_ms = (max_ms - waited_ms < quiet_ms ? max_ms - waited_ms : quiet_ms);
+        const int r = sd_journal_wait(journal->j, (uint64_t)timeout_ms * 1000);
+        if (r == SD_JOURNAL_NOP)
+            break;
+        if (r < 0 && r != -EINTR)
+        {
+            log_notice("Failed to wait for journal changes: %s", strerror(-r));
+            break;
+        }
+    }
+
+    return s_loop_terminated;
+}
+
+/*
+ * ABRT systemd-journal wrapper end
+ */
+
 void signal_loop_to_terminate(int signum)
 {
     signum = signum;
@@ -283,21 +420,24 @@ void abrt_journal_watch_notify_strings(abrt_journal_watch_t *watch, void *data)
 {
     struct abrt_journal_watch_notify_strings *conf = (struct abrt_journal_watch_notify_strings *)data;
 
-    char message[JOURNALD_MAX_FIELD_SIZE + 1];
-
-    if (abrt_journal_get_string_field(abrt_journal_watch_get_journal(watch), "MESSAGE", (char *)message) == NULL)
-        error_msg_and_die("Cannot read journal data.");
-
-    GList *cur = conf->strings;
-    while (cur)
+    if (conf->matcher == NULL)
     {
-        if (strstr(message, cur->data) != NULL)
-            break;
-
-        cur = g_list_next(cur);
+        const char **strings = xmalloc(sizeof(strings[0]) * (g_list_length(conf->strings) + 1));
+        const char **pp = strings;
+        for (GList *cur = conf->strings; cur; cur = g_list_next(cur))
+            *pp++ = cur->data;
+        *pp = NULL;
+        conf->matcher = str_matcher_new(strings);
+        free(strings);
     }
 
-    if (cur)
+    /* Searched in place, all strings at once */
+    const char *message;
+    size_t len;
+    if (abrt_journal_get_message(abrt_journal_watch_get_journal(watch), &message, &len) < 0)
+        error_msg_and_die("Cannot read journal data.");
+
+    if (str_matcher_find(conf->matcher, message, len) >= 0)
         conf->decorated_cb(watch, conf->decorated_cb_data);
 }
 
@@ -48,6 +48,10 @@ char *abrt_journal_get_string_field(abrt_journal_t *journal,
 
 char *abrt_journal_get_log_line(abrt_journal_t *journal);
 
+/* Zero-copy access to the MESSAGE field. The message is not NULL terminated,
+ * it points to journal's memory and is valid until the journal is moved. */
+int abrt_journal_get_message(abrt_journal_t *journal, const char **message, size_t *len);
+
 int abrt_journal_get_cursor(abrt_journal_t *journal, char **cursor);
 
 int abrt_journal_set_cursor(abrt_journal_t *journal, const char *cursor);
@@ -56,6 +60,23 @@ int abrt_journal_seek_tail(abrt_journal_t *journal);
 
 int abrt_journal_next(abrt_journal_t *journal);
 
+/*
+ * Saves the journal's cursor in file_name, restore_position() moves the
+ * journal back to it. Both return a negative number on errors, restoring
+ * from a missing file returns -ENOENT.
+ */
+int abrt_journal_save_current_position(abrt_journal_t *journal, const char *file_name);
+
+int abrt_journal_restore_position(abrt_journal_t *journal, const char *file_name);
+
+/*
+ * Waits until no new message comes for quiet_ms, but at most max_ms.
+ *
+ * Returns a positive number if SIGTERM, SIGHUP or SIGINT interrupted
+ * abrt_journal_watch_run_sync() meanwhile.
+ */
+int abrt_journal_wait_quiet(abrt_journal_t *journal, int quiet_ms, int max_ms);
+
 /*
  * A systemd-journal listener which waits for new messages a loop and notifies
  * them via a call back
@@ -101,6 +122,8 @@ struct abrt_journal_watch_notify_strings
     abrt_journal_watch_callback decorated_cb;
     void *decorated_cb_data;
     GList *strings;
+    /* Compiled strings, built on the first call, free it with str_matcher_free() */
+    struct str_matcher *matcher;
 };
 
 void abrt_journal_watch_notify_strings(abrt_journal_watch_t *watch, void *data);
@@ -54,6 +54,7 @@ static const char *optional_retrace[] = { FILENAME_ROOTDIR,
 static const char *required_vmcore[] = { FILENAME_VMCORE,
                                          NULL };
 static unsigned delay = 0;
+static char *unpacked_core = NULL;
 static int task_type = TASK_RETRACE;
 static bool http_show_headers;
 static bool no_pkgcheck;
@@ -87,6 +88,60 @@ static void args_add_if_exists(const char *args[],
     }
 }
 
+static void remove_unpacked_core(void)
+{
+    if (!unpacked_core)
+        return;
+
+    unlink(unpacked_core);
+    char *last_slash = strrchr(unpacked_core, '/');
+    *last_slash = '\0';
+    rmdir(unpacked_core);
+    free(unpacked_core);
+    unpacked_core = NULL;
+}
+
+/* Retrace server needs uncompressed core named FILENAME_COREDUMP.
+ * If the problem directory has only the compressed one, unpack it
+ * to a temporary directory and return the directory's name.
+ * Returns NULL if the core is not compressed.
+ */
+static const char *unpacked_core_dir(void)
+{
+    static bool checked;
+    static char *dir;
+    if (checked)
+        return dir;
+    checked = true;
+
+    bool is_temporary;
+    char *path = get_coredump_path(dump_dir_name, &is_temporary);
+    if (!path)
+        xfunc_die(); /* get_coredump_path already emitted error message */
+    if (!is_temporary)
+    {
+        free(path);
+        return NULL;
+    }
+
+    dir = xstrdup(LARGE_DATA_TMP_DIR"/abrt-retrace-client-core-XXXXXX");
+    if (!mkdtemp(dir))
+    {
+        unlink(path);
+        perror_msg_and_die(_("Can't create temporary file in "LARGE_DATA_TMP_DIR));
+    }
+    unpacked_core = concat_path_file(dir, FILENAME_COREDUMP);
+    atexit(remove_unpacked_core);
+    if (rename(path, unpacked_core) != 0)
+    {
+        unlink(path);
+        perror_msg_and_die("Can't rename '%s' to '%s'", path, unpacked_core);
+    }
+    free(path);
+
+    return dir;
+}
+
 /* Create an archive with files required for retrace server and return
  * a file descriptor. Returns -1 if it fails.
  */
@@ -136,7 +191,7 @@ static int create_archive(bool unlink_temp)
     /* Run tar, and set output to a pipe with xz waiting on the other
      * end.
      */
-    const char *tar_args[10];
+    const char *tar_args[12];
     tar_args[0] = "tar";
     tar_args[1] = "cO";
     tar_args[2] = xasprintf("--directory=%s", dump_dir_name);
@@ -146,11 +201,21 @@ static int create_archive(bool unlink_temp)
     while (required_files[index - 3])
         args_add_if_exists(tar_args, dd, required_files[index - 3], &index);
 
+    char *core_dir_arg = NULL;
     if (task_type == TASK_RETRACE || task_type == TASK_DEBUG)
     {
         int i;
         for (i = 0; optional_retrace[i]; ++i)
             args_add_if_exists(tar_args, dd, optional_retrace[i], &index);
+
+        /* Compressed core is not in the list above, take the unpacked copy */
+        const char *core_dir = unpacked_core_dir();
+        if (core_dir)
+        {
+            core_dir_arg = xasprintf("--directory=%s", core_dir);
+            tar_args[index++] = core_dir_arg;
+            tar_args[index++] = FILENAME_COREDUMP;
+        }
     }
 
     tar_args[index] = NULL;
@@ -169,6 +234,7 @@ static int create_archive(bool unlink_temp)
     }
 
     free((void*)tar_args[2]);
+    free(core_dir_arg);
     close(tar_xz_pipe[1]);
 
     /* Wait for tar and xz to finish successfully */
@@ -476,7 +542,10 @@ static int create(bool delete_temp_archive,
         const char **required_files = task_type == TASK_VMCORE ? required_vmcore : required_retrace;
         while (required_files[i])
         {
-            path = concat_path_file(dump_dir_name, required_files[i]);
+            if (strcmp(required_files[i], FILENAME_COREDUMP) == 0 && unpacked_core_dir())
+                path = xstrdup(unpacked_core);
+            else
+                path = concat_path_file(dump_dir_name, required_files[i]);
             xstat(path, &file_stat);
             free(path);
 
@@ -17,34 +17,156 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #include <sys/inotify.h>
+#include <poll.h>
 #include "libabrt.h"
+#include "oops-utils.h"
+#include "xorg-utils.h"
 
 #define MAX_SCAN_BLOCK  (4*1024*1024)
 #define READ_AHEAD          (10*1024)
 
+/* Number of bytes before the read position which identify the file content,
+ * they tell apart a file which was truncated and grew again or a new file
+ * which got the inode of the deleted one */
+#define FINGERPRINT_LEN 256
+
+/* After a change, wait until the file is quiet for QUIET_MS,
+ * but scan a file which is written all the time at least every MAX_DELAY_MS.
+ * Otherwise we may end up trying to analyze partial oops.
+ */
+#define QUIET_MS     200
+#define MAX_DELAY_MS 1000
+
+/* Read size of the built-in scanners */
+#define SCAN_BLOCK (64*1024)
+
 static unsigned page_size;
 
-static bool memstr(void *buf, unsigned size, const char *str)
+/* Extractors linked in, used instead of running PROG of the same name */
+struct builtin_scanner
+{
+    const char *name;
+    /* Options of PROG which are supported */
+    const char *options;
+    void *(*init)(unsigned opts, const char *dump_location);
+    void (*feed)(void *state, const char *buf, size_t len);
+    /* All new data were fed */
+    void (*flush)(void *state);
+};
+
+/* Bit of a lower case option letter in the opts of builtin_scanner.init */
+#define SCANNER_OPT(c) (1u << ((c) - 'a'))
+
+static const struct builtin_scanner *s_builtin;
+static void *s_builtin_state;
+
+/* Where we stopped reading, kept across restarts */
+struct watch_position
+{
+    unsigned long long dev;
+    unsigned long long ino;
+    long long offset;
+    unsigned long long fingerprint;
+};
+
+static char *position_file_name(const char *filename)
+{
+    /* "/var/log/Xorg.0.log" -> VAR_STATE"/abrt-watch-log-var-log-Xorg.0.log.state" */
+    char *name = xasprintf(VAR_STATE"/abrt-watch-log%s%s.state",
+            (filename[0] == '/' ? "" : "-"), filename);
+    for (char *c = name + strlen(VAR_STATE"/"); *c; ++c)
+        if (*c == '/')
+            *c = '-';
+    return name;
+}
+
+/* FNV-1a of FINGERPRINT_LEN bytes before offset */
+static int get_fingerprint(int fd, off_t offset, unsigned long long *fingerprint)
+{
+    char buf[FINGERPRINT_LEN];
+    off_t start = (offset > FINGERPRINT_LEN ? offset - FINGERPRINT_LEN : 0);
+    ssize_t len = pread(fd, buf, offset - start, start);
+    if (len != offset - start)
+        return -1;
+
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (ssize_t i = 0; i < len; ++i)
+        h = (h ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+    *fingerprint = h;
+    return 0;
+}
+
+static int load_position(const char *position_file, struct watch_position *pos)
 {
-    int len = strlen(str);
-    while ((int)size >= len)
+    FILE *fp = fopen(position_file, "r");
+    if (!fp)
     {
-        //log("LOOKING FOR:'%s'", str);
-        char *first = memchr(buf, (unsigned char)str[0], size - len + 1);
-        if (!first)
-            break;
-        //log("FOUND:'%.66s'", first);
-        first++;
-        if (len <= 1 || strncmp(first, str + 1, len - 1) == 0)
-            return true;
-        size -= (first - (char*)buf);
-        //log("SKIP TO:'%.66s' %d chars", first, (int)(first - (char*)buf));
-        buf = first;
+        if (errno != ENOENT)
+            perror_msg("Can't open '%s'", position_file);
+        return -1;
+    }
+
+    int r = fscanf(fp, "%llu %llu %lld %llx", &pos->dev, &pos->ino, &pos->offset, &pos->fingerprint);
+    fclose(fp);
+    if (r != 4 || pos->offset < 0)
+    {
+        error_msg("Ignoring malformed '%s'", position_file);
+        return -1;
     }
-    return false;
+    return 0;
 }
 
-static void run_scanner_prog(int fd, struct stat *statbuf, GList *match_list, char **prog)
+static void save_position(const char *position_file, int fd)
+{
+    static struct watch_position saved;
+    static bool warned;
+
+    struct stat st;
+    struct watch_position pos;
+    if (fstat(fd, &st) != 0)
+        return;
+    pos.dev = st.st_dev;
+    pos.ino = st.st_ino;
+    pos.offset = lseek(fd, 0, SEEK_CUR);
+    if (pos.offset < 0 || get_fingerprint(fd, pos.offset, &pos.fingerprint) != 0)
+        return;
+    if (memcmp(&pos, &saved, sizeof(pos)) == 0)
+        return;
+
+    /* Written in one go and renamed, so that a crash leaves the old state */
+    char *tmp = xasprintf("%s.new", position_file);
+    char *data = xasprintf("%llu %llu %lld %llx\n", pos.dev, pos.ino, pos.offset, pos.fingerprint);
+    int state_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (state_fd < 0
+     || full_write_str(state_fd, data) < 0
+     || close(state_fd) != 0
+     || rename(tmp, position_file) != 0
+    ) {
+        if (!warned)
+            perror_msg("Can't save read position to '%s'", position_file);
+        warned = true;
+        if (state_fd >= 0)
+            unlink(tmp);
+    }
+    else
+        saved = pos;
+    free(data);
+    free(tmp);
+}
+
+/* Is it the file we were reading, with the same content up to pos->offset? */
+static bool position_matches(int fd, const struct stat *st, const struct watch_position *pos)
+{
+    unsigned long long fingerprint;
+    return st->st_dev == pos->dev
+        && st->st_ino == pos->ino
+        && st->st_size >= pos->offset
+        && get_fingerprint(fd, pos->offset, &fingerprint) == 0
+        && fingerprint == pos->fingerprint;
+}
+
+static void run_scanner_prog(int fd, struct stat *statbuf, const struct str_matcher *matcher,
+        char **match_strings, char **prog)
 {
     /* fstat(fd, &statbuf) was just done by caller */
 
@@ -64,7 +186,7 @@ static void run_scanner_prog(int fd, struct stat *statbuf, GList *match_list, ch
         (long long)(cur_pos),
         (long long)(statbuf->st_size));
 
-    if (match_list && (statbuf->st_size - cur_pos) < MAX_SCAN_BLOCK)
+    if (matcher && (statbuf->st_size - cur_pos) < MAX_SCAN_BLOCK)
     {
         size_t length = statbuf->st_size - cur_pos;
 
@@ -75,17 +197,12 @@ static void run_scanner_prog(int fd, struct stat *statbuf, GList *match_list, ch
         if (map != MAP_FAILED)
         {
             char *start = (char*)map + (cur_pos & (page_size - 1));
-            for (GList *l = match_list; l; l = l->next)
+            /* All strings are searched for in one pass */
+            int found_idx = str_matcher_find(matcher, start, length);
+            if (found_idx >= 0)
             {
-                log_debug("Searching for '%s' in '%.*s'",
-                                (char*)l->data,
-                                length > 20 ? 20 : (int)length, start
-                );
-                if (memstr(start, length, (char*)l->data))
-                {
-                    log_debug("FOUND:'%s'", (char*)l->data);
-                    goto found;
-                }
+                log_debug("FOUND:'%s'", match_strings[found_idx]);
+                goto found;
             }
             /* None of the strings are found */
             log_debug("NOT FOUND");
@@ -97,6 +214,22 @@ static void run_scanner_prog(int fd, struct stat *statbuf, GList *match_list, ch
         }
     }
 
+    if (s_builtin)
+    {
+        char *buffer = xmalloc(SCAN_BLOCK);
+        ssize_t r;
+        while ((r = safe_read(fd, buffer, SCAN_BLOCK)) > 0)
+            s_builtin->feed(s_builtin_state, buffer, r);
+        if (r < 0)
+        {
+            perror_msg("Error reading the watched file");
+            lseek(fd, statbuf->st_size, SEEK_SET);
+        }
+        free(buffer);
+        s_builtin->flush(s_builtin_state);
+        return;
+    }
+
     fflush(NULL); /* paranoia */
     pid_t pid = vfork();
     if (pid < 0)
@@ -122,6 +255,208 @@ static void run_scanner_prog(int fd, struct stat *statbuf, GList *match_list, ch
     }
 }
 
+/* abrt-dump-oops */
+
+struct oops_scanner
+{
+    struct koops_parser *parser;
+    GPtrArray *oopses;
+    char *dump_location;
+    int flags;
+};
+
+static void *oops_scanner_init(unsigned opts, const char *dump_location)
+{
+    struct oops_scanner *scanner = xzalloc(sizeof(*scanner));
+    scanner->oopses = g_ptr_array_new_with_free_func(free);
+    scanner->parser = koops_parser_new(abrt_oops_array_append, scanner->oopses);
+    scanner->dump_location = (dump_location ? xstrdup(dump_location) : NULL);
+    /* Our read position is saved, the marker isn't needed */
+    scanner->flags = ABRT_OOPS_NO_SYSLOG_MARKER;
+    if (opts & SCANNER_OPT('x'))
+        scanner->flags |= ABRT_OOPS_WORLD_READABLE;
+    if (opts & SCANNER_OPT('t'))
+        scanner->flags |= ABRT_OOPS_THROTTLE_CREATION;
+    if (opts & SCANNER_OPT('o'))
+        scanner->flags |= ABRT_OOPS_PRINT_STDOUT;
+    return scanner;
+}
+
+static void oops_scanner_feed(void *state, const char *buf, size_t len)
+{
+    struct oops_scanner *scanner = state;
+    koops_parser_feed(scanner->parser, buf, len);
+}
+
+static void oops_scanner_flush(void *state)
+{
+    struct oops_scanner *scanner = state;
+    koops_parser_finish(scanner->parser);
+    abrt_oops_process_list(scanner->oopses, scanner->dump_location, scanner->flags);
+    g_ptr_array_set_size(scanner->oopses, 0);
+}
+
+/* abrt-dump-xorg */
+
+static void *xorg_scanner_init(unsigned opts, const char *dump_location)
+{
+    int flags = 0;
+    if (opts & SCANNER_OPT('x'))
+        flags |= ABRT_XORG_WORLD_READABLE;
+    if (opts & SCANNER_OPT('o'))
+        flags |= ABRT_XORG_PRINT_STDOUT;
+
+    return abrt_xorg_parser_new(dump_location, flags);
+}
+
+static void xorg_scanner_feed(void *state, const char *buf, size_t len)
+{
+    abrt_xorg_parser_feed(state, buf, len);
+}
+
+static void xorg_scanner_flush(void *state)
+{
+    unsigned count = abrt_xorg_parser_finish(state);
+    if (count != 0)
+        log("Found Xorg crashes: %u", count);
+}
+
+static const struct builtin_scanner builtin_scanners[] = {
+    { "abrt-dump-oops", "vsxtoD", oops_scanner_init, oops_scanner_feed, oops_scanner_flush },
+    { "abrt-dump-xorg", "vsxoD",  xorg_scanner_init, xorg_scanner_feed, xorg_scanner_flush },
+};
+
+/* Uses a built-in scanner if PROG is one of them and its arguments
+ * are the options it supports, "-d DIR" included (-v and -s are ignored,
+ * they are ours). Anything else is executed.
+ */
+static void find_builtin_scanner(char **prog)
+{
+    const char *name = strrchr(prog[0], '/');
+    name = (name ? name + 1 : prog[0]);
+
+    const struct builtin_scanner *builtin = NULL;
+    for (unsigned i = 0; i < ARRAY_SIZE(builtin_scanners); ++i)
+        if (strcmp(name, builtin_scanners[i].name) == 0)
+            builtin = &builtin_scanners[i];
+    if (!builtin)
+        return;
+
+    unsigned opts = 0;
+    const char *dump_location = NULL;
+    for (char **arg = prog + 1; *arg; ++arg)
+    {
+        if ((*arg)[0] != '-' || (*arg)[1] == '\0')
+            goto unsupported;
+
+        if (strcmp(*arg, "-d") == 0 && arg[1])
+        {
+            dump_location = *++arg;
+            continue;
+        }
+
+        for (const char *c = *arg + 1; *c; ++c)
+        {
+            if (!strchr(builtin->options, *c))
+                goto unsupported;
+            /* Only lower case letters fit in opts, D is stored as d */
+            opts |= SCANNER_OPT(*c == 'D' ? 'd' : *c);
+        }
+    }
+
+    char *conf_dump_location = NULL;
+    if (opts & SCANNER_OPT('d'))
+    {
+        if (dump_location)
+            goto unsupported;
+        load_abrt_conf();
+        conf_dump_location = g_settings_dump_location;
+        g_settings_dump_location = NULL;
+        free_abrt_conf_data();
+        dump_location = conf_dump_location;
+    }
+
+    log_info("Using built-in '%s'", builtin->name);
+    s_builtin = builtin;
+    s_builtin_state = builtin->init(opts, dump_location);
+    free(conf_dump_location);
+    return;
+
+ unsupported:
+    log_info("Arguments of '%s' not supported by the built-in scanner, executing it", prog[0]);
+}
+
+/* Blocks until the watched file changes and then until it is quiet */
+static void wait_for_change(int inotify_fd, const char *filename)
+{
+    char buf[4096];
+    log_debug("Waiting for '%s' to change", filename);
+    /* We block here: */
+    int len = read(inotify_fd, buf, sizeof(buf));
+    if (len < 0 && errno != EINTR) /* I saw EINTR here on strace attach */
+        perror_msg("Error reading inotify fd");
+    /* we don't actually check what happened to file -
+     * the code will handle all possibilities.
+     */
+    log_debug("Change in '%s' detected", filename);
+
+    /* Let them finish writing to the log file */
+    struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (waited_ms >= MAX_DELAY_MS)
+            break;
+        long timeout = MAX_DELAY_MS - waited_ms;
+        if (poll(&pfd, 1, (timeout < QUIET_MS ? timeout : QUIET_MS)) <= 0)
+            break;
+        if (read(inotify_fd, buf, sizeof(buf)) < 0 && errno != EINTR)
+            break;
+    }
+}
+
+/* Positions file_fd where we stopped last time. If the file was rotated
+ * meanwhile, the rest of the old file is read first.
+ */
+static void resume_reading(const char *filename, int file_fd, struct stat *statbuf,
+        const struct watch_position *pos, const struct str_matcher *matcher,
+        char **match_strings, char **prog)
+{
+    if (position_matches(file_fd, statbuf, pos))
+    {
+        log_info("Resuming '%s' at %lld", filename, pos->offset);
+        lseek(file_fd, pos->offset, SEEK_SET);
+        return;
+    }
+
+    /* Names logrotate and Xorg give to the previous file */
+    static const char *const rotated_suffixes[] = { ".1", ".old", NULL };
+    for (const char *const *suffix = rotated_suffixes; *suffix; ++suffix)
+    {
+        char *old_name = xasprintf("%s%s", filename, *suffix);
+        int old_fd = open(old_name, O_RDONLY | O_CLOEXEC);
+        struct stat old_st;
+        if (old_fd >= 0 && fstat(old_fd, &old_st) == 0 && position_matches(old_fd, &old_st, pos))
+        {
+            log_info("'%s' was rotated, finishing '%s' at %lld", filename, old_name, pos->offset);
+            lseek(old_fd, pos->offset, SEEK_SET);
+            run_scanner_prog(old_fd, &old_st, matcher, match_strings, prog);
+            close(old_fd);
+            free(old_name);
+            /* The whole new file was written after the rotation */
+            return;
+        }
+        if (old_fd >= 0)
+            close(old_fd);
+        free(old_name);
+    }
+
+    log_info("'%s' was replaced, reading it from the start", filename);
+}
+
 int main(int argc, char **argv)
 {
     /* I18n */
@@ -184,13 +519,31 @@ int main(int argc, char **argv)
         l = g_list_append(l, eol); /* in fact, always returns unchanged l */
     }
 
+    struct str_matcher *matcher = NULL;
+    char **match_strings = NULL;
+    if (match_list)
+    {
+        match_strings = xmalloc(sizeof(match_strings[0]) * (g_list_length(match_list) + 1));
+        char **pp = match_strings;
+        for (GList *l = match_list; l; l = l->next)
+            *pp++ = l->data;
+        *pp = NULL;
+        matcher = str_matcher_new((const char *const *)match_strings);
+    }
+
     const char *filename = *argv++;
+    find_builtin_scanner(argv);
 
     int inotify_fd = inotify_init();
     if (inotify_fd == -1)
         perror_msg_and_die("inotify_init failed");
     close_on_exec_on(inotify_fd);
 
+    char *position_file = position_file_name(filename);
+    struct watch_position position;
+    bool have_position = (load_position(position_file, &position) == 0);
+    bool first_open = true;
+
     struct stat statbuf;
     int file_fd = -1;
     int wd = -1;
@@ -203,13 +556,18 @@ int main(int argc, char **argv)
             memset(&statbuf, 0, sizeof(statbuf));
             if (fstat(file_fd, &statbuf) != 0)
                 goto close_fd;
-            run_scanner_prog(file_fd, &statbuf, match_list, argv);
+            run_scanner_prog(file_fd, &statbuf, matcher, match_strings, argv);
+            save_position(position_file, file_fd);
 
             /* Was file deleted or replaced? */
             ino_t fd_ino = statbuf.st_ino;
             if (stat(filename, &statbuf) != 0 || statbuf.st_ino != fd_ino) /* yes */
             {
                 log_info("Inode# changed, closing fd");
+                /* Writers may append to the renamed file until they
+                 * reopen the log, don't lose the last lines */
+                if (fstat(file_fd, &statbuf) == 0 && statbuf.st_ino == fd_ino)
+                    run_scanner_prog(file_fd, &statbuf, matcher, match_strings, argv);
  close_fd:
                 close(file_fd);
                 if (wd >= 0)
@@ -237,45 +595,35 @@ int main(int argc, char **argv)
                 }
                 if (fstat(file_fd, &statbuf) == 0)
                 {
-                    /* If file is large, skip the beginning.
+                    if (first_open && have_position)
+                        resume_reading(filename, file_fd, &statbuf, &position, matcher, match_strings, argv);
+                    /* If file is large and we never read it, skip the beginning.
                      * IOW: ignore old log messages because they are unlikely
                      * to have sufficiently recent data to be useful.
+                     * A file which replaced the one we read is read
+                     * from the start.
                      */
-                    if (statbuf.st_size > (MAX_SCAN_BLOCK - READ_AHEAD))
+                    else if (first_open && statbuf.st_size > (MAX_SCAN_BLOCK - READ_AHEAD))
                         lseek(file_fd, statbuf.st_size - (MAX_SCAN_BLOCK - READ_AHEAD), SEEK_SET);
+                    first_open = false;
                     /* Note that statbuf is filled by fstat by now,
                      * run_scanner_prog needs that
                      */
-                    run_scanner_prog(file_fd, &statbuf, match_list, argv);
+                    run_scanner_prog(file_fd, &statbuf, matcher, match_strings, argv);
+                    save_position(position_file, file_fd);
                 }
             }
         }
 
         /* Even if log file grows all the time, say, a new line every 5 ms,
-         * we don't want to scan it all the time. Sleep a bit and let it grow
-         * in bigger increments.
-         * Sleep longer if file does not exist.
+         * we don't want to scan it all the time. wait_for_change() lets it
+         * grow in bigger increments.
+         * Without inotify watch, poll the file. Sleep longer if file does not exist.
          */
-        sleep(file_fd >= 0 ? 1 : 59);
-
-        /* Now wait for it to change, be moved or deleted */
         if (wd >= 0)
-        {
-            char buf[4096];
-            log_debug("Waiting for '%s' to change", filename);
-            /* We block here: */
-            int len = read(inotify_fd, buf, sizeof(buf));
-            if (len < 0 && errno != EINTR) /* I saw EINTR here on strace attach */
-                perror_msg("Error reading inotify fd");
-            /* we don't actually check what happened to file -
-             * the code will handle all possibilities.
-             */
-            log_debug("Change in '%s' detected", filename);
-            /* Let them finish writing to the log file. otherwise
-             * we may end up trying to analyze partial oops.
-             */
-            sleep(1);
-        }
+            wait_for_change(inotify_fd, filename);
+        else
+            sleep(file_fd >= 0 ? 1 : 59);
 
     } /* while (1) */
 
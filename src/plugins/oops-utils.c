@@ -17,20 +17,31 @@
 #include "oops-utils.h"
 #include "libabrt.h"
 
-int abrt_oops_process_list(GList *oops_list, const char *dump_location, int flags)
+void abrt_oops_array_append(char *oops, void *param)
+{
+    GPtrArray *oopses = param;
+    if (oops == NULL)
+    {
+        /* Already reported */
+        g_ptr_array_set_size(oopses, 0);
+        return;
+    }
+    g_ptr_array_add(oopses, oops);
+}
+
+int abrt_oops_process_list(GPtrArray *oopses, const char *dump_location, int flags)
 {
     unsigned errors = 0;
 
-    int oops_cnt = g_list_length(oops_list);
+    const int oops_cnt = oopses->len;
     if (oops_cnt != 0)
     {
         log("Found oopses: %d", oops_cnt);
         if ((flags & ABRT_OOPS_PRINT_STDOUT))
         {
-            int i = 0;
-            while (i < oops_cnt)
+            for (int i = 0; i < oops_cnt; ++i)
             {
-                char *kernel_bt = (char*)g_list_nth_data(oops_list, i++);
+                char *kernel_bt = (char*)g_ptr_array_index(oopses, i);
                 char *tainted_short = kernel_tainted_short(kernel_bt);
                 if (tainted_short)
                     log("Kernel is tainted '%s'", tainted_short);
@@ -42,7 +53,7 @@ int abrt_oops_process_list(GList *oops_list, const char *dump_location, int flag
         if (dump_location != NULL)
         {
             log("Creating problem directories");
-            errors = abrt_oops_create_dump_dirs(oops_list, dump_location, flags);
+            errors = abrt_oops_create_dump_dirs(oopses, dump_location, flags);
             if (errors)
                 log("%d errors while dumping oopses", errors);
             /*
@@ -51,10 +62,11 @@ int abrt_oops_process_list(GList *oops_list, const char *dump_location, int flag
              * can't be sure here that the file we are watching
              * is the same file where syslog(xxx) stuff ends up.
              */
-            syslog(LOG_WARNING,
-                    "Reported %u kernel oopses to Abrt",
-                    oops_cnt
-            );
+            if (!(flags & ABRT_OOPS_NO_SYSLOG_MARKER))
+                syslog(LOG_WARNING,
+                        "Reported %u kernel oopses to Abrt",
+                        oops_cnt
+                );
         }
     }
 
@@ -77,18 +89,319 @@ int abrt_oops_process_list(GList *oops_list, const char *dump_location, int flag
     return errors;
 }
 
+/*
+ * Problem directory creation budget for -t: a token bucket holding up to
+ * ThrottleBurst tokens, one token is added every ThrottleInterval seconds.
+ * It lives as long as the process, so that a log watcher is throttled
+ * across scans.
+ */
+static struct {
+    bool loaded;
+    unsigned burst;
+    unsigned interval;
+    double tokens;
+    struct timespec refilled;
+} s_throttle;
+
+/* CountDuplicateOopses: duphash -> problem directory created by this process */
+static GHashTable *s_known_problems;
+
+/* HardwareErrorWindow: seconds, 0 = hardware errors are ordinary oopses */
+static unsigned s_hw_error_window;
+
+static void load_oops_conf(void)
+{
+    map_string_t *settings = new_map_string();
+    load_abrt_plugin_conf_file("oops.conf", settings);
+
+    int value;
+    s_throttle.burst = 1;
+    if (try_get_map_string_item_as_int(settings, "ThrottleBurst", &value) && value > 0)
+        s_throttle.burst = value;
+    s_throttle.interval = 1;
+    if (try_get_map_string_item_as_int(settings, "ThrottleInterval", &value) && value >= 0)
+        s_throttle.interval = value;
+
+    int count_duplicates = 0;
+    try_get_map_string_item_as_bool(settings, "CountDuplicateOopses", &count_duplicates);
+    if (count_duplicates)
+        s_known_problems = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+
+    s_hw_error_window = 3600;
+    if (try_get_map_string_item_as_int(settings, "HardwareErrorWindow", &value) && value >= 0)
+        s_hw_error_window = value;
+
+    free_map_string(settings);
+
+    s_throttle.tokens = s_throttle.burst;
+    clock_gettime(CLOCK_MONOTONIC, &s_throttle.refilled);
+    s_throttle.loaded = true;
+}
+
+/* Takes a token, waits for it if the bucket is empty.
+ * Returns a positive number if a signal interrupted the wait.
+ */
+static int abrt_oops_throttle(void)
+{
+    if (s_throttle.interval == 0)
+        return 0;
+
+    for (;;)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - s_throttle.refilled.tv_sec)
+                + (now.tv_nsec - s_throttle.refilled.tv_nsec) / 1e9;
+        s_throttle.refilled = now;
+        s_throttle.tokens += elapsed / s_throttle.interval;
+        if (s_throttle.tokens > s_throttle.burst)
+            s_throttle.tokens = s_throttle.burst;
+
+        if (s_throttle.tokens >= 1)
+        {
+            s_throttle.tokens -= 1;
+            return 0;
+        }
+
+        int wait = (1 - s_throttle.tokens) * s_throttle.interval + 0.999;
+        log_notice("Throttling problem directory creation for %d seconds", wait);
+        if (abrt_oops_signaled_sleep(wait) > 0)
+            return 1;
+    }
+}
+
+/* Data of the host, the same for all oopses of one batch. It is read once
+ * per batch, but every problem directory gets its own copy: the directories
+ * are reported, edited and deleted independently. */
+static const char *const s_shared_files[] = {
+    FILENAME_CMDLINE,
+    "proc_modules",
+    "fips_enabled",
+    "suspend_stats",
+    NULL
+};
+
+/* Adds an occurrence to the problem in dd. Only problems which abrtd has
+ * already processed have count. If add_pending is set, the occurrences of
+ * a problem without count are recorded in FILENAME_PENDING_OCCURRENCES and
+ * post-create adds them to the count. Returns false if nothing was added.
+ */
+static bool add_occurrence(struct dump_dir *dd, bool add_pending)
+{
+    const char *filename = FILENAME_COUNT;
+    char *count_str = dd_load_text_ext(dd, filename,
+            DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+    unsigned long count = count_str ? strtoul(count_str, NULL, 10) : 0;
+    free(count_str);
+
+    if (count == 0)
+    {
+        if (!add_pending)
+            return false;
+
+        filename = FILENAME_PENDING_OCCURRENCES;
+        count_str = dd_load_text_ext(dd, filename,
+                DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+        count = count_str ? strtoul(count_str, NULL, 10) : 0;
+        free(count_str);
+    }
+
+    char new_count_str[sizeof(long)*3 + 2];
+    sprintf(new_count_str, "%lu", count + 1);
+    dd_save_text(dd, filename, new_count_str);
+
+    char *last_ocr = xasprintf("%lu", (long)time(NULL));
+    dd_save_text(dd, FILENAME_LAST_OCCURRENCE, last_ocr);
+    free(last_ocr);
+
+    log_notice("Oops is a duplicate of '%s', %s %lu", dd->dd_dirname, filename, count + 1);
+    return true;
+}
+
+/* Counts the oops as another occurrence of a problem created earlier.
+ * Returns false if there is no such problem or if abrtd hasn't processed
+ * it yet, a new problem directory must be created then.
+ */
+static bool count_known_problem(const char *hash_str)
+{
+    const char *dir_name = g_hash_table_lookup(s_known_problems, hash_str);
+    if (!dir_name)
+        return false;
+
+    struct dump_dir *dd = dd_opendir(dir_name, DD_FAIL_QUIETLY_ENOENT);
+    if (!dd)
+    {
+        /* Deleted or reported */
+        g_hash_table_remove(s_known_problems, hash_str);
+        return false;
+    }
+
+    const bool added = add_occurrence(dd, /*add_pending:*/ false);
+    dd_close(dd);
+    return added;
+}
+
+/*
+ * Hardware errors
+ *
+ * Non-fatal MCEs are not bugs and some machines log them in bursts. All of
+ * them seen in HardwareErrorWindow seconds are counted per CPU and bank in
+ * the problem directory of the first one. The window is remembered in a state
+ * file, so it outlives the log watcher.
+ */
+#define HW_ERROR_STATE_FILE VAR_STATE"/abrt-oops-hw-errors.state"
+#define HW_ERROR_STATE_FILE_MODE 0600
+
+static bool is_hw_error(const char *backtrace)
+{
+    /* The fatal ones ("Machine Check Exception:") come once per boot with
+     * a few useful lines, they are saved as any other oops */
+    return strstr(backtrace, "Machine check events logged")
+        || strstr(backtrace, "Machine Check: ");
+}
+
+/* "CPU 2 Bank 5" for "CPU 2: Machine Check: 0 Bank 5: be00000000800400",
+ * "Machine check events logged" doesn't tell.
+ */
+static char *hw_error_source(const char *backtrace)
+{
+    const char *p = strstr(backtrace, "CPU ");
+    unsigned cpu, bank;
+    if (p && sscanf(p, "CPU %u: Machine Check: %*s Bank %u:", &cpu, &bank) == 2)
+        return xasprintf("CPU %u Bank %u", cpu, bank);
+    return xstrdup("unknown CPU and bank");
+}
+
+/* Adds one to the "SOURCE: COUNT" line of source in the text */
+static char *hw_error_counts_add(const char *counts, const char *source)
+{
+    struct strbuf *result = strbuf_new();
+    const size_t source_len = strlen(source);
+    bool found = false;
+
+    const char *p = counts ? counts : "";
+    while (*p)
+    {
+        const char *end = strchrnul(p, '\n');
+        if (!found && strncmp(p, source, source_len) == 0 && p[source_len] == ':')
+        {
+            unsigned long count = strtoul(p + source_len + 1, NULL, 10);
+            strbuf_append_strf(result, "%s: %lu\n", source, count + 1);
+            found = true;
+        }
+        else if (end != p)
+            strbuf_append_strf(result, "%.*s\n", (int)(end - p), p);
+
+        if (*end == '\0')
+            break;
+        p = end + 1;
+    }
+
+    if (!found)
+        strbuf_append_strf(result, "%s: 1\n", source);
+
+    return strbuf_free_nobuf(result);
+}
+
+static void count_hw_error_in_dir(struct dump_dir *dd, const char *backtrace)
+{
+    char *source = hw_error_source(backtrace);
+    char *counts = dd_load_text_ext(dd, FILENAME_HW_ERRORS,
+            DD_FAIL_QUIETLY_ENOENT | DD_LOAD_TEXT_RETURN_NULL_ON_FAILURE);
+    char *new_counts = hw_error_counts_add(counts, source);
+    dd_save_text(dd, FILENAME_HW_ERRORS, new_counts);
+    free(new_counts);
+    free(counts);
+    free(source);
+}
+
+/* Returns the problem directory of the current window or NULL */
+static char *load_hw_error_window(void)
+{
+    char *state = xmalloc_open_read_close(HW_ERROR_STATE_FILE, /*maxsize:*/ NULL);
+    if (!state)
+        return NULL;
+
+    char *dir_name = NULL;
+    char *end;
+    errno = 0;
+    const unsigned long start = strtoul(state, &end, 10);
+    const time_t now = time(NULL);
+    if (!errno && *end == ' ' && end[1] != '\0'
+     && now >= (time_t)start && now - (time_t)start < s_hw_error_window)
+    {
+        dir_name = xstrdup(end + 1);
+        strchrnul(dir_name, '\n')[0] = '\0';
+    }
+
+    free(state);
+    return dir_name;
+}
+
+static void open_hw_error_window(const char *dir_name)
+{
+    int state_fd = open(HW_ERROR_STATE_FILE,
+            O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+            HW_ERROR_STATE_FILE_MODE);
+    if (state_fd < 0)
+    {
+        perror_msg("Can't save hardware error window: open('%s')", HW_ERROR_STATE_FILE);
+        return;
+    }
+
+    char *state = xasprintf("%lu %s\n", (long)time(NULL), dir_name);
+    full_write_str(state_fd, state);
+    close(state_fd);
+    free(state);
+}
+
+/* Counts the hardware error in the problem directory of the current window.
+ * Returns false if there is no such window, a new problem directory must be
+ * created then.
+ */
+static bool count_hw_error(const char *backtrace)
+{
+    char *dir_name = load_hw_error_window();
+    if (!dir_name)
+        return false;
+
+    struct dump_dir *dd = dd_opendir(dir_name, DD_FAIL_QUIETLY_ENOENT);
+    if (!dd)
+    {
+        /* Deleted or a duplicate of an older one */
+        free(dir_name);
+        return false;
+    }
+
+    count_hw_error_in_dir(dd, backtrace);
+    add_occurrence(dd, /*add_pending:*/ true);
+    dd_close(dd);
+
+    log_notice("Hardware error counted in '%s'", dir_name);
+    free(dir_name);
+    return true;
+}
+
+static void save_oops_data(struct dump_dir *dd, char *oops, const char *proc_modules, const char *hash_str, char **tainted_modules);
+
 /* returns number of errors */
-unsigned abrt_oops_create_dump_dirs(GList *oops_list, const char *dump_location, int flags)
+unsigned abrt_oops_create_dump_dirs(GPtrArray *oopses, const char *dump_location, int flags)
 {
-    const int oops_cnt = g_list_length(oops_list);
+    const unsigned oops_cnt = oopses->len;
     unsigned countdown = ABRT_OOPS_MAX_DUMPED_COUNT; /* do not report hundreds of oopses */
 
     log_notice("Saving %u oopses as problem dirs", oops_cnt >= countdown ? countdown : oops_cnt);
 
+    const char *shared_values[ARRAY_SIZE(s_shared_files)] = { NULL };
     char *cmdline_str = xmalloc_fopen_fgetline_fclose("/proc/cmdline");
     char *fips_enabled = xmalloc_fopen_fgetline_fclose("/proc/sys/crypto/fips_enabled");
     char *proc_modules = xmalloc_open_read_close("/proc/modules", /*maxsize:*/ NULL);
     char *suspend_stats = xmalloc_open_read_close("/sys/kernel/debug/suspend_stats", /*maxsize:*/ NULL);
+    shared_values[0] = cmdline_str;
+    shared_values[1] = proc_modules;
+    if (fips_enabled && strcmp(fips_enabled, "0") != 0)
+        shared_values[2] = fips_enabled;
+    shared_values[3] = suspend_stats;
 
     time_t t = time(NULL);
     const char *iso_date = iso_date_string(&t);
@@ -102,11 +415,60 @@ unsigned abrt_oops_create_dump_dirs(GList *oops_list, const char *dump_location,
         my_euid = geteuid();
     }
 
+    if (!s_throttle.loaded)
+        load_oops_conf();
+
+    /* Duphashes (or texts, if the hash can't be computed) of the oopses
+     * of this batch -> their problem directories, a storm of one oops
+     * gets one directory */
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+    /* Computed on the first tainted oops */
+    char *tainted_modules = NULL;
+
     pid_t my_pid = getpid();
-    unsigned idx = 0;
     unsigned errors = 0;
-    while (idx < oops_cnt)
+    for (unsigned idx = 0; idx < oops_cnt; ++idx)
     {
+        char *oops = (char*)g_ptr_array_index(oopses, idx);
+        /* The same text as abrt-action-analyze-oops hashes: the backtrace
+         * without the version line */
+        const char *backtrace = strchr(oops, '\n') + 1;
+
+        const bool hw_error = (s_hw_error_window != 0 && is_hw_error(backtrace));
+        if (hw_error && count_hw_error(backtrace))
+            continue;
+
+        char hash_str[SHA1_RESULT_LEN*2 + 1];
+        const bool hashed = (koops_hash_str(hash_str, backtrace) == 0);
+        if (hashed && s_known_problems && count_known_problem(hash_str))
+            continue;
+
+        /* The first directory of this batch is usually still waiting for
+         * post-create. If it is gone (deleted as a dup by post-create),
+         * a new one is created and post-create counts it. */
+        const char *first_dir = g_hash_table_lookup(seen, hashed ? hash_str : oops);
+        struct dump_dir *first_dd = (first_dir ? dd_opendir(first_dir, DD_FAIL_QUIETLY_ENOENT) : NULL);
+        if (first_dd)
+        {
+            add_occurrence(first_dd, /*add_pending:*/ true);
+            dd_close(first_dd);
+            continue;
+        }
+
+        /* Don't save a storm of the same oops. Without the hash all oopses
+         * would share one bucket, so unhashed ones are always saved. */
+        if (hashed)
+        {
+            char *rate_key = xasprintf("kernel:%s", hash_str);
+            int suppressed = crash_rate_limit_check_key(rate_key);
+            free(rate_key);
+            if (suppressed)
+                continue;
+        }
+
+        if ((flags & ABRT_OOPS_THROTTLE_CREATION) && abrt_oops_throttle() > 0)
+            break;
+
         char base[sizeof("oops-YYYY-MM-DD-hh:mm:ss-%lu-%lu") + 2 * sizeof(long)*3];
         sprintf(base, "oops-%s-%lu-%lu", iso_date, (long)my_pid, (long)idx);
         char *path = concat_path_file(dump_location, base);
@@ -115,20 +477,22 @@ unsigned abrt_oops_create_dump_dirs(GList *oops_list, const char *dump_location,
         if (dd)
         {
             dd_create_basic_files(dd, /*uid:*/ my_euid, NULL);
-            abrt_oops_save_data_in_dump_dir(dd, (char*)g_list_nth_data(oops_list, idx++), proc_modules);
+            if (hw_error)
+                count_hw_error_in_dir(dd, backtrace);
+            save_oops_data(dd, oops, proc_modules, hashed ? hash_str : NULL, &tainted_modules);
             dd_save_text(dd, FILENAME_ABRT_VERSION, VERSION);
             dd_save_text(dd, FILENAME_ANALYZER, "Kerneloops");
             dd_save_text(dd, FILENAME_TYPE, "Kerneloops");
-            if (cmdline_str)
-                dd_save_text(dd, FILENAME_CMDLINE, cmdline_str);
-            if (proc_modules)
-                dd_save_text(dd, "proc_modules", proc_modules);
-            if (fips_enabled && strcmp(fips_enabled, "0") != 0)
-                dd_save_text(dd, "fips_enabled", fips_enabled);
-            if (suspend_stats)
-                dd_save_text(dd, "suspend_stats", suspend_stats);
+            for (unsigned i = 0; s_shared_files[i]; ++i)
+                if (shared_values[i])
+                    dd_save_text(dd, s_shared_files[i], shared_values[i]);
             dd_close(dd);
             notify_new_path(path);
+            if (hw_error)
+                open_hw_error_window(path);
+            if (hashed && s_known_problems)
+                g_hash_table_replace(s_known_problems, xstrdup(hash_str), xstrdup(path));
+            g_hash_table_replace(seen, xstrdup(hashed ? hash_str : oops), xstrdup(path));
         }
         else
             errors++;
@@ -137,12 +501,10 @@ unsigned abrt_oops_create_dump_dirs(GList *oops_list, const char *dump_location,
 
         if (--countdown == 0)
             break;
-
-        if (dd && (flags & ABRT_OOPS_THROTTLE_CREATION))
-            if (abrt_oops_signaled_sleep(1) > 0)
-                break;
     }
 
+    g_hash_table_destroy(seen);
+    free(tainted_modules);
     free(cmdline_str);
     free(proc_modules);
     free(fips_enabled);
@@ -192,6 +554,16 @@ static char *abrt_oops_list_of_tainted_modules(const char *proc_modules)
 }
 
 void abrt_oops_save_data_in_dump_dir(struct dump_dir *dd, char *oops, const char *proc_modules)
+{
+    char *tainted_modules = NULL;
+    save_oops_data(dd, oops, proc_modules, /*unknown hash*/NULL, &tainted_modules);
+    free(tainted_modules);
+}
+
+/* hash_str is the duphash of the backtrace, if already known.
+ * *tainted_modules caches the list of tainted modules found in proc_modules.
+ */
+static void save_oops_data(struct dump_dir *dd, char *oops, const char *proc_modules, const char *hash_str, char **tainted_modules)
 {
     char *first_line = oops;
     char *second_line = (char*)strchr(first_line, '\n'); /* never NULL */
@@ -201,6 +573,12 @@ void abrt_oops_save_data_in_dump_dir(struct dump_dir *dd, char *oops, const char
         dd_save_text(dd, FILENAME_KERNEL, first_line);
     dd_save_text(dd, FILENAME_BACKTRACE, second_line);
 
+    /* Must never describe some older backtrace */
+    if (hash_str)
+        dd_save_text(dd, FILENAME_KOOPS_DUPHASH, hash_str);
+    else
+        dd_delete_item(dd, FILENAME_KOOPS_DUPHASH);
+
     /* check if trace doesn't have line: 'Your BIOS is broken' */
     if (strstr(second_line, "Your BIOS is broken"))
         dd_save_text(dd, FILENAME_NOT_REPORTABLE,
@@ -229,12 +607,10 @@ void abrt_oops_save_data_in_dump_dir(struct dump_dir *dd, char *oops, const char
                     "diagnose tainted reports.");
             strbuf_append_strf(reason, fmt, tainted_short);
 
-            char *modlist = !proc_modules ? NULL : abrt_oops_list_of_tainted_modules(proc_modules);
-            if (modlist)
-            {
-                strbuf_append_strf(reason, _(" Tainted modules: %s."), modlist);
-                free(modlist);
-            }
+            if (!*tainted_modules && proc_modules)
+                *tainted_modules = abrt_oops_list_of_tainted_modules(proc_modules);
+            if (*tainted_modules)
+                strbuf_append_strf(reason, _(" Tainted modules: %s."), *tainted_modules);
 
             dd_save_text(dd, FILENAME_NOT_REPORTABLE, reason->buf);
             strbuf_free(reason);
@@ -31,12 +31,16 @@ enum {
     ABRT_OOPS_THROTTLE_CREATION = 1 << 0,
     ABRT_OOPS_WORLD_READABLE    = 1 << 1,
     ABRT_OOPS_PRINT_STDOUT      = 1 << 2,
+    /* The caller remembers which part of the log it has processed */
+    ABRT_OOPS_NO_SYSLOG_MARKER  = 1 << 3,
 };
 
 int g_abrt_oops_sleep_woke_up_on_signal;
 
-int abrt_oops_process_list(GList *oops_list, const char *dump_location, int flags);
-unsigned abrt_oops_create_dump_dirs(GList *oops_list, const char *dump_location, int flags);
+/* koops_parser_fn collecting the oopses into a GPtrArray */
+void abrt_oops_array_append(char *oops, void *param);
+int abrt_oops_process_list(GPtrArray *oopses, const char *dump_location, int flags);
+unsigned abrt_oops_create_dump_dirs(GPtrArray *oopses, const char *dump_location, int flags);
 void abrt_oops_save_data_in_dump_dir(struct dump_dir *dd, char *oops, const char *proc_modules);
 int abrt_oops_signaled_sleep(int seconds);
 char *abrt_oops_string_filter_regex(void);
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2015  ABRT team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "xorg-utils.h"
+#include "libabrt.h"
+
+/* I want to use -Werror, but gcc-4.4 throws a curveball:
+ * "warning: ignoring return value of 'ftruncate', declared with attribute warn_unused_result"
+ * and (void) cast is not enough to shut it up! Oh God...
+ */
+#define IGNORE_RESULT(func_call) do { if (func_call) /* nothing */; } while (0)
+
+/* prevent ridiculously large bts */
+#define MAX_BT_LINES 255
+
+struct abrt_xorg_parser
+{
+    char *dump_location;
+    int flags;
+    /* All backtraces seen, makes problem directory names unique */
+    unsigned bt_total;
+    /* Backtraces seen since the last abrt_xorg_parser_finish() */
+    unsigned bt_count;
+    /* Problem directories created since the last abrt_xorg_parser_finish() */
+    unsigned dumped_count;
+    /* Hashes of the backtraces seen since the last abrt_xorg_parser_finish() */
+    GHashTable *seen;
+
+    /* The backtrace being read */
+    bool in_bt;
+    struct strbuf *bt;
+    unsigned bt_line_count;
+    char *exe;
+    char *reason;
+
+    /* Incomplete line of abrt_xorg_parser_feed() */
+    char *line;
+    size_t line_len;
+    size_t line_size;
+};
+
+static const char *skip_pfx(const char *p)
+{
+    if (p[0] == '[')
+    {
+        const char *q = strchr(p, ']');
+        if (q && q[1] == ' ')
+            p = q + 2;
+    }
+
+    /* Newer servers mark the backtrace lines as errors: "(EE) 0: /usr/..."
+     * and that is also how they appear in systemd-journal.
+     */
+    if (strncmp(p, "(EE)", 4) == 0 && (p[4] == ' ' || p[4] == '\0'))
+        p += (p[4] == ' ' ? 5 : 4);
+    return p;
+}
+
+static void bt_hash_str(char hash_str[SHA1_RESULT_LEN*2 + 1], const char *bt)
+{
+    sha1_ctx_t ctx;
+    sha1_begin(&ctx);
+    sha1_hash(&ctx, bt, strlen(bt));
+    char hash_bytes[SHA1_RESULT_LEN];
+    sha1_end(&ctx, hash_bytes);
+    *bin2hex(hash_str, hash_bytes, SHA1_RESULT_LEN) = '\0';
+}
+
+static void save_bt_to_dump_dir(struct abrt_xorg_parser *parser, const char *bt, const char *exe, const char *reason)
+{
+    time_t t = time(NULL);
+    const char *iso_date = iso_date_string(&t);
+    /* dump should be readable by all if we're run with -x */
+    uid_t my_euid = (uid_t)-1L;
+    mode_t mode = DEFAULT_DUMP_DIR_MODE | S_IROTH;
+    /* and readable only for the owner otherwise */
+    if (!(parser->flags & ABRT_XORG_WORLD_READABLE))
+    {
+        mode = DEFAULT_DUMP_DIR_MODE;
+        my_euid = geteuid();
+    }
+
+    pid_t my_pid = getpid();
+
+    char base[sizeof("xorg-YYYY-MM-DD-hh:mm:ss-%lu-%lu") + 2 * sizeof(long)*3];
+    sprintf(base, "xorg-%s-%lu-%u", iso_date, (long)my_pid, parser->bt_total);
+    char *path = concat_path_file(parser->dump_location, base);
+
+    struct dump_dir *dd = dd_create(path, /*uid:*/ my_euid, mode);
+    if (dd)
+    {
+        dd_create_basic_files(dd, /*uid:*/ my_euid, NULL);
+        dd_save_text(dd, FILENAME_ABRT_VERSION, VERSION);
+        dd_save_text(dd, FILENAME_ANALYZER, "xorg");
+        dd_save_text(dd, FILENAME_TYPE, "xorg");
+        dd_save_text(dd, FILENAME_REASON, reason);
+        dd_save_text(dd, FILENAME_BACKTRACE, bt);
+        /*
+         * Reporters usually need component name to file a bug.
+         * It is usually derived from executable.
+         * We _guess_ X server's executable name as a last resort.
+         * Better ideas?
+         */
+        if (!exe)
+        {
+            exe = "/usr/bin/X";
+            if (access("/usr/bin/Xorg", X_OK) == 0)
+                exe = "/usr/bin/Xorg";
+        }
+        dd_save_text(dd, FILENAME_EXECUTABLE, exe);
+        dd_close(dd);
+        notify_new_path(path);
+    }
+
+    free(path);
+}
+
+/* Should the backtrace get a problem directory? */
+static bool want_dump_dir(struct abrt_xorg_parser *parser, const char *bt)
+{
+    if (parser->dumped_count >= ABRT_XORG_MAX_DUMPED_COUNT)
+        return false;
+
+    char hash_str[SHA1_RESULT_LEN*2 + 1];
+    bt_hash_str(hash_str, bt);
+    if (g_hash_table_contains(parser->seen, hash_str))
+    {
+        log_notice("Xorg backtrace %u is a duplicate of an earlier one", parser->bt_total);
+        return false;
+    }
+    g_hash_table_add(parser->seen, xstrdup(hash_str));
+
+    /* Don't save a storm of the same crash */
+    char *rate_key = xasprintf("xorg:%s", hash_str);
+    const int suppressed = crash_rate_limit_check_key(rate_key);
+    free(rate_key);
+
+    return !suppressed;
+}
+
+static void end_xorg_bt(struct abrt_xorg_parser *parser)
+{
+    if (parser->bt_line_count != 0)
+    {
+        const char *bt = parser->bt->buf;
+        const char *reason = parser->reason;
+        if (parser->flags & ABRT_XORG_PRINT_STDOUT)
+            printf("%s%s%s\n", bt, reason ? reason : "", reason ? "\n" : "");
+        if (parser->dump_location && want_dump_dir(parser, bt))
+        {
+            save_bt_to_dump_dir(parser, bt, parser->exe, reason ? reason : "Xorg server crashed");
+            parser->dumped_count++;
+        }
+    }
+    free(parser->reason);
+    free(parser->exe);
+
+    parser->in_bt = false;
+    strbuf_clear(parser->bt);
+    parser->bt_line_count = 0;
+    parser->exe = NULL;
+    parser->reason = NULL;
+}
+
+struct abrt_xorg_parser *abrt_xorg_parser_new(const char *dump_location, int flags)
+{
+    struct abrt_xorg_parser *parser = xzalloc(sizeof(*parser));
+    parser->dump_location = (dump_location ? xstrdup(dump_location) : NULL);
+    parser->flags = flags;
+    parser->seen = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    parser->bt = strbuf_new();
+    return parser;
+}
+
+void abrt_xorg_parser_free(struct abrt_xorg_parser *parser)
+{
+    if (!parser)
+        return;
+
+    g_hash_table_destroy(parser->seen);
+    strbuf_free(parser->bt);
+    free(parser->line);
+    free(parser->reason);
+    free(parser->exe);
+    free(parser->dump_location);
+    free(parser);
+}
+
+/* Lines after "Backtrace:" line.
+ * Example (yes, stray newline before 'B' is real):
+[ 86985.879]<space>
+Backtrace:
+[ 86985.880] 0: /usr/bin/Xorg (xorg_backtrace+0x2f) [0x462d8f]
+[ 86985.880] 1: /usr/bin/Xorg (0x400000+0x67b56) [0x467b56]
+[ 86985.880] 2: /lib64/libpthread.so.0 (0x30a5800000+0xf4f0) [0x30a580f4f0]
+[ 86985.880] 3: /usr/lib64/xorg/modules/extensions/librecord.so (0x7ff6c225e000+0x26c3) [0x7ff6c22606c3]
+[ 86985.880] 4: /usr/bin/Xorg (_CallCallbacks+0x3c) [0x43820c]
+[ 86985.880] 5: /usr/bin/Xorg (WriteToClient+0x1f5) [0x466315]
+[ 86985.880] 6: /usr/lib64/xorg/modules/extensions/libdri2.so (ProcDRI2WaitMSCReply+0x4f) [0x7ff6c1e4feef]
+[ 86985.880] 7: /usr/lib64/xorg/modules/extensions/libdri2.so (DRI2WaitMSCComplete+0x52) [0x7ff6c1e4e6d2]
+[ 86985.880] 8: /usr/lib64/xorg/modules/drivers/intel_drv.so (0x7ff6c1bfb000+0x25ae4) [0x7ff6c1c20ae4]
+[ 86985.880] 9: /usr/lib64/libdrm.so.2 (drmHandleEvent+0xa3) [0x376b407513]
+[ 86985.880] 10: /usr/bin/Xorg (WakeupHandler+0x6b) [0x4379db]
+[ 86985.880] 11: /usr/bin/Xorg (WaitForSomething+0x1a9) [0x460289]
+[ 86985.880] 12: /usr/bin/Xorg (0x400000+0x3379a) [0x43379a]
+[ 86985.880] 13: /usr/bin/Xorg (0x400000+0x22dc5) [0x422dc5]
+[ 86985.880] 14: /lib64/libc.so.6 (__libc_start_main+0xed) [0x30a542169d]
+[ 86985.880] 15: /usr/bin/Xorg (0x400000+0x230b1) [0x4230b1]
+[ 86985.880] Segmentation fault at address 0x7ff6bf09e010
+ */
+static void process_xorg_bt_line(struct abrt_xorg_parser *parser, const char *line)
+{
+    const char *p = skip_pfx(line);
+
+    /* xorg-server-1.12.0/os/osinit.c:
+     * if (sip->si_code == SI_USER) {
+     *     ErrorF("Recieved signal %d sent by process %ld, uid %ld\n",
+     *             ^^^^^^^^ yes, typo here! Can't grep for this word! :(
+     *            signo, (long) sip->si_pid, (long) sip->si_uid);
+     * } else {
+     *     switch (signo) {
+     *         case SIGSEGV:
+     *         case SIGBUS:
+     *         case SIGILL:
+     *         case SIGFPE:
+     *             ErrorF("%s at address %p\n", strsignal(signo), sip->si_addr);
+     */
+    /* Newer servers separate the reason from the backtrace by "(EE) " */
+    if (*p == '\0')
+        return;
+
+    if (*p < '0' || *p > '9')
+    {
+        if (strstr(p, " at address ") || strstr(p, " sent by process "))
+            parser->reason = xstrdup(p);
+        /* TODO: Other cases when we have useful reason string? */
+        end_xorg_bt(parser);
+        return;
+    }
+
+    errno = 0;
+    char *end;
+    IGNORE_RESULT(strtoul(p, &end, 10));
+    if (errno || end == p || *end != ':')
+    {
+        end_xorg_bt(parser);
+        return;
+    }
+
+    /* This looks like bt line */
+
+    /* Guess Xorg server's executable name from it */
+    if (!parser->exe)
+    {
+        const char *filename = skip_whitespace(end + 1);
+        const char *filename_end = skip_non_whitespace(filename);
+        /* Does it look like "[/usr]/[s]bin/Xfoo"? */
+        if (memmem(filename, filename_end - filename, "bin/X", 5))
+            parser->exe = xstrndup(filename, filename_end - filename);
+    }
+
+    /* Save it */
+    strbuf_append_str(parser->bt, p);
+    strbuf_append_char(parser->bt, '\n');
+    if (++parser->bt_line_count > MAX_BT_LINES)
+        end_xorg_bt(parser);
+}
+
+void abrt_xorg_parser_feed_line(struct abrt_xorg_parser *parser, const char *line)
+{
+    if (parser->in_bt)
+    {
+        process_xorg_bt_line(parser, line);
+        return;
+    }
+
+    if (strcmp(skip_pfx(line), "Backtrace:") == 0)
+    {
+        parser->bt_total++;
+        parser->bt_count++;
+        parser->in_bt = true;
+    }
+}
+
+static void abrt_xorg_parser_append(struct abrt_xorg_parser *parser, const char *data, size_t len)
+{
+    if (parser->line_len + len >= parser->line_size)
+    {
+        parser->line_size = parser->line_len + len + 256;
+        parser->line = xrealloc(parser->line, parser->line_size);
+    }
+    memcpy(parser->line + parser->line_len, data, len);
+    parser->line_len += len;
+    parser->line[parser->line_len] = '\0';
+}
+
+void abrt_xorg_parser_feed(struct abrt_xorg_parser *parser, const char *buffer, size_t buflen)
+{
+    const char *c = buffer;
+    const char *end = buffer + buflen;
+    while (c < end)
+    {
+        const char *eol = memchr(c, '\n', end - c);
+        if (!eol)
+        {
+            /* Wait for the rest of the line */
+            abrt_xorg_parser_append(parser, c, end - c);
+            break;
+        }
+
+        abrt_xorg_parser_append(parser, c, eol - c);
+        abrt_xorg_parser_feed_line(parser, parser->line);
+        parser->line_len = 0;
+        c = eol + 1;
+    }
+}
+
+unsigned abrt_xorg_parser_finish(struct abrt_xorg_parser *parser)
+{
+    if (parser->line_len != 0)
+    {
+        abrt_xorg_parser_feed_line(parser, parser->line);
+        parser->line_len = 0;
+    }
+
+    if (parser->in_bt)
+        end_xorg_bt(parser);
+
+    unsigned bt_count = parser->bt_count;
+    parser->bt_count = 0;
+    parser->dumped_count = 0;
+    g_hash_table_remove_all(parser->seen);
+
+    return bt_count;
+}
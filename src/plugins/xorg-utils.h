@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2015  ABRT team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef _ABRT_XORG_UTILS_H_
+#define _ABRT_XORG_UTILS_H_
+
+#include "libabrt.h"
+
+/* How many problem dirs to create at most in one scan?
+ * Identical backtraces get one problem dir per scan.
+ */
+#define ABRT_XORG_MAX_DUMPED_COUNT  5
+
+/* The string preceding every Xorg backtrace in the log */
+#define ABRT_XORG_SEARCH_STRING "Backtrace"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    ABRT_XORG_WORLD_READABLE = 1 << 0,
+    ABRT_XORG_PRINT_STDOUT   = 1 << 1,
+};
+
+/* Extracts Xorg crashes from log lines fed one by one or from blocks of
+ * the log. Problem directories are created in dump_location, if it isn't NULL.
+ */
+struct abrt_xorg_parser;
+struct abrt_xorg_parser *abrt_xorg_parser_new(const char *dump_location, int flags);
+void abrt_xorg_parser_free(struct abrt_xorg_parser *parser);
+void abrt_xorg_parser_feed_line(struct abrt_xorg_parser *parser, const char *line);
+/* Lines can be split across blocks */
+void abrt_xorg_parser_feed(struct abrt_xorg_parser *parser, const char *buffer, size_t buflen);
+/* End of the scanned part of the log, returns the number of crashes found */
+unsigned abrt_xorg_parser_finish(struct abrt_xorg_parser *parser);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_ABRT_XORG_UTILS_H_*/
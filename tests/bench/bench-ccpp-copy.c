@@ -0,0 +1,206 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Throughput of copying a core from the kernel's pipe in abrt-hook-ccpp
+ *
+ * A child process writes a synthetic core of SIZE_MB megabytes, in which
+ * ZERO_PERCENT of pages are zero, to a pipe, like the kernel does. The core
+ * is copied to a file in DIR by the old 4 KiB loop of the hook, by
+ * copy_core() of the current hook and by copy_core() compressing with xz
+ * at XZ_LEVEL (CoreCompression). The compressed core is then unpacked by
+ * get_coredump_path(), as gdb and eu-unstrip need it.
+ *
+ * Usage: bench-ccpp-copy [SIZE_MB [ZERO_PERCENT [DIR [XZ_LEVEL]]]]
+ */
+
+/* The hook is compiled in, its main() must not clash with ours */
+#define main abrt_hook_ccpp_main
+#include "abrt-hook-ccpp.c"
+#undef main
+
+#include <time.h>
+
+enum copy_method {
+    COPY_OLD_LOOP,
+    COPY_CORE,
+    COPY_CORE_XZ,
+};
+
+static const char *const method_names[] = {
+    [COPY_OLD_LOOP] = "4 KiB read/write loop (before)",
+    [COPY_CORE]     = "copy_core()",
+    [COPY_CORE_XZ]  = "copy_core() to coredump.xz",
+};
+
+/* The copy loop of abrt-hook-ccpp before the 1 MiB buffer, for comparison */
+static off_t old_copyfd_sparse(int src_fd, int dst_fd)
+{
+    off_t total = 0;
+    int last_was_seek = 0;
+    char buffer[4 * 1024];
+
+    while (1)
+    {
+        ssize_t rd = safe_read(src_fd, buffer, sizeof(buffer));
+        if (rd < 0)
+            return -1;
+        if (rd == 0)
+        {
+            if (finish_sparse(dst_fd, last_was_seek) != 0)
+                return -1;
+            return total;
+        }
+
+        ssize_t cnt = rd;
+        while (--cnt >= 0)
+            if (buffer[cnt] != 0)
+                break;
+        if (cnt >= 0)
+        {
+            if (full_write(dst_fd, buffer, rd) != rd)
+                return -1;
+            last_was_seek = 0;
+        }
+        else
+        {
+            xlseek(dst_fd, rd, SEEK_CUR);
+            last_was_seek = 1;
+        }
+        total += rd;
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes the synthetic core to a pipe from a child process */
+static pid_t start_feeder(int *fd, off_t size, unsigned zero_percent)
+{
+    int pipefd[2];
+    xpipe(pipefd);
+    pid_t pid = xfork();
+    if (pid == 0)
+    {
+        close(pipefd[0]);
+        unsigned page[SPARSE_BLOCK / sizeof(unsigned)];
+        for (off_t off = 0; off < size; off += SPARSE_BLOCK)
+        {
+            const unsigned n = off / SPARSE_BLOCK;
+            /* Scattered zero pages, the same ones in every run */
+            if ((n * 2654435761u) % 100 < zero_percent)
+                memset(page, 0, sizeof(page));
+            else
+                for (unsigned i = 0; i < ARRAY_SIZE(page); ++i)
+                    page[i] = (i % 16 == 0) ? n * i : i % 64;
+
+            if (full_write(pipefd[1], page, sizeof(page)) != sizeof(page))
+                _exit(1);
+        }
+        _exit(0);
+    }
+    close(pipefd[1]);
+    *fd = pipefd[0];
+    return pid;
+}
+
+static void print_result(const char *name, off_t size, double elapsed, off_t disk_size)
+{
+    printf("%-32s %8.1f MiB/s %8.2f cores/s, %lld KiB on disk\n",
+           name, size / elapsed / (1024 * 1024), 1 / elapsed,
+           (long long)(disk_size / 1024));
+}
+
+static void bench(const char *dir, off_t size, unsigned zero_percent, enum copy_method method, int xz_level)
+{
+    /* get_coredump_path() looks for coredump.xz in a problem directory */
+    char *problem_dir = concat_path_file(dir, "bench-ccpp-copy.XXXXXX");
+    if (!mkdtemp(problem_dir))
+        perror_msg_and_die("Can't create '%s'", problem_dir);
+    char *path = concat_path_file(problem_dir, FILENAME_COREDUMP_XZ);
+    int dst_fd = xopen3(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    int src_fd;
+    pid_t pid = start_feeder(&src_fd, size, zero_percent);
+
+    const double start = now();
+    off_t copied;
+    if (method == COPY_OLD_LOOP)
+        copied = old_copyfd_sparse(src_fd, dst_fd);
+    else
+    {
+        struct core_writer abrt_core;
+        if (core_writer_init(&abrt_core, dst_fd, method == COPY_CORE_XZ ? xz_level : -1) != 0)
+            error_msg_and_die("Can't initialize the core writer");
+        copied = copy_core(src_fd, &abrt_core, NULL, NULL, -1, 0);
+    }
+    const double elapsed = now() - start;
+
+    int status;
+    safe_waitpid(pid, &status, 0);
+    if (copied != size || status != 0)
+        error_msg_and_die("%s: copied %lld of %lld bytes", method_names[method],
+                          (long long)copied, (long long)size);
+
+    struct stat st;
+    xfstat(dst_fd, &st);
+    print_result(method_names[method], size, elapsed, st.st_blocks * 512LL);
+    close(src_fd);
+    close(dst_fd);
+
+    if (method == COPY_CORE_XZ)
+    {
+        const double unpack_start = now();
+        bool is_temporary;
+        char *unpacked = get_coredump_path(problem_dir, &is_temporary);
+        const double unpack_elapsed = now() - unpack_start;
+        if (!unpacked || !is_temporary)
+            error_msg_and_die("Can't unpack '%s'", path);
+
+        xstat(unpacked, &st);
+        print_result("get_coredump_path() unpacking", size, unpack_elapsed, st.st_blocks * 512LL);
+        unlink(unpacked);
+        free(unpacked);
+    }
+
+    unlink(path);
+    rmdir(problem_dir);
+    free(path);
+    free(problem_dir);
+}
+
+int main(int argc, char **argv)
+{
+    const off_t size = (argc > 1 ? xatoi_positive(argv[1]) : 512) * 1024LL * 1024;
+    const unsigned zero_percent = (argc > 2 ? xatoi_positive(argv[2]) : 70);
+    const char *dir = (argc > 3 ? argv[3] : "/var/tmp");
+    const int xz_level = (argc > 4 ? xatoi_positive(argv[4]) : 1);
+
+    printf("%lld MiB core, %u%% zero pages, copied to %s\n",
+           (long long)(size / (1024 * 1024)), zero_percent, dir);
+
+    bench(dir, size, zero_percent, COPY_OLD_LOOP, -1);
+    bench(dir, size, zero_percent, COPY_CORE, -1);
+    bench(dir, size, zero_percent, COPY_CORE_XZ, xz_level);
+
+    return 0;
+}
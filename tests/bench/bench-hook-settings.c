@@ -0,0 +1,89 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * How long abrt-hook-ccpp takes to get its settings
+ *
+ * Compares parsing abrt.conf and CCpp.conf and checking abrtd's pidfile,
+ * what the hook does without abrtd, with reading the snapshot abrtd keeps
+ * in /var/run/abrt/hook-settings. If abrtd doesn't run, the snapshot is
+ * written for the run and removed afterwards, which needs write access
+ * to /var/run/abrt.
+ *
+ * Usage: bench-hook-settings [ITERATIONS]
+ */
+
+#include "libabrt.h"
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_result(const char *name, unsigned iterations, double elapsed)
+{
+    printf("%-36s %10.1f us/crash\n", name, elapsed / iterations * 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned iterations = (argc > 1 ? xatoi_positive(argv[1]) : 1000);
+    if (iterations == 0)
+        error_msg_and_die("ITERATIONS must be positive");
+
+    struct hook_settings hs;
+
+    double start = now();
+    for (unsigned i = 0; i < iterations; ++i)
+    {
+        hook_settings_load(&hs);
+        daemon_is_ok();
+    }
+    print_result("parse config files + pidfile (before)", iterations, now() - start);
+
+    /* Don't replace abrtd's snapshot, it holds a lock on it */
+    bool abrtd_running;
+    int lock_fd = -1;
+    int r = hook_settings_read(&hs, &abrtd_running);
+    if (r != 0 && abrtd_running)
+        error_msg_and_die("abrtd's snapshot is out of date, try again in a second");
+    if (!abrtd_running)
+    {
+        hook_settings_load(&hs);
+        lock_fd = hook_settings_save(&hs, -1);
+        if (lock_fd < 0)
+            error_msg_and_die("Can't write the snapshot, run as root or start abrtd");
+    }
+
+    start = now();
+    for (unsigned i = 0; i < iterations; ++i)
+    {
+        if (hook_settings_read(&hs, &abrtd_running) != 0)
+            error_msg_and_die("Can't read the snapshot");
+    }
+    print_result("hook_settings_read()", iterations, now() - start);
+
+    if (lock_fd >= 0)
+        hook_settings_remove(lock_fd);
+
+    free_abrt_conf_data();
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+    Copyright (C) 2015  ABRT team
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Searching log lines for the suspicious strings of the koops parser
+ *
+ * Compares str_matcher with one strstr() per suspicious string, which the
+ * koops parser did before. The lines are read from FILE, a syslog or
+ * 'journalctl -k' output for example, or a synthetic log of ordinary
+ * kernel messages is used. The lines are searched REPEAT times.
+ *
+ * Usage: bench-str-matcher [FILE [REPEAT]]
+ */
+
+#include "libabrt.h"
+#include <time.h>
+
+static const char *const synthetic_lines[] = {
+    "Oct 17 04:30:10 host kernel: usb 1-1: new high-speed USB device number 2 using xhci_hcd",
+    "Oct 17 04:30:10 host kernel: e1000e 0000:00:19.0 eth0: Link is Up 1000 Mbps Full Duplex",
+    "Oct 17 04:30:11 host kernel: EXT4-fs (sda1): mounted filesystem with ordered data mode",
+    "Oct 17 04:30:11 host kernel: audit: type=1400 audit(1444969811.123:42): avc:  denied  { read }",
+    "Oct 17 04:30:12 host kernel: IPv6: ADDRCONF(NETDEV_CHANGE): wlp3s0: link becomes ready",
+    "Oct 17 04:30:12 host kernel: Bluetooth: RFCOMM TTY layer initialized",
+    "Oct 17 04:30:13 host kernel: BUG: unable to handle kernel NULL pointer dereference at 0000000000000008",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The search of the koops parser before str_matcher */
+static bool old_has_suspicious_string(const char *const *patterns, const char *line)
+{
+    for (const char *const *str = patterns; *str; ++str)
+        if (strstr(line, *str))
+            return true;
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned rounds = (argc > 2 ? xatoi_positive(argv[2]) : 10);
+
+    GPtrArray *lines = g_ptr_array_new();
+    char *content = NULL;
+    if (argc > 1)
+    {
+        content = xmalloc_xopen_read_close(argv[1], /*maxsize:*/ NULL);
+        for (char *line = strtok(content, "\n"); line; line = strtok(NULL, "\n"))
+            g_ptr_array_add(lines, line);
+    }
+    else
+    {
+        for (unsigned i = 0; i < 100000; ++i)
+            g_ptr_array_add(lines, (gpointer)synthetic_lines[i % ARRAY_SIZE(synthetic_lines)]);
+    }
+    if (lines->len == 0)
+        error_msg_and_die("No lines to search");
+
+    size_t bytes = 0;
+    for (unsigned i = 0; i < lines->len; ++i)
+        bytes += strlen(lines->pdata[i]);
+
+    GList *list = koops_suspicious_strings_list();
+    const unsigned count = g_list_length(list);
+    const char **pattern_array = xmalloc(sizeof(pattern_array[0]) * (count + 1));
+    unsigned n = 0;
+    for (GList *li = list; li; li = li->next)
+        pattern_array[n++] = li->data;
+    pattern_array[n] = NULL;
+    const char *const *patterns = (const char *const *)pattern_array;
+    g_list_free(list);
+
+    printf("%u lines, %zu bytes, %u suspicious strings, %u rounds\n",
+           lines->len, bytes, count, rounds);
+
+    unsigned old_found = 0;
+    double start = now();
+    for (unsigned r = 0; r < rounds; ++r)
+        for (unsigned i = 0; i < lines->len; ++i)
+            old_found += old_has_suspicious_string(patterns, lines->pdata[i]);
+    const double old_elapsed = now() - start;
+
+    unsigned found = 0;
+    start = now();
+    struct str_matcher *matcher = str_matcher_new(patterns);
+    for (unsigned r = 0; r < rounds; ++r)
+        for (unsigned i = 0; i < lines->len; ++i)
+            found += (str_matcher_find_str(matcher, lines->pdata[i]) >= 0);
+    const double elapsed = now() - start;
+    str_matcher_free(matcher);
+
+    if (found != old_found)
+        error_msg_and_die("str_matcher found %u lines, strstr() %u", found, old_found);
+
+    const double total = (double)bytes * rounds / (1024 * 1024);
+    printf("%-28s %8.1f MiB/s\n", "strstr() per string (before)", total / old_elapsed);
+    printf("%-28s %8.1f MiB/s\n", "str_matcher", total / elapsed);
+
+    free(pattern_array);
+    g_ptr_array_free(lines, TRUE);
+    free(content);
+    return 0;
+}
@@ -102,7 +102,7 @@ function load_abrt_conf() {
 function prepare() {
     load_abrt_conf
 
-    rm -f -- $ABRT_CONF_DUMP_LOCATION/last-ccpp
+    rm -f -- /var/run/abrt/crash-rate
     rm -f "/tmp/abrt-done"
 }
 
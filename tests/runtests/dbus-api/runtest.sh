@@ -92,6 +92,19 @@ rlJournalStart
 
     rlPhaseEnd
 
+    rlPhaseStartTest "GetProblemsFiltered"
+
+        rlRun "dbus-send --system --type=method_call --print-reply --dest=org.freedesktop.problems /org/freedesktop/problems org.freedesktop.problems.GetProblemsFiltered dict:string:string:since,${time_from},reported,no string:time boolean:true uint32:0 uint32:1 array:string:cmdline,reason boolean:true &> dbus_reply.log"
+
+        rlAssertGrep "$crash_PATH" dbus_reply.log
+        rlAssertGrep "$cmd_line" dbus_reply.log
+
+        rlRun "dbus-send --system --type=method_call --print-reply --dest=org.freedesktop.problems /org/freedesktop/problems org.freedesktop.problems.GetProblemsFiltered dict:string:string:reported,maybe string: boolean:false uint32:0 uint32:0 array:string:reason boolean:true &> dbus_error.log" 1
+
+        rlAssertGrep "InvalidFilter" dbus_error.log
+
+    rlPhaseEnd
+
     rlPhaseStartCleanup
         rlRun "abrt-cli rm $crash_PATH" 0 "Remove crash directory"
         rlBundleLogs abrt *.log
@@ -34,7 +34,7 @@ PACKAGE="abrt"
 rlJournalStart
     rlPhaseStartSetup
         TmpDir=$(mktemp -d)
-        cp -R -- dmesg-efi-* "$TmpDir"
+        cp -R -- dmesg-efi-* dmesg-ramoops* console-ramoops-* "$TmpDir"
         pushd -- "$TmpDir"
     rlPhaseEnd
 
@@ -48,6 +48,16 @@ rlJournalStart
         rlAssertNotExists dmesg-efi-2
     rlPhaseEnd
 
+    rlPhaseStartTest "merge fragmented pstore records"
+        rlRun "abrt-merge-pstoreoops -o dmesg-ramoops-[0-9] console-ramoops-0 > merged" 0 "Merging records"
+        rlAssertNotDiffer merged dmesg-ramoops.right
+        rlRun "abrt-dump-oops -o merged 2>&1 | grep 'Found oopses: 1'" 0 "Oops found in merged records"
+        rlRun "abrt-merge-pstoreoops -d dmesg-ramoops-[0-9] console-ramoops-0" 0 "Deleting records"
+        rlAssertNotExists dmesg-ramoops-0
+        rlAssertNotExists dmesg-ramoops-3
+        rlAssertExists console-ramoops-0
+    rlPhaseEnd
+
     rlPhaseStartCleanup
         popd
         rm -rf -- "$TmpDir"
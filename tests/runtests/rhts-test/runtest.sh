@@ -127,7 +127,7 @@ rlJournalStart
         rlAssertGrep "Connecting to http://127.0.0.1:12345/rs/cases/[0-9]*/attachments/.*/" client_create
 
         rlRun "abrt-cli rm $crash_PATH" 0 "Remove crash dir"
-        rlRun "rm -rf /var/tmp/abrt/last-ccpp"
+        rlRun "rm -f /var/run/abrt/crash-rate"
     rlPhaseEnd
 
    rlPhaseStartTest "rhtsupport create with option -u with attach email"
@@ -172,7 +172,7 @@ rlJournalStart
         rlAssertGrep "Connecting to http://127.0.0.1:12345/rs/cases/[0-9]*/attachments/.*/" client_create
 
         rlRun "abrt-cli rm $crash_PATH" 0 "Remove crash dir"
-        rlRun "rm -rf /var/tmp/abrt/last-ccpp"
+        rlRun "rm -f /var/run/abrt/crash-rate"
     rlPhaseEnd
 
     rlPhaseStartTest "rhtsupport create with option -u (uReport has been already submitted, email is configured)"
@@ -218,7 +218,7 @@ rlJournalStart
         rlAssertGrep "Connecting to http://127.0.0.1:12345/rs/cases/[0-9]*/attachments/.*/" client_create
 
         rlRun "abrt-cli rm $crash_PATH" 0 "Remove crash dir"
-        rlRun "rm -rf /var/tmp/abrt/last-ccpp"
+        rlRun "rm -f /var/run/abrt/crash-rate"
     rlPhaseEnd
 
     rlPhaseStartTest "rhtsupport create with option -u (uReport has been already submitted, email is not configured)"